@@ -27,26 +27,34 @@ PARALLEL SAFE
 LANGUAGE sql
 RETURN string_to_array(get_histogram_timings(), ',');
 
--- Intentionally uses a string body so we can drop and recreate the pg_stat_monitor view
+CREATE FUNCTION pg_stat_monitor_histogram(
+    IN bucket               int8,
+    IN queryids             int8[],
+    OUT queryid             int8,
+    OUT bucket_index        int,
+    OUT range_start         float8,
+    OUT range_end           float8,
+    OUT freq                int8
+)
+RETURNS SETOF record
+STRICT
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_histogram';
+
 CREATE OR REPLACE FUNCTION histogram(_bucket int, _quryid int8)
 RETURNS SETOF record
 PARALLEL SAFE
 LANGUAGE sql
 AS $$
-WITH stat AS (
-    SELECT
-        queryid,
-        bucket,
-        unnest(range()) AS range,
-        unnest(resp_calls)::int AS freq
-    FROM pg_stat_monitor
-)
 SELECT
-    range,
-    freq,
-    repeat('■', (freq::float / max(freq) OVER () * 30)::int) AS bar
-FROM stat
-WHERE queryid = _quryid AND bucket = _bucket
+    r.range,
+    h.freq::int AS freq,
+    repeat('■', (h.freq::float / max(h.freq) OVER () * 30)::int) AS bar
+FROM pg_stat_monitor_histogram(_bucket, ARRAY[_quryid]) AS h
+JOIN unnest(range()) WITH ORDINALITY AS r (range, ordinality)
+    ON r.ordinality = h.bucket_index + 1
+ORDER BY h.bucket_index
 $$;
 
 DROP FUNCTION pgsm_create_view();
@@ -64,94 +72,1144 @@ CREATE FUNCTION pg_stat_monitor_internal(
     OUT datname             text,
     OUT client_ip           int8,
 
-    OUT queryid             int8,  -- 6
-    OUT planid              int8,
-    OUT query               text,
-    OUT query_plan          text,
-    OUT pgsm_query_id       int8,
-    OUT top_queryid         int8,
-    OUT top_query           text,
-    OUT application_name    text,
+    OUT queryid             int8,  -- 6
+    OUT planid              int8,
+    OUT query               text,
+    OUT query_plan          text,
+    OUT pgsm_query_id       int8,
+    OUT top_queryid         int8,
+    OUT top_query           text,
+    OUT application_name    text,
+
+    OUT relations           text, -- 14
+    OUT cmd_type            int,
+    OUT elevel              int,
+    OUT sqlcode             TEXT,
+    OUT message             text,
+    OUT bucket_start_time   timestamptz,
+
+    OUT calls               int8,  -- 20
+
+    OUT total_exec_time     float8, -- 21
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+
+    OUT rows                int8, -- 26
+
+    OUT plans               int8,  -- 27
+
+    OUT total_plan_time     float8, -- 28
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+
+    OUT shared_blks_hit            int8, -- 33
+    OUT shared_blks_read           int8,
+    OUT shared_blks_dirtied        int8,
+    OUT shared_blks_written        int8,
+    OUT local_blks_hit             int8,
+    OUT local_blks_read            int8,
+    OUT local_blks_dirtied         int8,
+    OUT local_blks_written         int8,
+    OUT temp_blks_read             int8,
+    OUT temp_blks_written          int8,
+    OUT shared_blk_read_time       float8,
+    OUT shared_blk_write_time      float8,
+    OUT local_blk_read_time        float8,
+    OUT local_blk_write_time       float8,
+    OUT temp_blk_read_time         float8,
+    OUT temp_blk_write_time        float8,
+
+    OUT resp_calls          text, -- 49
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT wal_buffers_full    int8,
+    OUT comments            TEXT,
+
+    OUT jit_functions           int8, -- 57
+    OUT jit_generation_time     float8,
+    OUT jit_inlining_count      int8,
+    OUT jit_inlining_time       float8,
+    OUT jit_optimization_count  int8,
+    OUT jit_optimization_time   float8,
+    OUT jit_emission_count      int8,
+    OUT jit_emission_time       float8,
+    OUT jit_deform_count        int8,
+    OUT jit_deform_time         float8,
+
+    OUT parallel_workers_to_launch  int, -- 67
+    OUT parallel_workers_launched   int,
+
+    OUT generic_plan_calls   int8, -- 69
+    OUT custom_plan_calls    int8,
+
+    OUT min_exec_mem         int8, -- 71
+    OUT max_exec_mem         int8,
+    OUT mean_exec_mem        float8,
+    OUT exec_mem_calls       text,
+
+    OUT stats_since          timestamp with time zone, -- 75
+    OUT minmax_stats_since   timestamp with time zone,
+
+    OUT toplevel            BOOLEAN, -- 77
+    OUT bucket_done         BOOLEAN
+)
+RETURNS SETOF record
+STRICT
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_NEXT';
+
+CREATE FUNCTION pg_stat_monitor_filtered(
+    IN showtext             boolean DEFAULT true,
+    IN _bucket              int8 DEFAULT NULL,
+    IN _dbid                oid DEFAULT NULL,
+    IN _userid              oid DEFAULT NULL,
+    IN _queryid             int8 DEFAULT NULL,
+    IN _min_calls           int8 DEFAULT NULL,
+    OUT bucket              int8,   -- 0
+    OUT userid              oid,
+    OUT username            text,
+    OUT dbid                oid,
+    OUT datname             text,
+    OUT client_ip           int8,
+
+    OUT queryid             int8,  -- 6
+    OUT planid              int8,
+    OUT query               text,
+    OUT query_plan          text,
+    OUT pgsm_query_id       int8,
+    OUT top_queryid         int8,
+    OUT top_query           text,
+    OUT application_name    text,
+
+    OUT relations           text, -- 14
+    OUT cmd_type            int,
+    OUT elevel              int,
+    OUT sqlcode             TEXT,
+    OUT message             text,
+    OUT bucket_start_time   timestamptz,
+
+    OUT calls               int8,  -- 20
+
+    OUT total_exec_time     float8, -- 21
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+
+    OUT rows                int8, -- 26
+
+    OUT plans               int8,  -- 27
+
+    OUT total_plan_time     float8, -- 28
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+
+    OUT shared_blks_hit            int8, -- 33
+    OUT shared_blks_read           int8,
+    OUT shared_blks_dirtied        int8,
+    OUT shared_blks_written        int8,
+    OUT local_blks_hit             int8,
+    OUT local_blks_read            int8,
+    OUT local_blks_dirtied         int8,
+    OUT local_blks_written         int8,
+    OUT temp_blks_read             int8,
+    OUT temp_blks_written          int8,
+    OUT shared_blk_read_time       float8,
+    OUT shared_blk_write_time      float8,
+    OUT local_blk_read_time        float8,
+    OUT local_blk_write_time       float8,
+    OUT temp_blk_read_time         float8,
+    OUT temp_blk_write_time        float8,
+
+    OUT resp_calls          text, -- 49
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT wal_buffers_full    int8,
+    OUT comments            TEXT,
+
+    OUT jit_functions           int8, -- 57
+    OUT jit_generation_time     float8,
+    OUT jit_inlining_count      int8,
+    OUT jit_inlining_time       float8,
+    OUT jit_optimization_count  int8,
+    OUT jit_optimization_time   float8,
+    OUT jit_emission_count      int8,
+    OUT jit_emission_time       float8,
+    OUT jit_deform_count        int8,
+    OUT jit_deform_time         float8,
+
+    OUT parallel_workers_to_launch  int, -- 67
+    OUT parallel_workers_launched   int,
+
+    OUT generic_plan_calls   int8, -- 69
+    OUT custom_plan_calls    int8,
+
+    OUT min_exec_mem         int8, -- 71
+    OUT max_exec_mem         int8,
+    OUT mean_exec_mem        float8,
+    OUT exec_mem_calls       text,
+
+    OUT stats_since          timestamp with time zone, -- 75
+    OUT minmax_stats_since   timestamp with time zone,
+
+    OUT toplevel            BOOLEAN, -- 77
+    OUT bucket_done         BOOLEAN
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_filtered';
+
+CREATE FUNCTION pg_stat_monitor_changes(
+    IN since_generation     int8,
+    IN showtext             boolean DEFAULT true,
+    OUT bucket              int8,   -- 0
+    OUT userid              oid,
+    OUT username            text,
+    OUT dbid                oid,
+    OUT datname             text,
+    OUT client_ip           int8,
+
+    OUT queryid             int8,  -- 6
+    OUT planid              int8,
+    OUT query               text,
+    OUT query_plan          text,
+    OUT pgsm_query_id       int8,
+    OUT top_queryid         int8,
+    OUT top_query           text,
+    OUT application_name    text,
+
+    OUT relations           text, -- 14
+    OUT cmd_type            int,
+    OUT elevel              int,
+    OUT sqlcode             TEXT,
+    OUT message             text,
+    OUT bucket_start_time   timestamptz,
+
+    OUT calls               int8,  -- 20
+
+    OUT total_exec_time     float8, -- 21
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+
+    OUT rows                int8, -- 26
+
+    OUT plans               int8,  -- 27
+
+    OUT total_plan_time     float8, -- 28
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+
+    OUT shared_blks_hit            int8, -- 33
+    OUT shared_blks_read           int8,
+    OUT shared_blks_dirtied        int8,
+    OUT shared_blks_written        int8,
+    OUT local_blks_hit             int8,
+    OUT local_blks_read            int8,
+    OUT local_blks_dirtied         int8,
+    OUT local_blks_written         int8,
+    OUT temp_blks_read             int8,
+    OUT temp_blks_written          int8,
+    OUT shared_blk_read_time       float8,
+    OUT shared_blk_write_time      float8,
+    OUT local_blk_read_time        float8,
+    OUT local_blk_write_time       float8,
+    OUT temp_blk_read_time         float8,
+    OUT temp_blk_write_time        float8,
+
+    OUT resp_calls          text, -- 49
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT wal_buffers_full    int8,
+    OUT comments            TEXT,
+
+    OUT jit_functions           int8, -- 57
+    OUT jit_generation_time     float8,
+    OUT jit_inlining_count      int8,
+    OUT jit_inlining_time       float8,
+    OUT jit_optimization_count  int8,
+    OUT jit_optimization_time   float8,
+    OUT jit_emission_count      int8,
+    OUT jit_emission_time       float8,
+    OUT jit_deform_count        int8,
+    OUT jit_deform_time         float8,
+
+    OUT parallel_workers_to_launch  int, -- 67
+    OUT parallel_workers_launched   int,
+
+    OUT generic_plan_calls   int8, -- 69
+    OUT custom_plan_calls    int8,
+
+    OUT min_exec_mem         int8, -- 71
+    OUT max_exec_mem         int8,
+    OUT mean_exec_mem        float8,
+    OUT exec_mem_calls       text,
+
+    OUT stats_since          timestamp with time zone, -- 75
+    OUT minmax_stats_since   timestamp with time zone,
+
+    OUT toplevel            BOOLEAN, -- 77
+    OUT bucket_done         BOOLEAN
+)
+RETURNS SETOF record
+STRICT
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_changes';
+
+CREATE FUNCTION pg_stat_monitor_generation()
+RETURNS int8
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_generation';
+
+CREATE FUNCTION pg_stat_monitor_texts(
+    IN since                int8 DEFAULT 0,
+    OUT queryid             int8,
+    OUT pgsm_query_id       int8,
+    OUT dbid                oid,
+    OUT top_queryid         int8,
+    OUT query               text,
+    OUT top_query           text,
+    OUT generation          int8
+)
+RETURNS SETOF record
+STRICT
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_texts';
+
+CREATE FUNCTION pg_stat_monitor_buckets(
+    OUT bucket              int8,
+    OUT level               int,
+    OUT bucket_start_time   timestamptz,
+    OUT bucket_time         int,
+    OUT current             boolean
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_buckets';
+
+CREATE FUNCTION pg_stat_monitor_memory(
+    OUT bucket              int8,
+    OUT entries             int8,
+    OUT max_entries         int8,
+    OUT entry_bytes         int8,
+    OUT texts               int8,
+    OUT text_bytes          int8,
+    OUT avg_text_len        float8,
+    OUT dsa_bytes           int8,
+    OUT dsa_free_bytes      int8,
+    OUT dsa_overflow_bytes  int8
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_memory';
+
+CREATE FUNCTION pg_stat_monitor_wait_events(
+    OUT bucket              int8,
+    OUT bucket_start_time   timestamptz,
+    OUT queryid             int8,
+    OUT dbid                oid,
+    OUT userid              oid,
+    OUT wait_event_type     text,
+    OUT wait_event          text,
+    OUT samples             int8
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_wait_events';
+
+CREATE FUNCTION pg_stat_monitor_hotspots(
+    OUT bucket              int8,
+    OUT userid              oid,
+    OUT dbid                oid,
+    OUT queryid             int8,
+    OUT planid              int8,
+    OUT toplevel            bool,
+    OUT exec_time           float8,
+    OUT node                int,
+    OUT node_type           text,
+    OUT relid               oid,
+    OUT self_time           float8,
+    OUT total_time          float8,
+    OUT actual_rows         float8,
+    OUT plan_rows           float8,
+    OUT loops               float8
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_hotspots';
+
+CREATE FUNCTION pg_stat_monitor_hook_stats(
+    OUT name                text,
+    OUT calls               int8,
+    OUT total_time          float8
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_hook_stats';
+
+CREATE FUNCTION pg_stat_monitor_top(
+    IN metric               text,
+    IN n                    int DEFAULT 10,
+    IN buckets              int DEFAULT NULL,
+    OUT queryid             int8,
+    OUT query               text,
+    OUT calls               int8,
+    OUT total_exec_time     float8,
+    OUT mean_exec_time      float8,
+    OUT max_exec_time       float8,
+    OUT rows                int8,
+    OUT value               float8
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_top';
+
+CREATE FUNCTION pg_stat_monitor_projected(
+    IN groups               text[],
+    OUT bucket              int8,   -- 0
+    OUT userid              oid,
+    OUT username            text,
+    OUT dbid                oid,
+    OUT datname             text,
+    OUT client_ip           int8,
+
+    OUT queryid             int8,  -- 6
+    OUT planid              int8,
+    OUT query               text,
+    OUT query_plan          text,
+    OUT pgsm_query_id       int8,
+    OUT top_queryid         int8,
+    OUT top_query           text,
+    OUT application_name    text,
+
+    OUT relations           text, -- 14
+    OUT cmd_type            int,
+    OUT elevel              int,
+    OUT sqlcode             TEXT,
+    OUT message             text,
+    OUT bucket_start_time   timestamptz,
+
+    OUT calls               int8,  -- 20
+
+    OUT total_exec_time     float8, -- 21
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+
+    OUT rows                int8, -- 26
+
+    OUT plans               int8,  -- 27
+
+    OUT total_plan_time     float8, -- 28
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+
+    OUT shared_blks_hit            int8, -- 33
+    OUT shared_blks_read           int8,
+    OUT shared_blks_dirtied        int8,
+    OUT shared_blks_written        int8,
+    OUT local_blks_hit             int8,
+    OUT local_blks_read            int8,
+    OUT local_blks_dirtied         int8,
+    OUT local_blks_written         int8,
+    OUT temp_blks_read             int8,
+    OUT temp_blks_written          int8,
+    OUT shared_blk_read_time       float8,
+    OUT shared_blk_write_time      float8,
+    OUT local_blk_read_time        float8,
+    OUT local_blk_write_time       float8,
+    OUT temp_blk_read_time         float8,
+    OUT temp_blk_write_time        float8,
+
+    OUT resp_calls          text, -- 49
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT wal_buffers_full    int8,
+    OUT comments            TEXT,
+
+    OUT jit_functions           int8, -- 57
+    OUT jit_generation_time     float8,
+    OUT jit_inlining_count      int8,
+    OUT jit_inlining_time       float8,
+    OUT jit_optimization_count  int8,
+    OUT jit_optimization_time   float8,
+    OUT jit_emission_count      int8,
+    OUT jit_emission_time       float8,
+    OUT jit_deform_count        int8,
+    OUT jit_deform_time         float8,
+
+    OUT parallel_workers_to_launch  int, -- 67
+    OUT parallel_workers_launched   int,
+
+    OUT generic_plan_calls   int8, -- 69
+    OUT custom_plan_calls    int8,
+
+    OUT min_exec_mem         int8, -- 71
+    OUT max_exec_mem         int8,
+    OUT mean_exec_mem        float8,
+    OUT exec_mem_calls       text,
+
+    OUT stats_since          timestamp with time zone, -- 75
+    OUT minmax_stats_since   timestamp with time zone,
+
+    OUT toplevel            BOOLEAN, -- 77
+    OUT bucket_done         BOOLEAN
+)
+RETURNS SETOF record
+STRICT
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_projected';
+
+CREATE FUNCTION pg_stat_monitor_stream(
+    IN showtext             boolean DEFAULT true,
+    OUT bucket              int8,   -- 0
+    OUT userid              oid,
+    OUT username            text,
+    OUT dbid                oid,
+    OUT datname             text,
+    OUT client_ip           int8,
+
+    OUT queryid             int8,  -- 6
+    OUT planid              int8,
+    OUT query               text,
+    OUT query_plan          text,
+    OUT pgsm_query_id       int8,
+    OUT top_queryid         int8,
+    OUT top_query           text,
+    OUT application_name    text,
+
+    OUT relations           text, -- 14
+    OUT cmd_type            int,
+    OUT elevel              int,
+    OUT sqlcode             TEXT,
+    OUT message             text,
+    OUT bucket_start_time   timestamptz,
+
+    OUT calls               int8,  -- 20
+
+    OUT total_exec_time     float8, -- 21
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+
+    OUT rows                int8, -- 26
+
+    OUT plans               int8,  -- 27
+
+    OUT total_plan_time     float8, -- 28
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+
+    OUT shared_blks_hit            int8, -- 33
+    OUT shared_blks_read           int8,
+    OUT shared_blks_dirtied        int8,
+    OUT shared_blks_written        int8,
+    OUT local_blks_hit             int8,
+    OUT local_blks_read            int8,
+    OUT local_blks_dirtied         int8,
+    OUT local_blks_written         int8,
+    OUT temp_blks_read             int8,
+    OUT temp_blks_written          int8,
+    OUT shared_blk_read_time       float8,
+    OUT shared_blk_write_time      float8,
+    OUT local_blk_read_time        float8,
+    OUT local_blk_write_time       float8,
+    OUT temp_blk_read_time         float8,
+    OUT temp_blk_write_time        float8,
+
+    OUT resp_calls          text, -- 49
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT wal_buffers_full    int8,
+    OUT comments            TEXT,
+
+    OUT jit_functions           int8, -- 57
+    OUT jit_generation_time     float8,
+    OUT jit_inlining_count      int8,
+    OUT jit_inlining_time       float8,
+    OUT jit_optimization_count  int8,
+    OUT jit_optimization_time   float8,
+    OUT jit_emission_count      int8,
+    OUT jit_emission_time       float8,
+    OUT jit_deform_count        int8,
+    OUT jit_deform_time         float8,
+
+    OUT parallel_workers_to_launch  int, -- 67
+    OUT parallel_workers_launched   int,
+
+    OUT generic_plan_calls   int8, -- 69
+    OUT custom_plan_calls    int8,
+
+    OUT min_exec_mem         int8, -- 71
+    OUT max_exec_mem         int8,
+    OUT mean_exec_mem        float8,
+    OUT exec_mem_calls       text,
+
+    OUT stats_since          timestamp with time zone, -- 75
+    OUT minmax_stats_since   timestamp with time zone,
+
+    OUT toplevel            BOOLEAN, -- 77
+    OUT bucket_done         BOOLEAN
+)
+RETURNS SETOF record
+STRICT
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_stream';
+
+CREATE FUNCTION pg_stat_monitor_rollup(
+    IN from_bucket_time     timestamptz DEFAULT NULL,
+    IN to_bucket_time       timestamptz DEFAULT NULL,
+    IN group_by             text DEFAULT 'queryid',
+    OUT queryid             int8,
+    OUT pgsm_query_id       int8,
+    OUT dbid                oid,
+    OUT datname             text,
+    OUT userid              oid,
+    OUT username            text,
+    OUT application_name    text,
+    OUT query               text,
+    OUT calls               int8,
+    OUT total_exec_time     float8,
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+    OUT rows                int8,
+    OUT plans               int8,
+    OUT total_plan_time     float8,
+    OUT min_plan_time       float8,
+    OUT max_plan_time       float8,
+    OUT mean_plan_time      float8,
+    OUT stddev_plan_time    float8,
+    OUT shared_blks_hit     int8,
+    OUT shared_blks_read    int8,
+    OUT shared_blks_dirtied int8,
+    OUT shared_blks_written int8,
+    OUT local_blks_hit      int8,
+    OUT local_blks_read     int8,
+    OUT local_blks_dirtied  int8,
+    OUT local_blks_written  int8,
+    OUT temp_blks_read      int8,
+    OUT temp_blks_written   int8,
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_fpi             int8,
+    OUT wal_bytes           numeric,
+    OUT resp_calls          int8[]
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_rollup';
+
+CREATE FUNCTION pg_stat_monitor_metrics(
+    buckets     int DEFAULT NULL,
+    label_set   text[] DEFAULT '{queryid,datname,username}'
+)
+RETURNS text
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_metrics';
+
+CREATE FUNCTION pg_stat_monitor_export(bucket int8)
+RETURNS bytea
+STRICT
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_export';
+
+CREATE FUNCTION pg_stat_monitor_decode(
+    IN data                 bytea,
+    OUT bucket              int8,
+    OUT bucket_start_time   timestamptz,
+    OUT userid              oid,
+    OUT dbid                oid,
+    OUT client_ip           int8,
+    OUT queryid             int8,
+    OUT planid              int8,
+    OUT top_queryid         int8,
+    OUT pgsm_query_id       int8,
+    OUT toplevel            boolean,
+    OUT application_name    text,
+    OUT query               text,
+    OUT top_query           text,
+    OUT cmd_type            int,
+    OUT stats_since         timestamptz,
+    OUT calls               int8,
+    OUT rows                int8,
+    OUT total_exec_time     float8,
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+    OUT plans               int8,
+    OUT total_plan_time     float8,
+    OUT shared_blks_hit     int8,
+    OUT shared_blks_read    int8,
+    OUT shared_blks_dirtied int8,
+    OUT shared_blks_written int8,
+    OUT temp_blks_read      int8,
+    OUT temp_blks_written   int8,
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_bytes           numeric,
+    OUT resp_calls          int[],
+    OUT min_exec_mem        int8,
+    OUT max_exec_mem        int8,
+    OUT mean_exec_mem       float8,
+    OUT exec_mem_calls      int[]
+)
+RETURNS SETOF record
+STRICT
+IMMUTABLE
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_decode';
+
+CREATE FUNCTION pg_stat_monitor_archive(
+    IN from_time            timestamptz DEFAULT NULL,
+    IN to_time              timestamptz DEFAULT NULL,
+    OUT bucket              int8,
+    OUT bucket_start_time   timestamptz,
+    OUT userid              oid,
+    OUT dbid                oid,
+    OUT client_ip           int8,
+    OUT queryid             int8,
+    OUT planid              int8,
+    OUT top_queryid         int8,
+    OUT pgsm_query_id       int8,
+    OUT toplevel            boolean,
+    OUT application_name    text,
+    OUT query               text,
+    OUT top_query           text,
+    OUT cmd_type            int,
+    OUT stats_since         timestamptz,
+    OUT calls               int8,
+    OUT rows                int8,
+    OUT total_exec_time     float8,
+    OUT min_exec_time       float8,
+    OUT max_exec_time       float8,
+    OUT mean_exec_time      float8,
+    OUT stddev_exec_time    float8,
+    OUT plans               int8,
+    OUT total_plan_time     float8,
+    OUT shared_blks_hit     int8,
+    OUT shared_blks_read    int8,
+    OUT shared_blks_dirtied int8,
+    OUT shared_blks_written int8,
+    OUT temp_blks_read      int8,
+    OUT temp_blks_written   int8,
+    OUT cpu_user_time       float8,
+    OUT cpu_sys_time        float8,
+    OUT wal_records         int8,
+    OUT wal_bytes           numeric,
+    OUT resp_calls          int[],
+    OUT min_exec_mem        int8,
+    OUT max_exec_mem        int8,
+    OUT mean_exec_mem       float8,
+    OUT exec_mem_calls      int[]
+)
+RETURNS SETOF record
+PARALLEL SAFE
+LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_stat_monitor_archive';
+
+-- Archived buckets include the texts of all users
+REVOKE ALL ON FUNCTION pg_stat_monitor_archive FROM PUBLIC;
+
+-- Add the executor memory columns to the views of all versions
+CREATE OR REPLACE FUNCTION pgsm_create_14_view()
+RETURNS int
+LANGUAGE plpgsql
+AS $$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time AS bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    toplevel,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time AS blk_read_time,
+    shared_blk_write_time AS blk_write_time,
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    wal_records,
+    wal_fpi,
+    wal_bytes,
+    bucket_done,
+
+    plans,
+    total_plan_time,
+    min_plan_time,
+    max_plan_time,
+    mean_plan_time,
+    stddev_plan_time,
+
+    min_exec_mem,
+    max_exec_mem,
+    mean_exec_mem,
+    (string_to_array(exec_mem_calls, ',')) exec_mem_calls
+
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION pgsm_create_15_view() RETURNS INT AS
+$$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time AS bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    toplevel,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time AS blk_read_time,
+    shared_blk_write_time AS blk_write_time,
+    temp_blk_read_time,
+    temp_blk_write_time,
+
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    wal_records,
+    wal_fpi,
+    wal_bytes,
+    bucket_done,
+
+    plans,
+    total_plan_time,
+    min_plan_time,
+    max_plan_time,
+    mean_plan_time,
+    stddev_plan_time,
+
+    jit_functions,
+    jit_generation_time,
+    jit_inlining_count,
+    jit_inlining_time,
+    jit_optimization_count,
+    jit_optimization_time,
+    jit_emission_count,
+    jit_emission_time,
+
+    min_exec_mem,
+    max_exec_mem,
+    mean_exec_mem,
+    (string_to_array(exec_mem_calls, ',')) exec_mem_calls
+
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION pgsm_create_17_view()
+RETURNS int
+LANGUAGE plpgsql
+AS $$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    toplevel,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time,
+    shared_blk_write_time,
+    local_blk_read_time,
+    local_blk_write_time,
+    temp_blk_read_time,
+    temp_blk_write_time,
+
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    wal_records,
+    wal_fpi,
+    wal_bytes,
+    bucket_done,
 
-    OUT relations           text, -- 14
-    OUT cmd_type            int,
-    OUT elevel              int,
-    OUT sqlcode             TEXT,
-    OUT message             text,
-    OUT bucket_start_time   timestamptz,
+    plans,
+    total_plan_time,
+    min_plan_time,
+    max_plan_time,
+    mean_plan_time,
+    stddev_plan_time,
 
-    OUT calls               int8,  -- 20
+    jit_functions,
+    jit_generation_time,
+    jit_inlining_count,
+    jit_inlining_time,
+    jit_optimization_count,
+    jit_optimization_time,
+    jit_emission_count,
+    jit_emission_time,
+    jit_deform_count,
+    jit_deform_time,
 
-    OUT total_exec_time     float8, -- 21
-    OUT min_exec_time       float8,
-    OUT max_exec_time       float8,
-    OUT mean_exec_time      float8,
-    OUT stddev_exec_time    float8,
+    min_exec_mem,
+    max_exec_mem,
+    mean_exec_mem,
+    (string_to_array(exec_mem_calls, ',')) exec_mem_calls,
 
-    OUT rows                int8, -- 26
+    stats_since,
+    minmax_stats_since
 
-    OUT plans               int8,  -- 27
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$;
 
-    OUT total_plan_time     float8, -- 28
-    OUT min_plan_time       float8,
-    OUT max_plan_time       float8,
-    OUT mean_plan_time      float8,
-    OUT stddev_plan_time    float8,
+CREATE OR REPLACE FUNCTION pgsm_create_18_view()
+RETURNS int
+LANGUAGE plpgsql
+AS $$
+BEGIN
+CREATE VIEW pg_stat_monitor AS SELECT
+    bucket,
+    bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    '0.0.0.0'::inet + client_ip AS client_ip,
+    pgsm_query_id,
+    queryid,
+    toplevel,
+    top_queryid,
+    query,
+    comments,
+    planid,
+    query_plan,
+    top_query,
+    application_name,
+    string_to_array(relations, ',') AS relations,
+    cmd_type,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    elevel,
+    sqlcode,
+    message,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    shared_blks_hit,
+    shared_blks_read,
+    shared_blks_dirtied,
+    shared_blks_written,
+    local_blks_hit,
+    local_blks_read,
+    local_blks_dirtied,
+    local_blks_written,
+    temp_blks_read,
+    temp_blks_written,
+    shared_blk_read_time,
+    shared_blk_write_time,
+    local_blk_read_time,
+    local_blk_write_time,
+    temp_blk_read_time,
+    temp_blk_write_time,
 
-    OUT shared_blks_hit            int8, -- 33
-    OUT shared_blks_read           int8,
-    OUT shared_blks_dirtied        int8,
-    OUT shared_blks_written        int8,
-    OUT local_blks_hit             int8,
-    OUT local_blks_read            int8,
-    OUT local_blks_dirtied         int8,
-    OUT local_blks_written         int8,
-    OUT temp_blks_read             int8,
-    OUT temp_blks_written          int8,
-    OUT shared_blk_read_time       float8,
-    OUT shared_blk_write_time      float8,
-    OUT local_blk_read_time        float8,
-    OUT local_blk_write_time       float8,
-    OUT temp_blk_read_time         float8,
-    OUT temp_blk_write_time        float8,
+    (string_to_array(resp_calls, ',')) resp_calls,
+    cpu_user_time,
+    cpu_sys_time,
+    wal_records,
+    wal_fpi,
+    wal_bytes,
+    wal_buffers_full,
+    bucket_done,
 
-    OUT resp_calls          text, -- 49
-    OUT cpu_user_time       float8,
-    OUT cpu_sys_time        float8,
-    OUT wal_records         int8,
-    OUT wal_fpi             int8,
-    OUT wal_bytes           numeric,
-    OUT wal_buffers_full    int8,
-    OUT comments            TEXT,
+    plans,
+    total_plan_time,
+    min_plan_time,
+    max_plan_time,
+    mean_plan_time,
+    stddev_plan_time,
 
-    OUT jit_functions           int8, -- 57
-    OUT jit_generation_time     float8,
-    OUT jit_inlining_count      int8,
-    OUT jit_inlining_time       float8,
-    OUT jit_optimization_count  int8,
-    OUT jit_optimization_time   float8,
-    OUT jit_emission_count      int8,
-    OUT jit_emission_time       float8,
-    OUT jit_deform_count        int8,
-    OUT jit_deform_time         float8,
+    jit_functions,
+    jit_generation_time,
+    jit_inlining_count,
+    jit_inlining_time,
+    jit_optimization_count,
+    jit_optimization_time,
+    jit_emission_count,
+    jit_emission_time,
+    jit_deform_count,
+    jit_deform_time,
 
-    OUT parallel_workers_to_launch  int, -- 67
-    OUT parallel_workers_launched   int,
+    parallel_workers_to_launch,
+    parallel_workers_launched,
 
-    OUT generic_plan_calls   int8, -- 69
-    OUT custom_plan_calls    int8,
+    min_exec_mem,
+    max_exec_mem,
+    mean_exec_mem,
+    (string_to_array(exec_mem_calls, ',')) exec_mem_calls,
 
-    OUT stats_since          timestamp with time zone, -- 71
-    OUT minmax_stats_since   timestamp with time zone,
+    stats_since,
+    minmax_stats_since
 
-    OUT toplevel            BOOLEAN, -- 73
-    OUT bucket_done         BOOLEAN
-)
-RETURNS SETOF record
-STRICT
-PARALLEL SAFE
-LANGUAGE c
-AS 'MODULE_PATHNAME', 'pg_stat_monitor_NEXT';
+FROM pg_stat_monitor_internal(TRUE)
+ORDER BY bucket_start_time;
+RETURN 0;
+END;
+$$;
 
 CREATE FUNCTION pgsm_create_19_view()
 RETURNS int
@@ -239,6 +1297,11 @@ CREATE VIEW pg_stat_monitor AS SELECT
     generic_plan_calls,
     custom_plan_calls,
 
+    min_exec_mem,
+    max_exec_mem,
+    mean_exec_mem,
+    (string_to_array(exec_mem_calls, ',')) exec_mem_calls,
+
     stats_since,
     minmax_stats_since
 
@@ -269,3 +1332,28 @@ END;
 $$;
 
 GRANT SELECT ON pg_stat_monitor TO PUBLIC;
+
+-- Only the key columns, query text and execution times, for dashboards
+CREATE VIEW pg_stat_monitor_light AS SELECT
+    bucket,
+    bucket_start_time,
+    userid,
+    username,
+    dbid,
+    datname,
+    queryid,
+    toplevel,
+    query,
+    get_cmd_type(cmd_type) AS cmd_type_text,
+    calls,
+    total_exec_time,
+    min_exec_time,
+    max_exec_time,
+    mean_exec_time,
+    stddev_exec_time,
+    rows,
+    bucket_done
+FROM pg_stat_monitor_projected('{text,timing}')
+ORDER BY bucket_start_time;
+
+GRANT SELECT ON pg_stat_monitor_light TO PUBLIC;
@@ -0,0 +1,15 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+
+SELECT pg_stat_monitor_generation() AS gen0 \gset
+SELECT 1 AS num;
+
+-- Everything updated after gen0
+SELECT query, calls FROM pg_stat_monitor_changes(:gen0) ORDER BY query COLLATE "C";
+
+-- Only the entry touched since gen1 is returned
+SELECT pg_stat_monitor_generation() AS gen1 \gset
+SELECT query, calls FROM pg_stat_monitor_changes(:gen1) ORDER BY query COLLATE "C";
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
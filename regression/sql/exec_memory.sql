@@ -0,0 +1,25 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 1 AS num;
+SET work_mem = '64MB';
+SELECT count(*) FROM (SELECT g FROM generate_series(1, 200000) AS g ORDER BY g DESC) AS s;
+RESET work_mem;
+
+-- Executor memory of the calls, NULL for utility statements
+SELECT query, calls,
+       min_exec_mem > 0 AS min,
+       max_exec_mem >= min_exec_mem AS max,
+       mean_exec_mem BETWEEN min_exec_mem AND max_exec_mem AS mean,
+       max_exec_mem > 1024 * 1024 AS large,
+       cardinality(exec_mem_calls) AS buckets,
+       (SELECT sum(c::int8) FROM unnest(exec_mem_calls) AS c) AS hist_calls
+  FROM pg_stat_monitor
+ WHERE query IN ('SELECT 1 AS num', 'SET work_mem = ''64MB''') OR query LIKE 'SELECT count(*) FROM (SELECT g%'
+ ORDER BY query COLLATE "C";
+
+-- Statement with the largest executor memory
+SELECT query FROM pg_stat_monitor_top('max_exec_mem', 1);
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,36 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 1 AS num;
+SELECT 'a' AS str;
+
+SELECT bucket AS cur FROM pg_stat_monitor WHERE query = 'SELECT 1 AS num' \gset
+
+-- Round trip through the binary format
+SELECT query, calls, rows, calls = (SELECT sum(f) FROM unnest(resp_calls) AS f) AS histogram_ok
+  FROM pg_stat_monitor_decode(pg_stat_monitor_export(:cur))
+ WHERE query NOT LIKE '%pg_stat_monitor%' ORDER BY query COLLATE "C";
+
+SELECT d.calls = p.calls AND d.total_exec_time = p.total_exec_time AND
+       d.stddev_exec_time = p.stddev_exec_time AND d.resp_calls::text[] = p.resp_calls AND
+       d.max_exec_mem = p.max_exec_mem AND d.mean_exec_mem = p.mean_exec_mem AND
+       d.exec_mem_calls::text[] = p.exec_mem_calls::text[] AS same
+  FROM pg_stat_monitor AS p
+  JOIN pg_stat_monitor_decode(pg_stat_monitor_export(:cur)) AS d USING (bucket, queryid, userid, dbid)
+ WHERE p.query = 'SELECT 1 AS num';
+
+-- Header fields at fixed offsets in network byte order
+SELECT b = :cur AS current,
+       substr(e, 1, 4) = 'PGSM'::bytea AS magic,
+       get_byte(e, 4) * 256 + get_byte(e, 5) AS version,
+       get_byte(e, 7) & 1 = 1 AS partial
+  FROM (SELECT b, pg_stat_monitor_export(b) AS e
+          FROM (VALUES (:cur), ((:cur + 1) % 10)) AS v (b)) AS x
+ ORDER BY 1;
+
+SELECT pg_stat_monitor_export(-1);
+SELECT * FROM pg_stat_monitor_decode('\x00');
+SELECT * FROM pg_stat_monitor_decode(overlay(pg_stat_monitor_export(:cur) PLACING '\x4d534750'::bytea FROM 1 FOR 4));
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,28 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 1 AS num;
+SELECT 'a' AS str;
+
+-- Only statements executed at least twice
+SELECT query, calls FROM pg_stat_monitor_filtered(_min_calls => 2) ORDER BY query COLLATE "C";
+
+-- Filters on key columns
+SELECT query, calls FROM pg_stat_monitor_filtered(
+    _dbid => (SELECT oid FROM pg_database WHERE datname = current_database()),
+    _userid => (SELECT oid FROM pg_roles WHERE rolname = current_user))
+    WHERE query LIKE 'SELECT _ AS %' OR query LIKE 'SELECT ''a'' AS %'
+    ORDER BY query COLLATE "C";
+SELECT (SELECT count(*) FROM pg_stat_monitor_filtered(_dbid => 0)) AS no_db,
+       (SELECT count(*) FROM pg_stat_monitor_filtered(_bucket => -1)) AS no_bucket;
+
+-- Filtering by queryid returns the same entry as the view
+SELECT f.query, f.calls
+    FROM pg_stat_monitor_filtered(_queryid => (SELECT queryid FROM pg_stat_monitor WHERE query = 'SELECT ''a'' AS str')) f;
+
+-- Without text
+SELECT query IS NULL AS no_text, calls
+    FROM pg_stat_monitor_filtered(false, _queryid => (SELECT queryid FROM pg_stat_monitor WHERE query = 'SELECT 1 AS num'));
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
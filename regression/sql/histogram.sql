@@ -38,4 +38,12 @@ SELECT substr(query, 0, 50) as query, calls, resp_calls FROM pg_stat_monitor ORD
 
 SELECT * FROM generate_histogram();
 
+-- The same histogram as float8 ranges, unknown queryids are ignored
+SELECT h.bucket_index, round(h.range_start::numeric, 3) AS range_start,
+       round(h.range_end::numeric, 3) AS range_end, h.freq
+  FROM pg_stat_monitor AS p,
+       pg_stat_monitor_histogram(p.bucket, ARRAY[p.queryid, 0]) AS h
+ WHERE p.query = 'SELECT pg_sleep(0.4 * i)' AND h.freq > 0
+ ORDER BY h.bucket_index;
+
 DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,27 @@
+CREATE EXTENSION pg_stat_monitor;
+CREATE TABLE hotspot_t (a int);
+INSERT INTO hotspot_t SELECT generate_series(1, 1000);
+ANALYZE hotspot_t;
+SELECT pg_stat_monitor_reset();
+
+-- The first slow call marks the statement, the next one is instrumented
+SET max_parallel_workers_per_gather = 0;
+SET pg_stat_monitor.pgsm_hotspot_threshold = 0;
+SELECT count(*) FROM hotspot_t WHERE a <= 100;
+SELECT count(*) FROM hotspot_t WHERE a <= 100;
+RESET pg_stat_monitor.pgsm_hotspot_threshold;
+RESET max_parallel_workers_per_gather;
+
+SELECT h.node_type, h.relid::regclass AS relation, h.actual_rows, h.loops,
+       h.plan_rows > 0 AS planned,
+       h.self_time >= 0 AS self,
+       h.total_time >= h.self_time AS total,
+       h.exec_time >= h.total_time AS exec
+  FROM pg_stat_monitor_hotspots() AS h
+  JOIN pg_stat_monitor AS s USING (bucket, queryid, planid, userid, dbid, toplevel)
+ WHERE s.query LIKE 'SELECT count(*) FROM hotspot_t%'
+ ORDER BY h.node_type COLLATE "C";
+
+DROP TABLE hotspot_t;
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
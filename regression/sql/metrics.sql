@@ -0,0 +1,30 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 1 AS num;
+SELECT 1 AS num;
+
+-- Series of one query, leaving out the timings
+WITH q AS (SELECT queryid::text AS id FROM pg_stat_monitor WHERE query = 'SELECT 1 AS num')
+SELECT replace(replace(l.line, q.id, 'Q'), current_database(), 'D') AS line
+  FROM q, regexp_split_to_table(pg_stat_monitor_metrics(NULL, '{queryid,datname}'), E'\n')
+       WITH ORDINALITY AS l (line, n)
+ WHERE l.line LIKE '%"' || q.id || '"%'
+   AND (l.line NOT LIKE '%seconds%' OR l.line LIKE '%_gcount%')
+ ORDER BY l.n;
+
+-- Metadata and terminator
+SELECT l.line
+  FROM regexp_split_to_table(pg_stat_monitor_metrics(1, '{}'), E'\n') WITH ORDINALITY AS l (line, n)
+ WHERE l.line LIKE '#%'
+ ORDER BY l.n;
+
+-- Every histogram has a +Inf bucket
+SELECT count(*) FILTER (WHERE line LIKE '%le="+Inf"%') = count(*) FILTER (WHERE line LIKE '%\_gcount%') AS inf
+  FROM regexp_split_to_table(pg_stat_monitor_metrics(NULL, '{queryid}'), E'\n') AS line;
+
+SELECT pg_stat_monitor_metrics(NULL, '{query}');
+SELECT pg_stat_monitor_metrics(0);
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,28 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+
+-- Columns outside of the requested groups are NULL
+SELECT query, calls,
+       total_exec_time IS NULL AS no_timing,
+       shared_blks_hit IS NULL AS no_blocks,
+       resp_calls IS NULL AS no_histogram,
+       wal_records IS NULL AS no_wal,
+       jit_functions IS NULL AS no_jit
+  FROM pg_stat_monitor_projected('{text}')
+ WHERE query = 'SELECT 1 AS num';
+SELECT query IS NULL AS no_text,
+       total_exec_time >= 0 AS timing,
+       resp_calls IS NOT NULL AS histogram
+  FROM pg_stat_monitor_projected('{timing,histogram}')
+ WHERE queryid = (SELECT queryid FROM pg_stat_monitor WHERE query = 'SELECT 1 AS num');
+
+-- Lightweight view
+SELECT query, cmd_type_text, calls, total_exec_time >= 0 AS timing
+  FROM pg_stat_monitor_light
+ WHERE query LIKE 'SELECT _ AS %';
+
+SELECT * FROM pg_stat_monitor_projected('{bogus}');
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
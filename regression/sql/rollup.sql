@@ -0,0 +1,35 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SET application_name = 'rollup_a';
+SELECT pg_sleep(0.01);
+SELECT pg_sleep(0.02);
+SET application_name = 'rollup_b';
+SELECT pg_sleep(0.03);
+RESET application_name;
+
+-- Entries of one query under two application names, merged into one row
+WITH e AS (
+    SELECT calls, total_exec_time, mean_exec_time, min_exec_time, max_exec_time,
+           stddev_exec_time ^ 2 * calls AS m2
+      FROM pg_stat_monitor WHERE query LIKE 'SELECT pg_sleep%'
+), t AS (
+    SELECT count(*) AS entries, sum(calls) AS calls, sum(total_exec_time) / sum(calls) AS mean,
+           min(min_exec_time) AS min, max(max_exec_time) AS max FROM e
+)
+SELECT t.entries, r.calls,
+       r.min_exec_time = t.min AS min_ok,
+       r.max_exec_time = t.max AS max_ok,
+       abs(r.mean_exec_time - t.mean) < 1e-9 AS mean_ok,
+       abs(r.stddev_exec_time -
+           sqrt((SELECT sum(m2 + calls * (mean_exec_time - t.mean) ^ 2) FROM e) / t.calls)) < 1e-9 AS stddev_ok,
+       (SELECT sum(f) FROM unnest(r.resp_calls) AS f) = r.calls AS histogram_ok
+  FROM pg_stat_monitor_rollup() AS r, t
+ WHERE r.query LIKE 'SELECT pg_sleep%';
+
+SELECT datname = current_database() AS same_db, calls > 3 AS calls
+  FROM pg_stat_monitor_rollup(group_by => 'dbid');
+SELECT count(*) FROM pg_stat_monitor_rollup(now() + interval '1 hour', NULL);
+SELECT * FROM pg_stat_monitor_rollup(group_by => 'no_such_group');
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
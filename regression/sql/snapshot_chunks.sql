@@ -0,0 +1,14 @@
+CREATE EXTENSION pg_stat_monitor;
+SET pg_stat_monitor.pgsm_snapshot_chunk_size = 2;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 1 AS num;
+SELECT 'a' AS str;
+SELECT 1 + 1 AS sum;
+
+-- Four entries copied out two at a time
+SELECT query, calls FROM pg_stat_monitor ORDER BY query COLLATE "C";
+
+RESET pg_stat_monitor.pgsm_snapshot_chunk_size;
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
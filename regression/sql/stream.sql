@@ -0,0 +1,19 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 'a' AS str;
+
+-- One entry per chunk, rows returned one per call from the select list
+SET pg_stat_monitor.pgsm_snapshot_chunk_size = 1;
+SELECT (s).query, (s).calls
+  FROM (SELECT pg_stat_monitor_stream() AS s) AS t
+ WHERE (s).query LIKE 'SELECT _ AS %' OR (s).query LIKE 'SELECT ''_'' AS %'
+ ORDER BY (s).query COLLATE "C";
+RESET pg_stat_monitor.pgsm_snapshot_chunk_size;
+
+SELECT count(*) FILTER (WHERE query IS NOT NULL) AS with_text,
+       count(*) > 0 AS any_rows
+  FROM pg_stat_monitor_stream(false);
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
@@ -0,0 +1,20 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 1 AS num;
+
+-- Each text once, however many times it ran
+SELECT query, top_query FROM pg_stat_monitor_texts()
+ WHERE query NOT LIKE '%pg_stat_monitor_texts%' ORDER BY query COLLATE "C";
+
+-- Only the texts first seen after the marker
+SELECT max(generation) AS gen FROM pg_stat_monitor_texts() \gset
+SELECT 'a' AS str;
+SELECT 1 AS num;
+SELECT query FROM pg_stat_monitor_texts(:gen)
+ WHERE query NOT LIKE '%pg_stat_monitor_texts%' ORDER BY query COLLATE "C";
+
+SELECT * FROM pg_stat_monitor_texts(-1);
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
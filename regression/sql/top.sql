@@ -0,0 +1,23 @@
+CREATE EXTENSION pg_stat_monitor;
+SELECT pg_stat_monitor_reset();
+SELECT 1 AS num;
+SELECT 1 AS num;
+SELECT 1 AS num;
+SELECT 'a' AS str;
+SELECT 'a' AS str;
+
+-- Most called statements, largest first
+SELECT query, calls, value FROM pg_stat_monitor_top('calls', 2);
+
+-- Only the current bucket
+SELECT query, calls FROM pg_stat_monitor_top('calls', 1, 1);
+-- No more rows than queryids, whatever the number asked for
+SELECT query, calls FROM pg_stat_monitor_top('calls', 2000000000) WHERE calls > 1;
+
+SELECT * FROM pg_stat_monitor_top('rows', 0);
+
+SELECT * FROM pg_stat_monitor_top('no_such_metric');
+SELECT * FROM pg_stat_monitor_top('calls', 5, 0);
+
+SELECT pg_stat_monitor_reset();
+DROP EXTENSION pg_stat_monitor;
@@ -38,6 +38,21 @@ bool		pgsm_track_utility;
 static bool pgsm_track_application_names;	/* deprecated */
 bool		pgsm_enable_pgsm_query_id;
 int			pgsm_track = PGSM_TRACK_TOP;
+int			pgsm_eviction = PGSM_EVICTION_NONE;
+bool		pgsm_track_overhead;
+bool		pgsm_dynamic_hash;
+int			pgsm_dynamic_hash_max;
+int			pgsm_snapshot_chunk_size;
+bool		pgsm_save;
+char	   *pgsm_archive_directory;
+int			pgsm_archive_file_size;
+int			pgsm_archive_file_age;
+char	   *pgsm_rollup_levels;
+int			pgsm_rollup_nlevels;
+bool		pgsm_wait_sampling;
+int			pgsm_wait_sampling_frequency;
+int			pgsm_hotspot_threshold;
+pgsmRollupLevel pgsm_rollup_level[PGSM_MAX_ROLLUP_LEVELS];
 
 static const struct config_enum_entry track_options[] =
 {
@@ -47,6 +62,15 @@ static const struct config_enum_entry track_options[] =
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry eviction_options[] =
+{
+	{"none", PGSM_EVICTION_NONE, false},
+	{"least_time", PGSM_EVICTION_LEAST_TIME, false},
+	{"least_calls", PGSM_EVICTION_LEAST_CALLS, false},
+	{"clock", PGSM_EVICTION_CLOCK, false},
+	{NULL, 0, false}
+};
+
 /* Check hooks to ensure histogram_min < histogram_max */
 static bool check_histogram_min(double *newval, void **extra, GucSource source);
 static bool check_histogram_max(double *newval, void **extra, GucSource source);
@@ -54,6 +78,14 @@ static bool check_histogram_max(double *newval, void **extra, GucSource source);
 /* Check hook warning that a deprecated parameter has no effect */
 static bool check_track_application_names(bool *newval, void **extra, GucSource source);
 
+/* Check hook rejecting the dynamic hash table where dshash cannot scan */
+static bool check_dynamic_hash(bool *newval, void **extra, GucSource source);
+
+/* Hooks parsing the rollup levels */
+static bool parse_rollup_levels(const char *value, pgsmRollupLevel *levels, int *nlevels);
+static bool check_rollup_levels(char **newval, void **extra, GucSource source);
+static void assign_rollup_levels(const char *newval, void *extra);
+
 /*
  * Define (or redefine) custom GUC variables.
  */
@@ -94,8 +126,8 @@ init_guc(void)
 							&pgsm_max_buckets,	/* value address */
 							10, /* boot value */
 							1,	/* min value */
-							20000,	/* max value */
-							PGC_POSTMASTER, /* context */
+							PGSM_MAX_BUCKETS,	/* max value */
+							PGC_SIGHUP, /* context */
 							0,	/* flags */
 							NULL,	/* check_hook */
 							NULL,	/* assign_hook */
@@ -109,7 +141,7 @@ init_guc(void)
 							60, /* boot value */
 							1,	/* min value */
 							INT_MAX,	/* max value */
-							PGC_POSTMASTER, /* context */
+							PGC_SIGHUP, /* context */
 							GUC_UNIT_S, /* flags */
 							NULL,	/* check_hook */
 							NULL,	/* assign_hook */
@@ -123,7 +155,7 @@ init_guc(void)
 							 1, /* boot value */
 							 0, /* min value */
 							 HISTOGRAM_MAX_TIME,	/* max value */
-							 PGC_POSTMASTER,	/* context */
+							 PGC_SIGHUP,	/* context */
 							 GUC_UNIT_MS,	/* flags */
 							 check_histogram_min,	/* check_hook */
 							 NULL,	/* assign_hook */
@@ -137,7 +169,7 @@ init_guc(void)
 							 100000.0,	/* boot value */
 							 10.0,	/* min value */
 							 HISTOGRAM_MAX_TIME,	/* max value */
-							 PGC_POSTMASTER,	/* context */
+							 PGC_SIGHUP,	/* context */
 							 GUC_UNIT_MS,	/* flags */
 							 check_histogram_max,	/* check_hook */
 							 NULL,	/* assign_hook */
@@ -151,7 +183,7 @@ init_guc(void)
 							20, /* boot value */
 							2,	/* min value */
 							MAX_RESPONSE_BUCKET,	/* max value */
-							PGC_POSTMASTER, /* context */
+							PGC_SIGHUP, /* context */
 							0,	/* flags */
 							NULL,	/* check_hook */
 							NULL,	/* assign_hook */
@@ -268,6 +300,18 @@ init_guc(void)
 							 NULL,	/* assign_hook */
 							 NULL	/* show_hook */
 		);
+	DefineCustomEnumVariable("pg_stat_monitor.pgsm_eviction",	/* name */
+							 "Selects which statement of the current bucket makes room for a new one when the hash table is full.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &pgsm_eviction,	/* value address */
+							 PGSM_EVICTION_NONE,	/* boot value */
+							 eviction_options,	/* enum options */
+							 PGC_SIGHUP,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
 	DefineCustomBoolVariable("pg_stat_monitor.pgsm_track_planning", /* name */
 							 "Selects whether planning statistics are tracked.",	/* short_desc */
 							 NULL,	/* long_desc */
@@ -279,6 +323,161 @@ init_guc(void)
 							 NULL,	/* assign_hook */
 							 NULL	/* show_hook */
 		);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_snapshot_chunk_size",	/* name */
+							"Sets the number of entries copied per lock acquisition when reading pg_stat_monitor, 0 reads all entries under one lock.",	/* short_desc */
+							NULL,	/* long_desc */
+							&pgsm_snapshot_chunk_size,	/* value address */
+							0,	/* boot value */
+							0,	/* min value */
+							65536,	/* max value */
+							PGC_USERSET,	/* context */
+							0,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+	DefineCustomBoolVariable("pg_stat_monitor.pgsm_save",	/* name */
+							 "Save pg_stat_monitor statistics across server shutdowns.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &pgsm_save,	/* value address */
+							 false, /* boot value */
+							 PGC_POSTMASTER,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomStringVariable("pg_stat_monitor.pgsm_archive_directory",	/* name */
+							   "Sets the directory to archive closed buckets into, empty disables archiving.",	/* short_desc */
+							   NULL,	/* long_desc */
+							   &pgsm_archive_directory, /* value address */
+							   "",	/* boot value */
+							   PGC_POSTMASTER,	/* context */
+							   0,	/* flags */
+							   NULL,	/* check_hook */
+							   NULL,	/* assign_hook */
+							   NULL /* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_archive_file_size",	/* name */
+							"Sets the size after which a new archive file is started.",	/* short_desc */
+							NULL,	/* long_desc */
+							&pgsm_archive_file_size,	/* value address */
+							64, /* boot value */
+							1,	/* min value */
+							1024,	/* max value */
+							PGC_SIGHUP, /* context */
+							GUC_UNIT_MB,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_archive_file_age",	/* name */
+							"Sets the age after which a new archive file is started.",	/* short_desc */
+							NULL,	/* long_desc */
+							&pgsm_archive_file_age, /* value address */
+							1440,	/* boot value */
+							1,	/* min value */
+							INT_MAX / 60,	/* max value */
+							PGC_SIGHUP, /* context */
+							GUC_UNIT_MIN,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	DefineCustomBoolVariable("pg_stat_monitor.pgsm_track_overhead", /* name */
+							 "Times pg_stat_monitor's own work in each hook, see pg_stat_monitor_hook_stats().",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &pgsm_track_overhead,	/* value address */
+							 false, /* boot value */
+							 PGC_SUSET, /* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomBoolVariable("pg_stat_monitor.pgsm_dynamic_hash",	/* name */
+							 "Keep the statistics in a hash table growing on demand instead of a fixed one sized by pgsm_max.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &pgsm_dynamic_hash,	/* value address */
+							 false, /* boot value */
+							 PGC_POSTMASTER,	/* context */
+							 0, /* flags */
+							 check_dynamic_hash,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_dynamic_hash_max",	/* name */
+							"Sets the maximum memory the dynamic hash table may grow to.",	/* short_desc */
+							NULL,	/* long_desc */
+							&pgsm_dynamic_hash_max, /* value address */
+							256,	/* boot value */
+							10, /* min value */
+							INT_MAX,	/* max value */
+							PGC_SIGHUP, /* context */
+							GUC_UNIT_MB,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	DefineCustomStringVariable("pg_stat_monitor.pgsm_rollup_levels",	/* name */
+							   "Sets the coarser buckets expired buckets are merged into, as a list of bucketsxseconds.",	/* short_desc */
+							   NULL,	/* long_desc */
+							   &pgsm_rollup_levels, /* value address */
+							   "",	/* boot value */
+							   PGC_POSTMASTER,	/* context */
+							   0,	/* flags */
+							   check_rollup_levels, /* check_hook */
+							   assign_rollup_levels,	/* assign_hook */
+							   NULL /* show_hook */
+		);
+
+	DefineCustomBoolVariable("pg_stat_monitor.pgsm_wait_sampling",	/* name */
+							 "Samples the wait events of running statements in a background worker.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &pgsm_wait_sampling,	/* value address */
+							 false, /* boot value */
+							 PGC_POSTMASTER,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_wait_sampling_frequency",	/* name */
+							"Sets the number of times per second wait events are sampled.",	/* short_desc */
+							NULL,	/* long_desc */
+							&pgsm_wait_sampling_frequency,	/* value address */
+							10, /* boot value */
+							1,	/* min value */
+							1000,	/* max value */
+							PGC_SIGHUP, /* context */
+							0,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_stat_monitor.pgsm_hotspot_threshold",	/* name */
+							"Sets the execution time above which the slowest plan nodes of a statement are captured.",	/* short_desc */
+							"Statements which once ran longer than this are run with per node instrumentation. -1 disables it.",	/* long_desc */
+							&pgsm_hotspot_threshold,	/* value address */
+							-1, /* boot value */
+							-1, /* min value */
+							INT_MAX,	/* max value */
+							PGC_SUSET,	/* context */
+							GUC_UNIT_MS,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
 }
 
 /* Maximum value must be greater or equal to minimum + 1.0 */
@@ -309,3 +508,107 @@ check_track_application_names(bool *newval, void **extra, GucSource source)
 
 	return true;
 }
+
+static bool
+check_dynamic_hash(bool *newval, void **extra, GucSource source)
+{
+#if PG_VERSION_NUM < 150000
+	if (*newval)
+	{
+		GUC_check_errdetail("The dynamic hash table requires PostgreSQL 15 or later.");
+		return false;
+	}
+#endif
+	return true;
+}
+
+/*
+ * Parse a rollup level list like "24x3600,7x86400": 24 buckets of one hour,
+ * then 7 buckets of one day.  The time of each level must be a multiple of
+ * the time of the level before, starting with pgsm_bucket_time, so that the
+ * buckets of a level never straddle two buckets of the next one.
+ */
+static bool
+parse_rollup_levels(const char *value, pgsmRollupLevel *levels, int *nlevels)
+{
+	const char *p = value;
+	int64		prev_time = pgsm_bucket_time;
+
+	*nlevels = 0;
+
+	while (*p != '\0')
+	{
+		char	   *end;
+		long		buckets;
+		long		bucket_time;
+
+		if (*nlevels == PGSM_MAX_ROLLUP_LEVELS)
+		{
+			GUC_check_errdetail("At most %d rollup levels are supported.", PGSM_MAX_ROLLUP_LEVELS);
+			return false;
+		}
+
+		errno = 0;
+		buckets = strtol(p, &end, 10);
+		if (end == p || *end != 'x' || errno != 0)
+			goto syntax_error;
+		p = end + 1;
+		bucket_time = strtol(p, &end, 10);
+		if (end == p || (*end != ',' && *end != '\0') || errno != 0)
+			goto syntax_error;
+		p = (*end == ',') ? end + 1 : end;
+
+		if (buckets < 1 || buckets > 20000)
+		{
+			GUC_check_errdetail("The number of buckets of a rollup level must be between 1 and 20000.");
+			return false;
+		}
+		if (bucket_time <= prev_time || bucket_time > INT_MAX || bucket_time % prev_time != 0)
+		{
+			GUC_check_errdetail("The bucket time of a rollup level must be a multiple of the bucket time of the level before.");
+			return false;
+		}
+
+		levels[*nlevels].buckets = (int) buckets;
+		levels[*nlevels].bucket_time = (int) bucket_time;
+		(*nlevels)++;
+		prev_time = bucket_time;
+	}
+
+	return true;
+
+syntax_error:
+	GUC_check_errdetail("Rollup levels must be a comma-separated list of bucketsxseconds, like \"24x3600,7x86400\".");
+	return false;
+}
+
+static bool
+check_rollup_levels(char **newval, void **extra, GucSource source)
+{
+	pgsmRollupLevel levels[PGSM_MAX_ROLLUP_LEVELS];
+	int			nlevels;
+
+	return parse_rollup_levels(*newval, levels, &nlevels);
+}
+
+static void
+assign_rollup_levels(const char *newval, void *extra)
+{
+	if (!parse_rollup_levels(newval, pgsm_rollup_level, &pgsm_rollup_nlevels))
+		pgsm_rollup_nlevels = 0;
+}
+
+/*
+ * Total number of buckets: room for the largest ring of pgsm_max_buckets,
+ * which can change on reload, followed by the buckets of each rollup level.
+ */
+int
+pgsm_bucket_count(void)
+{
+	int			count = PGSM_MAX_BUCKETS;
+
+	for (int i = 0; i < pgsm_rollup_nlevels; i++)
+		count += pgsm_rollup_level[i].buckets;
+
+	return count;
+}
@@ -19,6 +19,16 @@
 
 #define HISTOGRAM_MAX_TIME		50000000
 #define MAX_RESPONSE_BUCKET		50
+#define PGSM_MAX_BUCKETS		20000
+
+#define PGSM_MAX_ROLLUP_LEVELS	4
+
+/* A level of coarser buckets, see pg_stat_monitor.pgsm_rollup_levels */
+typedef struct pgsmRollupLevel
+{
+	int			buckets;		/* number of buckets of the level */
+	int			bucket_time;	/* time per bucket in seconds */
+} pgsmRollupLevel;
 
 typedef enum
 {
@@ -27,6 +37,14 @@ typedef enum
 	PGSM_TRACK_ALL				/* all statements, including nested ones */
 }			PGSMTrackLevel;
 
+typedef enum
+{
+	PGSM_EVICTION_NONE = 0,		/* drop new statements when full */
+	PGSM_EVICTION_LEAST_TIME,	/* evict the least total execution time */
+	PGSM_EVICTION_LEAST_CALLS,	/* evict the least calls */
+	PGSM_EVICTION_CLOCK			/* evict the least recently used */
+}			PGSMEvictionPolicy;
+
 extern int	pgsm_max;
 extern int	pgsm_query_max_len;
 extern int	pgsm_bucket_time;
@@ -43,7 +61,23 @@ extern bool pgsm_normalized_query;
 extern bool pgsm_track_utility;
 extern bool pgsm_enable_pgsm_query_id;
 extern int	pgsm_track;
+extern int	pgsm_eviction;
+extern bool pgsm_track_overhead;
+extern bool pgsm_dynamic_hash;
+extern int	pgsm_dynamic_hash_max;
+extern int	pgsm_snapshot_chunk_size;
+extern bool pgsm_save;
+extern char *pgsm_archive_directory;
+extern int	pgsm_archive_file_size;
+extern int	pgsm_archive_file_age;
+extern char *pgsm_rollup_levels;
+extern int	pgsm_rollup_nlevels;
+extern bool pgsm_wait_sampling;
+extern int	pgsm_wait_sampling_frequency;
+extern int	pgsm_hotspot_threshold;
+extern pgsmRollupLevel pgsm_rollup_level[PGSM_MAX_ROLLUP_LEVELS];
 
 void		init_guc(void);
+int			pgsm_bucket_count(void);
 
 #endif							/* __PGSM_GUC_H__ */
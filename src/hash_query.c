@@ -14,7 +14,11 @@
 
 #include <postgres.h>
 
+#include <port/pg_bitutils.h>
+#include <port/pg_crc32c.h>
+#include <storage/fd.h>
 #include <storage/ipc.h>
+#include <storage/proc.h>
 #include <storage/shmem.h>
 #include <utils/memutils.h>
 
@@ -27,29 +31,64 @@ typedef struct pgsmLocalState
 	dsa_area   *dsa;			/* local dsa area for backend attached to the
 								 * dsa area created by postmaster at startup. */
 	HTAB	   *shared_hash;
+	dsa_area   *dshash_dsa;		/* dsa area of the entries, if
+								 * pgsm_dynamic_hash */
+	dshash_table *dshash;		/* attached with the dsa area, if
+								 * pgsm_dynamic_hash */
+	HTAB	   *wait_hash;		/* if pgsm_wait_sampling */
+	pgsmWaitSlot *wait_slots;	/* attached with the dsa area, if
+								 * pgsm_wait_sampling */
 } pgsmLocalState;
 
 static pgsmLocalState pgsmStateLocal;
 
+#if PG_VERSION_NUM >= 150000
+/* The tranche id is filled in from the shared state */
+static dshash_parameters pgsm_dshash_params = {
+	sizeof(pgsmHashKey),
+	sizeof(pgsmEntry),
+	dshash_memcmp,
+	dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+	dshash_memcpy,
+#endif
+	0
+};
+#endif
+
 static void pgsm_attach_dsa(void);
 static HTAB *pgsm_create_bucket_hash(void);
+static HTAB *pgsm_create_wait_hash(void);
 
 /*
- * Size of the shared state struct including the bucket timestamp array
+ * Size of the shared state struct including the bucket timestamp array, up
+ * to the bucket geometry array which follows it
  */
 static Size
-pgsm_shared_state_size(void)
+pgsm_shared_state_geometry_offset(void)
 {
 	Size		sz = sizeof(pgsmSharedState);
 
-	sz = add_size(sz, sizeof(TimestampTz) * pgsm_max_buckets);
+	sz = add_size(sz, sizeof(TimestampTz) * pgsm_bucket_count());
+	return MAXALIGN(sz);
+}
+
+/*
+ * Size of the shared state struct including the bucket arrays
+ */
+static Size
+pgsm_shared_state_size(void)
+{
+	Size		sz = pgsm_shared_state_geometry_offset();
+
+	sz = add_size(sz, sizeof(pgsmBucketGeometry) * pgsm_bucket_count());
 	return sz;
 }
 
 /*
  * Shared memory area size for storing the query texts
  */
-static Size
+Size
 pgsm_query_area_size(void)
 {
 	return MAXALIGN((int64) pgsm_query_shared_buffer * 1024 * 1024);
@@ -66,6 +105,20 @@ pgsm_bucket_hash_max_entries(void)
 	return hash_max_mem / sizeof(pgsmEntry);
 }
 
+/*
+ * Size of the dsa area of the dynamic hash table in the main shared memory,
+ * which grows from there.
+ */
+static Size
+pgsm_dshash_area_size(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (pgsm_dynamic_hash)
+		return MAXALIGN(dsa_minimum_size());
+#endif
+	return 0;
+}
+
 /*
  * Shared memory area size for storing the query texts and pgsm shared state
  * structure
@@ -75,6 +128,7 @@ pgsm_get_shared_area_size(void)
 {
 	Size		sz = MAXALIGN(pgsm_shared_state_size());
 
+	sz = add_size(sz, pgsm_dshash_area_size());
 	sz = add_size(sz, pgsm_query_area_size());
 	return sz;
 }
@@ -87,11 +141,100 @@ pgsm_ShmemSize(void)
 {
 	Size		sz = pgsm_get_shared_area_size();
 
-	sz = add_size(sz, hash_estimate_size(pgsm_bucket_hash_max_entries(), sizeof(pgsmEntry)));
+	if (!pgsm_dynamic_hash)
+		sz = add_size(sz, hash_estimate_size(pgsm_bucket_hash_max_entries(), sizeof(pgsmEntry)));
+	if (pgsm_wait_sampling)
+		sz = add_size(sz, hash_estimate_size(PGSM_WAIT_MAX_ENTRIES, sizeof(pgsmWaitEntry)));
 	return sz;
 }
 
-void
+/*
+ * Bytes of the dsa area one entry of the dynamic hash table takes: the entry
+ * after the item header of the table, a dsa_pointer and the hash value, with
+ * the rounding of the allocation up to its size class, or to whole pages for
+ * large ones, and its share of the bucket array, which is at most 3/4 full
+ * before it doubles.
+ */
+static Size
+pgsm_dynamic_hash_entry_size(void)
+{
+	Size		item = MAXALIGN(sizeof(dsa_pointer) + sizeof(uint32)) + sizeof(pgsmEntry);
+
+	if (item > 8192)
+		item = TYPEALIGN(4096, item);
+	else
+		item += item / 8;
+
+	return item + sizeof(dsa_pointer) * 8 / 3;
+}
+
+/*
+ * Number of maximum elements in the dynamic hash table, which may change on
+ * reload.
+ */
+static int64
+pgsm_dynamic_hash_max_entries(void)
+{
+	return (int64) pgsm_dynamic_hash_max * 1024 * 1024 / pgsm_dynamic_hash_entry_size();
+}
+
+/*
+ * Size limit of the dsa area of the dynamic hash table: the entries, plus the
+ * control object of the table and the segment headers and page maps of the
+ * area itself.
+ */
+static Size
+pgsm_dynamic_hash_area_limit(void)
+{
+	Size		sz = (Size) pgsm_dynamic_hash_max * 1024 * 1024;
+
+	return add_size(add_size(sz, sz / 64), 1024 * 1024);
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Can one more entry be added to the dynamic hash table without running its
+ * dsa area out of space?  dshash_find_or_insert() raises an ERROR then, which
+ * would fail the statement, so there must be room for the entry and for the
+ * bucket array doubling while the old one is still allocated.  That room is
+ * either left below the limit for a new segment, or, going by the estimated
+ * size of the entries, within the segments there.  Before PostgreSQL 17 the
+ * area cannot tell its size, so only the estimate is used.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock.
+ */
+static bool
+pgsm_dynamic_hash_has_room(pgsmSharedState *pgsm)
+{
+	Size		total = pgsm_dynamic_hash_area_limit();
+	Size		used;
+	Size		room;
+
+	/* The bucket array is at least 3/8 full before it doubles */
+	room = sizeof(dsa_pointer) * 2 *
+		pg_nextpower2_64(Max((uint64) pgsm->dshash_nentries * 8 / 3, 1024));
+	room = add_size(room, pgsm_dynamic_hash_entry_size());
+
+	/* And the header and page map of a new segment */
+	room = add_size(room, room / 64);
+
+#if PG_VERSION_NUM >= 170000
+	total = dsa_get_total_size(pgsmStateLocal.dshash_dsa);
+	if (add_size(total, room) <= pgsm_dynamic_hash_area_limit())
+		return true;
+#endif
+
+	used = mul_size(pgsm->dshash_nentries, pgsm_dynamic_hash_entry_size());
+	used = add_size(used, total / 64);
+	return add_size(used, room) <= total;
+}
+#endif
+
+/*
+ * Create or attach to the shared state.  Returns true if it was created, in
+ * which case the caller fills in pgsm->histogram.
+ */
+bool
 pgsm_startup(void)
 {
 	bool		found;
@@ -108,12 +251,36 @@ pgsm_startup(void)
 
 		/* Initialize fields */
 		pgsm->pgsm_oom = false;
-		pgsm->lock = &GetNamedLWLockTranche("pg_stat_monitor")->lock;
+		pgsm->evict_nkeys = 0;
+		pgsm->evict_next = 0;
+		pgsm->archiver_latch = NULL;
+		pgsm->lock = &GetNamedLWLockTranche("pg_stat_monitor")[0].lock;
+		pgsm->wait_lock = &GetNamedLWLockTranche("pg_stat_monitor")[1].lock;
 		pg_atomic_init_u64(&pgsm->current_bucket_id, 0);
 		pg_atomic_init_u64(&pgsm->current_bucket_start, 0);
+		pg_atomic_init_u64(&pgsm->generation, 0);
+		for (int i = 0; i < lengthof(pgsm->slow_queryids); i++)
+			pg_atomic_init_u64(&pgsm->slow_queryids[i], 0);
+		pgsm->settings.bucket_time = pgsm_bucket_time;
+		pgsm->settings.max_buckets = pgsm_max_buckets;
+		pgsm->settings.bucket_offset = 0;
+		pgsm->settings.histogram_min = pgsm_histogram_min;
+		pgsm->settings.histogram_max = pgsm_histogram_max;
+		pgsm->settings.histogram_buckets = pgsm_histogram_buckets;
+		pgsm->settings_time = PgReloadTime;
+		pgsm->used_buckets = pgsm_max_buckets;
+		pgsm->bucket_geometry = (pgsmBucketGeometry *) (p + pgsm_shared_state_geometry_offset());
+		memset(pgsm->bucket_geometry, 0, sizeof(pgsmBucketGeometry) * pgsm_bucket_count());
+		for (int i = 0; i < PGSM_HS_NUM; i++)
+		{
+			pg_atomic_init_u64(&pgsm->hook_calls[i], 0);
+			pg_atomic_init_u64(&pgsm->hook_time[i], 0);
+		}
 
 		/* the allocation of pgsmSharedState itself */
 		p += MAXALIGN(pgsm_shared_state_size());
+		pgsm->raw_dshash_area = pgsm_dynamic_hash ? p : NULL;
+		p += pgsm_dshash_area_size();
 		pgsm->raw_dsa_area = p;
 		dsa = dsa_create_in_place(pgsm->raw_dsa_area,
 								  pgsm_query_area_size(),
@@ -132,6 +299,57 @@ pgsm_startup(void)
 		if (pgsm_enable_overflow)
 			dsa_set_size_limit(dsa, -1);
 
+		/*
+		 * The number of procs is only known once the shared memory size has
+		 * been requested, so the slots live in the dsa area.
+		 */
+		pgsm->wait_slots = InvalidDsaPointer;
+		pgsm->wait_slot_count = 0;
+		if (pgsm_wait_sampling)
+		{
+			pgsmWaitSlot *slots;
+
+			pgsm->wait_slot_count = ProcGlobal->allProcCount;
+			pgsm->wait_slots = dsa_allocate0(dsa, sizeof(pgsmWaitSlot) * pgsm->wait_slot_count);
+			slots = dsa_get_address(dsa, pgsm->wait_slots);
+			for (int i = 0; i < pgsm->wait_slot_count; i++)
+				pg_atomic_init_u64(&slots[i].queryid, 0);
+		}
+
+		pgsm->dshash_handle = DSHASH_HANDLE_INVALID;
+		pgsm->dshash_nentries = 0;
+		pgsm->dshash_max = pgsm_dynamic_hash_max;
+#if PG_VERSION_NUM >= 150000
+		if (pgsm_dynamic_hash)
+		{
+			dsa_area   *dshash_dsa;
+			dshash_table *dshash;
+
+#if PG_VERSION_NUM >= 190000
+			pgsm->dshash_tranche_id = LWLockNewTrancheId("pg_stat_monitor_dshash");
+#else
+			pgsm->dshash_tranche_id = LWLockNewTrancheId();
+#endif
+
+			/*
+			 * The entries have a dsa area of their own, which grows up to
+			 * pgsm_dynamic_hash_max, so that they neither take the room of
+			 * the query texts nor lift their limit.
+			 */
+			dshash_dsa = dsa_create_in_place(pgsm->raw_dshash_area,
+											 pgsm_dshash_area_size(),
+											 pgsm->dshash_tranche_id, 0);
+			dsa_pin(dshash_dsa);
+			dsa_set_size_limit(dshash_dsa, pgsm_dynamic_hash_area_limit());
+
+			pgsm_dshash_params.tranche_id = pgsm->dshash_tranche_id;
+			dshash = dshash_create(dshash_dsa, &pgsm_dshash_params, NULL);
+			pgsm->dshash_handle = dshash_get_hash_table_handle(dshash);
+			dshash_detach(dshash);
+			dsa_detach(dshash_dsa);
+		}
+#endif
+
 		/*
 		 * Postmaster will never access the dsa again, thus free its local
 		 * references.
@@ -139,7 +357,10 @@ pgsm_startup(void)
 		dsa_detach(dsa);
 	}
 
-	pgsmStateLocal.shared_hash = pgsm_create_bucket_hash();
+	if (!pgsm_dynamic_hash)
+		pgsmStateLocal.shared_hash = pgsm_create_bucket_hash();
+	if (pgsm_wait_sampling)
+		pgsmStateLocal.wait_hash = pgsm_create_wait_hash();
 
 	LWLockRelease(AddinShmemInitLock);
 
@@ -147,6 +368,11 @@ pgsm_startup(void)
 
 	/* Reset in case this is a restart within the postmaster */
 	pgsmStateLocal.dsa = NULL;
+	pgsmStateLocal.dshash_dsa = NULL;
+	pgsmStateLocal.dshash = NULL;
+	pgsmStateLocal.wait_slots = NULL;
+
+	return !found;
 }
 
 /*
@@ -171,6 +397,28 @@ pgsm_create_bucket_hash(void)
 #endif
 }
 
+/*
+ * Create the hash table for the wait event samples.
+ */
+static HTAB *
+pgsm_create_wait_hash(void)
+{
+	HASHCTL		info = {
+		.keysize = sizeof(pgsmWaitKey),
+		.entrysize = sizeof(pgsmWaitEntry),
+	};
+
+#if PG_VERSION_NUM >= 190000
+	return ShmemInitHash("pg_stat_monitor: wait event hashtable",
+						 PGSM_WAIT_MAX_ENTRIES,
+						 &info, HASH_ELEM | HASH_BLOBS);
+#else
+	return ShmemInitHash("pg_stat_monitor: wait event hashtable",
+						 PGSM_WAIT_MAX_ENTRIES, PGSM_WAIT_MAX_ENTRIES,
+						 &info, HASH_ELEM | HASH_BLOBS);
+#endif
+}
+
 /*
  * Attach to the DSA area created by the postmaster.
  *
@@ -197,6 +445,24 @@ pgsm_attach_dsa(void)
 	/* Keep area attached until end of session */
 	dsa_pin_mapping(pgsmStateLocal.dsa);
 
+	if (DsaPointerIsValid(pgsmStateLocal.shared_pgsmState->wait_slots))
+		pgsmStateLocal.wait_slots = dsa_get_address(pgsmStateLocal.dsa,
+													pgsmStateLocal.shared_pgsmState->wait_slots);
+
+#if PG_VERSION_NUM >= 150000
+	if (pgsm_dynamic_hash)
+	{
+		pgsmStateLocal.dshash_dsa = dsa_attach_in_place(pgsmStateLocal.shared_pgsmState->raw_dshash_area,
+														NULL);
+		dsa_pin_mapping(pgsmStateLocal.dshash_dsa);
+
+		pgsm_dshash_params.tranche_id = pgsmStateLocal.shared_pgsmState->dshash_tranche_id;
+		pgsmStateLocal.dshash = dshash_attach(pgsmStateLocal.dshash_dsa, &pgsm_dshash_params,
+											  pgsmStateLocal.shared_pgsmState->dshash_handle,
+											  NULL);
+	}
+#endif
+
 	MemoryContextSwitchTo(oldcontext);
 }
 
@@ -207,16 +473,194 @@ get_dsa_area_for_query_text(void)
 	return pgsmStateLocal.dsa;
 }
 
+pgsmSharedState *
+pgsm_get_ss(void)
+{
+	return pgsmStateLocal.shared_pgsmState;
+}
+
 HTAB *
-get_pgsmHash(void)
+pgsm_get_wait_hash(void)
 {
-	return pgsmStateLocal.shared_hash;
+	return pgsmStateLocal.wait_hash;
 }
 
-pgsmSharedState *
-pgsm_get_ss(void)
+/*
+ * Slots of what each backend is running, NULL unless pgsm_wait_sampling.
+ */
+pgsmWaitSlot *
+pgsm_get_wait_slots(void)
 {
-	return pgsmStateLocal.shared_pgsmState;
+	pgsm_attach_dsa();
+	return pgsmStateLocal.wait_slots;
+}
+
+/*
+ * Entries are kept either in a fixed size hash table in the main shared
+ * memory, or, with pgsm_dynamic_hash, in a dshash table in the dsa area which
+ * grows on demand up to pgsm_dynamic_hash_max.  The functions below hide the
+ * difference from the rest of the code.
+ *
+ * Either way pgsm->lock protects the set of entries: lookups and scans need
+ * it at least shared, adding and removing entries need it exclusive.  The
+ * partition locks of the dshash table are only held within these functions,
+ * which is fine as dshash entries never move once allocated.
+ */
+
+/*
+ * Find an entry, or add one with only the key set.  Returns NULL if the table
+ * is full.
+ */
+pgsmEntry *
+hash_entry_enter(const pgsmHashKey *key, bool *found)
+{
+#if PG_VERSION_NUM >= 150000
+	if (pgsm_dynamic_hash)
+	{
+		pgsmSharedState *pgsm = pgsmStateLocal.shared_pgsmState;
+		pgsmEntry  *entry;
+
+		entry = hash_entry_find(key);
+		*found = (entry != NULL);
+		if (entry != NULL)
+			return entry;
+
+		if (pgsm->dshash_nentries >= pgsm_dynamic_hash_max_entries())
+			return NULL;
+
+		/* Follow pgsm_dynamic_hash_max on reload */
+		if (pgsm->dshash_max != pgsm_dynamic_hash_max)
+		{
+			dsa_set_size_limit(pgsmStateLocal.dshash_dsa, pgsm_dynamic_hash_area_limit());
+			pgsm->dshash_max = pgsm_dynamic_hash_max;
+		}
+
+		if (!pgsm_dynamic_hash_has_room(pgsm))
+			return NULL;
+
+		entry = dshash_find_or_insert(pgsmStateLocal.dshash, key, found);
+		dshash_release_lock(pgsmStateLocal.dshash, entry);
+		if (!*found)
+			pgsm->dshash_nentries++;
+		return entry;
+	}
+#endif
+
+	return hash_search(pgsmStateLocal.shared_hash, key, HASH_ENTER_NULL, found);
+}
+
+pgsmEntry *
+hash_entry_find(const pgsmHashKey *key)
+{
+#if PG_VERSION_NUM >= 150000
+	if (pgsm_dynamic_hash)
+	{
+		pgsmEntry  *entry;
+
+		pgsm_attach_dsa();
+		entry = dshash_find(pgsmStateLocal.dshash, key, false);
+		if (entry != NULL)
+			dshash_release_lock(pgsmStateLocal.dshash, entry);
+		return entry;
+	}
+#endif
+
+	return hash_search(pgsmStateLocal.shared_hash, key, HASH_FIND, NULL);
+}
+
+/*
+ * Remove an entry.  Freeing its query texts is up to the caller.
+ */
+void
+hash_entry_remove(pgsmEntry *entry)
+{
+	pgsmHashKey key = entry->key;
+
+#if PG_VERSION_NUM >= 150000
+	if (pgsm_dynamic_hash)
+	{
+		if (dshash_delete_key(pgsmStateLocal.dshash, &key))
+			pgsmStateLocal.shared_pgsmState->dshash_nentries--;
+		return;
+	}
+#endif
+
+	hash_search(pgsmStateLocal.shared_hash, &key, HASH_REMOVE, NULL);
+}
+
+long
+hash_entry_count(void)
+{
+	if (pgsm_dynamic_hash)
+		return (long) pgsmStateLocal.shared_pgsmState->dshash_nentries;
+
+	return hash_get_num_entries(pgsmStateLocal.shared_hash);
+}
+
+/*
+ * Start a scan over all entries.  Entries may be removed while scanning, but
+ * only the entry just returned.  Entries added while scanning may or may not
+ * be returned.
+ */
+void
+hash_entry_seq_init(pgsmHashSeqStatus *status)
+{
+	memset(status, 0, sizeof(*status));
+
+#if PG_VERSION_NUM >= 150000
+	if (pgsm_dynamic_hash)
+	{
+		dshash_seq_status dstat;
+		pgsmEntry  *entry;
+		long		max_entries = Max(hash_entry_count(), 1);
+
+		pgsm_attach_dsa();
+
+		status->dynamic = true;
+		status->entries = palloc_extended(max_entries * sizeof(pgsmEntry *),
+										  MCXT_ALLOC_HUGE);
+
+		dshash_seq_init(&dstat, pgsmStateLocal.dshash, false);
+		while ((entry = dshash_seq_next(&dstat)) != NULL &&
+			   status->nentries < max_entries)
+			status->entries[status->nentries++] = entry;
+		dshash_seq_term(&dstat);
+		return;
+	}
+#endif
+
+	hash_seq_init(&status->hstat, pgsmStateLocal.shared_hash);
+}
+
+pgsmEntry *
+hash_entry_seq_next(pgsmHashSeqStatus *status)
+{
+	if (!status->dynamic)
+		return hash_seq_search(&status->hstat);
+
+	if (status->next < status->nentries)
+		return status->entries[status->next++];
+
+	hash_entry_seq_term(status);
+	return NULL;
+}
+
+/*
+ * End a scan before hash_entry_seq_next() returned NULL.
+ */
+void
+hash_entry_seq_term(pgsmHashSeqStatus *status)
+{
+	if (!status->dynamic)
+	{
+		hash_seq_term(&status->hstat);
+		return;
+	}
+
+	if (status->entries != NULL)
+		pfree(status->entries);
+	status->entries = NULL;
+	status->nentries = 0;
 }
 
 pgsmEntry *
@@ -225,8 +669,11 @@ hash_entry_alloc(pgsmSharedState *pgsm, const pgsmHashKey *key)
 	pgsmEntry  *entry;
 	bool		found;
 
+	if (!hash_entry_has_room(key))
+		return hash_entry_find(key);
+
 	/* Find or create an entry with desired hash code */
-	entry = (pgsmEntry *) hash_search(pgsmStateLocal.shared_hash, key, HASH_ENTER_NULL, &found);
+	entry = hash_entry_enter(key, &found);
 	if (entry && !found)
 	{
 		/* New entry, initialize it */
@@ -234,7 +681,11 @@ hash_entry_alloc(pgsmSharedState *pgsm, const pgsmHashKey *key)
 		memset(&entry->counters, 0, sizeof(Counters));
 		entry->query = InvalidDsaPointer;
 		entry->counters.info.parent_query = InvalidDsaPointer;
+		entry->counters.hotspot = InvalidDsaPointer;
 		entry->stats_since = GetCurrentTimestamp();
+		entry->generation = 0;
+		entry->first_generation = pg_atomic_add_fetch_u64(&pgsm->generation, 1);
+		entry->usage = 0;
 
 		/* set the appropriate initial usage count */
 		/* re-initialize the mutex each time ... we assume no one using it */
@@ -253,23 +704,29 @@ hash_entry_alloc(pgsmSharedState *pgsm, const pgsmHashKey *key)
 void
 hash_entry_dealloc(int bucket_id)
 {
-	HASH_SEQ_STATUS hstat;
+	pgsmHashSeqStatus hstat;
 	pgsmEntry  *entry;
 
 	pgsm_attach_dsa();
 
+	/* The keys of the eviction victims could come back as new entries */
+	if (bucket_id == INVALID_BUCKET_ID ||
+		pgsmStateLocal.shared_pgsmState->evict_bucket == bucket_id)
+		pgsmStateLocal.shared_pgsmState->evict_nkeys = 0;
+
 	/* Iterate over the hash table. */
-	hash_seq_init(&hstat, pgsmStateLocal.shared_hash);
+	hash_entry_seq_init(&hstat);
 
-	while ((entry = hash_seq_search(&hstat)) != NULL)
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
 	{
 		/* Remove all entries if bucket_id == -1 */
 		if (bucket_id == INVALID_BUCKET_ID || entry->key.bucket_id == bucket_id)
 		{
 			dsa_pointer parent_qdsa = entry->counters.info.parent_query;
 			dsa_pointer pdsa = entry->query;
+			dsa_pointer hotspot = entry->counters.hotspot;
 
-			hash_search(pgsmStateLocal.shared_hash, &entry->key, HASH_REMOVE, NULL);
+			hash_entry_remove(entry);
 
 			if (DsaPointerIsValid(pdsa))
 				dsa_free(pgsmStateLocal.dsa, pdsa);
@@ -277,11 +734,611 @@ hash_entry_dealloc(int bucket_id)
 			if (DsaPointerIsValid(parent_qdsa))
 				dsa_free(pgsmStateLocal.dsa, parent_qdsa);
 
+			if (DsaPointerIsValid(hotspot))
+				dsa_free(pgsmStateLocal.dsa, hotspot);
+
 			pgsmStateLocal.shared_pgsmState->pgsm_oom = false;
 		}
 	}
 }
 
+/*
+ * Statistics file format, written by pgsm_dump_stats() and read back by
+ * pgsm_load_stats():
+ *
+ *	 pgsmDumpHeader
+ *	 TimestampTz bucket_start_time[nbuckets]
+ *	 pgsmBucketGeometry bucket_geometry[nbuckets]
+ *	 nentries times: pgsmEntry, uint32 query length, query text,
+ *					 uint32 parent query length, parent query text,
+ *					 uint32 hotspot length, HotspotInfo
+ *	 pg_crc32c of everything above
+ *
+ * Lengths of PG_UINT32_MAX stand for no text or no hotspots.  Entries are written as they
+ * are in shared memory, so the file is only valid for the same build.
+ */
+#define PGSM_DUMP_FILE		"pg_stat/pg_stat_monitor.stat"
+#define PGSM_FILE_HEADER	0x50534d01
+#define PGSM_FILE_FORMAT	4
+#define PGSM_NO_TEXT		PG_UINT32_MAX
+
+typedef struct pgsmDumpHeader
+{
+	uint32		magic;
+	uint32		format;
+	uint32		entry_size;		/* sizeof(pgsmEntry) */
+	int32		nbuckets;		/* pgsm_bucket_count() */
+	uint64		nentries;
+	uint64		current_bucket_id;
+	uint64		current_bucket_start;
+	uint64		generation;
+	pgsmSettings settings;
+} pgsmDumpHeader;
+
+static bool
+pgsm_dump_write(FILE *file, pg_crc32c *crc, const void *data, size_t len)
+{
+	COMP_CRC32C(*crc, data, len);
+	return fwrite(data, 1, len, file) == len;
+}
+
+static bool
+pgsm_dump_write_text(FILE *file, pg_crc32c *crc, dsa_area *dsa, dsa_pointer dp)
+{
+	uint32		len = PGSM_NO_TEXT;
+	char	   *str = NULL;
+
+	if (DsaPointerIsValid(dp))
+	{
+		str = dsa_get_address(dsa, dp);
+		len = strlen(str);
+	}
+
+	if (!pgsm_dump_write(file, crc, &len, sizeof(len)))
+		return false;
+	return str == NULL || pgsm_dump_write(file, crc, str, len);
+}
+
+static bool
+pgsm_dump_write_hotspot(FILE *file, pg_crc32c *crc, dsa_area *dsa, dsa_pointer dp)
+{
+	uint32		len = DsaPointerIsValid(dp) ? sizeof(HotspotInfo) : PGSM_NO_TEXT;
+
+	if (!pgsm_dump_write(file, crc, &len, sizeof(len)))
+		return false;
+	return !DsaPointerIsValid(dp) ||
+		pgsm_dump_write(file, crc, dsa_get_address(dsa, dp), len);
+}
+
+/*
+ * Write all entries, their texts and the bucket state to PGSM_DUMP_FILE, going
+ * through a temporary file so a crash never leaves a partial file behind.
+ */
+void
+pgsm_dump_stats(void)
+{
+	pgsmSharedState *pgsm = pgsmStateLocal.shared_pgsmState;
+	pgsmDumpHeader header;
+	pgsmHashSeqStatus hstat;
+	pgsmEntry  *entry;
+	pg_crc32c	crc;
+	FILE	   *file;
+	bool		ok = true;
+
+	file = AllocateFile(PGSM_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+	{
+		ereport(LOG,
+				errcode_for_file_access(),
+				errmsg("[pg_stat_monitor] pgsm_dump_stats: Could not write file \"%s\": %m.",
+					   PGSM_DUMP_FILE ".tmp"));
+		return;
+	}
+
+	pgsm_attach_dsa();
+	INIT_CRC32C(crc);
+
+	LWLockAcquire(pgsm->lock, LW_SHARED);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PGSM_FILE_HEADER;
+	header.format = PGSM_FILE_FORMAT;
+	header.entry_size = sizeof(pgsmEntry);
+	header.nbuckets = pgsm_bucket_count();
+	header.nentries = hash_entry_count();
+	header.current_bucket_id = pg_atomic_read_u64(&pgsm->current_bucket_id);
+	header.current_bucket_start = pg_atomic_read_u64(&pgsm->current_bucket_start);
+	header.generation = pg_atomic_read_u64(&pgsm->generation);
+	header.settings = pgsm->settings;
+
+	ok = pgsm_dump_write(file, &crc, &header, sizeof(header)) &&
+		pgsm_dump_write(file, &crc, pgsm->bucket_start_time,
+						sizeof(TimestampTz) * pgsm_bucket_count()) &&
+		pgsm_dump_write(file, &crc, pgsm->bucket_geometry,
+						sizeof(pgsmBucketGeometry) * pgsm_bucket_count());
+
+	hash_entry_seq_init(&hstat);
+	while (ok && (entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		ok = pgsm_dump_write(file, &crc, entry, sizeof(pgsmEntry)) &&
+			pgsm_dump_write_text(file, &crc, pgsmStateLocal.dsa, entry->query) &&
+			pgsm_dump_write_text(file, &crc, pgsmStateLocal.dsa,
+								 entry->counters.info.parent_query) &&
+			pgsm_dump_write_hotspot(file, &crc, pgsmStateLocal.dsa,
+									entry->counters.hotspot);
+	}
+	if (!ok)
+		hash_entry_seq_term(&hstat);
+
+	LWLockRelease(pgsm->lock);
+
+	FIN_CRC32C(crc);
+	if (ok)
+		ok = fwrite(&crc, 1, sizeof(crc), file) == sizeof(crc);
+
+	if (!ok || FreeFile(file) != 0)
+	{
+		ereport(LOG,
+				errcode_for_file_access(),
+				errmsg("[pg_stat_monitor] pgsm_dump_stats: Could not write file \"%s\": %m.",
+					   PGSM_DUMP_FILE ".tmp"));
+		if (!ok)
+			FreeFile(file);
+		unlink(PGSM_DUMP_FILE ".tmp");
+		return;
+	}
+
+	(void) durable_rename(PGSM_DUMP_FILE ".tmp", PGSM_DUMP_FILE, LOG);
+}
+
+static bool
+pgsm_load_read(FILE *file, pg_crc32c *crc, void *data, size_t len)
+{
+	if (fread(data, 1, len, file) != len)
+		return false;
+	if (crc)
+		COMP_CRC32C(*crc, data, len);
+	return true;
+}
+
+/*
+ * Read a text of the file into buf, or skip it if it is NULL.  Returns false
+ * on a read error, and sets *isnull if there is no text.
+ */
+static bool
+pgsm_load_text(FILE *file, pg_crc32c *crc, StringInfo buf, bool *isnull)
+{
+	uint32		len;
+
+	if (!pgsm_load_read(file, crc, &len, sizeof(len)))
+		return false;
+	*isnull = (len == PGSM_NO_TEXT);
+	if (*isnull)
+		return true;
+
+	resetStringInfo(buf);
+	enlargeStringInfo(buf, len + 1);
+	if (!pgsm_load_read(file, crc, buf->data, len))
+		return false;
+	buf->data[len] = '\0';
+	buf->len = len;
+
+	return true;
+}
+
+/* Copy a text read by pgsm_load_text() to the DSA area, if there is space */
+static dsa_pointer
+pgsm_load_text_to_dsa(StringInfo buf, bool isnull)
+{
+	dsa_pointer dp;
+
+	if (isnull)
+		return InvalidDsaPointer;
+
+	dp = dsa_allocate_extended(pgsmStateLocal.dsa, buf->len + 1, DSA_ALLOC_NO_OOM);
+	if (DsaPointerIsValid(dp))
+		memcpy(dsa_get_address(pgsmStateLocal.dsa, dp), buf->data, buf->len + 1);
+	return dp;
+}
+
+/* The same for the hotspots of an entry, read with pgsm_load_text() too */
+static dsa_pointer
+pgsm_load_hotspot_to_dsa(StringInfo buf, bool isnull)
+{
+	dsa_pointer dp;
+
+	if (isnull || buf->len != sizeof(HotspotInfo))
+		return InvalidDsaPointer;
+
+	dp = dsa_allocate_extended(pgsmStateLocal.dsa, sizeof(HotspotInfo), DSA_ALLOC_NO_OOM);
+	if (DsaPointerIsValid(dp))
+		memcpy(dsa_get_address(pgsmStateLocal.dsa, dp), buf->data, sizeof(HotspotInfo));
+	return dp;
+}
+
+/*
+ * Read the whole file once to check its header, its length and its
+ * checksum, without holding any lock.  Returns NULL if the file is fine, or
+ * the problem found.  The bucket start times and geometries are read into
+ * bucket_start_time and bucket_geometry.
+ */
+static const char *
+pgsm_load_check(FILE *file, pgsmDumpHeader *header, TimestampTz *bucket_start_time,
+				pgsmBucketGeometry *bucket_geometry)
+{
+	pg_crc32c	crc;
+	pg_crc32c	file_crc;
+	pgsmEntry  *buf = palloc(sizeof(pgsmEntry));
+	StringInfoData textbuf;
+	const char *problem = NULL;
+
+	INIT_CRC32C(crc);
+	initStringInfo(&textbuf);
+
+	if (!pgsm_load_read(file, &crc, header, sizeof(*header)))
+		problem = "truncated header";
+	else if (header->magic != PGSM_FILE_HEADER || header->format != PGSM_FILE_FORMAT ||
+			 header->entry_size != sizeof(pgsmEntry))
+		problem = "incompatible format";
+	else if (header->nbuckets != pgsm_bucket_count())
+		problem = "pg_stat_monitor.pgsm_rollup_levels changed";
+	else if (!pgsm_load_read(file, &crc, bucket_start_time,
+							 sizeof(TimestampTz) * pgsm_bucket_count()) ||
+			 !pgsm_load_read(file, &crc, bucket_geometry,
+							 sizeof(pgsmBucketGeometry) * pgsm_bucket_count()))
+		problem = "truncated file";
+
+	for (uint64 i = 0; problem == NULL && i < header->nentries; i++)
+	{
+		bool		isnull;
+
+		if (!pgsm_load_read(file, &crc, buf, sizeof(pgsmEntry)) ||
+			!pgsm_load_text(file, &crc, &textbuf, &isnull) ||
+			!pgsm_load_text(file, &crc, &textbuf, &isnull) ||
+			!pgsm_load_text(file, &crc, &textbuf, &isnull))
+			problem = "truncated file";
+	}
+
+	if (problem == NULL)
+	{
+		FIN_CRC32C(crc);
+		if (fread(&file_crc, 1, sizeof(file_crc), file) != sizeof(file_crc) ||
+			!EQ_CRC32C(crc, file_crc))
+			problem = "checksum mismatch";
+	}
+
+	pfree(buf);
+	pfree(textbuf.data);
+
+	return problem;
+}
+
+/* An entry of the file read ahead of taking pgsm->lock */
+typedef struct pgsmLoadItem
+{
+	pgsmEntry	entry;
+	dsa_pointer query;
+	dsa_pointer parent_query;
+	dsa_pointer hotspot;
+} pgsmLoadItem;
+
+#define PGSM_LOAD_BATCH		256
+
+/* Bucket state replaced by a load, restored if the load fails */
+typedef struct pgsmLoadBuckets
+{
+	TimestampTz *bucket_start_time;
+	pgsmBucketGeometry *bucket_geometry;
+	uint64		bucket_id;
+	uint64		bucket_start;
+	pgsmSettings settings;
+	int			used_buckets;
+} pgsmLoadBuckets;
+
+/*
+ * Remove the entries a failed load inserted, and restore the bucket state it
+ * replaced.  Entries of the statements which ran in the meantime are kept.
+ */
+static void
+pgsm_load_undo(pgsmSharedState *pgsm, pgsmHashKey *keys, uint64 nkeys,
+			   const pgsmLoadBuckets *old)
+{
+	LWLockAcquire(pgsm->lock, LW_EXCLUSIVE);
+
+	for (uint64 i = 0; i < nkeys; i++)
+	{
+		pgsmEntry  *entry = hash_entry_find(&keys[i]);
+		dsa_pointer query;
+		dsa_pointer parent_query;
+		dsa_pointer hotspot;
+
+		if (entry == NULL)
+			continue;
+
+		query = entry->query;
+		parent_query = entry->counters.info.parent_query;
+		hotspot = entry->counters.hotspot;
+		hash_entry_remove(entry);
+		if (DsaPointerIsValid(query))
+			dsa_free(pgsmStateLocal.dsa, query);
+		if (DsaPointerIsValid(parent_query))
+			dsa_free(pgsmStateLocal.dsa, parent_query);
+		if (DsaPointerIsValid(hotspot))
+			dsa_free(pgsmStateLocal.dsa, hotspot);
+	}
+
+	memcpy(pgsm->bucket_start_time, old->bucket_start_time,
+		   sizeof(TimestampTz) * pgsm_bucket_count());
+	memcpy(pgsm->bucket_geometry, old->bucket_geometry,
+		   sizeof(pgsmBucketGeometry) * pgsm_bucket_count());
+	pg_atomic_write_u64(&pgsm->current_bucket_id, old->bucket_id);
+	pg_atomic_write_u64(&pgsm->current_bucket_start, old->bucket_start);
+	pgsm->settings = old->settings;
+	pgsm->used_buckets = old->used_buckets;
+
+	LWLockRelease(pgsm->lock);
+}
+
+/*
+ * Load the entries saved by pgsm_dump_stats(), if any.  The file is removed
+ * afterwards, so statistics are not loaded twice, e.g. after a crash.
+ *
+ * The file is checked as a whole first, then its entries are read in
+ * batches, each inserted under a short exclusive lock, so statements are not
+ * stalled while the file is read.  Entries already present, because
+ * statements ran in the meantime, are left alone.  If the file turns out to
+ * be broken, only the entries the load inserted are removed again.
+ */
+void
+pgsm_load_stats(void)
+{
+	pgsmSharedState *pgsm = pgsmStateLocal.shared_pgsmState;
+	pgsmDumpHeader header;
+	TimestampTz *bucket_start_time;
+	pgsmBucketGeometry *bucket_geometry;
+	pgsmLoadBuckets old;
+	pgsmLoadItem *items;
+	pgsmHashKey *inserted;
+	StringInfoData textbuf;
+	FILE	   *file;
+	const char *problem;
+	uint64		nloaded = 0;
+
+	file = AllocateFile(PGSM_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					errcode_for_file_access(),
+					errmsg("[pg_stat_monitor] pgsm_load_stats: Could not read file \"%s\": %m.",
+						   PGSM_DUMP_FILE));
+		return;
+	}
+
+	pgsm_attach_dsa();
+	bucket_start_time = palloc(sizeof(TimestampTz) * pgsm_bucket_count());
+	bucket_geometry = palloc(sizeof(pgsmBucketGeometry) * pgsm_bucket_count());
+	old.bucket_start_time = palloc(sizeof(TimestampTz) * pgsm_bucket_count());
+	old.bucket_geometry = palloc(sizeof(pgsmBucketGeometry) * pgsm_bucket_count());
+
+	problem = pgsm_load_check(file, &header, bucket_start_time, bucket_geometry);
+	if (problem == NULL &&
+		fseeko(file, sizeof(header) +
+			   (sizeof(TimestampTz) + sizeof(pgsmBucketGeometry)) * pgsm_bucket_count(),
+			   SEEK_SET) != 0)
+		problem = "could not seek";
+	if (problem)
+		goto done;
+
+	items = palloc(sizeof(pgsmLoadItem) * PGSM_LOAD_BATCH);
+	inserted = palloc_extended(sizeof(pgsmHashKey) * Max(header.nentries, 1),
+							   MCXT_ALLOC_HUGE);
+	initStringInfo(&textbuf);
+
+	LWLockAcquire(pgsm->lock, LW_EXCLUSIVE);
+
+	memcpy(old.bucket_start_time, pgsm->bucket_start_time,
+		   sizeof(TimestampTz) * pgsm_bucket_count());
+	memcpy(old.bucket_geometry, pgsm->bucket_geometry,
+		   sizeof(pgsmBucketGeometry) * pgsm_bucket_count());
+	old.bucket_id = pg_atomic_read_u64(&pgsm->current_bucket_id);
+	old.bucket_start = pg_atomic_read_u64(&pgsm->current_bucket_start);
+	old.settings = pgsm->settings;
+	old.used_buckets = pgsm->used_buckets;
+
+	memcpy(pgsm->bucket_start_time, bucket_start_time,
+		   sizeof(TimestampTz) * pgsm_bucket_count());
+	memcpy(pgsm->bucket_geometry, bucket_geometry,
+		   sizeof(pgsmBucketGeometry) * pgsm_bucket_count());
+	pg_atomic_write_u64(&pgsm->current_bucket_id, header.current_bucket_id);
+	pg_atomic_write_u64(&pgsm->current_bucket_start, header.current_bucket_start);
+	if (pg_atomic_read_u64(&pgsm->generation) < header.generation)
+		pg_atomic_write_u64(&pgsm->generation, header.generation);
+
+	/*
+	 * Go on with the settings the buckets were made with, and let the first
+	 * bucket switch move to the current ones.
+	 */
+	pgsm->settings = header.settings;
+	pgsm->settings_time = 0;
+
+	/* Buckets of a larger ring than the one in use may remain */
+	pgsm->used_buckets = header.settings.max_buckets;
+	for (int bucket = header.settings.max_buckets; bucket < PGSM_MAX_BUCKETS; bucket++)
+	{
+		if (bucket_start_time[bucket] != 0)
+			pgsm->used_buckets = bucket + 1;
+	}
+
+	LWLockRelease(pgsm->lock);
+
+	for (uint64 nread = 0; problem == NULL && nread < header.nentries;)
+	{
+		int			nitems = 0;
+
+		/* Read a batch, texts included, without the lock */
+		while (nitems < PGSM_LOAD_BATCH && nread + nitems < header.nentries)
+		{
+			pgsmLoadItem *item = &items[nitems];
+			bool		isnull;
+
+			item->query = InvalidDsaPointer;
+			item->parent_query = InvalidDsaPointer;
+			item->hotspot = InvalidDsaPointer;
+			if (!pgsm_load_read(file, NULL, &item->entry, sizeof(pgsmEntry)) ||
+				!pgsm_load_text(file, NULL, &textbuf, &isnull))
+			{
+				problem = "file changed while loading";
+				break;
+			}
+			item->query = pgsm_load_text_to_dsa(&textbuf, isnull);
+			nitems++;
+
+			if (!pgsm_load_text(file, NULL, &textbuf, &isnull))
+			{
+				problem = "file changed while loading";
+				break;
+			}
+			item->parent_query = pgsm_load_text_to_dsa(&textbuf, isnull);
+
+			if (!pgsm_load_text(file, NULL, &textbuf, &isnull))
+			{
+				problem = "file changed while loading";
+				break;
+			}
+			item->hotspot = pgsm_load_hotspot_to_dsa(&textbuf, isnull);
+		}
+
+		if (problem == NULL)
+		{
+			LWLockAcquire(pgsm->lock, LW_EXCLUSIVE);
+
+			for (int i = 0; i < nitems; i++)
+			{
+				pgsmLoadItem *item = &items[i];
+				pgsmEntry  *entry = NULL;
+
+				/* Already there, out of shared memory or out of text space */
+				if (hash_entry_find(&item->entry.key) == NULL &&
+					DsaPointerIsValid(item->query))
+					entry = hash_entry_alloc(pgsm, &item->entry.key);
+				if (entry == NULL)
+					continue;
+
+				entry->pgsm_query_id = item->entry.pgsm_query_id;
+				memcpy(entry->datname, item->entry.datname, NAMEDATALEN);
+				memcpy(entry->username, item->entry.username, NAMEDATALEN);
+				entry->counters = item->entry.counters;
+				entry->counters.info.parent_query = item->parent_query;
+				entry->counters.hotspot = item->hotspot;
+				entry->stats_since = item->entry.stats_since;
+				entry->generation = item->entry.generation;
+				entry->first_generation = item->entry.first_generation;
+				entry->query = item->query;
+				item->query = InvalidDsaPointer;
+				item->parent_query = InvalidDsaPointer;
+				item->hotspot = InvalidDsaPointer;
+				inserted[nloaded++] = entry->key;
+			}
+
+			LWLockRelease(pgsm->lock);
+		}
+
+		/* Free the texts and hotspots of the entries which were not inserted */
+		for (int i = 0; i < nitems; i++)
+		{
+			if (DsaPointerIsValid(items[i].query))
+				dsa_free(pgsmStateLocal.dsa, items[i].query);
+			if (DsaPointerIsValid(items[i].parent_query))
+				dsa_free(pgsmStateLocal.dsa, items[i].parent_query);
+			if (DsaPointerIsValid(items[i].hotspot))
+				dsa_free(pgsmStateLocal.dsa, items[i].hotspot);
+		}
+
+		nread += nitems;
+	}
+
+	if (problem)
+	{
+		pgsm_load_undo(pgsm, inserted, nloaded, &old);
+		nloaded = 0;
+	}
+
+	pfree(items);
+	pfree(inserted);
+	pfree(textbuf.data);
+
+done:
+	FreeFile(file);
+	unlink(PGSM_DUMP_FILE);
+	pfree(bucket_start_time);
+	pfree(bucket_geometry);
+	pfree(old.bucket_start_time);
+	pfree(old.bucket_geometry);
+
+	if (problem)
+		ereport(LOG,
+				errmsg("[pg_stat_monitor] pgsm_load_stats: Ignoring file \"%s\": %s.",
+					   PGSM_DUMP_FILE, problem));
+	else
+		ereport(LOG,
+				errmsg("[pg_stat_monitor] pgsm_load_stats: Loaded " UINT64_FORMAT " entries from \"%s\".",
+					   nloaded, PGSM_DUMP_FILE));
+}
+
+/*
+ * Number of entries the hash table can hold
+ */
+int64
+hash_entry_capacity(void)
+{
+	if (pgsm_dynamic_hash)
+		return pgsm_dynamic_hash_max_entries();
+
+	return pgsm_bucket_hash_max_entries();
+}
+
+/*
+ * With rollup levels, as many entries as there are buckets are kept for their
+ * "other" entries, so that pgsm_rollup_bucket() can always fold what finds no
+ * room in the target bucket into it, and no call is lost.
+ */
+static int64
+hash_entry_reserved(void)
+{
+	return pgsm_rollup_nlevels > 0 ? pgsm_bucket_count() : 0;
+}
+
+/*
+ * Is there room for a new entry with this key, leaving the reserved entries
+ * to the "other" entries?  Caller must hold pgsm->lock.
+ */
+bool
+hash_entry_has_room(const pgsmHashKey *key)
+{
+	return pgsm_is_other_key(key) ||
+		hash_entry_count() < hash_entry_capacity() - hash_entry_reserved();
+}
+
+/*
+ * Bytes of memory the dsa areas hold, including the segments they grew beyond
+ * the areas in the main shared memory.  Returns -1 before PostgreSQL 17, which
+ * cannot tell.
+ */
+int64
+pgsm_dsa_total_size(void)
+{
+#if PG_VERSION_NUM >= 170000
+	int64		size = (int64) dsa_get_total_size(get_dsa_area_for_query_text());
+
+	if (pgsmStateLocal.dshash_dsa)
+		size += (int64) dsa_get_total_size(pgsmStateLocal.dshash_dsa);
+	return size;
+#else
+	return -1;
+#endif
+}
+
 bool
 IsSystemOOM(void)
 {
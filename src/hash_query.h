@@ -19,9 +19,12 @@
 #include <postgres.h>
 
 #include <executor/instrument.h>
+#include <lib/dshash.h>
+#include <storage/latch.h>
 #include <storage/lwlock.h>
 #include <storage/spin.h>
 #include <utils/dsa.h>
+#include <utils/hsearch.h>
 #include <utils/timestamp.h>
 
 #define ERROR_MESSAGE_LEN	100
@@ -64,6 +67,17 @@ typedef struct pgsmHashKey
 	int64		parentid;		/* parent queryId of current query */
 } pgsmHashKey;
 
+/*
+ * The "other" entry of a bucket has a key all zero but the bucket id.  It
+ * collects the counters of entries evicted from the bucket, or which found
+ * no room when rolled up into it.  Real entries always have a user.
+ */
+static inline bool
+pgsm_is_other_key(const pgsmHashKey *key)
+{
+	return key->userid == InvalidOid && key->queryid == INT64CONST(0);
+}
+
 typedef struct QueryInfo
 {
 	dsa_pointer parent_query;
@@ -148,6 +162,50 @@ typedef struct Wal_Usage
 	int64		wal_buffers_full;	/* # of times the WAL buffers became full */
 } Wal_Usage;
 
+/*
+ * Histogram of the executor memory of the calls: bucket 0 counts the calls
+ * below PGSM_MEM_HIST_MIN bytes, each next bucket twice as many bytes as the
+ * previous one, and the last one everything above.  The executor memory of a
+ * call is the size of its query context at ExecutorEnd, not its peak.
+ */
+#define PGSM_MEM_HIST_BUCKETS	20
+#define PGSM_MEM_HIST_MIN		(16 * 1024)
+
+typedef struct MemUsage
+{
+	int64		calls;			/* # of calls with executor memory measured */
+	int64		min_bytes;		/* minimum executor memory, in bytes */
+	int64		max_bytes;		/* maximum executor memory, in bytes */
+	double		mean_bytes;		/* mean executor memory, in bytes */
+	int32		hist_calls[PGSM_MEM_HIST_BUCKETS];	/* # of calls by executor
+													 * memory */
+} MemUsage;
+
+/*
+ * The plan nodes with the most self time of the slowest call run with per
+ * node instrumentation, see pgsm_hotspot_capture().
+ */
+#define PGSM_HOTSPOT_NODES		5
+
+typedef struct HotspotNode
+{
+	int32		node_tag;		/* NodeTag of the plan node */
+	Oid			relid;			/* scanned relation, or InvalidOid */
+	double		self_time;		/* time less the time of the children, in
+								 * msec */
+	double		total_time;		/* time including the children, in msec */
+	double		rows;			/* actual rows of all loops */
+	double		plan_rows;		/* estimated rows per loop */
+	double		loops;			/* # of loops */
+} HotspotNode;
+
+typedef struct HotspotInfo
+{
+	double		exec_time;		/* execution time of the call, in msec */
+	int32		nnodes;			/* # of valid nodes */
+	HotspotNode nodes[PGSM_HOTSPOT_NODES];	/* by descending self time */
+} HotspotInfo;
+
 typedef struct Counters
 {
 	Calls		calls;
@@ -172,6 +230,9 @@ typedef struct Counters
 											 * launched */
 	int64		generic_plan_calls; /* # of calls using a generic plan */
 	int64		custom_plan_calls;	/* # of calls using a custom plan */
+	MemUsage	mem;			/* executor memory at ExecutorEnd */
+	dsa_pointer hotspot;		/* HotspotInfo of the slowest call with node
+								 * instrumentation, allocated on the first */
 } Counters;
 
 /*
@@ -185,10 +246,125 @@ typedef struct pgsmEntry
 	char		username[NAMEDATALEN];	/* user name */
 	Counters	counters;		/* the statistics for this query */
 	TimestampTz stats_since;	/* timestamp of entry allocation */
+	uint64		generation;		/* change generation of the last update */
+	uint64		first_generation;	/* change generation at allocation */
+	uint32		usage;			/* usage count for clock eviction */
 	slock_t		mutex;			/* protects the counters only */
 	dsa_pointer query;			/* query text location within query buffer */
 } pgsmEntry;
 
+/*
+ * Bucket and histogram settings in use.  They follow the GUCs, which can
+ * change on reload, at bucket boundaries only, see pgsm_switch_settings().
+ */
+typedef struct pgsmSettings
+{
+	int			bucket_time;	/* pgsm_bucket_time */
+	int			max_buckets;	/* pgsm_max_buckets */
+	uint64		bucket_offset;	/* added to the bucket number of a time */
+	double		histogram_min;	/* pgsm_histogram_min */
+	double		histogram_max;	/* pgsm_histogram_max */
+	int			histogram_buckets;	/* pgsm_histogram_buckets */
+} pgsmSettings;
+
+/*
+ * Geometry of a bucket, from the settings in use when it started.  Its time
+ * and the number of buckets of its ring tell how long it stays valid, its
+ * histogram settings the bounds of its resp_calls.
+ */
+typedef struct pgsmBucketGeometry
+{
+	int			bucket_time;
+	int			max_buckets;
+	double		histogram_min;
+	double		histogram_max;
+	int			histogram_buckets;
+} pgsmBucketGeometry;
+
+/*
+ * Bounds of the execution time histogram for some histogram settings.  Fewer
+ * buckets than asked for are used if they would overlap.
+ */
+typedef struct pgsmHistogram
+{
+	double		min;			/* histogram_min */
+	double		max;			/* histogram_max */
+	int			buckets;		/* histogram_buckets */
+	int			count_user;		/* buckets between min and max */
+	int			count_total;	/* and the outlier buckets */
+	double		timings[MAX_RESPONSE_BUCKET + 2];	/* upper bounds, the last
+													 * one INFINITY */
+} pgsmHistogram;
+
+/*
+ * pg_stat_monitor's own cost, reported by pg_stat_monitor_hook_stats().  All
+ * of them are counted, those before PGSM_HS_DSA_ALLOC are also timed.
+ */
+typedef enum pgsmHookStat
+{
+	PGSM_HS_POST_PARSE_ANALYZE = 0,
+	PGSM_HS_EXECUTOR_START,
+	PGSM_HS_EXECUTOR_RUN,
+	PGSM_HS_EXECUTOR_FINISH,
+	PGSM_HS_EXECUTOR_END,
+	PGSM_HS_EXECUTOR_CHECK_PERMS,
+	PGSM_HS_PLANNER,
+	PGSM_HS_PROCESS_UTILITY,
+	PGSM_HS_EMIT_LOG,
+	PGSM_HS_STORE,
+	PGSM_HS_NORMALIZE,
+	PGSM_HS_EXPLAIN,
+	PGSM_HS_LOCK_WAIT,
+	PGSM_HS_BUCKET_ROTATION,
+	PGSM_HS_DSA_ALLOC,
+	PGSM_HS_DSA_ALLOC_FAILURE,
+	PGSM_HS_OOM_DROP,
+	PGSM_HS_EVICTION,
+	PGSM_HS_NUM
+} pgsmHookStat;
+
+/*
+ * Bitmap of the hashed queryids which ran longer than
+ * pg_stat_monitor.pgsm_hotspot_threshold, read without a lock.
+ */
+#define PGSM_HOTSPOT_BITS		65536
+
+/* Number of eviction victims picked by one scan of a bucket */
+#define PGSM_EVICT_BATCH		64
+
+/* Entries of the wait event sample table */
+#define PGSM_WAIT_MAX_ENTRIES	16384
+
+/*
+ * Wait event samples of a statement in a bucket, see pgsm_sampler_main().
+ * The wait event is 0 for samples taken while running on CPU.
+ */
+typedef struct pgsmWaitKey
+{
+	uint64		bucket_id;
+	int64		queryid;
+	Oid			dbid;
+	Oid			userid;
+	uint32		wait_event_info;
+} pgsmWaitKey;
+
+typedef struct pgsmWaitEntry
+{
+	pgsmWaitKey key;			/* hash key of entry - MUST BE FIRST */
+	TimestampTz bucket_start_time;	/* to tell when the bucket is recycled */
+	int64		samples;
+} pgsmWaitEntry;
+
+/*
+ * What each backend is running, indexed by proc number, for the wait event
+ * sampler.  Backends only ever write their own slot.
+ */
+typedef struct pgsmWaitSlot
+{
+	pg_atomic_uint64 queryid;	/* 0 when not running a statement */
+	Oid			userid;
+} pgsmWaitSlot;
+
 /*
  * Global shared state
  */
@@ -197,20 +373,100 @@ typedef struct pgsmSharedState
 	LWLock	   *lock;			/* protects hashtable search/modification */
 	pg_atomic_uint64 current_bucket_id;
 	pg_atomic_uint64 current_bucket_start;
+	pg_atomic_uint64 generation;	/* bumped on every entry update */
 	void	   *raw_dsa_area;	/* DSA area pointer to store query texts */
+	void	   *raw_dshash_area;	/* DSA area of the entries, if
+									 * pgsm_dynamic_hash */
+	Latch	   *archiver_latch; /* set when a bucket is closed, if archiving */
+	dshash_table_handle dshash_handle;	/* entries, if pgsm_dynamic_hash */
+	int			dshash_tranche_id;
+	int64		dshash_nentries;	/* protected by lock */
+	int			dshash_max;		/* pgsm_dynamic_hash_max of the area limit,
+								 * protected by lock */
+	pgsmSettings settings;		/* protected by lock */
+	TimestampTz settings_time;	/* PgReloadTime the settings were taken at */
+	pgsmHistogram histogram;	/* of the settings, protected by lock */
+	int			used_buckets;	/* ring buckets which may hold entries, more
+								 * than max_buckets while those of a larger
+								 * ring remain, protected by lock */
+	pgsmBucketGeometry *bucket_geometry;	/* per bucket, protected by lock */
+	pg_atomic_uint64 hook_calls[PGSM_HS_NUM];
+	pg_atomic_uint64 hook_time[PGSM_HS_NUM];	/* in microseconds */
+	LWLock	   *wait_lock;		/* protects the wait event sample table */
+	dsa_pointer wait_slots;		/* pgsmWaitSlot per proc, if
+								 * pgsm_wait_sampling */
+	int			wait_slot_count;
+	pg_atomic_uint64 slow_queryids[PGSM_HOTSPOT_BITS / 64];
+
+	/* Next eviction victims of evict_bucket, protected by lock */
+	uint64		evict_bucket;
+	int			evict_nkeys;
+	int			evict_next;
+	pgsmHashKey evict_keys[PGSM_EVICT_BATCH];
 
 	bool		pgsm_oom;
 	TimestampTz bucket_start_time[];	/* start time of the bucket */
 } pgsmSharedState;
 
+/*
+ * Queryids are hashes already, their low bits index the bitmap of slow
+ * queryids.  A collision only instruments a fast statement for nothing.
+ * Bits are never cleared for a single queryid, which would also clear its
+ * collisions, only all of them by pg_stat_monitor_reset().
+ */
+static inline bool
+pgsm_is_slow_queryid(pgsmSharedState *pgsm, int64 queryid)
+{
+	uint32		bit = (uint64) queryid % PGSM_HOTSPOT_BITS;
+
+	return (pg_atomic_read_u64(&pgsm->slow_queryids[bit / 64]) & (UINT64CONST(1) << (bit % 64))) != 0;
+}
+
+static inline void
+pgsm_mark_slow_queryid(pgsmSharedState *pgsm, int64 queryid)
+{
+	uint32		bit = (uint64) queryid % PGSM_HOTSPOT_BITS;
+
+	if (!pgsm_is_slow_queryid(pgsm, queryid))
+		pg_atomic_fetch_or_u64(&pgsm->slow_queryids[bit / 64], UINT64CONST(1) << (bit % 64));
+}
+
+/*
+ * State of a scan over all entries.  The entries of the dynamic hash table
+ * are collected when the scan starts, so that other entries can be looked up
+ * or added while scanning, as with the fixed one.
+ */
+typedef struct pgsmHashSeqStatus
+{
+	bool		dynamic;
+	HASH_SEQ_STATUS hstat;		/* fixed hash table */
+	pgsmEntry **entries;		/* dynamic hash table */
+	long		nentries;
+	long		next;
+} pgsmHashSeqStatus;
+
 /* hash_query.c */
-void		pgsm_startup(void);
+bool		pgsm_startup(void);
 dsa_area   *get_dsa_area_for_query_text(void);
-HTAB	   *get_pgsmHash(void);
 bool		IsSystemOOM(void);
 Size		pgsm_ShmemSize(void);
+Size		pgsm_query_area_size(void);
+int64		pgsm_dsa_total_size(void);
 pgsmSharedState *pgsm_get_ss(void);
 void		hash_entry_dealloc(int bucket_id);
 pgsmEntry  *hash_entry_alloc(pgsmSharedState *pgsm, const pgsmHashKey *key);
+pgsmEntry  *hash_entry_enter(const pgsmHashKey *key, bool *found);
+pgsmEntry  *hash_entry_find(const pgsmHashKey *key);
+void		hash_entry_remove(pgsmEntry *entry);
+long		hash_entry_count(void);
+HTAB	   *pgsm_get_wait_hash(void);
+pgsmWaitSlot *pgsm_get_wait_slots(void);
+int64		hash_entry_capacity(void);
+bool		hash_entry_has_room(const pgsmHashKey *key);
+void		hash_entry_seq_init(pgsmHashSeqStatus *status);
+pgsmEntry  *hash_entry_seq_next(pgsmHashSeqStatus *status);
+void		hash_entry_seq_term(pgsmHashSeqStatus *status);
+void		pgsm_dump_stats(void);
+void		pgsm_load_stats(void);
 
 #endif							/* __PGSM_HASH_QUERY_H__ */
@@ -18,35 +18,55 @@
 #include <math.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <access/hash.h>
+#include <access/htup_details.h>
 #include <access/parallel.h>
 #include <access/xact.h>
 #include <catalog/pg_authid.h>
 #include <catalog/pg_class.h>
+#include <catalog/pg_type.h>
 #include <commands/dbcommands.h>
 #include <commands/explain.h>
 #include <common/ip.h>
 #include <funcapi.h>
 #include <jit/jit.h>
+#include <lib/binaryheap.h>
+#include <lib/qunique.h>
 #include <libpq/libpq-be.h>
+#include <libpq/pqformat.h>
 #include <mb/pg_wchar.h>
 #include <miscadmin.h>
+#include <nodes/nodeFuncs.h>
 #include <nodes/pg_list.h>
 #include <optimizer/planner.h>
 #include <parser/analyze.h>
+#ifdef PGSM_BENCHMARK
+#include <parser/parser.h>
+#endif
 #include <parser/parsetree.h>
 #include <parser/scanner.h>
 #include <parser/scansup.h>
+#include <port/pg_bitutils.h>
+#include <port/pg_crc32c.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/fd.h>
 #include <storage/ipc.h>
+#include <storage/latch.h>
 #include <storage/proc.h>
 #include <storage/shmem.h>
 #include <tcop/utility.h>
 #include <utils/acl.h>
+#include <utils/array.h>
 #include <utils/builtins.h>
+#include <utils/float.h>
+#include <utils/guc.h>
 #include <utils/lsyscache.h>
 #include <utils/memutils.h>
 #include <utils/tuplestore.h>
+#include <utils/wait_event.h>
 
 #if PG_VERSION_NUM >= 180000
 #include <commands/explain_state.h>
@@ -69,7 +89,7 @@ PG_MODULE_MAGIC;
 #define PG_STAT_MONITOR_COLS_V2_0	64
 #define PG_STAT_MONITOR_COLS_V2_1	70
 #define PG_STAT_MONITOR_COLS_V2_3	73
-#define PG_STAT_MONITOR_COLS_NEXT	75
+#define PG_STAT_MONITOR_COLS_NEXT	79
 #define PG_STAT_MONITOR_COLS		PG_STAT_MONITOR_COLS_NEXT	/* maximum of above */
 
 #define pgsm_enabled(level) \
@@ -79,6 +99,9 @@ PG_MODULE_MAGIC;
 
 #define PGSM_INVALID_IP 0xFFFFFFFF
 
+/* Entries copied per chunk by pg_stat_monitor_stream() by default */
+#define PGSM_STREAM_CHUNK_SIZE 1000
+
  /*
   * Extension version number, for supporting older extension versions' objects
   */
@@ -111,14 +134,12 @@ static int	plan_nested_level = 0;
 #define pgsm_query_instr(qd)	((qd)->totaltime)
 #endif
 
-/* Histogram bucket variables */
-static double hist_bucket_min;
-static double hist_bucket_max;
-static int	hist_bucket_count_user;
-static int	hist_bucket_count_total;
-
-/* Upper bounds of histogram buckets, last one INFINITY */
-static double hist_bucket_timings[MAX_RESPONSE_BUCKET + 2];
+/*
+ * Histograms of the buckets statistics are stored into and read from, when
+ * they are not the one of the settings in use, see pgsm_bucket_histogram()
+ */
+static pgsmHistogram store_histogram;
+static pgsmHistogram read_histogram;
 
 /* The array to store outer layer query id */
 static int64 *nested_queryids;
@@ -131,22 +152,54 @@ static int	num_relations;		/* Number of relation in the query */
 static bool system_init = false;
 static struct rusage rusage_start;
 
+/* Whether our wait event slot names a running statement */
+static bool wait_slot_busy = false;
+
 /* Cached per-backend information */
 static char datname[NAMEDATALEN];
 static uint32 client_ip = PGSM_INVALID_IP;
 
+/*
+ * pg_stat_monitor's own cost in this backend, not yet added to the shared
+ * counters, see pgsm_flush_hook_stats()
+ */
+static int64 hook_calls[PGSM_HS_NUM];
+static instr_time hook_time[PGSM_HS_NUM];
+static TimestampTz hook_stats_flushed = 0;
+static bool hook_stats_exit_registered = false;
+
 /* Query buffer, store queries' text. */
 static char *pgsm_explain(QueryDesc *queryDesc);
 
 static void pgsm_shmem_startup(void);
 static void extract_query_comments(const char *query, char *comments, size_t max_len);
-static void set_histogram_bucket_timings(void);
-static double histogram_bucket_boundary(int index);
-static int	get_histogram_bucket(double q_time);
+static void pgsm_histogram_init(pgsmHistogram *hist, double min, double max,
+								int buckets, int elevel);
+static double histogram_bucket_boundary(const pgsmHistogram *hist, int index);
+static int	get_histogram_bucket(const pgsmHistogram *hist, double q_time);
+static const pgsmHistogram *pgsm_bucket_histogram(pgsmSharedState *pgsm, uint64 bucket_id,
+												  pgsmHistogram *cache);
+static void pgsm_histogram_convert(int *resp_calls, const pgsmHistogram *from,
+								   const pgsmHistogram *to);
+static int	get_mem_histogram_bucket(int64 bytes);
 
 static bool IsSystemInitialized(void);
+static inline void pgsm_hook_stat_start(instr_time *start);
+static inline void pgsm_hook_stat_stop(pgsmHookStat stat, instr_time *start);
+static void pgsm_flush_hook_stats(bool force);
+static bool IsBucketValid(uint64 bucketid, TimestampTz now);
+static int	pgsm_bucket_level(uint64 bucketid, uint64 *first);
 static double time_diff(struct timeval end, struct timeval start);
 static void request_additional_shared_resources(void);
+static void pgsm_register_saver(void);
+static void pgsm_register_archiver(void);
+static void pgsm_register_sampler(void);
+static void pgsm_set_wait_slot(int64 queryid);
+static void pgsm_xact_callback(XactEvent event, void *arg);
+
+PGDLLEXPORT void pgsm_saver_main(Datum main_arg);
+PGDLLEXPORT void pgsm_archiver_main(Datum main_arg);
+PGDLLEXPORT void pgsm_sampler_main(Datum main_arg);
 
 /* Hooks */
 #if PG_VERSION_NUM >= 150000
@@ -169,8 +222,10 @@ static void pgsm_shmem_request(void);
 static void pgsm_emit_log_hook(ErrorData *edata);
 #if PG_VERSION_NUM >= 190000
 static void pgsm_post_parse_analyze(ParseState *pstate, Query *query, const JumbleState *jstate);
+static void pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, const JumbleState *jstate);
 #else
 static void pgsm_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *jstate);
+static void pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, JumbleState *jstate);
 #endif
 static void pgsm_ExecutorStart(QueryDesc *queryDesc, int eflags);
 #if PG_VERSION_NUM >= 180000
@@ -208,8 +263,28 @@ PG_FUNCTION_INFO_V1(pg_stat_monitor_2_1);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_2_3);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_NEXT);
 PG_FUNCTION_INFO_V1(pg_stat_monitor);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_filtered);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_changes);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_generation);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_texts);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_buckets);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_memory);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_wait_events);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_hotspots);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_top);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_projected);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_stream);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_histogram);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_rollup);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_metrics);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_export);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_decode);
+PG_FUNCTION_INFO_V1(pg_stat_monitor_archive);
 PG_FUNCTION_INFO_V1(get_histogram_timings);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_hook_stats);
+#ifdef PGSM_BENCHMARK
+PG_FUNCTION_INFO_V1(pg_stat_monitor_bench_kernel);
+#endif
 PG_FUNCTION_INFO_V1(pg_stat_monitor_decode_error_level);
 PG_FUNCTION_INFO_V1(pg_stat_monitor_get_cmd_type);
 
@@ -232,6 +307,8 @@ typedef struct pgsmQueryStats
 	char		appname[NAMEDATALEN];	/* application name */
 	char		username[NAMEDATALEN];	/* user name */
 	Counters	counters;		/* the statistics for this query */
+	HotspotInfo hotspot;		/* of the call, if it had node
+								 * instrumentation */
 } pgsmQueryStats;
 
 /*
@@ -278,12 +355,98 @@ static void pgsm_update_counters(Counters *counters,
 								 int parallel_workers_to_launch,
 								 int parallel_workers_launched,
 								 int plan_origin);
-static void pgsm_merge_counters(Counters *dst, const Counters *src);
+static void pgsm_merge_counters(Counters *dst, const Counters *src,
+								const pgsmHistogram *hist);
+static void pgsm_add_counters(Counters *dst, const Counters *src);
+static void pgsm_combine_counters(Counters *dst, const Counters *src);
 static void pgsm_store(const pgsmQueryStats *stats);
+static void pgsm_store_internal(const pgsmQueryStats *stats);
+
+/*
+ * Groups of output columns of pg_stat_monitor_internal().  Columns of groups
+ * which are not requested are returned as NULL without being computed.  The
+ * key columns, calls, rows and the remaining scalar counters are always
+ * returned.
+ */
+#define PGSM_GROUP_TEXT			(1 << 0)	/* query, query_plan */
+#define PGSM_GROUP_INFO			(1 << 1)	/* top_query, application_name,
+											 * relations, sqlcode, message,
+											 * comments */
+#define PGSM_GROUP_TIMING		(1 << 2)	/* execution and planning times,
+											 * plans, cpu times */
+#define PGSM_GROUP_BLOCKS		(1 << 3)	/* block counters and times */
+#define PGSM_GROUP_HISTOGRAM	(1 << 4)	/* resp_calls */
+#define PGSM_GROUP_WAL			(1 << 5)	/* wal usage */
+#define PGSM_GROUP_JIT			(1 << 6)	/* jit counters and times */
+#define PGSM_GROUP_MEMORY		(1 << 7)	/* executor memory */
+#define PGSM_GROUP_ALL			0xFF
+
+/* The groups returned by showtext = false */
+#define PGSM_GROUPS_NO_TEXT		(PGSM_GROUP_ALL & ~PGSM_GROUP_TEXT)
+
+/*
+ * Predicates pushed down into the scan of the shared hash table.  Entries
+ * failing them are skipped before their query text is fetched and before any
+ * Datum is built for them.
+ */
+typedef struct pgsmReadFilter
+{
+	bool		has_bucket;
+	uint64		bucket;
+	bool		has_dbid;
+	Oid			dbid;
+	bool		has_userid;
+	Oid			userid;
+	bool		has_queryid;
+	int64		queryid;
+	int64		min_calls;		/* 0 means no restriction */
+	uint64		min_generation; /* only entries updated after this one */
+} pgsmReadFilter;
 
 static void pg_stat_monitor_internal(FunctionCallInfo fcinfo,
 									 pgsmVersion api_version,
-									 bool showtext);
+									 bits32 groups,
+									 const pgsmReadFilter *filter);
+static bool pgsm_filter_key(const pgsmReadFilter *filter, const pgsmHashKey *key);
+
+/*
+ * Local copy of an entry, holding everything needed to build its output row.
+ */
+typedef struct pgsmSnapshotEntry
+{
+	pgsmHashKey key;
+	int64		pgsm_query_id;
+	char		datname[NAMEDATALEN];
+	char		username[NAMEDATALEN];
+	Counters	counters;
+	TimestampTz stats_since;
+	TimestampTz bucket_start_time;
+	int			hist_buckets;	/* of the histogram of the bucket */
+	char	   *query_text;
+	char	   *parent_query_text;	/* NULL if there is no parent query */
+} pgsmSnapshotEntry;
+
+static bool pgsm_snapshot_entry(pgsmSharedState *pgsm, pgsmEntry *entry,
+								const pgsmReadFilter *filter, TimestampTz now,
+								bits32 groups, bool copy_text,
+								pgsmSnapshotEntry *snap);
+static pgsmHashKey *pgsm_collect_keys(pgsmSharedState *pgsm, const pgsmReadFilter *filter,
+									  TimestampTz now, long *nkeys);
+static int	pgsm_copy_chunk(pgsmSharedState *pgsm, const pgsmHashKey *keys, int nkeys,
+							const pgsmReadFilter *filter, TimestampTz now, bits32 groups,
+							pgsmSnapshotEntry *snaps);
+static void pgsm_free_snapshot_texts(pgsmSnapshotEntry *snap);
+static void pgsm_read_chunked(pgsmSharedState *pgsm, const pgsmReadFilter *filter,
+							  TimestampTz now, uint64 current_bucket,
+							  pgsmVersion api_version, bits32 groups,
+							  bool may_read_all_stats, Tuplestorestate *tupstore,
+							  TupleDesc tupdesc);
+static void pgsm_form_values(pgsmSnapshotEntry *snap, pgsmVersion api_version,
+							 bits32 groups, bool may_read_all_stats,
+							 uint64 current_bucket, Datum *values, bool *nulls);
+static bits32 pgsm_parse_groups(ArrayType *arr);
+static TupleDesc pgsm_init_srf(FunctionCallInfo fcinfo, const char *caller,
+							   Tuplestorestate **tupstore);
 
 static char *generate_normalized_query(const JumbleState *jstate, const char *query,
 									   int query_loc, int *query_len_p);
@@ -305,6 +468,7 @@ static uint64 get_next_wbucket(pgsmSharedState *pgsm);
 static bool disable_error_capture = false;
 
 static void pgsm_lock_aquire(pgsmSharedState *pgsm, LWLockMode mode);
+static bool pgsm_lock_aquire_or_wait(pgsmSharedState *pgsm);
 static void pgsm_lock_release(pgsmSharedState *pgsm);
 
 /*
@@ -332,7 +496,9 @@ _PG_init(void)
 	/* Initialize the GUC variables */
 	init_guc();
 
-	set_histogram_bucket_timings();
+	/* Warn about overlapping histogram buckets right away */
+	pgsm_histogram_init(&store_histogram, pgsm_histogram_min, pgsm_histogram_max,
+						pgsm_histogram_buckets, WARNING);
 
 	/*
 	 * Inform the postmaster that we want to enable query_id calculation if
@@ -374,6 +540,16 @@ _PG_init(void)
 
 	RegisterSubXactCallback(pgsm_subxact_callback, NULL);
 
+	if (pgsm_save)
+		pgsm_register_saver();
+	if (pgsm_archive_directory[0] != '\0')
+		pgsm_register_archiver();
+	if (pgsm_wait_sampling)
+	{
+		RegisterXactCallback(pgsm_xact_callback, NULL);
+		pgsm_register_sampler();
+	}
+
 	/*
 	 * Use max_stack_depth as a very high and very rough estimate for maximum
 	 * query nesting.
@@ -400,7 +576,9 @@ pgsm_shmem_startup(void)
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
 
-	pgsm_startup();
+	if (pgsm_startup())
+		pgsm_histogram_init(&pgsm_get_ss()->histogram, pgsm_histogram_min,
+							pgsm_histogram_max, pgsm_histogram_buckets, DEBUG1);
 
 	system_init = true;
 }
@@ -414,7 +592,61 @@ request_additional_shared_resources(void)
 	 * resources in pgsm_shmem_startup().
 	 */
 	RequestAddinShmemSpace(pgsm_ShmemSize());
-	RequestNamedLWLockTranche("pg_stat_monitor", 1);
+	RequestNamedLWLockTranche("pg_stat_monitor", 2);
+}
+
+/*
+ * Register the background worker which loads the statistics saved at the
+ * last shutdown and saves them again at the next one.  The postmaster cannot
+ * do that itself as it must not attach to the DSA segments of the texts.
+ */
+static void
+pgsm_register_saver(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 10;
+	strlcpy(worker.bgw_library_name, "pg_stat_monitor", BGW_MAXLEN);
+	strlcpy(worker.bgw_function_name, "pgsm_saver_main", BGW_MAXLEN);
+	strlcpy(worker.bgw_name, "pg_stat_monitor saver", BGW_MAXLEN);
+	strlcpy(worker.bgw_type, "pg_stat_monitor saver", BGW_MAXLEN);
+
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Main loop of the saver: load the saved statistics at startup, then wait
+ * for the shutdown request to save them.  Nothing is saved on a crash or an
+ * immediate shutdown.
+ */
+void
+pgsm_saver_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	pgsm_load_stats();
+
+	while (!ShutdownRequestPending)
+	{
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+
+	pgsm_dump_stats();
+
+	proc_exit(0);
 }
 
 /*
@@ -449,6 +681,24 @@ pgsm_post_parse_analyze(ParseState *pstate, Query *query, const JumbleState *jst
 #else
 pgsm_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *jstate)
 #endif
+{
+	instr_time	start;
+
+	if (prev_post_parse_analyze_hook)
+		prev_post_parse_analyze_hook(pstate, query, jstate);
+
+	hook_calls[PGSM_HS_POST_PARSE_ANALYZE]++;
+	pgsm_hook_stat_start(&start);
+	pgsm_post_parse_analyze_internal(pstate, query, jstate);
+	pgsm_hook_stat_stop(PGSM_HS_POST_PARSE_ANALYZE, &start);
+}
+
+static void
+#if PG_VERSION_NUM >= 190000
+pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, const JumbleState *jstate)
+#else
+pgsm_post_parse_analyze_internal(ParseState *pstate, Query *query, JumbleState *jstate)
+#endif
 {
 	const char *query_text;
 	int			query_len;
@@ -460,9 +710,6 @@ pgsm_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *jstate)
 	int			norm_query_len;
 	int			location;
 
-	if (prev_post_parse_analyze_hook)
-		prev_post_parse_analyze_hook(pstate, query, jstate);
-
 	/* Safety check... */
 	if (!IsSystemInitialized())
 		return;
@@ -505,11 +752,16 @@ pgsm_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *jstate)
 	/* Generate a normalized query */
 	if (jstate && jstate->clocations_count > 0 && (pgsm_enable_pgsm_query_id || pgsm_normalized_query))
 	{
+		instr_time	start;
+
+		hook_calls[PGSM_HS_NORMALIZE]++;
+		pgsm_hook_stat_start(&start);
 		norm_query_len = query_len;
 		norm_query = generate_normalized_query(jstate,
 											   query_text,	/* query */
 											   location,	/* query location */
 											   &norm_query_len);
+		pgsm_hook_stat_stop(PGSM_HS_NORMALIZE, &start);
 	}
 
 	/*
@@ -544,9 +796,30 @@ pgsm_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *jstate)
 static void
 pgsm_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
+	instr_time	start;
+
+	hook_calls[PGSM_HS_EXECUTOR_START]++;
+	pgsm_hook_stat_start(&start);
+
 	if (pgsm_enabled(nesting_level))
 		getrusage(RUSAGE_SELF, &rusage_start);
 
+	if (pgsm_wait_sampling && nesting_level == 0 && pgsm_enabled(nesting_level))
+		pgsm_set_wait_slot(queryDesc->plannedstmt->queryId);
+
+#if PG_VERSION_NUM < 190000
+
+	/*
+	 * Run the statements which were once slower than the hotspot threshold
+	 * with node instrumentation, see pgsm_hotspot_capture().
+	 */
+	if (pgsm_hotspot_threshold >= 0 && pgsm_enabled(nesting_level) &&
+		queryDesc->plannedstmt->queryId != INT64CONST(0) &&
+		!(eflags & EXEC_FLAG_EXPLAIN_ONLY) &&
+		pgsm_is_slow_queryid(pgsm_get_ss(), queryDesc->plannedstmt->queryId))
+		queryDesc->instrument_options |= INSTRUMENT_TIMER | INSTRUMENT_ROWS;
+#endif
+
 #if PG_VERSION_NUM >= 190000
 
 	/*
@@ -558,11 +831,15 @@ pgsm_ExecutorStart(QueryDesc *queryDesc, int eflags)
 		queryDesc->query_instr_options |= INSTRUMENT_ALL;
 #endif
 
+	pgsm_hook_stat_stop(PGSM_HS_EXECUTOR_START, &start);
+
 	if (prev_ExecutorStart)
 		prev_ExecutorStart(queryDesc, eflags);
 	else
 		standard_ExecutorStart(queryDesc, eflags);
 
+	pgsm_hook_stat_start(&start);
+
 	/*
 	 * If query has queryId zero, don't track it.  This prevents double
 	 * counting of optimizable statements that are directly contained in
@@ -596,6 +873,8 @@ pgsm_ExecutorStart(QueryDesc *queryDesc, int eflags)
 		}
 #endif
 	}
+
+	pgsm_hook_stat_stop(PGSM_HS_EXECUTOR_START, &start);
 }
 
 /*
@@ -609,12 +888,19 @@ pgsm_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
 				 bool execute_once)
 #endif
 {
+	instr_time	start;
+
+	hook_calls[PGSM_HS_EXECUTOR_RUN]++;
+	pgsm_hook_stat_start(&start);
+
 	if (nesting_level >= 0 && nesting_level < max_nesting_level)
 	{
 		nested_queryids[nesting_level] = queryDesc->plannedstmt->queryId;
 		nested_query_txts[nesting_level] = pstrdup(queryDesc->sourceText);
 	}
 
+	pgsm_hook_stat_stop(PGSM_HS_EXECUTOR_RUN, &start);
+
 	nesting_level++;
 	PG_TRY();
 	{
@@ -655,6 +941,8 @@ pgsm_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
 static void
 pgsm_ExecutorFinish(QueryDesc *queryDesc)
 {
+	hook_calls[PGSM_HS_EXECUTOR_FINISH]++;
+
 	nesting_level++;
 
 	PG_TRY();
@@ -691,6 +979,111 @@ pgsm_explain(QueryDesc *queryDesc)
 	return es->str->data;
 }
 
+#if PG_VERSION_NUM < 190000
+
+/* Add up the time of the direct children of a plan node */
+static bool
+pgsm_hotspot_children_walker(PlanState *planstate, void *context)
+{
+	double	   *children_time = (double *) context;
+
+	if (planstate->instrument)
+	{
+		InstrEndLoop(planstate->instrument);
+		*children_time += planstate->instrument->total;
+	}
+	return false;
+}
+
+/* Keep the PGSM_HOTSPOT_NODES nodes with the most self time */
+static bool
+pgsm_hotspot_walker(PlanState *planstate, void *context)
+{
+	HotspotInfo *hotspot = (HotspotInfo *) context;
+	Instrumentation *instr = planstate->instrument;
+
+	if (instr)
+	{
+		double		children_time = 0.0;
+		HotspotNode node = {0};
+		int			pos;
+
+		InstrEndLoop(instr);
+		planstate_tree_walker(planstate, pgsm_hotspot_children_walker, &children_time);
+
+		node.node_tag = (int32) nodeTag(planstate->plan);
+		node.self_time = Max(instr->total - children_time, 0.0) * 1000.0;
+		node.total_time = instr->total * 1000.0;
+		node.rows = instr->ntuples;
+		node.plan_rows = planstate->plan->plan_rows;
+		node.loops = instr->nloops;
+
+		switch (nodeTag(planstate->plan))
+		{
+			case T_SeqScan:
+			case T_SampleScan:
+			case T_IndexScan:
+			case T_IndexOnlyScan:
+			case T_BitmapHeapScan:
+			case T_TidScan:
+			case T_TidRangeScan:
+			case T_ForeignScan:
+			case T_CustomScan:
+				{
+					Index		scanrelid = ((Scan *) planstate->plan)->scanrelid;
+
+					if (scanrelid > 0)
+						node.relid = exec_rt_fetch(scanrelid, planstate->state)->relid;
+					break;
+				}
+			default:
+				break;
+		}
+
+		/* Insertion into the short array sorted by descending self time */
+		pos = hotspot->nnodes;
+		while (pos > 0 && hotspot->nodes[pos - 1].self_time < node.self_time)
+		{
+			if (pos < PGSM_HOTSPOT_NODES)
+				hotspot->nodes[pos] = hotspot->nodes[pos - 1];
+			pos--;
+		}
+		if (pos < PGSM_HOTSPOT_NODES)
+		{
+			hotspot->nodes[pos] = node;
+			if (hotspot->nnodes < PGSM_HOTSPOT_NODES)
+				hotspot->nnodes++;
+		}
+	}
+
+	return planstate_tree_walker(planstate, pgsm_hotspot_walker, context);
+}
+
+/*
+ * Remember a call slower than pg_stat_monitor.pgsm_hotspot_threshold, so
+ * the next calls of its queryid get node instrumentation, and keep the
+ * nodes with the most self time if this call already had it.
+ */
+static void
+pgsm_hotspot_capture(QueryDesc *queryDesc, HotspotInfo *hotspot)
+{
+	double		exec_time = queryDesc->totaltime->total * 1000.0;
+
+	if (exec_time < pgsm_hotspot_threshold)
+		return;
+
+	pgsm_mark_slow_queryid(pgsm_get_ss(), queryDesc->plannedstmt->queryId);
+
+	if (!(queryDesc->instrument_options & INSTRUMENT_TIMER) ||
+		queryDesc->planstate->instrument == NULL)
+		return;
+
+	memset(hotspot, 0, sizeof(HotspotInfo));
+	hotspot->exec_time = exec_time;
+	pgsm_hotspot_walker(queryDesc->planstate, hotspot);
+}
+#endif
+
 /*
  * ExecutorEnd hook: store results if needed
  */
@@ -700,12 +1093,17 @@ pgsm_ExecutorEnd(QueryDesc *queryDesc)
 	int64		queryId = queryDesc->plannedstmt->queryId;
 	PlanInfo	plan_info;
 	PlanInfo   *plan_ptr = NULL;
+	instr_time	start;
+
+	hook_calls[PGSM_HS_EXECUTOR_END]++;
+	pgsm_hook_stat_start(&start);
 
 	/* Extract the plan information in case of SELECT statement */
 	if (queryDesc->operation == CMD_SELECT && pgsm_enable_query_plan)
 	{
 		int			plan_len;
 		MemoryContext oldctx;
+		instr_time	explain_start;
 
 		/*
 		 * Run explain in a per query context so that there's no memory leak
@@ -713,7 +1111,10 @@ pgsm_ExecutorEnd(QueryDesc *queryDesc)
 		 */
 		oldctx = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
 
+		hook_calls[PGSM_HS_EXPLAIN]++;
+		pgsm_hook_stat_start(&explain_start);
 		plan_len = strlcpy(plan_info.plan_text, pgsm_explain(queryDesc), PLAN_TEXT_LEN);
+		pgsm_hook_stat_stop(PGSM_HS_EXPLAIN, &explain_start);
 
 		MemoryContextSwitchTo(oldctx);
 
@@ -742,6 +1143,9 @@ pgsm_ExecutorEnd(QueryDesc *queryDesc)
 		 * instrumentation is finalized by the executor itself.
 		 */
 		InstrEndLoop(queryDesc->totaltime);
+
+		if (pgsm_hotspot_threshold >= 0)
+			pgsm_hotspot_capture(queryDesc, &stats->hotspot);
 #endif
 
 		getrusage(RUSAGE_SELF, &rusage_end);
@@ -750,6 +1154,15 @@ pgsm_ExecutorEnd(QueryDesc *queryDesc)
 
 		stats->counters.info.cmd_type = queryDesc->operation;
 
+		/*
+		 * The memory of the executor state and its children, which hold the
+		 * plan node state, hash tables and sorts, before it is freed.  This
+		 * is its final size, not its peak: memory freed or reset during the
+		 * run, such as that of a rescanned hash table, is not counted.
+		 */
+		stats->counters.mem.calls = 1;
+		stats->counters.mem.max_bytes = (int64) MemoryContextMemAllocated(queryDesc->estate->es_query_cxt, true);
+
 		pgsm_update_counters(&stats->counters,	/* counters */
 							 plan_ptr,	/* PlanInfo */
 							 &sys_info, /* SysInfo */
@@ -785,6 +1198,8 @@ pgsm_ExecutorEnd(QueryDesc *queryDesc)
 		memset(&stats->counters, 0, sizeof(stats->counters));
 	}
 
+	pgsm_hook_stat_stop(PGSM_HS_EXECUTOR_END, &start);
+
 	if (prev_ExecutorEnd)
 		prev_ExecutorEnd(queryDesc);
 	else
@@ -793,6 +1208,12 @@ pgsm_ExecutorEnd(QueryDesc *queryDesc)
 	pgsm_delete_query_stats(queryDesc->plannedstmt->queryId);
 
 	num_relations = 0;
+
+	if (wait_slot_busy && nesting_level == 0)
+		pgsm_set_wait_slot(INT64CONST(0));
+
+	if (IsSystemInitialized())
+		pgsm_flush_hook_stats(false);
 }
 
 static bool
@@ -804,6 +1225,10 @@ pgsm_ExecutorCheckPerms(List *rangeTable, bool ereport_on_violation)
 {
 	ListCell   *lr;
 	Oid			reloids[REL_LST];
+	instr_time	start;
+
+	hook_calls[PGSM_HS_EXECUTOR_CHECK_PERMS]++;
+	pgsm_hook_stat_start(&start);
 
 	num_relations = 0;
 
@@ -861,6 +1286,8 @@ pgsm_ExecutorCheckPerms(List *rangeTable, bool ereport_on_violation)
 			break;
 	}
 
+	pgsm_hook_stat_stop(PGSM_HS_EXECUTOR_CHECK_PERMS, &start);
+
 	if (prev_ExecutorCheckPerms_hook)
 #if PG_VERSION_NUM >= 160000
 		return prev_ExecutorCheckPerms_hook(rangeTable, rtePermInfos, ereport_on_violation);
@@ -901,6 +1328,8 @@ pgsm_planner_hook(Query *parse, const char *query_string, int cursorOptions, Par
 	enabled = pgsm_enabled(plan_nested_level + nesting_level);
 #endif
 
+	hook_calls[PGSM_HS_PLANNER]++;
+
 	if (enabled && pgsm_track_planning && query_string && queryId != INT64CONST(0))
 	{
 		pgsmQueryStats *stats = NULL;
@@ -910,6 +1339,9 @@ pgsm_planner_hook(Query *parse, const char *query_string, int cursorOptions, Par
 		BufferUsage bufusage;
 		WalUsage	walusage_start;
 		WalUsage	walusage;
+		instr_time	hs_start;
+
+		pgsm_hook_stat_start(&hs_start);
 
 		/* We need to track buffer usage as the planner can access them. */
 		bufusage_start = pgBufferUsage;
@@ -923,6 +1355,8 @@ pgsm_planner_hook(Query *parse, const char *query_string, int cursorOptions, Par
 
 		stats = pgsm_get_query_stats(queryId, 0, query_string, parse->commandType);
 
+		pgsm_hook_stat_stop(PGSM_HS_PLANNER, &hs_start);
+
 #if PG_VERSION_NUM >= 170000
 		nesting_level++;
 #else
@@ -961,6 +1395,8 @@ pgsm_planner_hook(Query *parse, const char *query_string, int cursorOptions, Par
 		INSTR_TIME_SET_CURRENT(duration);
 		INSTR_TIME_SUBTRACT(duration, start);
 
+		pgsm_hook_stat_start(&hs_start);
+
 		/* calc differences of buffer counters. */
 		memset(&bufusage, 0, sizeof(BufferUsage));
 		BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
@@ -988,6 +1424,8 @@ pgsm_planner_hook(Query *parse, const char *query_string, int cursorOptions, Par
 			/* Record the planning event itself. */
 			stats->counters.plancalls.calls++;
 		}
+
+		pgsm_hook_stat_stop(PGSM_HS_PLANNER, &hs_start);
 	}
 	else
 	{
@@ -1051,6 +1489,8 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 	int64		queryId = pstmt->queryId;
 	bool		enabled = pgsm_track_utility && pgsm_enabled(nesting_level);
 
+	hook_calls[PGSM_HS_PROCESS_UTILITY]++;
+
 	/*
 	 * Force utility statements to get queryId zero.  We do this even in cases
 	 * where the statement contains an optimizable statement for which a
@@ -1099,6 +1539,9 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		WalUsage	walusage_start = pgWalUsage;
 		pgsmQueryStats stats = {0};
 		pgsmQueryExecInfo info;
+		instr_time	hs_start;
+
+		pgsm_hook_stat_start(&hs_start);
 
 		getrusage(RUSAGE_SELF, &rusage_start);
 
@@ -1109,6 +1552,8 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		 */
 		pgsm_fill_query_exec_info(&info);
 
+		pgsm_hook_stat_stop(PGSM_HS_PROCESS_UTILITY, &hs_start);
+
 		INSTR_TIME_SET_CURRENT(start);
 		nesting_level++;
 
@@ -1143,6 +1588,8 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		 * former value, which'd otherwise be a good idea.
 		 */
 
+		pgsm_hook_stat_start(&hs_start);
+
 		getrusage(RUSAGE_SELF, &rusage_end);
 		sys_info.utime = time_diff(rusage_end.ru_utime, rusage_start.ru_utime);
 		sys_info.stime = time_diff(rusage_end.ru_stime, rusage_start.ru_stime);
@@ -1191,6 +1638,8 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		pgsm_store(&stats);
 
 		pfree(store_text);
+
+		pgsm_hook_stat_stop(PGSM_HS_PROCESS_UTILITY, &hs_start);
 	}
 	else
 	{
@@ -1244,6 +1693,9 @@ pgsm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		PG_END_TRY();
 #endif
 	}
+
+	if (IsSystemInitialized())
+		pgsm_flush_hook_stats(false);
 }
 
 /*
@@ -1446,10 +1898,11 @@ pgsm_update_counters(Counters *counters,
 }
 
 /*
- * Merges source counters into destination counters.
+ * Merges source counters into destination counters.  hist is the histogram
+ * of the bucket of dst.
  */
 static void
-pgsm_merge_counters(Counters *dst, const Counters *src)
+pgsm_merge_counters(Counters *dst, const Counters *src, const pgsmHistogram *hist)
 {
 	int			index;
 
@@ -1500,9 +1953,32 @@ pgsm_merge_counters(Counters *dst, const Counters *src)
 			dst->time.max_time = src->time.total_time;
 	}
 
-	index = get_histogram_bucket(src->time.total_time);
+	index = get_histogram_bucket(hist, src->time.total_time);
 	dst->resp_calls[index]++;
 
+	/* executor memory: fold src as a single sample, if it ran the executor */
+	if (src->mem.calls > 0)
+	{
+		int64		bytes = src->mem.max_bytes;
+
+		dst->mem.calls += 1;
+		if (dst->mem.calls == 1)
+		{
+			dst->mem.min_bytes = bytes;
+			dst->mem.max_bytes = bytes;
+			dst->mem.mean_bytes = bytes;
+		}
+		else
+		{
+			dst->mem.mean_bytes += (bytes - dst->mem.mean_bytes) / dst->mem.calls;
+			if (dst->mem.min_bytes > bytes)
+				dst->mem.min_bytes = bytes;
+			if (dst->mem.max_bytes < bytes)
+				dst->mem.max_bytes = bytes;
+		}
+		dst->mem.hist_calls[get_mem_histogram_bucket(bytes)]++;
+	}
+
 	/* copy the plan text once */
 	if (!dst->planinfo.plan_text[0])
 	{
@@ -1516,7 +1992,16 @@ pgsm_merge_counters(Counters *dst, const Counters *src)
 	strlcpy(dst->error.sqlcode, src->error.sqlcode, SQLCODE_LEN);
 	strlcpy(dst->error.message, src->error.message, ERROR_MESSAGE_LEN);
 
-	/* additive counters */
+	pgsm_add_counters(dst, src);
+}
+
+/*
+ * Adds up the counters which are simple sums, shared by pgsm_merge_counters()
+ * and pgsm_combine_counters().
+ */
+static void
+pgsm_add_counters(Counters *dst, const Counters *src)
+{
 	dst->calls.rows += src->calls.rows;
 
 	dst->blocks.shared_blks_hit += src->blocks.shared_blks_hit;
@@ -1565,6 +2050,84 @@ pgsm_merge_counters(Counters *dst, const Counters *src)
 	dst->custom_plan_calls += src->custom_plan_calls;
 }
 
+/*
+ * Combine the timing statistics of two sets of dst_n and src_n calls, using
+ * the parallel algorithm of Chan et al. for the sum of variances.
+ */
+static void
+pgsm_combine_call_time(CallTime *dst, int64 dst_n, const CallTime *src, int64 src_n)
+{
+	double		delta;
+	double		n;
+
+	if (src_n == 0)
+		return;
+	if (dst_n == 0)
+	{
+		*dst = *src;
+		return;
+	}
+
+	n = (double) dst_n + (double) src_n;
+	delta = src->mean_time - dst->mean_time;
+
+	dst->total_time += src->total_time;
+	dst->mean_time += delta * src_n / n;
+	dst->sum_var_time += src->sum_var_time + delta * delta * dst_n * src_n / n;
+	if (dst->min_time > src->min_time)
+		dst->min_time = src->min_time;
+	if (dst->max_time < src->max_time)
+		dst->max_time = src->max_time;
+}
+
+/*
+ * Combine the executor memory statistics of two sets of calls.
+ */
+static void
+pgsm_combine_mem_usage(MemUsage *dst, const MemUsage *src)
+{
+	if (src->calls == 0)
+		return;
+	if (dst->calls == 0)
+	{
+		*dst = *src;
+		return;
+	}
+
+	dst->mean_bytes += (src->mean_bytes - dst->mean_bytes) * src->calls /
+		((double) dst->calls + (double) src->calls);
+	dst->calls += src->calls;
+	if (dst->min_bytes > src->min_bytes)
+		dst->min_bytes = src->min_bytes;
+	if (dst->max_bytes < src->max_bytes)
+		dst->max_bytes = src->max_bytes;
+	for (int i = 0; i < PGSM_MEM_HIST_BUCKETS; i++)
+		dst->hist_calls[i] += src->hist_calls[i];
+}
+
+/*
+ * Merges two aggregated counters, e.g. of the same query in different
+ * buckets.  Unlike pgsm_merge_counters() src is not a single sample.
+ */
+static void
+pgsm_combine_counters(Counters *dst, const Counters *src)
+{
+	pgsm_combine_call_time(&dst->time, dst->calls.calls,
+						   &src->time, src->calls.calls);
+	dst->calls.calls += src->calls.calls;
+
+	pgsm_combine_call_time(&dst->plantime, dst->plancalls.calls,
+						   &src->plantime, src->plancalls.calls);
+	dst->plancalls.calls += src->plancalls.calls;
+
+	for (int i = 0; i < MAX_RESPONSE_BUCKET + 2; i++)
+		dst->resp_calls[i] += src->resp_calls[i];
+
+	pgsm_combine_mem_usage(&dst->mem, &src->mem);
+
+	pgsm_add_counters(dst, src);
+}
+
 static void
 pgsm_store_error(const char *query, const ErrorData *edata)
 {
@@ -1785,67 +2348,315 @@ pgsm_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 }
 
 /*
- * Store some statistics for a statement.
+ * A statement failing skips ExecutorEnd, so stop reporting it to the wait
+ * event sampler when the transaction aborts.
  */
 static void
-pgsm_store(const pgsmQueryStats *stats)
+pgsm_xact_callback(XactEvent event, void *arg)
 {
-	pgsmEntry  *entry;
-	pgsmSharedState *pgsm;
-	bool		found;
-	pgsmHashKey key = stats->key;
-	char	   *query = stats->query;
-	char		comments[COMMENTS_LEN];
-	const char *parent_query = NULL;
-	dsa_pointer parent_query_pointer = InvalidDsaPointer;
-	dsa_area   *query_dsa_area = NULL;
+	if (event == XACT_EVENT_ABORT && wait_slot_busy)
+		pgsm_set_wait_slot(INT64CONST(0));
+}
 
-	/* Safety check... */
-	if (!IsSystemInitialized())
+/*
+ * Publish the top level statement this backend runs, 0 for none, in its
+ * wait event slot.  Only this backend writes the slot, the sampler reads it
+ * without a lock.
+ */
+static void
+pgsm_set_wait_slot(int64 queryid)
+{
+	pgsmWaitSlot *slots = pgsm_get_wait_slots();
+	int			procno;
+
+	if (slots == NULL || MyProc == NULL)
 		return;
 
-	pgsm = pgsm_get_ss();
+#if PG_VERSION_NUM >= 170000
+	procno = MyProcNumber;
+#else
+	procno = MyProc->pgprocno;
+#endif
+	if (procno < 0 || procno >= pgsm_get_ss()->wait_slot_count)
+		return;
 
-	key.bucket_id = get_next_wbucket(pgsm);
+	if (queryid != INT64CONST(0))
+	{
+		slots[procno].userid = GetUserId();
+		pg_write_barrier();
+	}
+	pg_atomic_write_u64(&slots[procno].queryid, (uint64) queryid);
+	wait_slot_busy = queryid != INT64CONST(0);
+}
 
-	/* Let's do all the leg work here before we acquire any locks */
+/*
+ * Counters of entries evicted from a bucket are kept in the "other" entry of
+ * the bucket, see pgsm_is_other_key().
+ */
+#define PGSM_MAX_USAGE		5
+#define PGSM_OTHER_QUERY	"<other>"
 
-	if (pgsm_extract_comments)
-		extract_query_comments(query, comments, sizeof(comments));
+static inline bool
+pgsm_is_other_entry(const pgsmEntry *entry)
+{
+	return pgsm_is_other_key(&entry->key);
+}
 
-	/* Update parent id if needed */
-	if (pgsm_track == PGSM_TRACK_ALL && nesting_level > 0 && nesting_level < max_nesting_level)
-	{
-		key.parentid = nested_queryids[nesting_level - 1];
-		parent_query = nested_query_txts[nesting_level - 1];
-	}
-	else
-	{
-		key.parentid = INT64CONST(0);
-	}
+/* Give an "other" entry its query text, if it has none yet */
+static void
+pgsm_set_other_query(pgsmEntry *other)
+{
+	dsa_area   *dsa = get_dsa_area_for_query_text();
+	dsa_pointer dp;
 
-	/*
-	 * Acquire a share lock to start with. We'd have to acquire exclusive if
-	 * we need to create the entry.
-	 */
-	pgsm_lock_aquire(pgsm, LW_SHARED);
-	entry = (pgsmEntry *) hash_search(get_pgsmHash(), &key, HASH_FIND, &found);
+	if (DsaPointerIsValid(other->query))
+		return;
 
-	if (!entry)
+	dp = dsa_allocate_extended(dsa, sizeof(PGSM_OTHER_QUERY), DSA_ALLOC_NO_OOM);
+	hook_calls[PGSM_HS_DSA_ALLOC]++;
+	if (!DsaPointerIsValid(dp))
 	{
-		dsa_pointer dsa_query_pointer;
-		char	   *query_buff;
-		int			query_len = strlen(query);
+		hook_calls[PGSM_HS_DSA_ALLOC_FAILURE]++;
+		return;
+	}
 
-		/* New query, truncate length if necessary. */
+	memcpy(dsa_get_address(dsa, dp), PGSM_OTHER_QUERY, sizeof(PGSM_OTHER_QUERY));
+	other->query = dp;
+}
+
+/*
+ * Scan a bucket for the PGSM_EVICT_BATCH entries with the lowest value
+ * according to pg_stat_monitor.pgsm_eviction, and keep their keys in the
+ * shared state as the next victims, from the lowest value up.  The clock
+ * policy ages every entry it passes, so entries which are not used again
+ * between two scans end up with the lowest usage count.
+ */
+static void
+pgsm_eviction_scan(pgsmSharedState *pgsm, uint64 bucket_id)
+{
+	pgsmHashSeqStatus hstat;
+	pgsmEntry  *entry;
+	double		values[PGSM_EVICT_BATCH];
+	int			n = 0;
+
+	hash_entry_seq_init(&hstat);
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		double		value;
+		int			i;
+
+		if (entry->key.bucket_id != bucket_id || pgsm_is_other_entry(entry))
+			continue;
+
+		switch (pgsm_eviction)
+		{
+			case PGSM_EVICTION_LEAST_TIME:
+				value = entry->counters.time.total_time;
+				break;
+			case PGSM_EVICTION_LEAST_CALLS:
+				value = entry->counters.calls.calls;
+				break;
+			default:
+				value = entry->usage;
+				if (entry->usage > 0)
+					entry->usage--;
+				break;
+		}
+
+		if (n == PGSM_EVICT_BATCH && value >= values[n - 1])
+			continue;
+
+		/* Insert into the sorted victims, dropping the highest if full */
+		i = Min(n, PGSM_EVICT_BATCH - 1);
+		while (i > 0 && values[i - 1] > value)
+		{
+			values[i] = values[i - 1];
+			pgsm->evict_keys[i] = pgsm->evict_keys[i - 1];
+			i--;
+		}
+		values[i] = value;
+		pgsm->evict_keys[i] = entry->key;
+		if (n < PGSM_EVICT_BATCH)
+			n++;
+	}
+
+	pgsm->evict_bucket = bucket_id;
+	pgsm->evict_nkeys = n;
+	pgsm->evict_next = 0;
+}
+
+/*
+ * Pick the entry of a bucket to evict.  The victims picked by the last scan
+ * of the bucket are taken in turn, so that the bucket is scanned once every
+ * PGSM_EVICT_BATCH evictions rather than on every one.  With the clock
+ * policy, a victim used again since the scan gets a second chance.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock.
+ */
+static pgsmEntry *
+pgsm_eviction_victim(pgsmSharedState *pgsm, uint64 bucket_id)
+{
+	bool		scanned = false;
+
+	if (pgsm->evict_bucket != bucket_id)
+		pgsm->evict_nkeys = 0;
+
+	for (;;)
+	{
+		pgsmEntry  *entry;
+
+		if (pgsm->evict_next >= pgsm->evict_nkeys)
+		{
+			if (scanned)
+				return NULL;
+			pgsm_eviction_scan(pgsm, bucket_id);
+			scanned = true;
+			continue;
+		}
+
+		/* Skip the victims removed since the scan */
+		entry = hash_entry_find(&pgsm->evict_keys[pgsm->evict_next++]);
+		if (entry == NULL)
+			continue;
+
+		if (!scanned && pgsm_eviction == PGSM_EVICTION_CLOCK && entry->usage > 0)
+		{
+			entry->usage--;
+			continue;
+		}
+
+		return entry;
+	}
+}
+
+/*
+ * Make room in a full hash table for a new entry by evicting entries of its
+ * bucket.  The counters of evicted entries are added to the "other" entry of
+ * the bucket, so the totals of the bucket stay right.  Returns NULL if the
+ * bucket has nothing left to evict.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock.
+ */
+static pgsmEntry *
+pgsm_evict_alloc(pgsmSharedState *pgsm, const pgsmHashKey *key)
+{
+	dsa_area   *dsa = get_dsa_area_for_query_text();
+	pgsmHashKey other_key;
+	pgsmEntry  *entry;
+
+	memset(&other_key, 0, sizeof(other_key));
+	other_key.bucket_id = key->bucket_id;
+
+	while ((entry = hash_entry_alloc(pgsm, key)) == NULL)
+	{
+		pgsmEntry  *victim = pgsm_eviction_victim(pgsm, key->bucket_id);
+		pgsmEntry  *other;
+		Counters	counters;
+
+		if (victim == NULL)
+			return NULL;
+
+		hook_calls[PGSM_HS_EVICTION]++;
+		counters = victim->counters;
+		if (DsaPointerIsValid(victim->query))
+			dsa_free(dsa, victim->query);
+		if (DsaPointerIsValid(victim->counters.info.parent_query))
+			dsa_free(dsa, victim->counters.info.parent_query);
+		if (DsaPointerIsValid(victim->counters.hotspot))
+			dsa_free(dsa, victim->counters.hotspot);
+		hash_entry_remove(victim);
+
+		/* Cannot fail, the victim just made room */
+		other = hash_entry_alloc(pgsm, &other_key);
+		if (other == NULL)
+			return NULL;
+
+		pgsm_set_other_query(other);
+		pgsm_combine_counters(&other->counters, &counters);
+		other->generation = pg_atomic_add_fetch_u64(&pgsm->generation, 1);
+	}
+
+	return entry;
+}
+
+/*
+ * Store some statistics for a statement.
+ */
+static void
+pgsm_store(const pgsmQueryStats *stats)
+{
+	instr_time	start;
+
+	hook_calls[PGSM_HS_STORE]++;
+	pgsm_hook_stat_start(&start);
+	pgsm_store_internal(stats);
+	pgsm_hook_stat_stop(PGSM_HS_STORE, &start);
+}
+
+static void
+pgsm_store_internal(const pgsmQueryStats *stats)
+{
+	pgsmEntry  *entry;
+	pgsmSharedState *pgsm;
+	const pgsmHistogram *hist;
+	pgsmHashKey key = stats->key;
+	char	   *query = stats->query;
+	char		comments[COMMENTS_LEN];
+	const char *parent_query = NULL;
+	dsa_pointer parent_query_pointer = InvalidDsaPointer;
+	dsa_pointer hotspot_pointer = InvalidDsaPointer;
+	HotspotInfo *hotspot = NULL;
+	dsa_area   *query_dsa_area = NULL;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		return;
+
+	pgsm = pgsm_get_ss();
+
+	key.bucket_id = get_next_wbucket(pgsm);
+
+	/* Let's do all the leg work here before we acquire any locks */
+
+	if (pgsm_extract_comments)
+		extract_query_comments(query, comments, sizeof(comments));
+
+	/* Update parent id if needed */
+	if (pgsm_track == PGSM_TRACK_ALL && nesting_level > 0 && nesting_level < max_nesting_level)
+	{
+		key.parentid = nested_queryids[nesting_level - 1];
+		parent_query = nested_query_txts[nesting_level - 1];
+	}
+	else
+	{
+		key.parentid = INT64CONST(0);
+	}
+
+	/*
+	 * Acquire a share lock to start with. We'd have to acquire exclusive if
+	 * we need to create the entry.
+	 */
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+	entry = hash_entry_find(&key);
+
+	if (!entry)
+	{
+		dsa_pointer dsa_query_pointer;
+		char	   *query_buff;
+		int			query_len = strlen(query);
+
+		/* New query, truncate length if necessary. */
 		if (query_len > pgsm_query_max_len)
 			query_len = pg_mbcliplen(query, query_len, pgsm_query_max_len);
 
 		/* Save the query text in raw dsa area */
 		query_dsa_area = get_dsa_area_for_query_text();
 		dsa_query_pointer = dsa_allocate_extended(query_dsa_area, query_len + 1, DSA_ALLOC_NO_OOM);
+		hook_calls[PGSM_HS_DSA_ALLOC]++;
 		if (!DsaPointerIsValid(dsa_query_pointer))
 		{
+			hook_calls[PGSM_HS_DSA_ALLOC_FAILURE]++;
+			hook_calls[PGSM_HS_OOM_DROP]++;
 			pgsm_lock_release(pgsm);
 			return;
 		}
@@ -1863,12 +2674,15 @@ pgsm_store(const pgsmQueryStats *stats)
 
 		/* OK to create a new hashtable entry */
 		entry = hash_entry_alloc(pgsm, &key);
+		if (entry == NULL && pgsm_eviction != PGSM_EVICTION_NONE)
+			entry = pgsm_evict_alloc(pgsm, &key);
 
 		if (entry == NULL)
 		{
 			pgsm_lock_release(pgsm);
 
 			dsa_free(query_dsa_area, dsa_query_pointer);
+			hook_calls[PGSM_HS_OOM_DROP]++;
 
 			/*
 			 * Out of memory; report only if the state has changed now.
@@ -1883,7 +2697,8 @@ pgsm_store(const pgsmQueryStats *stats)
 						errcode(ERRCODE_OUT_OF_MEMORY),
 						errmsg("[pg_stat_monitor] pgsm_store: Hash table is out of memory and can no longer store queries!"),
 						errdetail("You may reset the view or when the buckets are deallocated, pg_stat_monitor will resume saving "
-								  "queries. Alternatively, try increasing the value of pg_stat_monitor.pgsm_max."));
+								  "queries. Alternatively, try increasing the value of %s.",
+								  pgsm_dynamic_hash ? "pg_stat_monitor.pgsm_dynamic_hash_max" : "pg_stat_monitor.pgsm_max"));
 				disable_error_capture = false;
 			}
 
@@ -1928,8 +2743,11 @@ pgsm_store(const pgsmQueryStats *stats)
 		parent_query_pointer = dsa_allocate_extended(query_dsa_area,
 													 parent_query_len + 1,
 													 DSA_ALLOC_NO_OOM);
+		hook_calls[PGSM_HS_DSA_ALLOC]++;
 
-		if (DsaPointerIsValid(parent_query_pointer))
+		if (!DsaPointerIsValid(parent_query_pointer))
+			hook_calls[PGSM_HS_DSA_ALLOC_FAILURE]++;
+		else
 		{
 			char	   *parent_query_buff = dsa_get_address(query_dsa_area,
 															parent_query_pointer);
@@ -1939,9 +2757,46 @@ pgsm_store(const pgsmQueryStats *stats)
 		}
 	}
 
+	/*
+	 * Likewise allocate the hotspots of the entry on their first capture,
+	 * and find them before taking the entry mutex, as dsa_get_address() may
+	 * have to map a segment.  The pointer is only ever set once, under the
+	 * mutex, and the hotspots only freed under an exclusive lock.
+	 */
+	if (stats->hotspot.nnodes > 0)
+	{
+		query_dsa_area = get_dsa_area_for_query_text();
+
+		if (DsaPointerIsValid(entry->counters.hotspot))
+			hotspot = dsa_get_address(query_dsa_area, entry->counters.hotspot);
+		else
+		{
+			hotspot_pointer = dsa_allocate_extended(query_dsa_area, sizeof(HotspotInfo),
+													DSA_ALLOC_NO_OOM | DSA_ALLOC_ZERO);
+			hook_calls[PGSM_HS_DSA_ALLOC]++;
+
+			if (!DsaPointerIsValid(hotspot_pointer))
+				hook_calls[PGSM_HS_DSA_ALLOC_FAILURE]++;
+			else
+				hotspot = dsa_get_address(query_dsa_area, hotspot_pointer);
+		}
+	}
+
+	hist = pgsm_bucket_histogram(pgsm, entry->key.bucket_id, &store_histogram);
+
 	SpinLockAcquire(&entry->mutex);
 
-	pgsm_merge_counters(&entry->counters, &stats->counters);
+	/*
+	 * Stamp the entry while holding its mutex, so a reader which has read the
+	 * generation counter before visiting this entry is guaranteed to see
+	 * this update.  See pg_stat_monitor_changes().
+	 */
+	entry->generation = pg_atomic_add_fetch_u64(&pgsm->generation, 1);
+
+	if (entry->usage < PGSM_MAX_USAGE)
+		entry->usage++;
+
+	pgsm_merge_counters(&entry->counters, &stats->counters, hist);
 
 	/* copy the query metadata once */
 	if (pgsm_extract_comments && comments[0] && !entry->counters.info.comments[0])
@@ -1964,10 +2819,29 @@ pgsm_store(const pgsmQueryStats *stats)
 	Assert(key.parentid != INT64CONST(0) ||
 		   !DsaPointerIsValid(entry->counters.info.parent_query));
 
+	/*
+	 * Keep the hotspots of the slowest call which has them.  A backend which
+	 * lost the race to allocate them first leaves them be this time.
+	 */
+	if (DsaPointerIsValid(hotspot_pointer))
+	{
+		if (DsaPointerIsValid(entry->counters.hotspot))
+			hotspot = NULL;
+		else
+		{
+			entry->counters.hotspot = hotspot_pointer;
+			hotspot_pointer = InvalidDsaPointer;
+		}
+	}
+	if (hotspot != NULL && stats->hotspot.exec_time > hotspot->exec_time)
+		*hotspot = stats->hotspot;
+
 	SpinLockRelease(&entry->mutex);
 
 	if (DsaPointerIsValid(parent_query_pointer))
 		dsa_free(query_dsa_area, parent_query_pointer);
+	if (DsaPointerIsValid(hotspot_pointer))
+		dsa_free(query_dsa_area, hotspot_pointer);
 
 	pgsm_lock_release(pgsm);
 }
@@ -1990,525 +2864,4160 @@ pg_stat_monitor_reset(PG_FUNCTION_ARGS)
 	pgsm_lock_aquire(pgsm, LW_EXCLUSIVE);
 	hash_entry_dealloc(INVALID_BUCKET_ID);
 	pgsm_lock_release(pgsm);
+
+	/* Forget which statements were slow, so they run uninstrumented again */
+	for (int i = 0; i < PGSM_HOTSPOT_BITS / 64; i++)
+		pg_atomic_write_u64(&pgsm->slow_queryids[i], 0);
 	PG_RETURN_VOID();
 }
 
 Datum
 pg_stat_monitor_1_0(PG_FUNCTION_ARGS)
 {
-	pg_stat_monitor_internal(fcinfo, PGSM_V1_0, true);
+	pg_stat_monitor_internal(fcinfo, PGSM_V1_0, PGSM_GROUP_ALL, NULL);
 	return (Datum) 0;
 }
 
 Datum
 pg_stat_monitor_2_0(PG_FUNCTION_ARGS)
 {
-	pg_stat_monitor_internal(fcinfo, PGSM_V2_0, true);
+	pg_stat_monitor_internal(fcinfo, PGSM_V2_0, PGSM_GROUP_ALL, NULL);
 	return (Datum) 0;
 }
 
 Datum
 pg_stat_monitor_2_1(PG_FUNCTION_ARGS)
 {
-	pg_stat_monitor_internal(fcinfo, PGSM_V2_1, true);
+	pg_stat_monitor_internal(fcinfo, PGSM_V2_1, PGSM_GROUP_ALL, NULL);
 	return (Datum) 0;
 }
 
 Datum
 pg_stat_monitor_2_3(PG_FUNCTION_ARGS)
 {
-	pg_stat_monitor_internal(fcinfo, PGSM_V2_3, true);
+	pg_stat_monitor_internal(fcinfo, PGSM_V2_3, PGSM_GROUP_ALL, NULL);
 	return (Datum) 0;
 }
 
 Datum
 pg_stat_monitor_NEXT(PG_FUNCTION_ARGS)
 {
-	pg_stat_monitor_internal(fcinfo, PGSM_NEXT, true);
+	pg_stat_monitor_internal(fcinfo, PGSM_NEXT, PGSM_GROUP_ALL, NULL);
 	return (Datum) 0;
 }
 
 /*
-  * Legacy entry point for pg_stat_monitor() API versions 1.0
-  */
+ * Same as pg_stat_monitor_NEXT, but only returns the entries matching the
+ * given bucket, dbid, userid, queryid and minimum number of calls.  NULL
+ * arguments do not restrict the result.
+ */
 Datum
-pg_stat_monitor(PG_FUNCTION_ARGS)
+pg_stat_monitor_filtered(PG_FUNCTION_ARGS)
 {
-	pg_stat_monitor_internal(fcinfo, PGSM_V1_0, true);
+	pgsmReadFilter filter = {0};
+	bool		showtext = PG_ARGISNULL(0) ? true : PG_GETARG_BOOL(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		filter.has_bucket = true;
+		filter.bucket = (uint64) PG_GETARG_INT64(1);
+	}
+	if (!PG_ARGISNULL(2))
+	{
+		filter.has_dbid = true;
+		filter.dbid = PG_GETARG_OID(2);
+	}
+	if (!PG_ARGISNULL(3))
+	{
+		filter.has_userid = true;
+		filter.userid = PG_GETARG_OID(3);
+	}
+	if (!PG_ARGISNULL(4))
+	{
+		filter.has_queryid = true;
+		filter.queryid = PG_GETARG_INT64(4);
+	}
+	if (!PG_ARGISNULL(5))
+		filter.min_calls = PG_GETARG_INT64(5);
+
+	pg_stat_monitor_internal(fcinfo, PGSM_NEXT,
+							 showtext ? PGSM_GROUP_ALL : PGSM_GROUPS_NO_TEXT,
+							 &filter);
 	return (Datum) 0;
 }
 
-static bool
-IsBucketValid(uint64 bucketid, TimestampTz now)
+/*
+ * Return the entries updated after the given change generation.
+ *
+ * Collectors should read pg_stat_monitor_generation() before calling this
+ * function and pass that value as since_generation on the next poll.  An
+ * update racing with the scan may be returned twice, but is never missed.
+ */
+Datum
+pg_stat_monitor_changes(PG_FUNCTION_ARGS)
 {
-	long		secs;
-	int			microsecs;
-	pgsmSharedState *pgsm = pgsm_get_ss();
+	pgsmReadFilter filter = {0};
+	int64		since = PG_GETARG_INT64(0);
 
-	TimestampDifference(pgsm->bucket_start_time[bucketid], now, &secs, &microsecs);
+	filter.min_generation = since > 0 ? (uint64) since : 0;
 
-	return secs <= (int64) pgsm_bucket_time * pgsm_max_buckets;
+	pg_stat_monitor_internal(fcinfo, PGSM_NEXT,
+							 PG_GETARG_BOOL(1) ? PGSM_GROUP_ALL : PGSM_GROUPS_NO_TEXT,
+							 &filter);
+	return (Datum) 0;
 }
 
-/* Common code for all versions of pg_stat_monitor() */
-static void
-pg_stat_monitor_internal(FunctionCallInfo fcinfo,
-						 pgsmVersion api_version,
-						 bool showtext)
+/*
+ * Current value of the change generation counter, the high-water mark to
+ * pass to the next pg_stat_monitor_changes() call.
+ */
+Datum
+pg_stat_monitor_generation(PG_FUNCTION_ARGS)
 {
-	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_generation: Must be loaded via shared_preload_libraries."));
+
+	PG_RETURN_INT64((int64) pg_atomic_read_u64(&pgsm_get_ss()->generation));
+}
+
+/* One distinct text returned by pg_stat_monitor_texts() */
+typedef struct pgsmTextKey
+{
+	int64		queryid;
+	int64		parentid;
+	Oid			dbid;
+} pgsmTextKey;
+
+typedef struct pgsmTextEntry
+{
+	pgsmTextKey key;			/* hash key - MUST BE FIRST */
+	int64		pgsm_query_id;
+	uint64		first_generation;	/* oldest allocation among the entries */
+	dsa_pointer query;
+	dsa_pointer parent_query;
+	bool		query_visible;	/* may the caller see the texts? */
+	char	   *query_text;
+	char	   *parent_query_text;
+} pgsmTextEntry;
+
+/*
+ * Return every distinct (queryid, dbid, top_queryid) once with its query and
+ * top query texts, no matter in how many buckets it appears.  This allows
+ * reading the statistics without texts, e.g. pg_stat_monitor_internal(false),
+ * and joining them to the texts, which are the bulk of the data.
+ *
+ * Only texts whose oldest entry was allocated after the since generation are
+ * returned, so a collector passing the highest generation it has seen only
+ * receives the texts that are new to it.
+ */
+Datum
+pg_stat_monitor_texts(PG_FUNCTION_ARGS)
+{
+	int64		since = PG_GETARG_INT64(0);
 	bool		may_read_all_stats;
 	TupleDesc	tupdesc;
 	Tuplestorestate *tupstore;
-	MemoryContext per_query_ctx;
-	MemoryContext oldcontext;
-	HASH_SEQ_STATUS hstat;
 	TimestampTz now;
-	uint64		current_bucket;
-	pgsmEntry  *entry;
 	pgsmSharedState *pgsm;
-	int			expected_columns;
-
-	may_read_all_stats = is_member_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
-
-	switch (api_version)
-	{
-		case PGSM_V1_0:
-			expected_columns = PG_STAT_MONITOR_COLS_V1_0;
-			break;
-		case PGSM_V2_0:
-			expected_columns = PG_STAT_MONITOR_COLS_V2_0;
-			break;
-		case PGSM_V2_1:
-			expected_columns = PG_STAT_MONITOR_COLS_V2_1;
-			break;
-		case PGSM_V2_3:
-			expected_columns = PG_STAT_MONITOR_COLS_V2_3;
-			break;
-		case PGSM_NEXT:
-			expected_columns = PG_STAT_MONITOR_COLS_NEXT;
-			break;
-		default:
-			Assert(false);
-	}
+	HASHCTL		info;
+	HTAB	   *agg;
+	HASH_SEQ_STATUS hstat;
+	pgsmHashSeqStatus hseq;
+	pgsmEntry  *entry;
+	pgsmTextEntry *txt;
 
-	/* Disallow old api usage */
-	if (api_version < PGSM_V2_0)
-		ereport(ERROR,
-				errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: API version not supported."),
-				errhint("Upgrade pg_stat_monitor extension"));
 	/* Safety check... */
 	if (!IsSystemInitialized())
 		ereport(ERROR,
 				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Must be loaded via shared_preload_libraries."));
-
-	/* Out of memory? */
-	if (IsSystemOOM())
-		ereport(WARNING,
-				errcode(ERRCODE_OUT_OF_MEMORY),
-				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Hash table is out of memory and can no longer store queries!"),
-				errdetail("You may reset the view or when the buckets are deallocated, pg_stat_monitor will resume saving "
-						  "queries. Alternatively, try increasing the value of pg_stat_monitor.pgsm_max."));
+				errmsg("[pg_stat_monitor] pg_stat_monitor_texts: Must be loaded via shared_preload_libraries."));
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+	if (since < 0)
 		ereport(ERROR,
-				errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Set-valued function called in context that cannot accept a set."));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Materialize mode required, but it is not "
-					   "allowed in this context."));
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_texts: Generation must not be negative."));
 
-	/* Switch into long-lived context to construct returned data structures */
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_texts", &tupstore);
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_internal: Return type must be a row type.");
+	may_read_all_stats = is_member_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
 
-	if (tupdesc->natts != expected_columns)
-		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_internal: Incorrect number of output arguments, received %d, required %d.", tupdesc->natts, expected_columns);
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgsmTextKey);
+	info.entrysize = sizeof(pgsmTextEntry);
+	info.hcxt = CurrentMemoryContext;
+	agg = hash_create("pg_stat_monitor texts", 256, &info,
+					  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	pgsm = pgsm_get_ss();
+	now = GetCurrentTimestamp();
 
-	MemoryContextSwitchTo(oldcontext);
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	hash_entry_seq_init(&hseq);
+	while ((entry = hash_entry_seq_next(&hseq)) != NULL)
+	{
+		pgsmTextKey key;
+		bool		found;
+		bool		visible;
+
+		if (!IsBucketValid(entry->key.bucket_id, now))
+			continue;
+
+		memset(&key, 0, sizeof(key));
+		key.queryid = entry->key.queryid;
+		key.parentid = entry->key.parentid;
+		key.dbid = entry->key.dbid;
+
+		txt = hash_search(agg, &key, HASH_ENTER, &found);
+		if (!found)
+		{
+			txt->pgsm_query_id = entry->pgsm_query_id;
+			txt->first_generation = entry->first_generation;
+			txt->query = InvalidDsaPointer;
+			txt->parent_query = InvalidDsaPointer;
+			txt->query_visible = false;
+		}
+		else if (entry->first_generation < txt->first_generation)
+			txt->first_generation = entry->first_generation;
+
+		visible = may_read_all_stats || entry->key.userid == GetUserId();
+		if (!DsaPointerIsValid(txt->query) || (visible && !txt->query_visible))
+		{
+			txt->query = entry->query;
+			txt->parent_query = entry->counters.info.parent_query;
+			txt->query_visible = visible;
+		}
+	}
+
+	/* Copy out the texts that are new, while the lock is still held */
+	hash_seq_init(&hstat, agg);
+	while ((txt = hash_seq_search(&hstat)) != NULL)
+	{
+		txt->query_text = NULL;
+		txt->parent_query_text = NULL;
+
+		if (txt->first_generation <= (uint64) since)
+			continue;
+
+		if (!txt->query_visible)
+			txt->query_text = "<insufficient privilege>";
+		else if (DsaPointerIsValid(txt->query))
+			txt->query_text = pstrdup(dsa_get_address(get_dsa_area_for_query_text(), txt->query));
+		else
+			txt->query_text = "Query string not available";
+
+		if (txt->key.parentid == INT64CONST(0))
+			continue;
+
+		if (!txt->query_visible)
+			txt->parent_query_text = "<insufficient privilege>";
+		else if (DsaPointerIsValid(txt->parent_query))
+			txt->parent_query_text = pstrdup(dsa_get_address(get_dsa_area_for_query_text(), txt->parent_query));
+		else
+			txt->parent_query_text = "parent query text not available";
+	}
+
+	pgsm_lock_release(pgsm);
+
+	hash_seq_init(&hstat, agg);
+	while ((txt = hash_seq_search(&hstat)) != NULL)
+	{
+		Datum		values[7];
+		bool		nulls[7] = {0};
+
+		if (txt->query_text == NULL)
+			continue;
+
+		values[0] = Int64GetDatum(txt->key.queryid);
+		values[1] = Int64GetDatum(txt->pgsm_query_id);
+		values[2] = ObjectIdGetDatum(txt->key.dbid);
+		if (txt->key.parentid != INT64CONST(0))
+		{
+			values[3] = Int64GetDatum(txt->key.parentid);
+			values[5] = CStringGetTextDatum(txt->parent_query_text);
+		}
+		else
+		{
+			nulls[3] = true;
+			nulls[5] = true;
+		}
+		values[4] = CStringGetTextDatum(txt->query_text);
+		values[6] = Int64GetDatum((int64) txt->first_generation);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	hash_destroy(agg);
+
+	return (Datum) 0;
+}
+
+/*
+ * List the buckets in use with their rollup level and time span.  Level 0 is
+ * the ring of pgsm_max_buckets, levels from 1 on are the coarser buckets of
+ * pg_stat_monitor.pgsm_rollup_levels.
+ */
+Datum
+pg_stat_monitor_buckets(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pgsmSharedState *pgsm;
+	TimestampTz now;
+	uint64		current_bucket_id;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_buckets: Must be loaded via shared_preload_libraries."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_buckets", &tupstore);
 
 	pgsm = pgsm_get_ss();
+	now = GetCurrentTimestamp();
+
 	pgsm_lock_aquire(pgsm, LW_SHARED);
-	hash_seq_init(&hstat, get_pgsmHash());
 
-	now = GetCurrentTimestamp();
-	current_bucket = pg_atomic_read_u64(&pgsm->current_bucket_id);
+	current_bucket_id = pg_atomic_read_u64(&pgsm->current_bucket_id);
 
-	while ((entry = hash_seq_search(&hstat)) != NULL)
+	for (uint64 bucket = 0; bucket < pgsm_bucket_count(); bucket++)
 	{
-		Datum		values[PG_STAT_MONITOR_COLS] = {0};
-		bool		nulls[PG_STAT_MONITOR_COLS] = {0};
-		int			i = 0;
-		Counters	tmp;
-		pgsmHashKey tmpkey;
-		double		stddev;
-		int64		queryid = entry->key.queryid;
-		int64		bucketid = entry->key.bucket_id;
-		Oid			dbid = entry->key.dbid;
-		Oid			userid = entry->key.userid;
-		uint32		ip = entry->key.ip;
-		int64		planid = entry->key.planid;
-		int64		pgsm_query_id = entry->pgsm_query_id;
-		char	   *query_text;
-		char	   *parent_query_text = NULL;
-		bool		toplevel = entry->key.toplevel;
-
-		/* Load the query text from dsa area */
+		Datum		values[5];
+		bool		nulls[5] = {0};
+		uint64		first;
+		int			level;
+
+		if (pgsm->bucket_start_time[bucket] == 0 || !IsBucketValid(bucket, now))
+			continue;
+
+		level = pgsm_bucket_level(bucket, &first);
+
+		values[0] = Int64GetDatum((int64) bucket);
+		values[1] = Int32GetDatum(level + 1);
+		values[2] = TimestampTzGetDatum(pgsm->bucket_start_time[bucket]);
+		values[3] = Int32GetDatum(pgsm->bucket_geometry[bucket].bucket_time);
+		values[4] = BoolGetDatum(bucket == current_bucket_id);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pgsm_lock_release(pgsm);
+
+	return (Datum) 0;
+}
+
+/* Memory used by the entries and query texts of one bucket */
+typedef struct pgsmMemoryUsage
+{
+	int64		entries;
+	int64		texts;
+	int64		text_bytes;
+} pgsmMemoryUsage;
+
+#define PG_STAT_MONITOR_MEMORY_COLS 10
+
+static void
+pgsm_memory_put_row(Tuplestorestate *tupstore, TupleDesc tupdesc, int64 bucket,
+					const pgsmMemoryUsage *usage, const int64 *dsa_values)
+{
+	Datum		values[PG_STAT_MONITOR_MEMORY_COLS];
+	bool		nulls[PG_STAT_MONITOR_MEMORY_COLS] = {0};
+
+	if (bucket < 0)
+		nulls[0] = true;
+	else
+		values[0] = Int64GetDatum(bucket);
+	values[1] = Int64GetDatum(usage->entries);
+	values[2] = Int64GetDatum(hash_entry_capacity());
+	values[3] = Int64GetDatum(usage->entries * (int64) sizeof(pgsmEntry));
+	values[4] = Int64GetDatum(usage->texts);
+	values[5] = Int64GetDatum(usage->text_bytes);
+	if (usage->texts == 0)
+		nulls[6] = true;
+	else
+		values[6] = Float8GetDatum((double) (usage->text_bytes - usage->texts) / usage->texts);
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (dsa_values == NULL || dsa_values[i] < 0)
+			nulls[7 + i] = true;
+		else
+			values[7 + i] = Int64GetDatum(dsa_values[i]);
+	}
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * Report the memory used by each bucket, and a total row with a NULL bucket.
+ * Entry capacity is shared by all buckets.  Text bytes include the
+ * terminating zero byte, the average length does not.
+ *
+ * The dsa columns are only in the total row and only known on PostgreSQL
+ * 17+: the bytes held by the dsa area, the bytes of it not used by query
+ * texts (and, with pgsm_dynamic_hash, entries), and the bytes it grew beyond
+ * pg_stat_monitor.pgsm_query_shared_buffer.  The free bytes include what is
+ * lost to fragmentation, the dsa allocator does not report that apart.
+ */
+Datum
+pg_stat_monitor_memory(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pgsmSharedState *pgsm;
+	pgsmMemoryUsage *usage;
+	pgsmMemoryUsage total = {0};
+	pgsmHashSeqStatus hstat;
+	pgsmEntry  *entry;
+	dsa_area   *dsa;
+	int64		dsa_values[3] = {-1, -1, -1};
+	int64		dsa_size;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_memory: Must be loaded via shared_preload_libraries."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_memory", &tupstore);
+
+	pgsm = pgsm_get_ss();
+	dsa = get_dsa_area_for_query_text();
+	usage = palloc0(sizeof(pgsmMemoryUsage) * pgsm_bucket_count());
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	hash_entry_seq_init(&hstat);
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		pgsmMemoryUsage *u = &usage[entry->key.bucket_id];
+
+		u->entries++;
 		if (DsaPointerIsValid(entry->query))
 		{
-			dsa_area   *query_dsa_area;
+			u->texts++;
+			u->text_bytes += strlen(dsa_get_address(dsa, entry->query)) + 1;
+		}
+		if (DsaPointerIsValid(entry->counters.info.parent_query))
+		{
+			u->texts++;
+			u->text_bytes += strlen(dsa_get_address(dsa, entry->counters.info.parent_query)) + 1;
+		}
+	}
+
+	dsa_size = pgsm_dsa_total_size();
+
+	pgsm_lock_release(pgsm);
+
+	for (uint64 bucket = 0; bucket < pgsm_bucket_count(); bucket++)
+	{
+		if (usage[bucket].entries == 0)
+			continue;
+
+		pgsm_memory_put_row(tupstore, tupdesc, (int64) bucket, &usage[bucket], NULL);
+
+		total.entries += usage[bucket].entries;
+		total.texts += usage[bucket].texts;
+		total.text_bytes += usage[bucket].text_bytes;
+	}
+
+	if (dsa_size >= 0)
+	{
+		int64		used = total.text_bytes;
+
+		if (pgsm_dynamic_hash)
+			used += total.entries * (int64) sizeof(pgsmEntry);
+
+		dsa_values[0] = dsa_size;
+		dsa_values[1] = Max(dsa_size - used, 0);
+		dsa_values[2] = Max(dsa_size - (int64) pgsm_query_area_size(), 0);
+	}
+
+	pgsm_memory_put_row(tupstore, tupdesc, -1, &total, dsa_values);
+
+	pfree(usage);
+
+	return (Datum) 0;
+}
+
+/*
+ * Report the wait event samples of the statements by bucket.  The wait
+ * event type and name are NULL for samples taken while running on CPU.
+ */
+Datum
+pg_stat_monitor_wait_events(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pgsmSharedState *pgsm;
+	HTAB	   *wait_hash;
+	HASH_SEQ_STATUS hstat;
+	pgsmWaitEntry *entry;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_wait_events: Must be loaded via shared_preload_libraries."));
+
+	if (!pgsm_wait_sampling)
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_wait_events: Wait event sampling is disabled."),
+				errhint("Set pg_stat_monitor.pgsm_wait_sampling to enable it."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_wait_events", &tupstore);
+
+	pgsm = pgsm_get_ss();
+	wait_hash = pgsm_get_wait_hash();
+
+	LWLockAcquire(pgsm->wait_lock, LW_SHARED);
+
+	hash_seq_init(&hstat, wait_hash);
+	while ((entry = hash_seq_search(&hstat)) != NULL)
+	{
+		Datum		values[8];
+		bool		nulls[8] = {0};
+		uint32		wait_event_info = entry->key.wait_event_info;
+		const char *wait_event_type = NULL;
+		const char *wait_event = NULL;
+
+		/* Not cleaned up yet by the sampler */
+		if (entry->bucket_start_time != pgsm->bucket_start_time[entry->key.bucket_id])
+			continue;
 
-			query_dsa_area = get_dsa_area_for_query_text();
-			query_text = dsa_get_address(query_dsa_area, entry->query);
+		values[0] = Int64GetDatum((int64) entry->key.bucket_id);
+		values[1] = TimestampTzGetDatum(entry->bucket_start_time);
+		values[2] = Int64GetDatum(entry->key.queryid);
+		values[3] = ObjectIdGetDatum(entry->key.dbid);
+		values[4] = ObjectIdGetDatum(entry->key.userid);
+		if (wait_event_info != 0)
+		{
+			wait_event_type = pgstat_get_wait_event_type(wait_event_info);
+			wait_event = pgstat_get_wait_event(wait_event_info);
 		}
+		if (wait_event_type)
+			values[5] = CStringGetTextDatum(wait_event_type);
 		else
-			query_text = "Query string not available";	/* Should never happen */
+			nulls[5] = true;
+		if (wait_event)
+			values[6] = CStringGetTextDatum(wait_event);
+		else
+			nulls[6] = true;
+		values[7] = Int64GetDatum(entry->samples);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgsm->wait_lock);
+
+	return (Datum) 0;
+}
+
+/* Name of a plan node as shown by EXPLAIN, from its NodeTag */
+static const char *
+pgsm_plan_node_name(NodeTag tag)
+{
+	switch (tag)
+	{
+		case T_Result:
+			return "Result";
+		case T_ProjectSet:
+			return "ProjectSet";
+		case T_ModifyTable:
+			return "ModifyTable";
+		case T_Append:
+			return "Append";
+		case T_MergeAppend:
+			return "Merge Append";
+		case T_RecursiveUnion:
+			return "Recursive Union";
+		case T_BitmapAnd:
+			return "BitmapAnd";
+		case T_BitmapOr:
+			return "BitmapOr";
+		case T_NestLoop:
+			return "Nested Loop";
+		case T_MergeJoin:
+			return "Merge Join";
+		case T_HashJoin:
+			return "Hash Join";
+		case T_SeqScan:
+			return "Seq Scan";
+		case T_SampleScan:
+			return "Sample Scan";
+		case T_Gather:
+			return "Gather";
+		case T_GatherMerge:
+			return "Gather Merge";
+		case T_IndexScan:
+			return "Index Scan";
+		case T_IndexOnlyScan:
+			return "Index Only Scan";
+		case T_BitmapIndexScan:
+			return "Bitmap Index Scan";
+		case T_BitmapHeapScan:
+			return "Bitmap Heap Scan";
+		case T_TidScan:
+			return "Tid Scan";
+		case T_TidRangeScan:
+			return "Tid Range Scan";
+		case T_SubqueryScan:
+			return "Subquery Scan";
+		case T_FunctionScan:
+			return "Function Scan";
+		case T_TableFuncScan:
+			return "Table Function Scan";
+		case T_ValuesScan:
+			return "Values Scan";
+		case T_CteScan:
+			return "CTE Scan";
+		case T_NamedTuplestoreScan:
+			return "Named Tuplestore Scan";
+		case T_WorkTableScan:
+			return "WorkTable Scan";
+		case T_ForeignScan:
+			return "Foreign Scan";
+		case T_CustomScan:
+			return "Custom Scan";
+		case T_Material:
+			return "Materialize";
+		case T_Memoize:
+			return "Memoize";
+		case T_Sort:
+			return "Sort";
+		case T_IncrementalSort:
+			return "Incremental Sort";
+		case T_Group:
+			return "Group";
+		case T_Agg:
+			return "Aggregate";
+		case T_WindowAgg:
+			return "WindowAgg";
+		case T_Unique:
+			return "Unique";
+		case T_SetOp:
+			return "SetOp";
+		case T_LockRows:
+			return "LockRows";
+		case T_Limit:
+			return "Limit";
+		case T_Hash:
+			return "Hash";
+		default:
+			return "???";
+	}
+}
+
+/* An entry's hotspots copied out by pg_stat_monitor_hotspots() */
+typedef struct pgsmHotspotRow
+{
+	pgsmHashKey key;
+	HotspotInfo hotspot;
+} pgsmHotspotRow;
+
+/*
+ * Report the plan nodes with the most self time of the slowest call of each
+ * entry run with node instrumentation, one row per node.  Actual rows are
+ * per loop like in EXPLAIN ANALYZE.
+ */
+Datum
+pg_stat_monitor_hotspots(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pgsmSharedState *pgsm;
+	pgsmHashSeqStatus hstat;
+	pgsmEntry  *entry;
+	TimestampTz now;
+	List	   *rows = NIL;
+	ListCell   *lc;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_hotspots: Must be loaded via shared_preload_libraries."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_hotspots", &tupstore);
+
+	pgsm = pgsm_get_ss();
+	now = GetCurrentTimestamp();
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	hash_entry_seq_init(&hstat);
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		pgsmHotspotRow *row;
+		HotspotInfo *hotspot;
+
+		if (!DsaPointerIsValid(entry->counters.hotspot) ||
+			!IsBucketValid(entry->key.bucket_id, now))
+			continue;
 
-		/* copy counters to a local variable to keep locking time short */
+		hotspot = dsa_get_address(get_dsa_area_for_query_text(), entry->counters.hotspot);
+		row = palloc(sizeof(pgsmHotspotRow));
 		SpinLockAcquire(&entry->mutex);
-		tmp = entry->counters;
-		tmpkey = entry->key;
+		row->key = entry->key;
+		row->hotspot = *hotspot;
 		SpinLockRelease(&entry->mutex);
 
-		/*
-		 * In case that query plan is enabled, there is no need to show 0
-		 * planid query
-		 */
-		if (tmp.info.cmd_type == CMD_SELECT && pgsm_enable_query_plan && planid == 0)
-			continue;
+		if (row->hotspot.nnodes == 0)
+			pfree(row);
+		else
+			rows = lappend(rows, row);
+	}
 
-		if (!IsBucketValid(bucketid, now))
-			continue;
+	pgsm_lock_release(pgsm);
 
-		/* read the parent query text if any */
-		if (tmpkey.parentid != INT64CONST(0))
-		{
-			if (DsaPointerIsValid(tmp.info.parent_query))
-			{
-				dsa_area   *query_dsa_area;
+	foreach(lc, rows)
+	{
+		pgsmHotspotRow *row = lfirst(lc);
 
-				query_dsa_area = get_dsa_area_for_query_text();
-				parent_query_text = dsa_get_address(query_dsa_area, tmp.info.parent_query);
-			}
+		for (int n = 0; n < row->hotspot.nnodes; n++)
+		{
+			HotspotNode *node = &row->hotspot.nodes[n];
+			Datum		values[15];
+			bool		nulls[15] = {0};
+			int			i = 0;
+
+			values[i++] = Int64GetDatum((int64) row->key.bucket_id);
+			values[i++] = ObjectIdGetDatum(row->key.userid);
+			values[i++] = ObjectIdGetDatum(row->key.dbid);
+			values[i++] = Int64GetDatum(row->key.queryid);
+			values[i++] = Int64GetDatum(row->key.planid);
+			values[i++] = BoolGetDatum(row->key.toplevel);
+			values[i++] = Float8GetDatum(row->hotspot.exec_time);
+			values[i++] = Int32GetDatum(n + 1);
+			values[i++] = CStringGetTextDatum(pgsm_plan_node_name((NodeTag) node->node_tag));
+			if (OidIsValid(node->relid))
+				values[i++] = ObjectIdGetDatum(node->relid);
 			else
-				parent_query_text = "parent query text not available";
+				nulls[i++] = true;
+			values[i++] = Float8GetDatum(node->self_time);
+			values[i++] = Float8GetDatum(node->total_time);
+			values[i++] = Float8GetDatum(node->loops > 0 ? node->rows / node->loops : 0.0);
+			values[i++] = Float8GetDatum(node->plan_rows);
+			values[i++] = Float8GetDatum(node->loops);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 		}
+	}
 
-		/* bucketid at column number 0 */
-		values[i++] = Int64GetDatumFast(bucketid);
+	return (Datum) 0;
+}
 
-		/* userid at column number 1 */
-		values[i++] = ObjectIdGetDatum(userid);
+/* Names of the column groups accepted by pg_stat_monitor_projected() */
+static const struct
+{
+	const char *name;
+	bits32		group;
+}			pgsm_column_groups[] =
+{
+	{"text", PGSM_GROUP_TEXT},
+	{"info", PGSM_GROUP_INFO},
+	{"timing", PGSM_GROUP_TIMING},
+	{"blocks", PGSM_GROUP_BLOCKS},
+	{"histogram", PGSM_GROUP_HISTOGRAM},
+	{"wal", PGSM_GROUP_WAL},
+	{"jit", PGSM_GROUP_JIT},
+	{"memory", PGSM_GROUP_MEMORY},
+	{"all", PGSM_GROUP_ALL},
+};
 
-		/* username at column number 2 */
-		values[i++] = CStringGetTextDatum(entry->username);
+/* Convert an array of column group names into a bitmap */
+static bits32
+pgsm_parse_groups(ArrayType *arr)
+{
+	Datum	   *elems;
+	bool	   *elem_nulls;
+	int			nelems;
+	bits32		groups = 0;
 
-		/* dbid at column number 3 */
-		values[i++] = ObjectIdGetDatum(dbid);
+	deconstruct_array(arr, TEXTOID, -1, false, TYPALIGN_INT,
+					  &elems, &elem_nulls, &nelems);
 
-		/* datname at column number 4 */
-		values[i++] = CStringGetTextDatum(entry->datname);
+	for (int i = 0; i < nelems; i++)
+	{
+		char	   *name;
+		int			j;
 
-		/*
-		 * ip address at column number 5, Superusers or members of
-		 * pg_read_all_stats members are allowed
-		 */
-		if (may_read_all_stats || userid == GetUserId())
-			values[i++] = UInt32GetDatum(ip);
-		else
-			nulls[i++] = true;
+		if (elem_nulls[i])
+			continue;
 
-		/* queryid at column number 6 */
-		values[i++] = Int64GetDatum(queryid);
+		name = TextDatumGetCString(elems[i]);
+		for (j = 0; j < lengthof(pgsm_column_groups); j++)
+		{
+			if (pg_strcasecmp(name, pgsm_column_groups[j].name) == 0)
+				break;
+		}
+		if (j == lengthof(pgsm_column_groups))
+			ereport(ERROR,
+					errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					errmsg("[pg_stat_monitor] pg_stat_monitor_projected: Unknown column group \"%s\".", name),
+					errhint("Valid column groups are text, info, timing, blocks, histogram, wal, jit, memory and all."));
 
-		/* planid at column number 7 */
-		if (planid)
-			values[i++] = Int64GetDatum(planid);
+		groups |= pgsm_column_groups[j].group;
+		pfree(name);
+	}
+
+	return groups;
+}
+
+/*
+ * pg_stat_monitor() restricted to the given column groups.  Columns outside
+ * of them are returned as NULL and are never computed, which makes a
+ * difference for the text, relations and histogram columns in particular.
+ */
+Datum
+pg_stat_monitor_projected(PG_FUNCTION_ARGS)
+{
+	bits32		groups = pgsm_parse_groups(PG_GETARG_ARRAYTYPE_P(0));
+
+	pg_stat_monitor_internal(fcinfo, PGSM_NEXT, groups, NULL);
+	return (Datum) 0;
+}
+
+/*
+  * Legacy entry point for pg_stat_monitor() API versions 1.0
+  */
+Datum
+pg_stat_monitor(PG_FUNCTION_ARGS)
+{
+	pg_stat_monitor_internal(fcinfo, PGSM_V1_0, PGSM_GROUP_ALL, NULL);
+	return (Datum) 0;
+}
+
+/*
+ * Rollup level of a bucket, -1 for the ring of pgsm_max_buckets.  Sets
+ * *first to the id of the first bucket of that level.
+ */
+static int
+pgsm_bucket_level(uint64 bucketid, uint64 *first)
+{
+	*first = 0;
+	if (bucketid < PGSM_MAX_BUCKETS)
+		return -1;
+
+	*first = PGSM_MAX_BUCKETS;
+	for (int level = 0; level < pgsm_rollup_nlevels; level++)
+	{
+		if (bucketid < *first + pgsm_rollup_level[level].buckets)
+			return level;
+		*first += pgsm_rollup_level[level].buckets;
+	}
+
+	elog(ERROR, "[pg_stat_monitor] pgsm_bucket_level: Invalid bucket " UINT64_FORMAT ".", bucketid);
+	return -1;					/* keep compiler quiet */
+}
+
+/*
+ * Is the bucket still within the time its ring covers?  Buckets are checked
+ * against the geometry they started with, so that those started before a
+ * switch of the settings stay valid for as long as they were meant to.
+ */
+static bool
+IsBucketValid(uint64 bucketid, TimestampTz now)
+{
+	long		secs;
+	int			microsecs;
+	pgsmSharedState *pgsm = pgsm_get_ss();
+	const pgsmBucketGeometry *geometry = &pgsm->bucket_geometry[bucketid];
+
+	TimestampDifference(pgsm->bucket_start_time[bucketid], now, &secs, &microsecs);
+
+	return secs <= (int64) geometry->bucket_time * geometry->max_buckets;
+}
+
+/*
+ * Check the key columns of an entry against the filter.  This only looks at
+ * the hash key, so it is safe to call without holding the entry mutex.
+ */
+static bool
+pgsm_filter_key(const pgsmReadFilter *filter, const pgsmHashKey *key)
+{
+	if (filter == NULL)
+		return true;
+
+	if (filter->has_bucket && key->bucket_id != filter->bucket)
+		return false;
+	if (filter->has_dbid && key->dbid != filter->dbid)
+		return false;
+	if (filter->has_userid && key->userid != filter->userid)
+		return false;
+	if (filter->has_queryid && key->queryid != filter->queryid)
+		return false;
+
+	return true;
+}
+
+/* Common code for all versions of pg_stat_monitor() */
+static void
+pg_stat_monitor_internal(FunctionCallInfo fcinfo,
+						 pgsmVersion api_version,
+						 bits32 groups,
+						 const pgsmReadFilter *filter)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	bool		may_read_all_stats;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	pgsmHashSeqStatus hstat;
+	TimestampTz now;
+	uint64		current_bucket;
+	pgsmEntry  *entry;
+	pgsmSharedState *pgsm;
+	int			expected_columns;
+
+	may_read_all_stats = is_member_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
+
+	switch (api_version)
+	{
+		case PGSM_V1_0:
+			expected_columns = PG_STAT_MONITOR_COLS_V1_0;
+			break;
+		case PGSM_V2_0:
+			expected_columns = PG_STAT_MONITOR_COLS_V2_0;
+			break;
+		case PGSM_V2_1:
+			expected_columns = PG_STAT_MONITOR_COLS_V2_1;
+			break;
+		case PGSM_V2_3:
+			expected_columns = PG_STAT_MONITOR_COLS_V2_3;
+			break;
+		case PGSM_NEXT:
+			expected_columns = PG_STAT_MONITOR_COLS_NEXT;
+			break;
+		default:
+			Assert(false);
+	}
+
+	/* Disallow old api usage */
+	if (api_version < PGSM_V2_0)
+		ereport(ERROR,
+				errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: API version not supported."),
+				errhint("Upgrade pg_stat_monitor extension"));
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Must be loaded via shared_preload_libraries."));
+
+	/* Out of memory? */
+	if (IsSystemOOM())
+		ereport(WARNING,
+				errcode(ERRCODE_OUT_OF_MEMORY),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Hash table is out of memory and can no longer store queries!"),
+				errdetail("You may reset the view or when the buckets are deallocated, pg_stat_monitor will resume saving "
+						  "queries. Alternatively, try increasing the value of pg_stat_monitor.pgsm_max."));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Set-valued function called in context that cannot accept a set."));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_internal: Materialize mode required, but it is not "
+					   "allowed in this context."));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_internal: Return type must be a row type.");
+
+	if (tupdesc->natts != expected_columns)
+		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_internal: Incorrect number of output arguments, received %d, required %d.", tupdesc->natts, expected_columns);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	pgsm = pgsm_get_ss();
+	now = GetCurrentTimestamp();
+	current_bucket = pg_atomic_read_u64(&pgsm->current_bucket_id);
+
+	if (pgsm_snapshot_chunk_size > 0)
+	{
+		pgsm_read_chunked(pgsm, filter, now, current_bucket, api_version,
+						  groups, may_read_all_stats, tupstore, tupdesc);
+		return;
+	}
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+	hash_entry_seq_init(&hstat);
+
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		Datum		values[PG_STAT_MONITOR_COLS] = {0};
+		bool		nulls[PG_STAT_MONITOR_COLS] = {0};
+		pgsmSnapshotEntry snap;
+
+		if (!pgsm_snapshot_entry(pgsm, entry, filter, now, groups, false, &snap))
+			continue;
+
+		pgsm_form_values(&snap, api_version, groups, may_read_all_stats,
+						 current_bucket, values, nulls);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	/* clean up and return the tuplestore */
+	pgsm_lock_release(pgsm);
+}
+
+/*
+ * Copy out an entry for the read functions.  The caller must hold pgsm->lock.
+ *
+ * Returns false if the entry is to be skipped.  Query texts are only looked
+ * up if their column group is requested.  If copy_text is true they are
+ * copied into local memory, otherwise they point into the DSA area and are
+ * only valid as long as the lock is held.
+ */
+static bool
+pgsm_snapshot_entry(pgsmSharedState *pgsm, pgsmEntry *entry,
+					const pgsmReadFilter *filter, TimestampTz now,
+					bits32 groups, bool copy_text, pgsmSnapshotEntry *snap)
+{
+	Counters   *tmp = &snap->counters;
+	char	   *query_text;
+	uint64		generation;
+
+	/* Skip filtered out entries before doing any work for them */
+	if (!pgsm_filter_key(filter, &entry->key))
+		return false;
+
+	if (!IsBucketValid(entry->key.bucket_id, now))
+		return false;
+
+	/* copy counters to a local variable to keep locking time short */
+	SpinLockAcquire(&entry->mutex);
+	*tmp = entry->counters;
+	snap->key = entry->key;
+	generation = entry->generation;
+	SpinLockRelease(&entry->mutex);
+
+	/*
+	 * In case that query plan is enabled, there is no need to show 0 planid
+	 * query
+	 */
+	if (tmp->info.cmd_type == CMD_SELECT && pgsm_enable_query_plan && snap->key.planid == 0)
+		return false;
+
+	if (filter)
+	{
+		/* Zero calls are reported as one call, see pgsm_form_values() */
+		if (Max(tmp->calls.calls, 1) < filter->min_calls)
+			return false;
+
+		if (generation <= filter->min_generation)
+			return false;
+	}
+
+	snap->pgsm_query_id = entry->pgsm_query_id;
+	strlcpy(snap->datname, entry->datname, NAMEDATALEN);
+	strlcpy(snap->username, entry->username, NAMEDATALEN);
+	snap->stats_since = entry->stats_since;
+	snap->bucket_start_time = pgsm->bucket_start_time[entry->key.bucket_id];
+	snap->hist_buckets = pgsm_bucket_histogram(pgsm, entry->key.bucket_id,
+											   &read_histogram)->count_total;
+
+	/* Load the query text from dsa area */
+	snap->query_text = NULL;
+	if (groups & PGSM_GROUP_TEXT)
+	{
+		if (DsaPointerIsValid(entry->query))
+			query_text = dsa_get_address(get_dsa_area_for_query_text(), entry->query);
+		else
+			query_text = "Query string not available";	/* Should never happen */
+		snap->query_text = copy_text ? pstrdup(query_text) : query_text;
+	}
+
+	/* read the parent query text if any */
+	snap->parent_query_text = NULL;
+	if ((groups & PGSM_GROUP_INFO) && snap->key.parentid != INT64CONST(0))
+	{
+		char	   *parent_query_text;
+
+		if (DsaPointerIsValid(tmp->info.parent_query))
+			parent_query_text = dsa_get_address(get_dsa_area_for_query_text(),
+												tmp->info.parent_query);
+		else
+			parent_query_text = "parent query text not available";
+		snap->parent_query_text = copy_text ? pstrdup(parent_query_text) : parent_query_text;
+	}
+
+	return true;
+}
+
+/*
+ * Collect the keys of the entries passing the key filter, which is cheap
+ * compared to copying the entries.  Returns a palloc'd array.
+ */
+static pgsmHashKey *
+pgsm_collect_keys(pgsmSharedState *pgsm, const pgsmReadFilter *filter,
+				  TimestampTz now, long *nkeys)
+{
+	pgsmHashSeqStatus hstat;
+	pgsmEntry  *entry;
+	pgsmHashKey *keys;
+	long		max_keys;
+
+	*nkeys = 0;
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	max_keys = Max(hash_entry_count(), 1);
+	keys = palloc_extended(max_keys * sizeof(pgsmHashKey), MCXT_ALLOC_HUGE);
+
+	hash_entry_seq_init(&hstat);
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		if (!pgsm_filter_key(filter, &entry->key) ||
+			!IsBucketValid(entry->key.bucket_id, now))
+			continue;
+
+		keys[(*nkeys)++] = entry->key;
+		if (*nkeys >= max_keys)
+		{
+			hash_entry_seq_term(&hstat);
+			break;
+		}
+	}
+
+	pgsm_lock_release(pgsm);
+
+	return keys;
+}
+
+/*
+ * Look up the given keys and copy the entries, including their query texts,
+ * into snaps, holding the shared lock only for the duration of the copy.
+ * Returns the number of entries copied.  Entries deallocated since their keys
+ * were collected are skipped.
+ */
+static int
+pgsm_copy_chunk(pgsmSharedState *pgsm, const pgsmHashKey *keys, int nkeys,
+				const pgsmReadFilter *filter, TimestampTz now, bits32 groups,
+				pgsmSnapshotEntry *snaps)
+{
+	int			ncopied = 0;
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+	for (int k = 0; k < nkeys; k++)
+	{
+		pgsmEntry  *entry = hash_entry_find(&keys[k]);
+
+		if (entry == NULL)
+			continue;
+
+		if (pgsm_snapshot_entry(pgsm, entry, filter, now, groups, true,
+								&snaps[ncopied]))
+			ncopied++;
+	}
+	pgsm_lock_release(pgsm);
+
+	return ncopied;
+}
+
+/* Free the query texts copied by pgsm_copy_chunk() */
+static void
+pgsm_free_snapshot_texts(pgsmSnapshotEntry *snap)
+{
+	if (snap->query_text)
+		pfree(snap->query_text);
+	if (snap->parent_query_text)
+		pfree(snap->parent_query_text);
+}
+
+/*
+ * Copy-out variant of the scan, used when pgsm_snapshot_chunk_size is set.
+ *
+ * The keys of the matching entries are collected in one pass, then the
+ * entries are looked up and copied into local memory at most
+ * pgsm_snapshot_chunk_size at a time.  The shared lock is released between
+ * chunks and while the tuples are built and written to the tuplestore, so
+ * bucket rotation and new entries only wait for one chunk to be copied.
+ * Query texts are copied while the lock is held, so there is no need to pin
+ * them in the DSA area.  Entries deallocated between two chunks are skipped,
+ * which means the result is not a point-in-time snapshot of the whole table.
+ */
+static void
+pgsm_read_chunked(pgsmSharedState *pgsm, const pgsmReadFilter *filter,
+				  TimestampTz now, uint64 current_bucket,
+				  pgsmVersion api_version, bits32 groups,
+				  bool may_read_all_stats, Tuplestorestate *tupstore,
+				  TupleDesc tupdesc)
+{
+	pgsmHashKey *keys;
+	pgsmSnapshotEntry *snaps;
+	long		nkeys;
+
+	keys = pgsm_collect_keys(pgsm, filter, now, &nkeys);
+
+	snaps = palloc_extended(pgsm_snapshot_chunk_size * sizeof(pgsmSnapshotEntry),
+							MCXT_ALLOC_HUGE);
+
+	for (long start = 0; start < nkeys; start += pgsm_snapshot_chunk_size)
+	{
+		int			ncopied;
+
+		ncopied = pgsm_copy_chunk(pgsm, keys + start,
+								  Min(pgsm_snapshot_chunk_size, nkeys - start),
+								  filter, now, groups, snaps);
+
+		for (int j = 0; j < ncopied; j++)
+		{
+			Datum		values[PG_STAT_MONITOR_COLS] = {0};
+			bool		nulls[PG_STAT_MONITOR_COLS] = {0};
+
+			pgsm_form_values(&snaps[j], api_version, groups,
+							 may_read_all_stats, current_bucket, values, nulls);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			pgsm_free_snapshot_texts(&snaps[j]);
+		}
+	}
+
+	pfree(snaps);
+	pfree(keys);
+}
+
+/* Cursor of pg_stat_monitor_stream(), kept across calls */
+typedef struct pgsmStreamState
+{
+	pgsmHashKey *keys;			/* keys of the entries to return */
+	long		nkeys;
+	long		next_key;		/* first key of the next chunk */
+	pgsmSnapshotEntry *snaps;	/* the current chunk */
+	int			nsnaps;
+	int			next_snap;		/* next entry of the chunk to return */
+	int			chunk_size;
+	TimestampTz now;
+	uint64		current_bucket;
+	bits32		groups;
+	bool		may_read_all_stats;
+} pgsmStreamState;
+
+/*
+ * Value-per-call variant of pg_stat_monitor_internal() with the columns of
+ * the current API version.
+ *
+ * The keys are collected on the first call, then the entries are copied a
+ * chunk at a time (pgsm_snapshot_chunk_size, or PGSM_STREAM_CHUNK_SIZE if
+ * that is not set) and returned one row per call, without holding any lock
+ * between calls.  Note that the executor materializes set returning functions
+ * called in FROM, the rows are only streamed when the function is called in
+ * the select list, e.g.
+ *
+ *	 COPY (SELECT (s).* FROM (SELECT pg_stat_monitor_stream() AS s) AS t) TO STDOUT;
+ */
+Datum
+pg_stat_monitor_stream(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	pgsmStreamState *state;
+	pgsmSharedState *pgsm;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_stream: Must be loaded via shared_preload_libraries."));
+
+	pgsm = pgsm_get_ss();
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_stream: Return type must be a row type.");
+
+		if (tupdesc->natts != PG_STAT_MONITOR_COLS_NEXT)
+			elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_stream: Incorrect number of output arguments, received %d, required %d.", tupdesc->natts, PG_STAT_MONITOR_COLS_NEXT);
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		state = palloc0(sizeof(pgsmStreamState));
+		state->now = GetCurrentTimestamp();
+		state->current_bucket = pg_atomic_read_u64(&pgsm->current_bucket_id);
+		state->groups = PG_GETARG_BOOL(0) ? PGSM_GROUP_ALL : PGSM_GROUPS_NO_TEXT;
+		state->may_read_all_stats = is_member_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
+		state->chunk_size = pgsm_snapshot_chunk_size > 0 ?
+			pgsm_snapshot_chunk_size : PGSM_STREAM_CHUNK_SIZE;
+		state->keys = pgsm_collect_keys(pgsm, NULL, state->now, &state->nkeys);
+		state->snaps = palloc_extended(state->chunk_size * sizeof(pgsmSnapshotEntry),
+									   MCXT_ALLOC_HUGE);
+		funcctx->user_fctx = state;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (pgsmStreamState *) funcctx->user_fctx;
+
+	/* Copy out the next chunk once the current one is used up */
+	while (state->next_snap >= state->nsnaps && state->next_key < state->nkeys)
+	{
+		int			nkeys = Min(state->chunk_size, state->nkeys - state->next_key);
+		MemoryContext oldcontext;
+
+		/* the texts must survive until their row is returned */
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		state->nsnaps = pgsm_copy_chunk(pgsm, state->keys + state->next_key, nkeys,
+										NULL, state->now, state->groups,
+										state->snaps);
+		MemoryContextSwitchTo(oldcontext);
+
+		state->next_key += nkeys;
+		state->next_snap = 0;
+	}
+
+	if (state->next_snap < state->nsnaps)
+	{
+		pgsmSnapshotEntry *snap = &state->snaps[state->next_snap++];
+		Datum		values[PG_STAT_MONITOR_COLS] = {0};
+		bool		nulls[PG_STAT_MONITOR_COLS] = {0};
+		HeapTuple	tuple;
+
+		pgsm_form_values(snap, PGSM_NEXT, state->groups,
+						 state->may_read_all_stats, state->current_bucket,
+						 values, nulls);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		pgsm_free_snapshot_texts(snap);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Build the output columns for one snapshot entry.  The number of columns
+ * depends on the API version, columns of groups not requested are NULL.  May
+ * modify the snapshot.
+ */
+static void
+pgsm_form_values(pgsmSnapshotEntry *snap, pgsmVersion api_version,
+				 bits32 groups, bool may_read_all_stats,
+				 uint64 current_bucket, Datum *values, bool *nulls)
+{
+	Counters   *tmp = &snap->counters;
+	double		stddev;
+	int			i = 0;
+
+/* Skip n columns of a group that was not requested */
+#define SKIP_COLUMNS(n) \
+	do { \
+		for (int skip_ = 0; skip_ < (n); skip_++) \
+			nulls[i++] = true; \
+	} while (0)
+
+	/* bucketid at column number 0 */
+	values[i++] = Int64GetDatumFast(snap->key.bucket_id);
+
+	/* userid at column number 1 */
+	values[i++] = ObjectIdGetDatum(snap->key.userid);
+
+	/* username at column number 2 */
+	values[i++] = CStringGetTextDatum(snap->username);
+
+	/* dbid at column number 3 */
+	values[i++] = ObjectIdGetDatum(snap->key.dbid);
+
+	/* datname at column number 4 */
+	values[i++] = CStringGetTextDatum(snap->datname);
+
+	/*
+	 * ip address at column number 5, Superusers or members of
+	 * pg_read_all_stats members are allowed
+	 */
+	if (may_read_all_stats || snap->key.userid == GetUserId())
+		values[i++] = UInt32GetDatum(snap->key.ip);
+	else
+		nulls[i++] = true;
+
+	/* queryid at column number 6 */
+	values[i++] = Int64GetDatum(snap->key.queryid);
+
+	/* planid at column number 7 */
+	if (snap->key.planid)
+		values[i++] = Int64GetDatum(snap->key.planid);
+	else
+		nulls[i++] = true;
+
+	if (may_read_all_stats || snap->key.userid == GetUserId())
+	{
+		if (groups & PGSM_GROUP_TEXT)
+		{
+			/* query at column number 8 */
+			values[i++] = CStringGetTextDatum(snap->query_text);
+			/* plan at column number 9 */
+			if (snap->key.planid && tmp->planinfo.plan_text[0])
+				values[i++] = CStringGetTextDatum(tmp->planinfo.plan_text);
+			else
+				nulls[i++] = true;
+		}
+		else
+		{
+			/* query and plan at column number 8 and 9 */
+			SKIP_COLUMNS(2);
+		}
+	}
+	else
+	{
+		/* query text and plan at column number 8 and 9 */
+		values[i++] = CStringGetTextDatum("<insufficient privilege>");
+		values[i++] = CStringGetTextDatum("<insufficient privilege>");
+	}
+
+	/* pgsm_query_id at column number 10 */
+	if (snap->pgsm_query_id)
+		values[i++] = Int64GetDatum(snap->pgsm_query_id);
+	else
+		nulls[i++] = true;
+
+	/* parentid at column number 11 */
+	if (snap->key.parentid != INT64CONST(0))
+	{
+		values[i++] = Int64GetDatum(snap->key.parentid);
+		if (groups & PGSM_GROUP_INFO)
+			values[i++] = CStringGetTextDatum(snap->parent_query_text);
+		else
+			nulls[i++] = true;
+	}
+	else
+	{
+		nulls[i++] = true;
+		nulls[i++] = true;
+	}
+
+	if (groups & PGSM_GROUP_INFO)
+	{
+		/* application_name at column number 13 */
+		if (strlen(tmp->info.application_name) > 0)
+			values[i++] = CStringGetTextDatum(tmp->info.application_name);
+		else
+			nulls[i++] = true;
+
+		/* relations at column number 14 */
+		if (tmp->info.num_relations > 0)
+		{
+			StringInfoData buf;
+
+			initStringInfo(&buf);
+
+			for (int j = 0; j < tmp->info.num_relations; j++)
+			{
+				if (j > 0)
+					appendStringInfoChar(&buf, ',');
+				appendStringInfoString(&buf, tmp->info.relations[j]);
+			}
+
+			values[i++] = CStringGetTextDatum(buf.data);
+			pfree(buf.data);
+		}
+		else
+			nulls[i++] = true;
+	}
+	else
+		SKIP_COLUMNS(2);
+
+	/* cmd_type at column number 15 */
+	if (tmp->info.cmd_type == CMD_NOTHING)
+		nulls[i++] = true;
+	else
+		values[i++] = Int64GetDatumFast((int64) tmp->info.cmd_type);
+
+	/* elevel at column number 16 */
+	values[i++] = Int64GetDatumFast(tmp->error.elevel);
+
+	if (groups & PGSM_GROUP_INFO)
+	{
+		/* sqlcode at column number 17 */
+		if (strlen(tmp->error.sqlcode) == 0)
+			nulls[i++] = true;
+		else
+			values[i++] = CStringGetTextDatum(tmp->error.sqlcode);
+
+		/* message at column number 18 */
+		if (strlen(tmp->error.message) == 0)
+			nulls[i++] = true;
+		else
+			values[i++] = CStringGetTextDatum(tmp->error.message);
+	}
+	else
+		SKIP_COLUMNS(2);
+
+	/* bucket_start_time at column number 19 */
+	values[i++] = TimestampTzGetDatum(snap->bucket_start_time);
+
+	if (tmp->calls.calls == 0)
+	{
+		/* Query of pg_stat_monitor itself started from zero count */
+		tmp->calls.calls++;
+		tmp->resp_calls[0]++;
+	}
+
+	/* calls at column number 20 */
+	values[i++] = Int64GetDatumFast(tmp->calls.calls);
+
+	if (groups & PGSM_GROUP_TIMING)
+	{
+		/* total_time at column number 21 */
+		values[i++] = Float8GetDatumFast(tmp->time.total_time);
+
+		/* min_time at column number 22 */
+		values[i++] = Float8GetDatumFast(tmp->time.min_time);
+
+		/* max_time at column number 23 */
+		values[i++] = Float8GetDatumFast(tmp->time.max_time);
+
+		/* mean_time at column number 24 */
+		values[i++] = Float8GetDatumFast(tmp->time.mean_time);
+		if (tmp->calls.calls > 1)
+			stddev = sqrt(tmp->time.sum_var_time / tmp->calls.calls);
+		else
+			stddev = 0.0;
+
+		/* stddev_exec_time at column number 25 */
+		values[i++] = Float8GetDatumFast(stddev);
+	}
+	else
+		SKIP_COLUMNS(5);
+
+	/* rows at column number 26 */
+	values[i++] = Int64GetDatumFast(tmp->calls.rows);
+
+	if (groups & PGSM_GROUP_TIMING)
+	{
+		/* plans at column number 27 */
+		values[i++] = Int64GetDatumFast(tmp->plancalls.calls);
+
+		/* total_plan_time at column number 28 */
+		values[i++] = Float8GetDatumFast(tmp->plantime.total_time);
+
+		/* min_plan_time at column number 29 */
+		values[i++] = Float8GetDatumFast(tmp->plantime.min_time);
+
+		/* max_plan_time at column number 30 */
+		values[i++] = Float8GetDatumFast(tmp->plantime.max_time);
+
+		/* mean_plan_time at column number 31 */
+		values[i++] = Float8GetDatumFast(tmp->plantime.mean_time);
+		if (tmp->plancalls.calls > 1)
+			stddev = sqrt(tmp->plantime.sum_var_time / tmp->plancalls.calls);
+		else
+			stddev = 0.0;
+
+		/* stddev_plan_time at column number 32 */
+		values[i++] = Float8GetDatumFast(stddev);
+	}
+	else
+		SKIP_COLUMNS(6);
+
+	/* blocks are from column number 33 - 48 */
+	if (groups & PGSM_GROUP_BLOCKS)
+	{
+		values[i++] = Int64GetDatumFast(tmp->blocks.shared_blks_hit);
+		values[i++] = Int64GetDatumFast(tmp->blocks.shared_blks_read);
+		values[i++] = Int64GetDatumFast(tmp->blocks.shared_blks_dirtied);
+		values[i++] = Int64GetDatumFast(tmp->blocks.shared_blks_written);
+		values[i++] = Int64GetDatumFast(tmp->blocks.local_blks_hit);
+		values[i++] = Int64GetDatumFast(tmp->blocks.local_blks_read);
+		values[i++] = Int64GetDatumFast(tmp->blocks.local_blks_dirtied);
+		values[i++] = Int64GetDatumFast(tmp->blocks.local_blks_written);
+		values[i++] = Int64GetDatumFast(tmp->blocks.temp_blks_read);
+		values[i++] = Int64GetDatumFast(tmp->blocks.temp_blks_written);
+		values[i++] = Float8GetDatumFast(tmp->blocks.shared_blk_read_time);
+		values[i++] = Float8GetDatumFast(tmp->blocks.shared_blk_write_time);
+		if (api_version >= PGSM_V2_1)
+		{
+			values[i++] = Float8GetDatumFast(tmp->blocks.local_blk_read_time);
+			values[i++] = Float8GetDatumFast(tmp->blocks.local_blk_write_time);
+		}
+		values[i++] = Float8GetDatumFast(tmp->blocks.temp_blk_read_time);
+		values[i++] = Float8GetDatumFast(tmp->blocks.temp_blk_write_time);
+	}
+	else
+		SKIP_COLUMNS(api_version >= PGSM_V2_1 ? 16 : 14);
+
+	/* resp_calls at column number 49 */
+	if (groups & PGSM_GROUP_HISTOGRAM)
+		values[i++] = intarray_get_datum(tmp->resp_calls, snap->hist_buckets);
+	else
+		nulls[i++] = true;
+
+	if (groups & PGSM_GROUP_TIMING)
+	{
+		/* cpu_user_time at column number 50 */
+		values[i++] = Float8GetDatumFast(tmp->sysinfo.utime);
+
+		/* cpu_sys_time at column number 51 */
+		values[i++] = Float8GetDatumFast(tmp->sysinfo.stime);
+	}
+	else
+		SKIP_COLUMNS(2);
+
+	if (groups & PGSM_GROUP_WAL)
+	{
+		char		buf[256];
+		Datum		wal_bytes;
+
+		/* wal_records at column number 52 */
+		values[i++] = Int64GetDatumFast(tmp->walusage.wal_records);
+
+		/* wal_fpi at column number 53 */
+		values[i++] = Int64GetDatumFast(tmp->walusage.wal_fpi);
+
+		snprintf(buf, sizeof(buf), UINT64_FORMAT, tmp->walusage.wal_bytes);
+
+		/* Convert to numeric */
+		wal_bytes = DirectFunctionCall3(numeric_in,
+										CStringGetDatum(buf),
+										ObjectIdGetDatum(0),
+										Int32GetDatum(-1));
+		/* wal_bytes at column number 54 */
+		values[i++] = wal_bytes;
+
+		if (api_version >= PGSM_V2_3)
+		{
+			/* wal_buffers_full at column number 55 */
+			values[i++] = Int64GetDatumFast(tmp->walusage.wal_buffers_full);
+		}
+	}
+	else
+		SKIP_COLUMNS(api_version >= PGSM_V2_3 ? 4 : 3);
+
+	/* comments at column number 56 */
+	if ((groups & PGSM_GROUP_INFO) && strlen(tmp->info.comments) > 0)
+		values[i++] = CStringGetTextDatum(tmp->info.comments);
+	else
+		nulls[i++] = true;
+
+	/* jit counters are from column number 57 - 66 */
+	if (groups & PGSM_GROUP_JIT)
+	{
+		values[i++] = Int64GetDatumFast(tmp->jitinfo.jit_functions);
+		values[i++] = Float8GetDatumFast(tmp->jitinfo.jit_generation_time);
+		values[i++] = Int64GetDatumFast(tmp->jitinfo.jit_inlining_count);
+		values[i++] = Float8GetDatumFast(tmp->jitinfo.jit_inlining_time);
+		values[i++] = Int64GetDatumFast(tmp->jitinfo.jit_optimization_count);
+		values[i++] = Float8GetDatumFast(tmp->jitinfo.jit_optimization_time);
+		values[i++] = Int64GetDatumFast(tmp->jitinfo.jit_emission_count);
+		values[i++] = Float8GetDatumFast(tmp->jitinfo.jit_emission_time);
+		if (api_version >= PGSM_V2_1)
+		{
+			/* at column number 65 */
+			values[i++] = Int64GetDatumFast(tmp->jitinfo.jit_deform_count);
+			values[i++] = Float8GetDatumFast(tmp->jitinfo.jit_deform_time);
+		}
+	}
+	else
+		SKIP_COLUMNS(api_version >= PGSM_V2_1 ? 10 : 8);
+
+	if (api_version >= PGSM_V2_3)
+	{
+		/* at column number 67 */
+		values[i++] = Int64GetDatumFast(tmp->parallel_workers_to_launch);
+		values[i++] = Int64GetDatumFast(tmp->parallel_workers_launched);
+	}
+
+	if (api_version >= PGSM_NEXT)
+	{
+		/* at column number 69 */
+		values[i++] = Int64GetDatumFast(tmp->generic_plan_calls);
+		values[i++] = Int64GetDatumFast(tmp->custom_plan_calls);
+
+		/* executor memory is from column number 71 - 74 */
+		if ((groups & PGSM_GROUP_MEMORY) && tmp->mem.calls > 0)
+		{
+			values[i++] = Int64GetDatumFast(tmp->mem.min_bytes);
+			values[i++] = Int64GetDatumFast(tmp->mem.max_bytes);
+			values[i++] = Float8GetDatumFast(tmp->mem.mean_bytes);
+			values[i++] = intarray_get_datum(tmp->mem.hist_calls, PGSM_MEM_HIST_BUCKETS);
+		}
+		else
+			SKIP_COLUMNS(4);
+	}
+
+	if (api_version >= PGSM_V2_1)
+	{
+		/* at column number 75 */
+		values[i++] = TimestampTzGetDatum(snap->stats_since);
+		/* exists for compatibility with pg_stat_statements */
+		values[i++] = TimestampTzGetDatum(snap->stats_since);
+	}
+
+	/* toplevel at column number 77 */
+	values[i++] = BoolGetDatum(snap->key.toplevel);
+
+	/* bucket_done at column number 78 */
+	values[i++] = BoolGetDatum(snap->key.bucket_id != current_bucket);
+
+#undef SKIP_COLUMNS
+}
+
+/*
+ * Set up a tuplestore for a materialize mode set returning function, like
+ * InitMaterializedSRF() which is not available in all supported versions.
+ */
+static TupleDesc
+pgsm_init_srf(FunctionCallInfo fcinfo, const char *caller, Tuplestorestate **tupstore)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				errmsg("[pg_stat_monitor] %s: Set-valued function called in context that cannot accept a set.", caller));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				errmsg("[pg_stat_monitor] %s: Materialize mode required, but it is not "
+					   "allowed in this context.", caller));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "[pg_stat_monitor] %s: Return type must be a row type.", caller);
+
+	*tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = *tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupdesc;
+}
+
+/* Metrics pg_stat_monitor_top() can rank by */
+typedef enum pgsmTopMetric
+{
+	PGSM_TOP_CALLS,
+	PGSM_TOP_TOTAL_EXEC_TIME,
+	PGSM_TOP_MEAN_EXEC_TIME,
+	PGSM_TOP_MAX_EXEC_TIME,
+	PGSM_TOP_ROWS,
+	PGSM_TOP_TOTAL_PLAN_TIME,
+	PGSM_TOP_SHARED_BLKS_HIT,
+	PGSM_TOP_SHARED_BLKS_READ,
+	PGSM_TOP_TEMP_BLKS_WRITTEN,
+	PGSM_TOP_CPU_USER_TIME,
+	PGSM_TOP_CPU_SYS_TIME,
+	PGSM_TOP_WAL_BYTES,
+	PGSM_TOP_MAX_EXEC_MEM
+} pgsmTopMetric;
+
+static const struct
+{
+	const char *name;
+	pgsmTopMetric metric;
+}			pgsm_top_metrics[] =
+{
+	{"calls", PGSM_TOP_CALLS},
+	{"total_exec_time", PGSM_TOP_TOTAL_EXEC_TIME},
+	{"mean_exec_time", PGSM_TOP_MEAN_EXEC_TIME},
+	{"max_exec_time", PGSM_TOP_MAX_EXEC_TIME},
+	{"rows", PGSM_TOP_ROWS},
+	{"total_plan_time", PGSM_TOP_TOTAL_PLAN_TIME},
+	{"shared_blks_hit", PGSM_TOP_SHARED_BLKS_HIT},
+	{"shared_blks_read", PGSM_TOP_SHARED_BLKS_READ},
+	{"temp_blks_written", PGSM_TOP_TEMP_BLKS_WRITTEN},
+	{"cpu_user_time", PGSM_TOP_CPU_USER_TIME},
+	{"cpu_sys_time", PGSM_TOP_CPU_SYS_TIME},
+	{"wal_bytes", PGSM_TOP_WAL_BYTES},
+	{"max_exec_mem", PGSM_TOP_MAX_EXEC_MEM},
+};
+
+/* Per queryid aggregate built by pg_stat_monitor_top() */
+typedef struct pgsmTopEntry
+{
+	int64		queryid;		/* hash key - MUST BE FIRST */
+	int64		calls;
+	int64		rows;
+	double		total_time;
+	double		max_time;
+	int64		max_mem;
+	double		sum;			/* sum of the metric, if it is additive */
+	double		value;			/* final value of the metric */
+	dsa_pointer query;			/* text of one of the aggregated entries */
+	bool		query_visible;	/* may the caller see that text? */
+	char	   *query_text;		/* copied out for the winners only */
+} pgsmTopEntry;
+
+/* Contribution of one entry to an additive metric */
+static double
+pgsm_top_metric_sum(pgsmTopMetric metric, const pgsmEntry *entry)
+{
+	const Counters *c = &entry->counters;
+
+	switch (metric)
+	{
+		case PGSM_TOP_TOTAL_PLAN_TIME:
+			return c->plantime.total_time;
+		case PGSM_TOP_SHARED_BLKS_HIT:
+			return (double) c->blocks.shared_blks_hit;
+		case PGSM_TOP_SHARED_BLKS_READ:
+			return (double) c->blocks.shared_blks_read;
+		case PGSM_TOP_TEMP_BLKS_WRITTEN:
+			return (double) c->blocks.temp_blks_written;
+		case PGSM_TOP_CPU_USER_TIME:
+			return c->sysinfo.utime;
+		case PGSM_TOP_CPU_SYS_TIME:
+			return c->sysinfo.stime;
+		case PGSM_TOP_WAL_BYTES:
+			return (double) c->walusage.wal_bytes;
+		default:
+			/* computed from the common aggregates instead */
+			return 0.0;
+	}
+}
+
+/*
+ * The heap comparator is reversed so the top of the heap is the smallest
+ * value kept, which is the one to replace when a larger value shows up.
+ */
+static int
+pgsm_top_cmp(Datum a, Datum b, void *arg)
+{
+	double		va = ((pgsmTopEntry *) DatumGetPointer(a))->value;
+	double		vb = ((pgsmTopEntry *) DatumGetPointer(b))->value;
+
+	if (va > vb)
+		return -1;
+	if (va < vb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Return the top n queryids by the given metric, aggregated over the given
+ * number of most recent buckets, or over all buckets if that is NULL.
+ *
+ * The candidates are ranked with a bounded heap of n entries and query
+ * texts are only copied for the ones that made it into the result.
+ */
+Datum
+pg_stat_monitor_top(PG_FUNCTION_ARGS)
+{
+	bool		may_read_all_stats;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pgsmTopMetric metric;
+	char	   *metric_name;
+	int			n;
+	int			nbuckets;
+	uint64		current_bucket;
+	uint64		max_buckets;
+	TimestampTz now;
+	pgsmSharedState *pgsm;
+	HASHCTL		info;
+	HTAB	   *agg;
+	HASH_SEQ_STATUS hstat;
+	pgsmHashSeqStatus hseq;
+	pgsmEntry  *entry;
+	pgsmTopEntry *top;
+	binaryheap *heap;
+	pgsmTopEntry **winners;
+	int			nwinners;
+	int			i;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_top: Must be loaded via shared_preload_libraries."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_top", &tupstore);
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		return (Datum) 0;
+
+	metric_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	for (i = 0; i < lengthof(pgsm_top_metrics); i++)
+	{
+		if (strcmp(metric_name, pgsm_top_metrics[i].name) == 0)
+			break;
+	}
+	if (i == lengthof(pgsm_top_metrics))
+		ereport(ERROR,
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_top: Unknown metric \"%s\".", metric_name));
+	metric = pgsm_top_metrics[i].metric;
+
+	n = PG_GETARG_INT32(1);
+	if (n < 1)
+		ereport(ERROR,
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_top: Number of rows must be positive."));
+
+	/* All buckets of the ring by default */
+	nbuckets = PG_ARGISNULL(2) ? PGSM_MAX_BUCKETS : PG_GETARG_INT32(2);
+	if (nbuckets < 1)
+		ereport(ERROR,
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_top: Number of buckets must be positive."));
+
+	may_read_all_stats = is_member_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(int64);
+	info.entrysize = sizeof(pgsmTopEntry);
+	info.hcxt = CurrentMemoryContext;
+	agg = hash_create("pg_stat_monitor top", 256, &info,
+					  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	pgsm = pgsm_get_ss();
+	now = GetCurrentTimestamp();
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	current_bucket = pg_atomic_read_u64(&pgsm->current_bucket_id);
+	max_buckets = pgsm->settings.max_buckets;
+
+	/* Aggregate the requested buckets per queryid */
+	hash_entry_seq_init(&hseq);
+	while ((entry = hash_entry_seq_next(&hseq)) != NULL)
+	{
+		uint64		age;
+		bool		found;
+		bool		visible;
+
+		/* Number of rotations since the entry's bucket was current */
+		if (entry->key.bucket_id >= max_buckets)
+			continue;
+		age = (current_bucket + max_buckets - entry->key.bucket_id) % max_buckets;
+		if (age >= nbuckets || !IsBucketValid(entry->key.bucket_id, now))
+			continue;
+
+		top = hash_search(agg, &entry->key.queryid, HASH_ENTER, &found);
+		if (!found)
+		{
+			memset((char *) top + sizeof(int64), 0, sizeof(pgsmTopEntry) - sizeof(int64));
+			top->query = InvalidDsaPointer;
+		}
+
+		visible = may_read_all_stats || entry->key.userid == GetUserId();
+		if (!DsaPointerIsValid(top->query) || (visible && !top->query_visible))
+		{
+			top->query = entry->query;
+			top->query_visible = visible;
+		}
+
+		SpinLockAcquire(&entry->mutex);
+		top->calls += entry->counters.calls.calls;
+		top->rows += entry->counters.calls.rows;
+		top->total_time += entry->counters.time.total_time;
+		top->max_time = Max(top->max_time, entry->counters.time.max_time);
+		if (entry->counters.mem.calls > 0)
+			top->max_mem = Max(top->max_mem, entry->counters.mem.max_bytes);
+		top->sum += pgsm_top_metric_sum(metric, entry);
+		SpinLockRelease(&entry->mutex);
+	}
+
+	/*
+	 * Keep the n largest values in a heap whose top is the smallest kept.
+	 * There can be no more winners than queryids, whatever n the caller
+	 * asked for.
+	 */
+	n = Min(n, Max(hash_get_num_entries(agg), 1));
+	heap = binaryheap_allocate(n, pgsm_top_cmp, NULL);
+	hash_seq_init(&hstat, agg);
+	while ((top = hash_seq_search(&hstat)) != NULL)
+	{
+		switch (metric)
+		{
+			case PGSM_TOP_CALLS:
+				top->value = (double) top->calls;
+				break;
+			case PGSM_TOP_TOTAL_EXEC_TIME:
+				top->value = top->total_time;
+				break;
+			case PGSM_TOP_MEAN_EXEC_TIME:
+				top->value = top->calls > 0 ? top->total_time / top->calls : 0.0;
+				break;
+			case PGSM_TOP_MAX_EXEC_TIME:
+				top->value = top->max_time;
+				break;
+			case PGSM_TOP_ROWS:
+				top->value = (double) top->rows;
+				break;
+			case PGSM_TOP_MAX_EXEC_MEM:
+				top->value = (double) top->max_mem;
+				break;
+			default:
+				top->value = top->sum;
+				break;
+		}
+
+		if (heap->bh_size < n)
+			binaryheap_add(heap, PointerGetDatum(top));
+		else if (top->value > ((pgsmTopEntry *) DatumGetPointer(binaryheap_first(heap)))->value)
+			binaryheap_replace_first(heap, PointerGetDatum(top));
+	}
+
+	/* Pop smallest first, fetching the texts while the lock is still held */
+	nwinners = heap->bh_size;
+	winners = palloc(sizeof(pgsmTopEntry *) * Max(nwinners, 1));
+	for (i = nwinners - 1; i >= 0; i--)
+	{
+		top = (pgsmTopEntry *) DatumGetPointer(binaryheap_remove_first(heap));
+
+		if (!top->query_visible)
+			top->query_text = "<insufficient privilege>";
+		else if (DsaPointerIsValid(top->query))
+			top->query_text = pstrdup(dsa_get_address(get_dsa_area_for_query_text(), top->query));
+		else
+			top->query_text = "Query string not available";
+		winners[i] = top;
+	}
+
+	pgsm_lock_release(pgsm);
+
+	for (i = 0; i < nwinners; i++)
+	{
+		Datum		values[8] = {0};
+		bool		nulls[8] = {0};
+		int			j = 0;
+
+		top = winners[i];
+		values[j++] = Int64GetDatum(top->queryid);
+		values[j++] = CStringGetTextDatum(top->query_text);
+		values[j++] = Int64GetDatum(top->calls);
+		values[j++] = Float8GetDatum(top->total_time);
+		values[j++] = Float8GetDatum(top->calls > 0 ? top->total_time / top->calls : 0.0);
+		values[j++] = Float8GetDatum(top->max_time);
+		values[j++] = Int64GetDatum(top->rows);
+		values[j++] = Float8GetDatum(top->value);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	binaryheap_free(heap);
+	hash_destroy(agg);
+
+	return (Datum) 0;
+}
+
+static int
+pgsm_cmp_int64(const void *a, const void *b)
+{
+	int64		va = *(const int64 *) a;
+	int64		vb = *(const int64 *) b;
+
+	if (va < vb)
+		return -1;
+	if (va > vb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Response time histograms of the given queryids in one bucket, summed over
+ * all entries of each queryid, ordered by queryid.  Ranges are returned as
+ * float8 bounds in milliseconds, the last upper bound being infinity.
+ *
+ * Only the hash keys are compared while scanning, no query text or other
+ * column is looked at.
+ */
+Datum
+pg_stat_monitor_histogram(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	int64		bucket = PG_GETARG_INT64(0);
+	ArrayType  *arr = PG_GETARG_ARRAYTYPE_P(1);
+	Datum	   *elems;
+	bool	   *elem_nulls;
+	int			nelems;
+	int64	   *queryids;
+	int			nqueryids = 0;
+	int64		(*freqs)[MAX_RESPONSE_BUCKET + 2];
+	bool	   *found;
+	pgsmSharedState *pgsm;
+	pgsmHistogram cache = {0};
+	pgsmHistogram hist;
+	pgsmHashSeqStatus hstat;
+	pgsmEntry  *entry;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_histogram: Must be loaded via shared_preload_libraries."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_histogram", &tupstore);
+
+	if (bucket < 0 || bucket >= pgsm_bucket_count() ||
+		!IsBucketValid(bucket, GetCurrentTimestamp()))
+		return (Datum) 0;
+
+	deconstruct_array(arr, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE,
+					  &elems, &elem_nulls, &nelems);
+
+	queryids = palloc(sizeof(int64) * Max(nelems, 1));
+	for (int i = 0; i < nelems; i++)
+	{
+		if (!elem_nulls[i])
+			queryids[nqueryids++] = DatumGetInt64(elems[i]);
+	}
+	if (nqueryids == 0)
+		return (Datum) 0;
+
+	qsort(queryids, nqueryids, sizeof(int64), pgsm_cmp_int64);
+	nqueryids = qunique(queryids, nqueryids, sizeof(int64), pgsm_cmp_int64);
+
+	freqs = palloc0(sizeof(*freqs) * nqueryids);
+	found = palloc0(sizeof(bool) * nqueryids);
+
+	pgsm = pgsm_get_ss();
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	hist = *pgsm_bucket_histogram(pgsm, bucket, &cache);
+
+	hash_entry_seq_init(&hstat);
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		int64	   *match;
+		int			q;
+
+		if (entry->key.bucket_id != bucket)
+			continue;
+
+		match = bsearch(&entry->key.queryid, queryids, nqueryids,
+						sizeof(int64), pgsm_cmp_int64);
+		if (match == NULL)
+			continue;
+
+		q = match - queryids;
+		found[q] = true;
+
+		SpinLockAcquire(&entry->mutex);
+		/* Zero calls are reported as one call, see pgsm_form_values() */
+		if (entry->counters.calls.calls == 0)
+			freqs[q][0]++;
+		for (int b = 0; b < hist.count_total; b++)
+			freqs[q][b] += entry->counters.resp_calls[b];
+		SpinLockRelease(&entry->mutex);
+	}
+
+	pgsm_lock_release(pgsm);
+
+	for (int q = 0; q < nqueryids; q++)
+	{
+		if (!found[q])
+			continue;
+
+		for (int b = 0; b < hist.count_total; b++)
+		{
+			Datum		values[5];
+			bool		nulls[5] = {0};
+
+			values[0] = Int64GetDatum(queryids[q]);
+			values[1] = Int32GetDatum(b);
+			values[2] = Float8GetDatum(b > 0 ? hist.timings[b - 1] : 0.0);
+			values[3] = Float8GetDatum(hist.timings[b]);
+			values[4] = Int64GetDatum(freqs[q][b]);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/* Columns pg_stat_monitor_rollup() can group by */
+typedef enum pgsmRollupGroup
+{
+	PGSM_ROLLUP_QUERYID,
+	PGSM_ROLLUP_PGSM_QUERY_ID,
+	PGSM_ROLLUP_DBID,
+	PGSM_ROLLUP_USERID,
+	PGSM_ROLLUP_APPID
+} pgsmRollupGroup;
+
+static const struct
+{
+	const char *name;
+	pgsmRollupGroup group;
+}			pgsm_rollup_groups[] =
+{
+	{"queryid", PGSM_ROLLUP_QUERYID},
+	{"pgsm_query_id", PGSM_ROLLUP_PGSM_QUERY_ID},
+	{"dbid", PGSM_ROLLUP_DBID},
+	{"userid", PGSM_ROLLUP_USERID},
+	{"appid", PGSM_ROLLUP_APPID},
+};
+
+/* Per group aggregate built by pg_stat_monitor_rollup() */
+typedef struct pgsmRollupEntry
+{
+	int64		key;			/* hash key - MUST BE FIRST */
+	int64		queryid;
+	int64		pgsm_query_id;
+	Oid			dbid;
+	Oid			userid;
+	char		datname[NAMEDATALEN];
+	char		username[NAMEDATALEN];
+	Counters	counters;		/* combined counters of the group */
+	dsa_pointer query;			/* text of one of the aggregated entries */
+	bool		query_visible;	/* may the caller see that text? */
+	char	   *query_text;
+} pgsmRollupEntry;
+
+#define PG_STAT_MONITOR_ROLLUP_COLS	37
+
+static int64
+pgsm_rollup_key(pgsmRollupGroup group, const pgsmEntry *entry)
+{
+	switch (group)
+	{
+		case PGSM_ROLLUP_PGSM_QUERY_ID:
+			return entry->pgsm_query_id;
+		case PGSM_ROLLUP_DBID:
+			return (int64) entry->key.dbid;
+		case PGSM_ROLLUP_USERID:
+			return (int64) entry->key.userid;
+		case PGSM_ROLLUP_APPID:
+			return entry->key.appid;
+		default:
+			return entry->key.queryid;
+	}
+}
+
+/*
+ * Merge the entries of all buckets started within [from_bucket_time,
+ * to_bucket_time] into one row per group_by value.  Either bound may be NULL
+ * to leave that side open.
+ *
+ * Counters are combined as aggregates rather than as single samples, so mean
+ * and standard deviation of the result are those of all calls in the group.
+ * Columns that are not determined by the group are NULL.
+ */
+Datum
+pg_stat_monitor_rollup(PG_FUNCTION_ARGS)
+{
+	bool		may_read_all_stats;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	TimestampTz from_time = DT_NOBEGIN;
+	TimestampTz to_time = DT_NOEND;
+	pgsmRollupGroup group = PGSM_ROLLUP_QUERYID;
+	bool		with_query;
+	TimestampTz now;
+	pgsmSharedState *pgsm;
+	pgsmHistogram cache = {0};
+	pgsmHistogram hist;
+	HASHCTL		info;
+	HTAB	   *agg;
+	HASH_SEQ_STATUS hstat;
+	pgsmHashSeqStatus hseq;
+	pgsmEntry  *entry;
+	pgsmRollupEntry *roll;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_rollup: Must be loaded via shared_preload_libraries."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_rollup", &tupstore);
+	if (tupdesc->natts != PG_STAT_MONITOR_ROLLUP_COLS)
+		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_rollup: Incorrect number of output arguments, received %d, required %d.",
+			 tupdesc->natts, PG_STAT_MONITOR_ROLLUP_COLS);
+
+	if (!PG_ARGISNULL(0))
+		from_time = PG_GETARG_TIMESTAMPTZ(0);
+	if (!PG_ARGISNULL(1))
+		to_time = PG_GETARG_TIMESTAMPTZ(1);
+	if (!PG_ARGISNULL(2))
+	{
+		char	   *name = text_to_cstring(PG_GETARG_TEXT_PP(2));
+		int			i;
+
+		for (i = 0; i < lengthof(pgsm_rollup_groups); i++)
+		{
+			if (strcmp(name, pgsm_rollup_groups[i].name) == 0)
+				break;
+		}
+		if (i == lengthof(pgsm_rollup_groups))
+			ereport(ERROR,
+					errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					errmsg("[pg_stat_monitor] pg_stat_monitor_rollup: Unknown group \"%s\".", name),
+					errhint("Valid groups are queryid, pgsm_query_id, dbid, userid and appid."));
+		group = pgsm_rollup_groups[i].group;
+	}
+	with_query = (group == PGSM_ROLLUP_QUERYID || group == PGSM_ROLLUP_PGSM_QUERY_ID);
+
+	may_read_all_stats = is_member_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(int64);
+	info.entrysize = sizeof(pgsmRollupEntry);
+	info.hcxt = CurrentMemoryContext;
+	agg = hash_create("pg_stat_monitor rollup", 256, &info,
+					  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	pgsm = pgsm_get_ss();
+	now = GetCurrentTimestamp();
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	/* Histograms of buckets with other settings are added to this one */
+	hist = pgsm->histogram;
+
+	hash_entry_seq_init(&hseq);
+	while ((entry = hash_entry_seq_next(&hseq)) != NULL)
+	{
+		TimestampTz bucket_start = pgsm->bucket_start_time[entry->key.bucket_id];
+		Counters	tmp;
+		int64		key;
+		bool		found;
+		bool		visible;
+
+		if (bucket_start < from_time || bucket_start > to_time ||
+			!IsBucketValid(entry->key.bucket_id, now))
+			continue;
+
+		key = pgsm_rollup_key(group, entry);
+		roll = hash_search(agg, &key, HASH_ENTER, &found);
+		if (!found)
+		{
+			memset((char *) roll + sizeof(int64), 0, sizeof(pgsmRollupEntry) - sizeof(int64));
+			roll->queryid = entry->key.queryid;
+			roll->pgsm_query_id = entry->pgsm_query_id;
+			roll->dbid = entry->key.dbid;
+			roll->userid = entry->key.userid;
+			strlcpy(roll->datname, entry->datname, NAMEDATALEN);
+			strlcpy(roll->username, entry->username, NAMEDATALEN);
+			roll->query = InvalidDsaPointer;
+		}
+
+		visible = may_read_all_stats || entry->key.userid == GetUserId();
+		if (!DsaPointerIsValid(roll->query) || (visible && !roll->query_visible))
+		{
+			roll->query = entry->query;
+			roll->query_visible = visible;
+		}
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = entry->counters;
+		SpinLockRelease(&entry->mutex);
+
+		/* Zero calls are reported as one call, see pgsm_form_values() */
+		if (tmp.calls.calls == 0)
+		{
+			tmp.calls.calls++;
+			tmp.resp_calls[0]++;
+		}
+		pgsm_histogram_convert(tmp.resp_calls,
+							   pgsm_bucket_histogram(pgsm, entry->key.bucket_id, &cache),
+							   &hist);
+
+		if (!found)
+			strlcpy(roll->counters.info.application_name, tmp.info.application_name, NAMEDATALEN);
+		pgsm_combine_counters(&roll->counters, &tmp);
+	}
+
+	/* Fetch the texts while the lock is still held */
+	if (with_query)
+	{
+		hash_seq_init(&hstat, agg);
+		while ((roll = hash_seq_search(&hstat)) != NULL)
+		{
+			if (!roll->query_visible)
+				roll->query_text = "<insufficient privilege>";
+			else if (DsaPointerIsValid(roll->query))
+				roll->query_text = pstrdup(dsa_get_address(get_dsa_area_for_query_text(), roll->query));
+			else
+				roll->query_text = "Query string not available";
+		}
+	}
+
+	pgsm_lock_release(pgsm);
+
+	hash_seq_init(&hstat, agg);
+	while ((roll = hash_seq_search(&hstat)) != NULL)
+	{
+		Datum		values[PG_STAT_MONITOR_ROLLUP_COLS] = {0};
+		bool		nulls[PG_STAT_MONITOR_ROLLUP_COLS] = {0};
+		Counters   *c = &roll->counters;
+		Datum	   *resp;
+		char		buf[256];
+		int			i = 0;
+
+		/* queryid, pgsm_query_id */
+		values[i] = Int64GetDatum(roll->queryid);
+		nulls[i++] = (group != PGSM_ROLLUP_QUERYID);
+		values[i] = Int64GetDatum(roll->pgsm_query_id);
+		nulls[i++] = !with_query;
+
+		/* dbid, datname */
+		values[i] = ObjectIdGetDatum(roll->dbid);
+		nulls[i++] = (group != PGSM_ROLLUP_DBID);
+		values[i] = CStringGetTextDatum(roll->datname);
+		nulls[i++] = (group != PGSM_ROLLUP_DBID);
+
+		/* userid, username */
+		values[i] = ObjectIdGetDatum(roll->userid);
+		nulls[i++] = (group != PGSM_ROLLUP_USERID);
+		values[i] = CStringGetTextDatum(roll->username);
+		nulls[i++] = (group != PGSM_ROLLUP_USERID);
+
+		/* application_name */
+		if (group == PGSM_ROLLUP_APPID && c->info.application_name[0])
+			values[i++] = CStringGetTextDatum(c->info.application_name);
+		else
+			nulls[i++] = true;
+
+		/* query */
+		if (with_query)
+			values[i++] = CStringGetTextDatum(roll->query_text);
+		else
+			nulls[i++] = true;
+
+		values[i++] = Int64GetDatumFast(c->calls.calls);
+		values[i++] = Float8GetDatumFast(c->time.total_time);
+		values[i++] = Float8GetDatumFast(c->time.min_time);
+		values[i++] = Float8GetDatumFast(c->time.max_time);
+		values[i++] = Float8GetDatumFast(c->time.mean_time);
+		values[i++] = Float8GetDatum(c->calls.calls > 0 ?
+									 sqrt(c->time.sum_var_time / c->calls.calls) : 0.0);
+		values[i++] = Int64GetDatumFast(c->calls.rows);
+
+		values[i++] = Int64GetDatumFast(c->plancalls.calls);
+		values[i++] = Float8GetDatumFast(c->plantime.total_time);
+		values[i++] = Float8GetDatumFast(c->plantime.min_time);
+		values[i++] = Float8GetDatumFast(c->plantime.max_time);
+		values[i++] = Float8GetDatumFast(c->plantime.mean_time);
+		values[i++] = Float8GetDatum(c->plancalls.calls > 0 ?
+									 sqrt(c->plantime.sum_var_time / c->plancalls.calls) : 0.0);
+
+		values[i++] = Int64GetDatumFast(c->blocks.shared_blks_hit);
+		values[i++] = Int64GetDatumFast(c->blocks.shared_blks_read);
+		values[i++] = Int64GetDatumFast(c->blocks.shared_blks_dirtied);
+		values[i++] = Int64GetDatumFast(c->blocks.shared_blks_written);
+		values[i++] = Int64GetDatumFast(c->blocks.local_blks_hit);
+		values[i++] = Int64GetDatumFast(c->blocks.local_blks_read);
+		values[i++] = Int64GetDatumFast(c->blocks.local_blks_dirtied);
+		values[i++] = Int64GetDatumFast(c->blocks.local_blks_written);
+		values[i++] = Int64GetDatumFast(c->blocks.temp_blks_read);
+		values[i++] = Int64GetDatumFast(c->blocks.temp_blks_written);
+
+		values[i++] = Float8GetDatumFast(c->sysinfo.utime);
+		values[i++] = Float8GetDatumFast(c->sysinfo.stime);
+
+		values[i++] = Int64GetDatumFast(c->walusage.wal_records);
+		values[i++] = Int64GetDatumFast(c->walusage.wal_fpi);
+		snprintf(buf, sizeof(buf), UINT64_FORMAT, c->walusage.wal_bytes);
+		values[i++] = DirectFunctionCall3(numeric_in,
+										  CStringGetDatum(buf),
+										  ObjectIdGetDatum(0),
+										  Int32GetDatum(-1));
+
+		resp = palloc(sizeof(Datum) * hist.count_total);
+		for (int b = 0; b < hist.count_total; b++)
+			resp[b] = Int64GetDatum((int64) c->resp_calls[b]);
+		values[i++] = PointerGetDatum(construct_array(resp, hist.count_total, INT8OID,
+													  sizeof(int64), FLOAT8PASSBYVAL,
+													  TYPALIGN_DOUBLE));
+
+		Assert(i == PG_STAT_MONITOR_ROLLUP_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	hash_destroy(agg);
+
+	return (Datum) 0;
+}
+
+/* Labels pg_stat_monitor_metrics() can attach to each series */
+#define PGSM_LABEL_QUERYID		(1 << 0)
+#define PGSM_LABEL_DATNAME		(1 << 1)
+#define PGSM_LABEL_USERNAME		(1 << 2)
+#define PGSM_LABEL_APPNAME		(1 << 3)
+
+static const struct
+{
+	const char *name;
+	bits32		label;
+}			pgsm_metrics_labels[] =
+{
+	{"queryid", PGSM_LABEL_QUERYID},
+	{"datname", PGSM_LABEL_DATNAME},
+	{"username", PGSM_LABEL_USERNAME},
+	{"appname", PGSM_LABEL_APPNAME},
+};
+
+/* Gauges exposed by pg_stat_monitor_metrics(), besides the histogram */
+typedef enum pgsmMetric
+{
+	PGSM_METRIC_CALLS,
+	PGSM_METRIC_ROWS,
+	PGSM_METRIC_PLAN_TIME,
+	PGSM_METRIC_SHARED_BLKS_HIT,
+	PGSM_METRIC_SHARED_BLKS_READ,
+	PGSM_METRIC_TEMP_BLKS_WRITTEN,
+	PGSM_METRIC_CPU_USER_TIME,
+	PGSM_METRIC_CPU_SYS_TIME,
+	PGSM_METRIC_WAL_BYTES
+} pgsmMetric;
+
+static const struct
+{
+	const char *name;
+	const char *unit;
+	const char *help;
+	pgsmMetric	metric;
+}			pgsm_metrics_gauges[] =
+{
+	{"pg_stat_monitor_calls", NULL, "Number of times executed.", PGSM_METRIC_CALLS},
+	{"pg_stat_monitor_rows", NULL, "Number of rows retrieved or affected.", PGSM_METRIC_ROWS},
+	{"pg_stat_monitor_plan_time_seconds", "seconds", "Time spent planning.", PGSM_METRIC_PLAN_TIME},
+	{"pg_stat_monitor_shared_blks_hit", NULL, "Number of shared block cache hits.", PGSM_METRIC_SHARED_BLKS_HIT},
+	{"pg_stat_monitor_shared_blks_read", NULL, "Number of shared blocks read.", PGSM_METRIC_SHARED_BLKS_READ},
+	{"pg_stat_monitor_temp_blks_written", NULL, "Number of temp blocks written.", PGSM_METRIC_TEMP_BLKS_WRITTEN},
+	{"pg_stat_monitor_cpu_user_time_seconds", "seconds", "CPU user time.", PGSM_METRIC_CPU_USER_TIME},
+	{"pg_stat_monitor_cpu_sys_time_seconds", "seconds", "CPU system time.", PGSM_METRIC_CPU_SYS_TIME},
+	{"pg_stat_monitor_wal_bytes", "bytes", "Amount of WAL generated.", PGSM_METRIC_WAL_BYTES},
+};
+
+typedef struct pgsmMetricsKey
+{
+	int64		queryid;
+	int64		appid;
+	Oid			dbid;
+	Oid			userid;
+} pgsmMetricsKey;
+
+/* Per series aggregate built by pg_stat_monitor_metrics() */
+typedef struct pgsmMetricsEntry
+{
+	pgsmMetricsKey key;			/* hash key - MUST BE FIRST */
+	char	   *labels;			/* formatted label set, without braces */
+	char		datname[NAMEDATALEN];
+	char		username[NAMEDATALEN];
+	Counters	counters;		/* combined counters of the series */
+} pgsmMetricsEntry;
+
+static double
+pgsm_metrics_value(pgsmMetric metric, const Counters *c)
+{
+	switch (metric)
+	{
+		case PGSM_METRIC_CALLS:
+			return (double) c->calls.calls;
+		case PGSM_METRIC_ROWS:
+			return (double) c->calls.rows;
+		case PGSM_METRIC_PLAN_TIME:
+			return c->plantime.total_time / 1000.0;
+		case PGSM_METRIC_SHARED_BLKS_HIT:
+			return (double) c->blocks.shared_blks_hit;
+		case PGSM_METRIC_SHARED_BLKS_READ:
+			return (double) c->blocks.shared_blks_read;
+		case PGSM_METRIC_TEMP_BLKS_WRITTEN:
+			return (double) c->blocks.temp_blks_written;
+		case PGSM_METRIC_CPU_USER_TIME:
+			return c->sysinfo.utime / 1000.0;
+		case PGSM_METRIC_CPU_SYS_TIME:
+			return c->sysinfo.stime / 1000.0;
+		case PGSM_METRIC_WAL_BYTES:
+			return (double) c->walusage.wal_bytes;
+	}
+
+	return 0.0;
+}
+
+/* Append name="value", escaping the value as OpenMetrics requires */
+static void
+pgsm_metrics_append_label(StringInfo buf, const char *name, const char *value)
+{
+	if (buf->len > 0)
+		appendStringInfoChar(buf, ',');
+	appendStringInfo(buf, "%s=\"", name);
+	for (const char *p = value; *p; p++)
+	{
+		if (*p == '\\')
+			appendStringInfoString(buf, "\\\\");
+		else if (*p == '"')
+			appendStringInfoString(buf, "\\\"");
+		else if (*p == '\n')
+			appendStringInfoString(buf, "\\n");
+		else
+			appendStringInfoChar(buf, *p);
+	}
+	appendStringInfoChar(buf, '"');
+}
+
+static void
+pgsm_metrics_append_sample(StringInfo buf, const char *name, const char *suffix,
+						   const char *labels, const char *extra, const char *value)
+{
+	appendStringInfo(buf, "%s%s", name, suffix);
+	if (labels[0] || extra)
+	{
+		appendStringInfoChar(buf, '{');
+		appendStringInfoString(buf, labels);
+		if (labels[0] && extra)
+			appendStringInfoChar(buf, ',');
+		if (extra)
+			appendStringInfoString(buf, extra);
+		appendStringInfoChar(buf, '}');
+	}
+	appendStringInfo(buf, " %s\n", value);
+}
+
+/*
+ * Return the statistics of the given number of most recent buckets, or of
+ * all buckets if that is NULL, in the OpenMetrics text format.  One series
+ * is returned per distinct combination of the requested labels.
+ *
+ * The values cover a window of buckets and drop when a bucket is recycled,
+ * so they are exposed as gauges and the response times as a gaugehistogram
+ * built from resp_calls, with the histogram boundaries as le values.
+ */
+Datum
+pg_stat_monitor_metrics(PG_FUNCTION_ARGS)
+{
+	int			nbuckets;
+	bits32		labels = 0;
+	uint64		current_bucket;
+	uint64		max_buckets;
+	TimestampTz now;
+	pgsmSharedState *pgsm;
+	pgsmHistogram cache = {0};
+	pgsmHistogram histogram;
+	HASHCTL		info;
+	HTAB	   *agg;
+	HASH_SEQ_STATUS hstat;
+	pgsmHashSeqStatus hseq;
+	pgsmEntry  *entry;
+	pgsmMetricsEntry *series;
+	pgsmMetricsEntry **all;
+	int			nseries;
+	StringInfoData buf;
+	const char *hist = "pg_stat_monitor_exec_time_seconds";
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_metrics: Must be loaded via shared_preload_libraries."));
+
+	/* All buckets of the ring by default */
+	nbuckets = PG_ARGISNULL(0) ? PGSM_MAX_BUCKETS : PG_GETARG_INT32(0);
+	if (nbuckets < 1)
+		ereport(ERROR,
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_metrics: Number of buckets must be positive."));
+
+	if (!PG_ARGISNULL(1))
+	{
+		Datum	   *elems;
+		bool	   *elem_nulls;
+		int			nelems;
+
+		deconstruct_array(PG_GETARG_ARRAYTYPE_P(1), TEXTOID, -1, false, TYPALIGN_INT,
+						  &elems, &elem_nulls, &nelems);
+
+		for (int i = 0; i < nelems; i++)
+		{
+			char	   *name;
+			int			j;
+
+			if (elem_nulls[i])
+				continue;
+
+			name = TextDatumGetCString(elems[i]);
+			for (j = 0; j < lengthof(pgsm_metrics_labels); j++)
+			{
+				if (strcmp(name, pgsm_metrics_labels[j].name) == 0)
+					break;
+			}
+			if (j == lengthof(pgsm_metrics_labels))
+				ereport(ERROR,
+						errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("[pg_stat_monitor] pg_stat_monitor_metrics: Unknown label \"%s\".", name),
+						errhint("Valid labels are queryid, datname, username and appname."));
+
+			labels |= pgsm_metrics_labels[j].label;
+			pfree(name);
+		}
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgsmMetricsKey);
+	info.entrysize = sizeof(pgsmMetricsEntry);
+	info.hcxt = CurrentMemoryContext;
+	agg = hash_create("pg_stat_monitor metrics", 256, &info,
+					  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	pgsm = pgsm_get_ss();
+	now = GetCurrentTimestamp();
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	current_bucket = pg_atomic_read_u64(&pgsm->current_bucket_id);
+	max_buckets = pgsm->settings.max_buckets;
+
+	/* Histograms of buckets with other settings are added to this one */
+	histogram = pgsm->histogram;
+
+	hash_entry_seq_init(&hseq);
+	while ((entry = hash_entry_seq_next(&hseq)) != NULL)
+	{
+		pgsmMetricsKey key;
+		Counters	tmp;
+		uint64		age;
+		bool		found;
+
+		/* Number of rotations since the entry's bucket was current */
+		if (entry->key.bucket_id >= max_buckets)
+			continue;
+		age = (current_bucket + max_buckets - entry->key.bucket_id) % max_buckets;
+		if (age >= nbuckets || !IsBucketValid(entry->key.bucket_id, now))
+			continue;
+
+		memset(&key, 0, sizeof(key));
+		if (labels & PGSM_LABEL_QUERYID)
+			key.queryid = entry->key.queryid;
+		if (labels & PGSM_LABEL_APPNAME)
+			key.appid = entry->key.appid;
+		if (labels & PGSM_LABEL_DATNAME)
+			key.dbid = entry->key.dbid;
+		if (labels & PGSM_LABEL_USERNAME)
+			key.userid = entry->key.userid;
+
+		series = hash_search(agg, &key, HASH_ENTER, &found);
+		if (!found)
+		{
+			memset((char *) series + sizeof(key), 0, sizeof(pgsmMetricsEntry) - sizeof(key));
+			strlcpy(series->datname, entry->datname, NAMEDATALEN);
+			strlcpy(series->username, entry->username, NAMEDATALEN);
+		}
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = entry->counters;
+		SpinLockRelease(&entry->mutex);
+
+		/* Zero calls are reported as one call, see pgsm_form_values() */
+		if (tmp.calls.calls == 0)
+		{
+			tmp.calls.calls++;
+			tmp.resp_calls[0]++;
+		}
+		pgsm_histogram_convert(tmp.resp_calls,
+							   pgsm_bucket_histogram(pgsm, entry->key.bucket_id, &cache),
+							   &histogram);
+
+		if (!found)
+			strlcpy(series->counters.info.application_name, tmp.info.application_name, NAMEDATALEN);
+		pgsm_combine_counters(&series->counters, &tmp);
+	}
+
+	pgsm_lock_release(pgsm);
+
+	/* Format the label set of every series once */
+	nseries = hash_get_num_entries(agg);
+	all = palloc(sizeof(pgsmMetricsEntry *) * Max(nseries, 1));
+	nseries = 0;
+	hash_seq_init(&hstat, agg);
+	while ((series = hash_seq_search(&hstat)) != NULL)
+	{
+		StringInfoData lbuf;
+
+		initStringInfo(&lbuf);
+		if (labels & PGSM_LABEL_QUERYID)
+		{
+			char		id[32];
+
+			snprintf(id, sizeof(id), INT64_FORMAT, series->key.queryid);
+			pgsm_metrics_append_label(&lbuf, "queryid", id);
+		}
+		if (labels & PGSM_LABEL_DATNAME)
+			pgsm_metrics_append_label(&lbuf, "datname", series->datname);
+		if (labels & PGSM_LABEL_USERNAME)
+			pgsm_metrics_append_label(&lbuf, "username", series->username);
+		if (labels & PGSM_LABEL_APPNAME)
+			pgsm_metrics_append_label(&lbuf, "appname", series->counters.info.application_name);
+		series->labels = lbuf.data;
+		all[nseries++] = series;
+	}
+
+	initStringInfo(&buf);
+
+	for (int m = 0; m < lengthof(pgsm_metrics_gauges); m++)
+	{
+		const char *name = pgsm_metrics_gauges[m].name;
+
+		appendStringInfo(&buf, "# TYPE %s gauge\n", name);
+		if (pgsm_metrics_gauges[m].unit)
+			appendStringInfo(&buf, "# UNIT %s %s\n", name, pgsm_metrics_gauges[m].unit);
+		appendStringInfo(&buf, "# HELP %s %s\n", name, pgsm_metrics_gauges[m].help);
+
+		for (int s = 0; s < nseries; s++)
+			pgsm_metrics_append_sample(&buf, name, "", all[s]->labels, NULL,
+									   float8out_internal(pgsm_metrics_value(pgsm_metrics_gauges[m].metric,
+																			 &all[s]->counters)));
+	}
+
+	appendStringInfo(&buf, "# TYPE %s gaugehistogram\n", hist);
+	appendStringInfo(&buf, "# UNIT %s seconds\n", hist);
+	appendStringInfo(&buf, "# HELP %s Execution time.\n", hist);
+	for (int s = 0; s < nseries; s++)
+	{
+		Counters   *c = &all[s]->counters;
+		int64		cumulative = 0;
+		char		value[32];
+
+		for (int b = 0; b < histogram.count_total; b++)
+		{
+			cumulative += c->resp_calls[b];
+			if (isinf(histogram.timings[b]))
+				continue;
+
+			snprintf(value, sizeof(value), INT64_FORMAT, cumulative);
+			pgsm_metrics_append_sample(&buf, hist, "_bucket", all[s]->labels,
+									   psprintf("le=\"%s\"", float8out_internal(histogram.timings[b] / 1000.0)),
+									   value);
+		}
+
+		/*
+		 * OpenMetrics requires a +Inf bucket in every histogram, whatever the
+		 * upper bound of the last one, and it must agree with _gcount.
+		 */
+		snprintf(value, sizeof(value), INT64_FORMAT, cumulative);
+		pgsm_metrics_append_sample(&buf, hist, "_bucket", all[s]->labels, "le=\"+Inf\"", value);
+		pgsm_metrics_append_sample(&buf, hist, "_gcount", all[s]->labels, NULL, value);
+		pgsm_metrics_append_sample(&buf, hist, "_gsum", all[s]->labels, NULL,
+								   float8out_internal(c->time.total_time / 1000.0));
+	}
+
+	appendStringInfoString(&buf, "# EOF\n");
+
+	hash_destroy(agg);
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
+
+/*
+ * Binary bucket export, as returned by pg_stat_monitor_export() and read by
+ * pg_stat_monitor_decode().  The format does not depend on the server's
+ * architecture or build: all integers are two's complement and all floats
+ * IEEE 754 binary64, both stored in network byte order (big endian), with no
+ * padding.  Format version 3 is laid out as
+ *
+ *	 header							PGSM_EXPORT_HEADER_SIZE bytes
+ *	 key record[nentries]			key_size bytes each
+ *	 counters record[nentries]		counters_size bytes each
+ *	 text dictionary				text_len bytes
+ *
+ * with the sections following each other without gaps.  The header is
+ *
+ *	 offset  size  field
+ *	 0		 4	   magic, the bytes "PGSM"
+ *	 4		 2	   version
+ *	 6		 2	   flags, PGSM_EXPORT_PARTIAL if the bucket was still open
+ *	 8		 2	   header_size
+ *	 10		 2	   hist_buckets, # of resp_calls elements per entry
+ *	 12		 4	   key_size
+ *	 16		 4	   counters_size
+ *	 20		 4	   nentries
+ *	 24		 4	   text_len
+ *	 28		 8	   bucket
+ *	 36		 8	   bucket_start_time, usec since 2000-01-01 00:00 UTC
+ *
+ * The fields of the key and counters records are listed, in order, by
+ * pgsm_export_put_key() and pgsm_export_put_counters().  Readers must skip
+ * the header and records by their sizes in the header, as a later version
+ * may append fields to them.
+ *
+ * The dictionary holds NUL terminated strings, each distinct text only once,
+ * which the keys refer to by their offset within the dictionary,
+ * PGSM_EXPORT_NO_TEXT meaning none.
+ */
+#define PGSM_EXPORT_MAGIC		0x5047534D	/* "PGSM" */
+#define PGSM_EXPORT_VERSION		3
+#define PGSM_EXPORT_NO_TEXT		PG_UINT32_MAX
+
+/* Flags of the header */
+#define PGSM_EXPORT_PARTIAL		0x0001	/* bucket was still accumulating */
+
+#define PGSM_EXPORT_HEADER_SIZE	44
+#define PGSM_EXPORT_KEY_SIZE	77
+#define PGSM_EXPORT_COUNTERS_SIZE(hist_buckets) (512 + 4 * (hist_buckets))
+
+/* The header of an export, as read by pgsm_export_get_header() */
+typedef struct pgsmExportHeader
+{
+	uint32		magic;
+	uint16		version;
+	uint16		flags;
+	uint16		header_size;
+	uint16		hist_buckets;
+	uint32		key_size;
+	uint32		counters_size;
+	uint32		nentries;
+	uint32		text_len;
+	uint64		bucket;
+	TimestampTz bucket_start_time;
+} pgsmExportHeader;
+
+/* The key record of an entry */
+typedef struct pgsmExportKey
+{
+	int64		queryid;
+	int64		planid;
+	int64		appid;
+	int64		parentid;
+	int64		pgsm_query_id;
+	TimestampTz stats_since;
+	Oid			userid;
+	Oid			dbid;
+	uint32		ip;
+	uint32		query;			/* dictionary offsets */
+	uint32		parent_query;
+	uint32		application_name;
+	int32		cmd_type;
+	bool		toplevel;
+} pgsmExportKey;
+
+/* Hash of a dictionary text, to store every distinct one once */
+typedef struct pgsmExportTextKey
+{
+	uint32		hash;
+	uint32		len;
+} pgsmExportTextKey;
+
+typedef struct pgsmExportText
+{
+	pgsmExportTextKey key;		/* hash key - MUST BE FIRST */
+	uint32		offset;
+} pgsmExportText;
+
+#define PG_STAT_MONITOR_DECODE_COLS	39
+
+static uint32
+pgsm_export_text(StringInfo dict, HTAB *texts, const char *str)
+{
+	pgsmExportTextKey key;
+	pgsmExportText *dtext;
+	bool		found;
+	uint32		offset;
+
+	if (str == NULL)
+		return PGSM_EXPORT_NO_TEXT;
+
+	key.len = strlen(str);
+	key.hash = DatumGetUInt32(hash_any((const unsigned char *) str, key.len));
+
+	dtext = hash_search(texts, &key, HASH_ENTER, &found);
+	if (found && memcmp(dict->data + dtext->offset, str, key.len + 1) == 0)
+		return dtext->offset;
+
+	/* New text, or a hash collision which is just stored twice */
+	offset = dict->len;
+	appendBinaryStringInfo(dict, str, key.len + 1);
+	if (!found)
+		dtext->offset = offset;
+
+	return offset;
+}
+
+static void
+pgsm_export_put_header(StringInfo buf, const pgsmExportHeader *header)
+{
+	pq_sendint32(buf, header->magic);
+	pq_sendint16(buf, header->version);
+	pq_sendint16(buf, header->flags);
+	pq_sendint16(buf, header->header_size);
+	pq_sendint16(buf, header->hist_buckets);
+	pq_sendint32(buf, header->key_size);
+	pq_sendint32(buf, header->counters_size);
+	pq_sendint32(buf, header->nentries);
+	pq_sendint32(buf, header->text_len);
+	pq_sendint64(buf, header->bucket);
+	pq_sendint64(buf, header->bucket_start_time);
+}
+
+/*
+ * Read the header at the start of an export.  Returns false if the data is
+ * too short to hold one, the fields are not validated.
+ */
+static bool
+pgsm_export_get_header(const char *data, Size len, pgsmExportHeader *header)
+{
+	StringInfoData msg;
+
+	if (len < PGSM_EXPORT_HEADER_SIZE)
+		return false;
+
+	msg.data = (char *) data;
+	msg.len = PGSM_EXPORT_HEADER_SIZE;
+	msg.maxlen = PGSM_EXPORT_HEADER_SIZE;
+	msg.cursor = 0;
+
+	header->magic = pq_getmsgint(&msg, 4);
+	header->version = pq_getmsgint(&msg, 2);
+	header->flags = pq_getmsgint(&msg, 2);
+	header->header_size = pq_getmsgint(&msg, 2);
+	header->hist_buckets = pq_getmsgint(&msg, 2);
+	header->key_size = pq_getmsgint(&msg, 4);
+	header->counters_size = pq_getmsgint(&msg, 4);
+	header->nentries = pq_getmsgint(&msg, 4);
+	header->text_len = pq_getmsgint(&msg, 4);
+	header->bucket = (uint64) pq_getmsgint64(&msg);
+	header->bucket_start_time = pq_getmsgint64(&msg);
+
+	return true;
+}
+
+static void
+pgsm_export_put_key(StringInfo buf, const pgsmExportKey *k)
+{
+	pq_sendint64(buf, k->queryid);
+	pq_sendint64(buf, k->planid);
+	pq_sendint64(buf, k->appid);
+	pq_sendint64(buf, k->parentid);
+	pq_sendint64(buf, k->pgsm_query_id);
+	pq_sendint64(buf, k->stats_since);
+	pq_sendint32(buf, k->userid);
+	pq_sendint32(buf, k->dbid);
+	pq_sendint32(buf, k->ip);
+	pq_sendint32(buf, k->query);
+	pq_sendint32(buf, k->parent_query);
+	pq_sendint32(buf, k->application_name);
+	pq_sendint32(buf, k->cmd_type);
+	pq_sendbyte(buf, k->toplevel ? 1 : 0);
+}
+
+static void
+pgsm_export_get_key(StringInfo msg, pgsmExportKey *k)
+{
+	k->queryid = pq_getmsgint64(msg);
+	k->planid = pq_getmsgint64(msg);
+	k->appid = pq_getmsgint64(msg);
+	k->parentid = pq_getmsgint64(msg);
+	k->pgsm_query_id = pq_getmsgint64(msg);
+	k->stats_since = pq_getmsgint64(msg);
+	k->userid = pq_getmsgint(msg, 4);
+	k->dbid = pq_getmsgint(msg, 4);
+	k->ip = pq_getmsgint(msg, 4);
+	k->query = pq_getmsgint(msg, 4);
+	k->parent_query = pq_getmsgint(msg, 4);
+	k->application_name = pq_getmsgint(msg, 4);
+	k->cmd_type = (int32) pq_getmsgint(msg, 4);
+	k->toplevel = pq_getmsgbyte(msg) != 0;
+}
+
+static void
+pgsm_export_put_counters(StringInfo buf, const Counters *c, int hist_buckets)
+{
+	pq_sendint64(buf, c->calls.calls);
+	pq_sendint64(buf, c->calls.rows);
+	pq_sendfloat8(buf, c->time.total_time);
+	pq_sendfloat8(buf, c->time.min_time);
+	pq_sendfloat8(buf, c->time.max_time);
+	pq_sendfloat8(buf, c->time.mean_time);
+	pq_sendfloat8(buf, c->time.sum_var_time);
+	pq_sendint64(buf, c->plancalls.calls);
+	pq_sendint64(buf, c->plancalls.rows);
+	pq_sendfloat8(buf, c->plantime.total_time);
+	pq_sendfloat8(buf, c->plantime.min_time);
+	pq_sendfloat8(buf, c->plantime.max_time);
+	pq_sendfloat8(buf, c->plantime.mean_time);
+	pq_sendfloat8(buf, c->plantime.sum_var_time);
+	pq_sendint64(buf, c->blocks.shared_blks_hit);
+	pq_sendint64(buf, c->blocks.shared_blks_read);
+	pq_sendint64(buf, c->blocks.shared_blks_dirtied);
+	pq_sendint64(buf, c->blocks.shared_blks_written);
+	pq_sendint64(buf, c->blocks.local_blks_hit);
+	pq_sendint64(buf, c->blocks.local_blks_read);
+	pq_sendint64(buf, c->blocks.local_blks_dirtied);
+	pq_sendint64(buf, c->blocks.local_blks_written);
+	pq_sendint64(buf, c->blocks.temp_blks_read);
+	pq_sendint64(buf, c->blocks.temp_blks_written);
+	pq_sendfloat8(buf, c->blocks.shared_blk_read_time);
+	pq_sendfloat8(buf, c->blocks.shared_blk_write_time);
+	pq_sendfloat8(buf, c->blocks.local_blk_read_time);
+	pq_sendfloat8(buf, c->blocks.local_blk_write_time);
+	pq_sendfloat8(buf, c->blocks.temp_blk_read_time);
+	pq_sendfloat8(buf, c->blocks.temp_blk_write_time);
+	pq_sendfloat8(buf, c->sysinfo.utime);
+	pq_sendfloat8(buf, c->sysinfo.stime);
+	pq_sendint64(buf, c->jitinfo.jit_functions);
+	pq_sendfloat8(buf, c->jitinfo.jit_generation_time);
+	pq_sendint64(buf, c->jitinfo.jit_inlining_count);
+	pq_sendfloat8(buf, c->jitinfo.jit_inlining_time);
+	pq_sendint64(buf, c->jitinfo.jit_deform_count);
+	pq_sendfloat8(buf, c->jitinfo.jit_deform_time);
+	pq_sendint64(buf, c->jitinfo.jit_optimization_count);
+	pq_sendfloat8(buf, c->jitinfo.jit_optimization_time);
+	pq_sendint64(buf, c->jitinfo.jit_emission_count);
+	pq_sendfloat8(buf, c->jitinfo.jit_emission_time);
+	pq_sendint64(buf, c->walusage.wal_records);
+	pq_sendint64(buf, c->walusage.wal_fpi);
+	pq_sendint64(buf, c->walusage.wal_bytes);
+	pq_sendint64(buf, c->walusage.wal_buffers_full);
+	pq_sendint64(buf, c->parallel_workers_to_launch);
+	pq_sendint64(buf, c->parallel_workers_launched);
+	pq_sendint64(buf, c->generic_plan_calls);
+	pq_sendint64(buf, c->custom_plan_calls);
+	pq_sendint64(buf, c->mem.calls);
+	pq_sendint64(buf, c->mem.min_bytes);
+	pq_sendint64(buf, c->mem.max_bytes);
+	pq_sendfloat8(buf, c->mem.mean_bytes);
+	for (int b = 0; b < PGSM_MEM_HIST_BUCKETS; b++)
+		pq_sendint32(buf, c->mem.hist_calls[b]);
+	for (int b = 0; b < hist_buckets; b++)
+		pq_sendint32(buf, c->resp_calls[b]);
+}
+
+static void
+pgsm_export_get_counters(StringInfo msg, Counters *c, int hist_buckets)
+{
+	c->calls.calls = pq_getmsgint64(msg);
+	c->calls.rows = pq_getmsgint64(msg);
+	c->time.total_time = pq_getmsgfloat8(msg);
+	c->time.min_time = pq_getmsgfloat8(msg);
+	c->time.max_time = pq_getmsgfloat8(msg);
+	c->time.mean_time = pq_getmsgfloat8(msg);
+	c->time.sum_var_time = pq_getmsgfloat8(msg);
+	c->plancalls.calls = pq_getmsgint64(msg);
+	c->plancalls.rows = pq_getmsgint64(msg);
+	c->plantime.total_time = pq_getmsgfloat8(msg);
+	c->plantime.min_time = pq_getmsgfloat8(msg);
+	c->plantime.max_time = pq_getmsgfloat8(msg);
+	c->plantime.mean_time = pq_getmsgfloat8(msg);
+	c->plantime.sum_var_time = pq_getmsgfloat8(msg);
+	c->blocks.shared_blks_hit = pq_getmsgint64(msg);
+	c->blocks.shared_blks_read = pq_getmsgint64(msg);
+	c->blocks.shared_blks_dirtied = pq_getmsgint64(msg);
+	c->blocks.shared_blks_written = pq_getmsgint64(msg);
+	c->blocks.local_blks_hit = pq_getmsgint64(msg);
+	c->blocks.local_blks_read = pq_getmsgint64(msg);
+	c->blocks.local_blks_dirtied = pq_getmsgint64(msg);
+	c->blocks.local_blks_written = pq_getmsgint64(msg);
+	c->blocks.temp_blks_read = pq_getmsgint64(msg);
+	c->blocks.temp_blks_written = pq_getmsgint64(msg);
+	c->blocks.shared_blk_read_time = pq_getmsgfloat8(msg);
+	c->blocks.shared_blk_write_time = pq_getmsgfloat8(msg);
+	c->blocks.local_blk_read_time = pq_getmsgfloat8(msg);
+	c->blocks.local_blk_write_time = pq_getmsgfloat8(msg);
+	c->blocks.temp_blk_read_time = pq_getmsgfloat8(msg);
+	c->blocks.temp_blk_write_time = pq_getmsgfloat8(msg);
+	c->sysinfo.utime = pq_getmsgfloat8(msg);
+	c->sysinfo.stime = pq_getmsgfloat8(msg);
+	c->jitinfo.jit_functions = pq_getmsgint64(msg);
+	c->jitinfo.jit_generation_time = pq_getmsgfloat8(msg);
+	c->jitinfo.jit_inlining_count = pq_getmsgint64(msg);
+	c->jitinfo.jit_inlining_time = pq_getmsgfloat8(msg);
+	c->jitinfo.jit_deform_count = pq_getmsgint64(msg);
+	c->jitinfo.jit_deform_time = pq_getmsgfloat8(msg);
+	c->jitinfo.jit_optimization_count = pq_getmsgint64(msg);
+	c->jitinfo.jit_optimization_time = pq_getmsgfloat8(msg);
+	c->jitinfo.jit_emission_count = pq_getmsgint64(msg);
+	c->jitinfo.jit_emission_time = pq_getmsgfloat8(msg);
+	c->walusage.wal_records = pq_getmsgint64(msg);
+	c->walusage.wal_fpi = pq_getmsgint64(msg);
+	c->walusage.wal_bytes = (uint64) pq_getmsgint64(msg);
+	c->walusage.wal_buffers_full = pq_getmsgint64(msg);
+	c->parallel_workers_to_launch = pq_getmsgint64(msg);
+	c->parallel_workers_launched = pq_getmsgint64(msg);
+	c->generic_plan_calls = pq_getmsgint64(msg);
+	c->custom_plan_calls = pq_getmsgint64(msg);
+	c->mem.calls = pq_getmsgint64(msg);
+	c->mem.min_bytes = pq_getmsgint64(msg);
+	c->mem.max_bytes = pq_getmsgint64(msg);
+	c->mem.mean_bytes = pq_getmsgfloat8(msg);
+	for (int b = 0; b < PGSM_MEM_HIST_BUCKETS; b++)
+		c->mem.hist_calls[b] = (int32) pq_getmsgint(msg, 4);
+	for (int b = 0; b < hist_buckets; b++)
+		c->resp_calls[b] = (int32) pq_getmsgint(msg, 4);
+}
+
+/*
+ * Serialize all entries of a bucket in the binary format described above.
+ * Texts of other users are only included if may_read_all_stats is true.
+ */
+static bytea *
+pgsm_export_bucket(uint64 bucket, bool may_read_all_stats)
+{
+	pgsmReadFilter filter = {0};
+	TimestampTz now;
+	pgsmSharedState *pgsm;
+	HASHCTL		info;
+	HTAB	   *texts;
+	pgsmHashSeqStatus hstat;
+	pgsmEntry  *entry;
+	pgsmSnapshotEntry snap;
+	StringInfoData keys;
+	StringInfoData counters;
+	StringInfoData dict;
+	StringInfoData buf;
+	pgsmExportHeader header;
+	bytea	   *result;
+
+	filter.has_bucket = true;
+	filter.bucket = bucket;
+
+	memset(&header, 0, sizeof(header));
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgsmExportTextKey);
+	info.entrysize = sizeof(pgsmExportText);
+	info.hcxt = CurrentMemoryContext;
+	texts = hash_create("pg_stat_monitor export texts", 256, &info,
+						HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	initStringInfo(&keys);
+	initStringInfo(&counters);
+	initStringInfo(&dict);
+
+	pgsm = pgsm_get_ss();
+	now = GetCurrentTimestamp();
+
+	pgsm_lock_aquire(pgsm, LW_SHARED);
+
+	header.bucket_start_time = pgsm->bucket_start_time[bucket];
+	header.hist_buckets = pgsm_bucket_histogram(pgsm, bucket, &read_histogram)->count_total;
+
+	/* Calls may still be added to the current bucket after the export */
+	if (pg_atomic_read_u64(&pgsm->current_bucket_id) == bucket)
+		header.flags |= PGSM_EXPORT_PARTIAL;
+
+	hash_entry_seq_init(&hstat);
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		pgsmExportKey k;
+		Counters   *tmp = &snap.counters;
+		bool		visible;
+
+		/* The texts point into the DSA area, they are copied right away */
+		if (!pgsm_snapshot_entry(pgsm, entry, &filter, now,
+								 PGSM_GROUP_TEXT | PGSM_GROUP_INFO, false, &snap))
+			continue;
+
+		/* Zero calls are reported as one call, see pgsm_form_values() */
+		if (tmp->calls.calls == 0)
+		{
+			tmp->calls.calls++;
+			tmp->resp_calls[0]++;
+		}
+
+		visible = may_read_all_stats || snap.key.userid == GetUserId();
+
+		k.queryid = snap.key.queryid;
+		k.planid = snap.key.planid;
+		k.appid = snap.key.appid;
+		k.parentid = snap.key.parentid;
+		k.pgsm_query_id = snap.pgsm_query_id;
+		k.stats_since = snap.stats_since;
+		k.userid = snap.key.userid;
+		k.dbid = snap.key.dbid;
+		k.ip = snap.key.ip;
+		k.query = pgsm_export_text(&dict, texts,
+								   visible ? snap.query_text : "<insufficient privilege>");
+		k.parent_query = pgsm_export_text(&dict, texts,
+										  snap.parent_query_text && !visible ?
+										  "<insufficient privilege>" : snap.parent_query_text);
+		k.application_name = pgsm_export_text(&dict, texts,
+											  tmp->info.application_name[0] ?
+											  tmp->info.application_name : NULL);
+		k.cmd_type = (int32) tmp->info.cmd_type;
+		k.toplevel = snap.key.toplevel;
+
+		pgsm_export_put_key(&keys, &k);
+		pgsm_export_put_counters(&counters, tmp, header.hist_buckets);
+		header.nentries++;
+	}
+
+	pgsm_lock_release(pgsm);
+
+	header.magic = PGSM_EXPORT_MAGIC;
+	header.version = PGSM_EXPORT_VERSION;
+	header.header_size = PGSM_EXPORT_HEADER_SIZE;
+	header.key_size = PGSM_EXPORT_KEY_SIZE;
+	header.counters_size = PGSM_EXPORT_COUNTERS_SIZE(header.hist_buckets);
+	header.text_len = dict.len;
+	header.bucket = bucket;
+
+	Assert(keys.len == header.nentries * header.key_size);
+	Assert(counters.len == header.nentries * header.counters_size);
+
+	initStringInfo(&buf);
+	appendStringInfoSpaces(&buf, VARHDRSZ);
+	pgsm_export_put_header(&buf, &header);
+	Assert(buf.len == VARHDRSZ + PGSM_EXPORT_HEADER_SIZE);
+	appendBinaryStringInfo(&buf, keys.data, keys.len);
+	appendBinaryStringInfo(&buf, counters.data, counters.len);
+	appendBinaryStringInfo(&buf, dict.data, dict.len);
+
+	result = (bytea *) buf.data;
+	SET_VARSIZE(result, buf.len);
+
+	pfree(keys.data);
+	pfree(counters.data);
+	pfree(dict.data);
+	hash_destroy(texts);
+
+	return result;
+}
+
+/*
+ * Return all entries of a bucket as a single bytea in the binary format
+ * described above.  Meant for collectors which read many entries and would
+ * rather not pay for building and parsing a row per entry.  The current
+ * bucket is flagged as partial, as it is still accumulating calls.
+ */
+Datum
+pg_stat_monitor_export(PG_FUNCTION_ARGS)
+{
+	int64		bucket = PG_GETARG_INT64(0);
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_export: Must be loaded via shared_preload_libraries."));
+
+	if (bucket < 0 || bucket >= pgsm_bucket_count())
+		ereport(ERROR,
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_export: Bucket must be between 0 and %d.",
+					   pgsm_bucket_count() - 1));
+
+	PG_RETURN_BYTEA_P(pgsm_export_bucket((uint64) bucket,
+										 is_member_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS)));
+}
+
+static void
+pgsm_decode_invalid(const char *caller, const char *detail)
+{
+	ereport(ERROR,
+			errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+			errmsg("[pg_stat_monitor] %s: Invalid export data.", caller),
+			errdetail("%s", detail));
+}
+
+static Datum
+pgsm_decode_text(const char *caller, const char *dict, uint32 text_len,
+				 uint32 offset, bool *isnull)
+{
+	if (offset == PGSM_EXPORT_NO_TEXT)
+	{
+		*isnull = true;
+		return (Datum) 0;
+	}
+	if (offset >= text_len)
+		pgsm_decode_invalid(caller, "Text offset is out of range.");
+
+	*isnull = false;
+	return CStringGetTextDatum(dict + offset);
+}
+
+/*
+ * Append the entries of one pg_stat_monitor_export() blob to a tuplestore
+ * with PG_STAT_MONITOR_DECODE_COLS columns.
+ */
+static void
+pgsm_decode_export(const char *caller, const char *buf, Size len,
+				   Tuplestorestate *tupstore, TupleDesc tupdesc)
+{
+	pgsmExportHeader header;
+	uint64		keys_offset;
+	uint64		counters_offset;
+	uint64		text_offset;
+	const char *dict;
+	StringInfoData msg;
+
+	if (!pgsm_export_get_header(buf, len, &header))
+		pgsm_decode_invalid(caller, "Data is shorter than the header.");
+
+	if (header.magic != PGSM_EXPORT_MAGIC)
+		pgsm_decode_invalid(caller, "Magic number does not match.");
+	if (header.version != PGSM_EXPORT_VERSION)
+		pgsm_decode_invalid(caller, "Unsupported format version.");
+	if (header.hist_buckets > MAX_RESPONSE_BUCKET + 2)
+		pgsm_decode_invalid(caller, "Too many histogram buckets.");
+	if (header.header_size < PGSM_EXPORT_HEADER_SIZE ||
+		header.key_size < PGSM_EXPORT_KEY_SIZE ||
+		header.counters_size < PGSM_EXPORT_COUNTERS_SIZE(header.hist_buckets))
+		pgsm_decode_invalid(caller, "Header or record sizes are too small.");
+
+	keys_offset = header.header_size;
+	counters_offset = keys_offset + (uint64) header.nentries * header.key_size;
+	text_offset = counters_offset + (uint64) header.nentries * header.counters_size;
+	if (text_offset + header.text_len != len)
+		pgsm_decode_invalid(caller, "Section sizes do not match the data length.");
+
+	dict = buf + text_offset;
+	if (header.text_len > 0 && dict[header.text_len - 1] != '\0')
+		pgsm_decode_invalid(caller, "Text dictionary is not terminated.");
+
+	msg.data = (char *) buf;
+	msg.len = len;
+	msg.maxlen = len;
+
+	for (uint32 e = 0; e < header.nentries; e++)
+	{
+		Datum		values[PG_STAT_MONITOR_DECODE_COLS] = {0};
+		bool		nulls[PG_STAT_MONITOR_DECODE_COLS] = {0};
+		pgsmExportKey k;
+		Counters	c;
+		Datum		resp[MAX_RESPONSE_BUCKET + 2];
+		Datum		mem[PGSM_MEM_HIST_BUCKETS];
+		char		wal_bytes[32];
+		int			i = 0;
+
+		/* Fields appended to the records by later versions are skipped */
+		msg.cursor = keys_offset + (uint64) e * header.key_size;
+		pgsm_export_get_key(&msg, &k);
+		msg.cursor = counters_offset + (uint64) e * header.counters_size;
+		memset(&c, 0, sizeof(c));
+		pgsm_export_get_counters(&msg, &c, header.hist_buckets);
+
+		values[i++] = Int64GetDatum((int64) header.bucket);
+		values[i++] = TimestampTzGetDatum(header.bucket_start_time);
+		values[i++] = ObjectIdGetDatum(k.userid);
+		values[i++] = ObjectIdGetDatum(k.dbid);
+		values[i++] = Int64GetDatum((int64) k.ip);
+		values[i++] = Int64GetDatum(k.queryid);
+		values[i++] = Int64GetDatum(k.planid);
+		values[i] = Int64GetDatum(k.parentid);
+		nulls[i++] = (k.parentid == INT64CONST(0));
+		values[i++] = Int64GetDatum(k.pgsm_query_id);
+		values[i++] = BoolGetDatum(k.toplevel);
+		values[i] = pgsm_decode_text(caller, dict, header.text_len, k.application_name, &nulls[i]);
+		i++;
+		values[i] = pgsm_decode_text(caller, dict, header.text_len, k.query, &nulls[i]);
+		i++;
+		values[i] = pgsm_decode_text(caller, dict, header.text_len, k.parent_query, &nulls[i]);
+		i++;
+		values[i++] = Int32GetDatum(k.cmd_type);
+		values[i++] = TimestampTzGetDatum(k.stats_since);
+
+		values[i++] = Int64GetDatum(c.calls.calls);
+		values[i++] = Int64GetDatum(c.calls.rows);
+		values[i++] = Float8GetDatum(c.time.total_time);
+		values[i++] = Float8GetDatum(c.time.min_time);
+		values[i++] = Float8GetDatum(c.time.max_time);
+		values[i++] = Float8GetDatum(c.time.mean_time);
+		values[i++] = Float8GetDatum(c.calls.calls > 0 ?
+									 sqrt(c.time.sum_var_time / c.calls.calls) : 0.0);
+		values[i++] = Int64GetDatum(c.plancalls.calls);
+		values[i++] = Float8GetDatum(c.plantime.total_time);
+		values[i++] = Int64GetDatum(c.blocks.shared_blks_hit);
+		values[i++] = Int64GetDatum(c.blocks.shared_blks_read);
+		values[i++] = Int64GetDatum(c.blocks.shared_blks_dirtied);
+		values[i++] = Int64GetDatum(c.blocks.shared_blks_written);
+		values[i++] = Int64GetDatum(c.blocks.temp_blks_read);
+		values[i++] = Int64GetDatum(c.blocks.temp_blks_written);
+		values[i++] = Float8GetDatum(c.sysinfo.utime);
+		values[i++] = Float8GetDatum(c.sysinfo.stime);
+		values[i++] = Int64GetDatum(c.walusage.wal_records);
+
+		snprintf(wal_bytes, sizeof(wal_bytes), UINT64_FORMAT, c.walusage.wal_bytes);
+		values[i++] = DirectFunctionCall3(numeric_in,
+										  CStringGetDatum(wal_bytes),
+										  ObjectIdGetDatum(0),
+										  Int32GetDatum(-1));
+
+		for (int b = 0; b < header.hist_buckets; b++)
+			resp[b] = Int32GetDatum(c.resp_calls[b]);
+		values[i++] = PointerGetDatum(construct_array(resp, header.hist_buckets, INT4OID,
+													  sizeof(int32), true, TYPALIGN_INT));
+
+		if (c.mem.calls > 0)
+		{
+			values[i++] = Int64GetDatum(c.mem.min_bytes);
+			values[i++] = Int64GetDatum(c.mem.max_bytes);
+			values[i++] = Float8GetDatum(c.mem.mean_bytes);
+			for (int b = 0; b < PGSM_MEM_HIST_BUCKETS; b++)
+				mem[b] = Int32GetDatum(c.mem.hist_calls[b]);
+			values[i++] = PointerGetDatum(construct_array(mem, PGSM_MEM_HIST_BUCKETS, INT4OID,
+														  sizeof(int32), true, TYPALIGN_INT));
+		}
 		else
-			nulls[i++] = true;
+		{
+			for (int n = 0; n < 4; n++)
+				nulls[i++] = true;
+		}
+
+		Assert(i == PG_STAT_MONITOR_DECODE_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+}
+
+/*
+ * Turn the result of pg_stat_monitor_export() back into rows, mainly to
+ * round-trip the format in tests and to document how it is read.
+ */
+Datum
+pg_stat_monitor_decode(PG_FUNCTION_ARGS)
+{
+	bytea	   *data = PG_GETARG_BYTEA_PP(0);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_decode", &tupstore);
+	if (tupdesc->natts != PG_STAT_MONITOR_DECODE_COLS)
+		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_decode: Incorrect number of output arguments, received %d, required %d.",
+			 tupdesc->natts, PG_STAT_MONITOR_DECODE_COLS);
+
+	pgsm_decode_export("pg_stat_monitor_decode",
+					   VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data),
+					   tupstore, tupdesc);
+
+	return (Datum) 0;
+}
+
+/*
+ * Archiving of closed buckets.
+ *
+ * When pg_stat_monitor.pgsm_archive_directory is set, a background worker
+ * appends every bucket to files in that directory once the bucket is closed,
+ * well before it is recycled.  A file is a sequence of records:
+ *
+ *	 pgsmArchiveRecord
+ *	 the bucket as returned by pg_stat_monitor_export()
+ *	 pg_crc32c of the bucket
+ *
+ * Files are named after the start time of their first bucket, so their names
+ * sort in time order, and a new file is started once the current one exceeds
+ * pgsm_archive_file_size or pgsm_archive_file_age.  Nothing is ever appended
+ * to a file the worker did not create itself, hence a truncated record can
+ * only be the last one of a file.  Old files are left for the administrator
+ * to remove.
+ */
+#define PGSM_ARCHIVE_MAGIC		0x41534750
+#define PGSM_ARCHIVE_PREFIX		"pgsm-"
+#define PGSM_ARCHIVE_SUFFIX		".archive"
+
+typedef struct pgsmArchiveRecord
+{
+	uint32		magic;
+	uint32		len;			/* length of the bucket data */
+} pgsmArchiveRecord;
+
+/* State of the archiver worker */
+static FILE *archive_file = NULL;
+static char archive_path[MAXPGPATH];
+static uint64 archive_size;
+static TimestampTz archive_opened;
+static TimestampTz archived_until;
+
+/*
+ * Get the start time of the first bucket in an archive file from its name.
+ * Returns false if the file is not an archive file.
+ */
+static bool
+pgsm_archive_file_time(const char *name, TimestampTz *start)
+{
+	long long	secs;
+	int			n = 0;
+
+	if (sscanf(name, PGSM_ARCHIVE_PREFIX "%12lld" PGSM_ARCHIVE_SUFFIX "%n", &secs, &n) != 1 ||
+		n != strlen(name))
+		return false;
+
+	*start = time_t_to_timestamptz((pg_time_t) secs);
+	return true;
+}
+
+static int
+pgsm_archive_name_cmp(const ListCell *a, const ListCell *b)
+{
+	return strcmp(lfirst(a), lfirst(b));
+}
+
+/*
+ * Return the names of the archive files, oldest first.
+ */
+static List *
+pgsm_archive_files(void)
+{
+	List	   *files = NIL;
+	DIR		   *dir;
+	struct dirent *de;
+	TimestampTz start;
+
+	dir = AllocateDir(pgsm_archive_directory);
+	while ((de = ReadDir(dir, pgsm_archive_directory)) != NULL)
+	{
+		if (pgsm_archive_file_time(de->d_name, &start))
+			files = lappend(files, pstrdup(de->d_name));
+	}
+	FreeDir(dir);
+
+	list_sort(files, pgsm_archive_name_cmp);
+	return files;
+}
+
+/*
+ * Read the next record of an archive file into buf.  Returns false at the
+ * end of the file and at a truncated or corrupt record.
+ */
+static bool
+pgsm_archive_read(FILE *file, const char *path, StringInfo buf)
+{
+	pgsmArchiveRecord rec;
+	pg_crc32c	crc;
+	pg_crc32c	file_crc;
+	size_t		nread;
+
+	nread = fread(&rec, 1, sizeof(rec), file);
+	if (nread == 0 && !ferror(file))
+		return false;
+
+	if (nread != sizeof(rec) ||
+		rec.magic != PGSM_ARCHIVE_MAGIC ||
+		rec.len < PGSM_EXPORT_HEADER_SIZE ||
+		rec.len > MaxAllocSize - 1)
+		goto bad_record;
+
+	resetStringInfo(buf);
+	enlargeStringInfo(buf, rec.len);
+	if (fread(buf->data, 1, rec.len, file) != rec.len ||
+		fread(&file_crc, 1, sizeof(file_crc), file) != sizeof(file_crc))
+		goto bad_record;
+	buf->len = rec.len;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, buf->data, buf->len);
+	FIN_CRC32C(crc);
+	if (!EQ_CRC32C(crc, file_crc))
+		goto bad_record;
+
+	return true;
+
+bad_record:
+	if (ferror(file))
+		ereport(WARNING,
+				errcode_for_file_access(),
+				errmsg("[pg_stat_monitor] pgsm_archive_read: Could not read file \"%s\": %m.",
+					   path));
+	else
+		ereport(WARNING,
+				errcode(ERRCODE_DATA_CORRUPTED),
+				errmsg("[pg_stat_monitor] pgsm_archive_read: Ignoring the rest of file \"%s\" after a truncated or corrupt record.",
+					   path));
+	return false;
+}
+
+/* Start time of the bucket in a record read by pgsm_archive_read() */
+static TimestampTz
+pgsm_archive_record_time(StringInfo buf)
+{
+	pgsmExportHeader header;
+
+	if (!pgsm_export_get_header(buf->data, buf->len, &header))
+		return 0;
+	return header.bucket_start_time;
+}
+
+/*
+ * Find the start time of the last bucket archived, so that a restarted
+ * worker neither writes buckets twice nor skips any.
+ */
+static TimestampTz
+pgsm_archive_last_time(void)
+{
+	List	   *files = pgsm_archive_files();
+	TimestampTz last = 0;
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+
+	for (int i = list_length(files) - 1; i >= 0 && last == 0; i--)
+	{
+		char		path[MAXPGPATH];
+		FILE	   *file;
+
+		snprintf(path, sizeof(path), "%s/%s", pgsm_archive_directory,
+				 (char *) list_nth(files, i));
+		file = AllocateFile(path, PG_BINARY_R);
+		if (file == NULL)
+			ereport(ERROR,
+					errcode_for_file_access(),
+					errmsg("[pg_stat_monitor] pgsm_archiver_main: Could not open file \"%s\": %m.",
+						   path));
+
+		while (pgsm_archive_read(file, path, &buf))
+			last = Max(last, pgsm_archive_record_time(&buf));
+
+		FreeFile(file);
+	}
+
+	pfree(buf.data);
+	list_free_deep(files);
+
+	return last;
+}
+
+static void
+pgsm_archive_close(void)
+{
+	if (archive_file == NULL)
+		return;
+
+	if (fflush(archive_file) != 0 || pg_fsync(fileno(archive_file)) != 0)
+		ereport(LOG,
+				errcode_for_file_access(),
+				errmsg("[pg_stat_monitor] pgsm_archiver_main: Could not fsync file \"%s\": %m.",
+					   archive_path));
+	FreeFile(archive_file);
+	archive_file = NULL;
+}
+
+static void
+pgsm_archive_write(bytea *data, TimestampTz bucket_start_time)
+{
+	pgsmArchiveRecord rec;
+	pg_crc32c	crc;
+	TimestampTz now = GetCurrentTimestamp();
+
+	rec.magic = PGSM_ARCHIVE_MAGIC;
+	rec.len = VARSIZE_ANY_EXHDR(data);
+
+	if (archive_file != NULL &&
+		(archive_size + rec.len > (uint64) pgsm_archive_file_size * 1024 * 1024 ||
+		 now - archive_opened >= (int64) pgsm_archive_file_age * SECS_PER_MINUTE * USECS_PER_SEC))
+		pgsm_archive_close();
+
+	if (archive_file == NULL)
+	{
+		/*
+		 * A file of the same name can only be left over from a failed write
+		 * of this very bucket, as it was not found by pgsm_archive_last_time().
+		 */
+		snprintf(archive_path, sizeof(archive_path), "%s/" PGSM_ARCHIVE_PREFIX "%012lld" PGSM_ARCHIVE_SUFFIX,
+				 pgsm_archive_directory,
+				 (long long) timestamptz_to_time_t(bucket_start_time));
+		archive_file = AllocateFile(archive_path, PG_BINARY_W);
+		if (archive_file == NULL)
+			ereport(ERROR,
+					errcode_for_file_access(),
+					errmsg("[pg_stat_monitor] pgsm_archiver_main: Could not create file \"%s\": %m.",
+						   archive_path));
+		archive_size = 0;
+		archive_opened = now;
+	}
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, VARDATA_ANY(data), rec.len);
+	FIN_CRC32C(crc);
+
+	if (fwrite(&rec, sizeof(rec), 1, archive_file) != 1 ||
+		fwrite(VARDATA_ANY(data), 1, rec.len, archive_file) != rec.len ||
+		fwrite(&crc, sizeof(crc), 1, archive_file) != 1 ||
+		fflush(archive_file) != 0)
+		ereport(ERROR,
+				errcode_for_file_access(),
+				errmsg("[pg_stat_monitor] pgsm_archiver_main: Could not write file \"%s\": %m.",
+					   archive_path));
+
+	archive_size += sizeof(rec) + rec.len + sizeof(crc);
+}
+
+/*
+ * Archive all closed buckets which have not been archived yet, oldest first.
+ */
+static void
+pgsm_archive_buckets(pgsmSharedState *pgsm)
+{
+	TimestampTz now = GetCurrentTimestamp();
+
+	for (;;)
+	{
+		uint64		current_bucket_id = pg_atomic_read_u64(&pgsm->current_bucket_id);
+		int64		bucket = -1;
+		TimestampTz bucket_start_time = 0;
+		bytea	   *data;
+		pgsmExportHeader header;
 
-		if (may_read_all_stats || userid == GetUserId())
+		for (int i = 0; i < pgsm->used_buckets; i++)
 		{
-			if (showtext)
-			{
-				/* query at column number 8 */
-				values[i++] = CStringGetTextDatum(query_text);
-				/* plan at column number 9 */
-				if (planid && tmp.planinfo.plan_text[0])
-					values[i++] = CStringGetTextDatum(tmp.planinfo.plan_text);
-				else
-					nulls[i++] = true;
-			}
-			else
+			TimestampTz t = pgsm->bucket_start_time[i];
+
+			if ((uint64) i == current_bucket_id || t == 0 || t <= archived_until ||
+				!IsBucketValid(i, now))
+				continue;
+			if (bucket < 0 || t < bucket_start_time)
 			{
-				/* query at column number 8 */
-				nulls[i++] = true;
-				/* plan at column number 9 */
-				nulls[i++] = true;
+				bucket = i;
+				bucket_start_time = t;
 			}
 		}
-		else
-		{
-			/* query text and plan at column number 8 and 9 */
-			values[i++] = CStringGetTextDatum("<insufficient privilege>");
-			values[i++] = CStringGetTextDatum("<insufficient privilege>");
-		}
 
-		/* pgsm_query_id at column number 10 */
-		if (pgsm_query_id)
-			values[i++] = Int64GetDatum(pgsm_query_id);
-		else
-			nulls[i++] = true;
+		if (bucket < 0)
+			break;
 
-		/* parentid at column number 11 */
-		if (tmpkey.parentid != INT64CONST(0))
-		{
-			values[i++] = Int64GetDatum(tmpkey.parentid);
-			values[i++] = CStringGetTextDatum(parent_query_text);
-		}
-		else
+		data = pgsm_export_bucket((uint64) bucket, true);
+		pgsm_export_get_header(VARDATA(data), VARSIZE(data) - VARHDRSZ, &header);
+
+		/*
+		 * We may have picked the bucket a rotation was starting, before its
+		 * id was published.  The bucket it closed is older and still to be
+		 * archived, so look again without moving archived_until.
+		 */
+		if (header.flags & PGSM_EXPORT_PARTIAL)
 		{
-			nulls[i++] = true;
-			nulls[i++] = true;
+			pfree(data);
+			continue;
 		}
 
-		/* application_name at column number 13 */
-		if (strlen(tmp.info.application_name) > 0)
-			values[i++] = CStringGetTextDatum(tmp.info.application_name);
-		else
-			nulls[i++] = true;
+		/* Skip empty buckets and those recycled while we were looking */
+		if (header.nentries > 0 &&
+			header.bucket_start_time == bucket_start_time)
+			pgsm_archive_write(data, bucket_start_time);
 
-		/* relations at column number 14 */
-		if (tmp.info.num_relations > 0)
-		{
-			StringInfoData buf;
+		pfree(data);
+		archived_until = bucket_start_time;
+	}
+}
 
-			initStringInfo(&buf);
+static void
+pgsm_archiver_shutdown(int code, Datum arg)
+{
+	pgsm_get_ss()->archiver_latch = NULL;
+	pgsm_archive_close();
+}
 
-			for (int j = 0; j < tmp.info.num_relations; j++)
-			{
-				if (j > 0)
-					appendStringInfoChar(&buf, ',');
-				appendStringInfoString(&buf, tmp.info.relations[j]);
-			}
+/*
+ * Register the background worker archiving closed buckets.
+ */
+static void
+pgsm_register_archiver(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 10;
+	strlcpy(worker.bgw_library_name, "pg_stat_monitor", BGW_MAXLEN);
+	strlcpy(worker.bgw_function_name, "pgsm_archiver_main", BGW_MAXLEN);
+	strlcpy(worker.bgw_name, "pg_stat_monitor archiver", BGW_MAXLEN);
+	strlcpy(worker.bgw_type, "pg_stat_monitor archiver", BGW_MAXLEN);
+
+	RegisterBackgroundWorker(&worker);
+}
 
-			values[i++] = CStringGetTextDatum(buf.data);
-			pfree(buf.data);
-		}
-		else
-			nulls[i++] = true;
+/*
+ * Main loop of the archiver: archive the closed buckets whenever a bucket
+ * is closed, and at least once per bucket time.  An error makes the worker
+ * exit and start over after bgw_restart_time.
+ */
+void
+pgsm_archiver_main(Datum main_arg)
+{
+	pgsmSharedState *pgsm;
+	MemoryContext archiver_context;
 
-		/* cmd_type at column number 15 */
-		if (tmp.info.cmd_type == CMD_NOTHING)
-			nulls[i++] = true;
-		else
-			values[i++] = Int64GetDatumFast((int64) tmp.info.cmd_type);
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
 
-		/* elevel at column number 16 */
-		values[i++] = Int64GetDatumFast(tmp.error.elevel);
+	if (MakePGDirectory(pgsm_archive_directory) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				errcode_for_file_access(),
+				errmsg("[pg_stat_monitor] pgsm_archiver_main: Could not create directory \"%s\": %m.",
+					   pgsm_archive_directory));
 
-		/* sqlcode at column number 17 */
-		if (strlen(tmp.error.sqlcode) == 0)
-			nulls[i++] = true;
-		else
-			values[i++] = CStringGetTextDatum(tmp.error.sqlcode);
+	archiver_context = AllocSetContextCreate(TopMemoryContext,
+											 "pg_stat_monitor archiver",
+											 ALLOCSET_DEFAULT_SIZES);
+	MemoryContextSwitchTo(archiver_context);
 
-		/* message at column number 18 */
-		if (strlen(tmp.error.message) == 0)
-			nulls[i++] = true;
-		else
-			values[i++] = CStringGetTextDatum(tmp.error.message);
+	archived_until = pgsm_archive_last_time();
 
-		/* bucket_start_time at column number 19 */
-		values[i++] = TimestampTzGetDatum(pgsm->bucket_start_time[entry->key.bucket_id]);
+	pgsm = pgsm_get_ss();
+	on_shmem_exit(pgsm_archiver_shutdown, (Datum) 0);
+	pgsm->archiver_latch = MyLatch;
 
-		if (tmp.calls.calls == 0)
+	while (!ShutdownRequestPending)
+	{
+		pgsm_archive_buckets(pgsm);
+		MemoryContextReset(archiver_context);
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 (long) pgsm->settings.bucket_time * 1000L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (ConfigReloadPending)
 		{
-			/* Query of pg_stat_monitor itself started from zero count */
-			tmp.calls.calls++;
-			tmp.resp_calls[0]++;
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
 		}
+	}
 
-		/* calls at column number 20 */
-		values[i++] = Int64GetDatumFast(tmp.calls.calls);
+	proc_exit(0);
+}
 
-		/* total_time at column number 21 */
-		values[i++] = Float8GetDatumFast(tmp.time.total_time);
+/*
+ * Register the background worker sampling the wait events of the running
+ * statements.
+ */
+static void
+pgsm_register_sampler(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 10;
+	strlcpy(worker.bgw_library_name, "pg_stat_monitor", BGW_MAXLEN);
+	strlcpy(worker.bgw_function_name, "pgsm_sampler_main", BGW_MAXLEN);
+	strlcpy(worker.bgw_name, "pg_stat_monitor sampler", BGW_MAXLEN);
+	strlcpy(worker.bgw_type, "pg_stat_monitor sampler", BGW_MAXLEN);
+
+	RegisterBackgroundWorker(&worker);
+}
 
-		/* min_time at column number 22 */
-		values[i++] = Float8GetDatumFast(tmp.time.min_time);
+/*
+ * Take one sample of the wait event of every backend running a statement,
+ * and count it in the current bucket.  A sample is dropped when the table
+ * is full.
+ */
+static void
+pgsm_sample_wait_events(pgsmSharedState *pgsm, pgsmWaitSlot *slots, HTAB *wait_hash)
+{
+	uint64		bucket_id;
+	TimestampTz bucket_start_time;
+
+	/* The bucket start time is written before the bucket id is published */
+	bucket_id = pg_atomic_read_u64(&pgsm->current_bucket_id);
+	pg_read_barrier();
+	bucket_start_time = pgsm->bucket_start_time[bucket_id];
+	if (bucket_start_time == 0)
+		return;
 
-		/* max_time at column number 23 */
-		values[i++] = Float8GetDatumFast(tmp.time.max_time);
+	LWLockAcquire(pgsm->wait_lock, LW_EXCLUSIVE);
 
-		/* mean_time at column number 24 */
-		values[i++] = Float8GetDatumFast(tmp.time.mean_time);
-		if (tmp.calls.calls > 1)
-			stddev = sqrt(tmp.time.sum_var_time / tmp.calls.calls);
-		else
-			stddev = 0.0;
+	for (int i = 0; i < pgsm->wait_slot_count; i++)
+	{
+		PGPROC	   *proc = &ProcGlobal->allProcs[i];
+		uint64		queryid;
+		pgsmWaitKey key;
+		pgsmWaitEntry *entry;
+		bool		found;
+
+		queryid = pg_atomic_read_u64(&slots[i].queryid);
+		if (queryid == 0 || proc->pid == 0)
+			continue;
+		pg_read_barrier();
 
-		/* stddev_exec_time at column number 25 */
-		values[i++] = Float8GetDatumFast(stddev);
+		/* Zero the padding, the key is hashed as a blob */
+		memset(&key, 0, sizeof(key));
+		key.bucket_id = bucket_id;
+		key.queryid = (int64) queryid;
+		key.dbid = proc->databaseId;
+		key.userid = slots[i].userid;
+		key.wait_event_info = UINT32_ACCESS_ONCE(proc->wait_event_info);
 
-		/* rows at column number 26 */
-		values[i++] = Int64GetDatumFast(tmp.calls.rows);
+		entry = hash_search(wait_hash, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+			continue;
 
-		if (tmp.calls.calls == 0)
+		/* Start over if the bucket was recycled since the last sample */
+		if (!found || entry->bucket_start_time != bucket_start_time)
 		{
-			/* Query of pg_stat_monitor itslef started from zero count */
-			tmp.calls.calls++;
-			tmp.resp_calls[0]++;
+			entry->bucket_start_time = bucket_start_time;
+			entry->samples = 0;
 		}
+		entry->samples++;
+	}
 
-		/* plans at column number 27 */
-		values[i++] = Int64GetDatumFast(tmp.plancalls.calls);
+	LWLockRelease(pgsm->wait_lock);
+}
 
-		/* total_plan_time at column number 28 */
-		values[i++] = Float8GetDatumFast(tmp.plantime.total_time);
+/*
+ * Remove the samples of buckets recycled since they were taken, so they do
+ * not hold on to the room of the table.
+ */
+static void
+pgsm_wait_cleanup(pgsmSharedState *pgsm, HTAB *wait_hash)
+{
+	HASH_SEQ_STATUS hstat;
+	pgsmWaitEntry *entry;
 
-		/* min_plan_time at column number 29 */
-		values[i++] = Float8GetDatumFast(tmp.plantime.min_time);
+	LWLockAcquire(pgsm->wait_lock, LW_EXCLUSIVE);
 
-		/* max_plan_time at column number 30 */
-		values[i++] = Float8GetDatumFast(tmp.plantime.max_time);
+	hash_seq_init(&hstat, wait_hash);
+	while ((entry = hash_seq_search(&hstat)) != NULL)
+	{
+		if (entry->bucket_start_time != pgsm->bucket_start_time[entry->key.bucket_id])
+			hash_search(wait_hash, &entry->key, HASH_REMOVE, NULL);
+	}
 
-		/* mean_plan_time at column number 31 */
-		values[i++] = Float8GetDatumFast(tmp.plantime.mean_time);
-		if (tmp.plancalls.calls > 1)
-			stddev = sqrt(tmp.plantime.sum_var_time / tmp.plancalls.calls);
-		else
-			stddev = 0.0;
+	LWLockRelease(pgsm->wait_lock);
+}
 
-		/* stddev_plan_time at column number 32 */
-		values[i++] = Float8GetDatumFast(stddev);
+/*
+ * Main loop of the wait event sampler: take pgsm_wait_sampling_frequency
+ * samples per second, and clean up recycled buckets once per second.  It
+ * never takes pgsm->lock, backends only publish what they run in their own
+ * slot.
+ */
+void
+pgsm_sampler_main(Datum main_arg)
+{
+	pgsmSharedState *pgsm;
+	pgsmWaitSlot *slots;
+	HTAB	   *wait_hash;
+	TimestampTz last_cleanup;
 
-		/* blocks are from column number 33 - 48 */
-		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_hit);
-		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_dirtied);
-		values[i++] = Int64GetDatumFast(tmp.blocks.shared_blks_written);
-		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_hit);
-		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_dirtied);
-		values[i++] = Int64GetDatumFast(tmp.blocks.local_blks_written);
-		values[i++] = Int64GetDatumFast(tmp.blocks.temp_blks_read);
-		values[i++] = Int64GetDatumFast(tmp.blocks.temp_blks_written);
-		values[i++] = Float8GetDatumFast(tmp.blocks.shared_blk_read_time);
-		values[i++] = Float8GetDatumFast(tmp.blocks.shared_blk_write_time);
-		if (api_version >= PGSM_V2_1)
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	pgsm = pgsm_get_ss();
+	slots = pgsm_get_wait_slots();
+	wait_hash = pgsm_get_wait_hash();
+	if (slots == NULL || wait_hash == NULL)
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pgsm_sampler_main: Wait event sampling is not set up."));
+
+	last_cleanup = GetCurrentTimestamp();
+
+	while (!ShutdownRequestPending)
+	{
+		TimestampTz now;
+
+		pgsm_sample_wait_events(pgsm, slots, wait_hash);
+
+		now = GetCurrentTimestamp();
+		if (TimestampDifferenceExceeds(last_cleanup, now, 1000))
 		{
-			values[i++] = Float8GetDatumFast(tmp.blocks.local_blk_read_time);
-			values[i++] = Float8GetDatumFast(tmp.blocks.local_blk_write_time);
+			pgsm_wait_cleanup(pgsm, wait_hash);
+			last_cleanup = now;
 		}
-		values[i++] = Float8GetDatumFast(tmp.blocks.temp_blk_read_time);
-		values[i++] = Float8GetDatumFast(tmp.blocks.temp_blk_write_time);
 
-		/* resp_calls at column number 49 */
-		values[i++] = intarray_get_datum(tmp.resp_calls, hist_bucket_count_total);
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 Max(1000L / pgsm_wait_sampling_frequency, 1L), PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
 
-		/* cpu_user_time at column number 50 */
-		values[i++] = Float8GetDatumFast(tmp.sysinfo.utime);
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
 
-		/* cpu_sys_time at column number 51 */
-		values[i++] = Float8GetDatumFast(tmp.sysinfo.stime);
+	proc_exit(0);
+}
 
-		/* wal_records at column number 52 */
-		values[i++] = Int64GetDatumFast(tmp.walusage.wal_records);
+/*
+ * Read the archived buckets which started between from_time and to_time,
+ * both inclusive and unbounded when NULL.
+ */
+Datum
+pg_stat_monitor_archive(PG_FUNCTION_ARGS)
+{
+	TimestampTz from_time = PG_ARGISNULL(0) ? DT_NOBEGIN : PG_GETARG_TIMESTAMPTZ(0);
+	TimestampTz to_time = PG_ARGISNULL(1) ? DT_NOEND : PG_GETARG_TIMESTAMPTZ(1);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	List	   *files;
+	ListCell   *lc;
+	StringInfoData buf;
 
-		/* wal_fpi at column number 53 */
-		values[i++] = Int64GetDatumFast(tmp.walusage.wal_fpi);
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_archive: Must be loaded via shared_preload_libraries."));
 
-		{
-			char		buf[256];
-			Datum		wal_bytes;
+	if (pgsm_archive_directory[0] == '\0')
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_archive: Archiving is disabled."),
+				errhint("Set pg_stat_monitor.pgsm_archive_directory to enable it."));
 
-			snprintf(buf, sizeof(buf), UINT64_FORMAT, tmp.walusage.wal_bytes);
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_archive", &tupstore);
+	if (tupdesc->natts != PG_STAT_MONITOR_DECODE_COLS)
+		elog(ERROR, "[pg_stat_monitor] pg_stat_monitor_archive: Incorrect number of output arguments, received %d, required %d.",
+			 tupdesc->natts, PG_STAT_MONITOR_DECODE_COLS);
 
-			/* Convert to numeric */
-			wal_bytes = DirectFunctionCall3(numeric_in,
-											CStringGetDatum(buf),
-											ObjectIdGetDatum(0),
-											Int32GetDatum(-1));
-			/* wal_bytes at column number 54 */
-			values[i++] = wal_bytes;
-		}
+	/* The worker may not have created the directory yet */
+	if (access(pgsm_archive_directory, F_OK) != 0 && errno == ENOENT)
+		return (Datum) 0;
 
-		if (api_version >= PGSM_V2_3)
-		{
-			/* wal_buffers_full at column number 55 */
-			values[i++] = Int64GetDatumFast(tmp.walusage.wal_buffers_full);
-		}
+	files = pgsm_archive_files();
+	initStringInfo(&buf);
 
-		/* application_name at column number 56 */
-		if (strlen(tmp.info.comments) > 0)
-			values[i++] = CStringGetTextDatum(tmp.info.comments);
-		else
-			nulls[i++] = true;
+	foreach(lc, files)
+	{
+		const char *name = lfirst(lc);
+		TimestampTz file_start;
+		char		path[MAXPGPATH];
+		FILE	   *file;
 
-		/* blocks are from column number 57 - 64 */
-		values[i++] = Int64GetDatumFast(tmp.jitinfo.jit_functions);
-		values[i++] = Float8GetDatumFast(tmp.jitinfo.jit_generation_time);
-		values[i++] = Int64GetDatumFast(tmp.jitinfo.jit_inlining_count);
-		values[i++] = Float8GetDatumFast(tmp.jitinfo.jit_inlining_time);
-		values[i++] = Int64GetDatumFast(tmp.jitinfo.jit_optimization_count);
-		values[i++] = Float8GetDatumFast(tmp.jitinfo.jit_optimization_time);
-		values[i++] = Int64GetDatumFast(tmp.jitinfo.jit_emission_count);
-		values[i++] = Float8GetDatumFast(tmp.jitinfo.jit_emission_time);
-		if (api_version >= PGSM_V2_1)
-		{
-			/* at column number 65 */
-			values[i++] = Int64GetDatumFast(tmp.jitinfo.jit_deform_count);
-			values[i++] = Float8GetDatumFast(tmp.jitinfo.jit_deform_time);
-		}
+		/* Files hold buckets from their name onwards */
+		if (!pgsm_archive_file_time(name, &file_start) || file_start > to_time)
+			break;
 
-		if (api_version >= PGSM_V2_3)
+		/* ... and up to the name of the next file */
+		if (lnext(files, lc) != NULL)
 		{
-			/* at column number 67 */
-			values[i++] = Int64GetDatumFast(tmp.parallel_workers_to_launch);
-			values[i++] = Int64GetDatumFast(tmp.parallel_workers_launched);
-		}
+			TimestampTz next_start;
 
-		if (api_version >= PGSM_NEXT)
-		{
-			/* at column number 69 */
-			values[i++] = Int64GetDatumFast(tmp.generic_plan_calls);
-			values[i++] = Int64GetDatumFast(tmp.custom_plan_calls);
+			if (pgsm_archive_file_time(lfirst(lnext(files, lc)), &next_start) &&
+				next_start <= from_time)
+				continue;
 		}
 
-		if (api_version >= PGSM_V2_1)
+		snprintf(path, sizeof(path), "%s/%s", pgsm_archive_directory, name);
+		file = AllocateFile(path, PG_BINARY_R);
+		if (file == NULL)
 		{
-			/* at column number 71 */
-			values[i++] = TimestampTzGetDatum(entry->stats_since);
-			/* exists for compatibility with pg_stat_statements */
-			values[i++] = TimestampTzGetDatum(entry->stats_since);
+			/* Removed by the administrator while we were reading */
+			if (errno == ENOENT)
+				continue;
+			ereport(ERROR,
+					errcode_for_file_access(),
+					errmsg("[pg_stat_monitor] pg_stat_monitor_archive: Could not open file \"%s\": %m.",
+						   path));
 		}
 
-		/* toplevel at column number 73 */
-		values[i++] = BoolGetDatum(toplevel);
+		while (pgsm_archive_read(file, path, &buf))
+		{
+			TimestampTz t = pgsm_archive_record_time(&buf);
 
-		/* bucket_done at column number 74 */
-		values[i++] = BoolGetDatum(bucketid != current_bucket);
+			if (t >= from_time && t <= to_time)
+				pgsm_decode_export("pg_stat_monitor_archive", buf.data, buf.len,
+								   tupstore, tupdesc);
+		}
 
-		/* clean up and return the tuplestore */
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		FreeFile(file);
 	}
-	/* clean up and return the tuplestore */
-	pgsm_lock_release(pgsm);
+
+	return (Datum) 0;
 }
 
 static const char *
@@ -2594,74 +7103,368 @@ get_cmd_type(int cmd_type)
 	}
 }
 
-Datum
-pg_stat_monitor_get_cmd_type(PG_FUNCTION_ARGS)
+Datum
+pg_stat_monitor_get_cmd_type(PG_FUNCTION_ARGS)
+{
+	const char *cmd_string = get_cmd_type(PG_GETARG_INT32(0));
+
+	if (cmd_string == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_TEXT_P(cstring_to_text(cmd_string));
+}
+
+/*
+ * Record the geometry of a bucket starting now, from the settings in use and
+ * the rollup level it belongs to, if any.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock.
+ */
+static void
+pgsm_start_bucket_geometry(pgsmSharedState *pgsm, uint64 bucket_id,
+						   const pgsmRollupLevel *lv)
+{
+	pgsmBucketGeometry *geometry = &pgsm->bucket_geometry[bucket_id];
+
+	geometry->bucket_time = lv ? lv->bucket_time : pgsm->settings.bucket_time;
+	geometry->max_buckets = lv ? lv->buckets : pgsm->settings.max_buckets;
+	geometry->histogram_min = pgsm->settings.histogram_min;
+	geometry->histogram_max = pgsm->settings.histogram_max;
+	geometry->histogram_buckets = pgsm->settings.histogram_buckets;
+}
+
+/*
+ * Keep the hotspots of the slower of two entries of a statement in dst.  Those
+ * of src are moved over if dst has none yet.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock.
+ */
+static void
+pgsm_combine_hotspot(pgsmEntry *dst, pgsmEntry *src)
+{
+	dsa_area   *dsa = get_dsa_area_for_query_text();
+	HotspotInfo *dst_hotspot;
+	HotspotInfo *src_hotspot;
+
+	if (!DsaPointerIsValid(src->counters.hotspot))
+		return;
+
+	if (!DsaPointerIsValid(dst->counters.hotspot))
+	{
+		dst->counters.hotspot = src->counters.hotspot;
+		src->counters.hotspot = InvalidDsaPointer;
+		return;
+	}
+
+	dst_hotspot = dsa_get_address(dsa, dst->counters.hotspot);
+	src_hotspot = dsa_get_address(dsa, src->counters.hotspot);
+	if (src_hotspot->exec_time > dst_hotspot->exec_time)
+		*dst_hotspot = *src_hotspot;
+}
+
+/*
+ * Merge the entries of a bucket about to be recycled into the bucket of the
+ * given rollup level covering its start time.  The texts and hotspots of
+ * new rollup entries are moved over instead of copied.  A rollup bucket
+ * recycled on the way is merged into the next level first, so data only
+ * moves from fine to coarse buckets and is never counted twice.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock.
+ */
+static void
+pgsm_rollup_bucket(pgsmSharedState *pgsm, uint64 bucket_id, int level)
+{
+	pgsmRollupLevel *lv;
+	TimestampTz start = pgsm->bucket_start_time[bucket_id];
+	TimestampTz target_start;
+	pg_time_t	secs;
+	uint64		target;
+	pgsmHistogram from_cache = {0};
+	pgsmHistogram to_cache = {0};
+	const pgsmHistogram *from;
+	const pgsmHistogram *to;
+	pgsmHashSeqStatus hstat;
+	pgsmEntry  *entry;
+
+	if (level >= pgsm_rollup_nlevels || start == 0)
+		return;
+
+	lv = &pgsm_rollup_level[level];
+	target = PGSM_MAX_BUCKETS;
+	for (int i = 0; i < level; i++)
+		target += pgsm_rollup_level[i].buckets;
+
+	secs = timestamptz_to_time_t(start);
+	secs -= secs % lv->bucket_time;
+	target += (secs / lv->bucket_time) % lv->buckets;
+	target_start = time_t_to_timestamptz(secs);
+
+	/* Older than anything this level still holds */
+	if (pgsm->bucket_start_time[target] > target_start)
+		return;
+
+	if (pgsm->bucket_start_time[target] != target_start)
+	{
+		pgsm_rollup_bucket(pgsm, target, level + 1);
+		hash_entry_dealloc(target);
+		pgsm->bucket_start_time[target] = target_start;
+		pgsm_start_bucket_geometry(pgsm, target, lv);
+	}
+
+	/* Histograms of buckets with other settings are moved to its bounds */
+	from = pgsm_bucket_histogram(pgsm, bucket_id, &from_cache);
+	to = pgsm_bucket_histogram(pgsm, target, &to_cache);
+
+	hash_entry_seq_init(&hstat);
+	while ((entry = hash_entry_seq_next(&hstat)) != NULL)
+	{
+		pgsmHashKey key;
+		pgsmEntry  *dst;
+		bool		found;
+
+		if (entry->key.bucket_id != bucket_id)
+			continue;
+
+		key = entry->key;
+		key.bucket_id = target;
+
+		/*
+		 * No room left for the entry in the target bucket, add its counters
+		 * to the "other" entry of the bucket, which always has room.
+		 */
+		if (!hash_entry_has_room(&key) && hash_entry_find(&key) == NULL)
+		{
+			pgsmEntry  *other;
+			Counters	counters;
+
+			memset(&key, 0, sizeof(key));
+			key.bucket_id = target;
+
+			other = hash_entry_alloc(pgsm, &key);
+			if (other == NULL)
+			{
+				pgsm->pgsm_oom = true;
+				continue;
+			}
+
+			pgsm_set_other_query(other);
+			counters = entry->counters;
+			pgsm_histogram_convert(counters.resp_calls, from, to);
+			pgsm_combine_counters(&other->counters, &counters);
+			other->stats_since = Min(other->stats_since, entry->stats_since);
+			other->generation = pg_atomic_add_fetch_u64(&pgsm->generation, 1);
+			continue;
+		}
+
+		/* Entries added here are skipped by this scan, if seen at all */
+		dst = hash_entry_enter(&key, &found);
+		if (dst == NULL)
+		{
+			/* Only if the shared memory itself ran out */
+			pgsm->pgsm_oom = true;
+			continue;
+		}
+
+		if (!found)
+		{
+			memcpy((char *) dst + sizeof(pgsmHashKey), (char *) entry + sizeof(pgsmHashKey),
+				   sizeof(pgsmEntry) - sizeof(pgsmHashKey));
+			SpinLockInit(&dst->mutex);
+			pgsm_histogram_convert(dst->counters.resp_calls, from, to);
+
+			/* hash_entry_dealloc() must not free the texts now */
+			entry->query = InvalidDsaPointer;
+			entry->counters.info.parent_query = InvalidDsaPointer;
+			entry->counters.hotspot = InvalidDsaPointer;
+		}
+		else
+		{
+			Counters	counters = entry->counters;
+
+			pgsm_histogram_convert(counters.resp_calls, from, to);
+			pgsm_combine_counters(&dst->counters, &counters);
+			pgsm_combine_hotspot(dst, entry);
+			dst->stats_since = Min(dst->stats_since, entry->stats_since);
+		}
+		dst->generation = pg_atomic_add_fetch_u64(&pgsm->generation, 1);
+	}
+}
+
+/*
+ * Switch to the bucket and histogram settings of the last configuration
+ * reload, when a new bucket starts.  A shorter bucket time ends the current
+ * bucket early, so that it takes effect right away.  Backends reload at
+ * slightly different times, so only one which has reloaded since the settings
+ * in use were taken may switch; one still running with older settings must
+ * not switch back.
+ *
+ * The new ring goes on from the bucket after the current one, so that the
+ * buckets of the old ring are recycled oldest first.  Buckets beyond a
+ * smaller ring, the one just closed among them, stay until they expire, see
+ * pgsm_drop_stale_buckets().  Buckets started before a switch keep their
+ * geometry, so they are validated and their histograms read as they were
+ * made.  The histogram of the new settings is computed here, once.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock.
+ */
+static void
+pgsm_switch_settings(pgsmSharedState *pgsm, uint64 current_bucket_id, time_t now)
 {
-	const char *cmd_string = get_cmd_type(PG_GETARG_INT32(0));
+	pgsmSettings *settings = &pgsm->settings;
 
-	if (cmd_string == NULL)
-		PG_RETURN_NULL();
+	if (PgReloadTime <= pgsm->settings_time)
+		return;
+	pgsm->settings_time = PgReloadTime;
 
-	PG_RETURN_TEXT_P(cstring_to_text(cmd_string));
+	if (settings->bucket_time != pgsm_bucket_time ||
+		settings->max_buckets != pgsm_max_buckets)
+	{
+		uint64		next_bucket_id = (current_bucket_id + 1) % pgsm_max_buckets;
+
+		pgsm->used_buckets = Max(pgsm->used_buckets, pgsm_max_buckets);
+		settings->bucket_time = pgsm_bucket_time;
+		settings->max_buckets = pgsm_max_buckets;
+		settings->bucket_offset = (next_bucket_id + pgsm_max_buckets -
+								   (now / pgsm_bucket_time) % pgsm_max_buckets) % pgsm_max_buckets;
+	}
+
+	settings->histogram_min = pgsm_histogram_min;
+	settings->histogram_max = pgsm_histogram_max;
+	settings->histogram_buckets = pgsm_histogram_buckets;
+
+	if (pgsm->histogram.min != pgsm_histogram_min ||
+		pgsm->histogram.max != pgsm_histogram_max ||
+		pgsm->histogram.buckets != pgsm_histogram_buckets)
+		pgsm_histogram_init(&pgsm->histogram, pgsm_histogram_min, pgsm_histogram_max,
+							pgsm_histogram_buckets, LOG);
+}
+
+/*
+ * Roll up and drop the buckets beyond the ring in use, left by a larger one
+ * before a switch of the settings, once they expire.  Nothing recycles them.
+ *
+ * Caller must hold an exclusive lock on pgsm->lock.
+ */
+static void
+pgsm_drop_stale_buckets(pgsmSharedState *pgsm, TimestampTz now)
+{
+	int			used_buckets = pgsm->settings.max_buckets;
+
+	for (int bucket = pgsm->settings.max_buckets; bucket < pgsm->used_buckets; bucket++)
+	{
+		if (pgsm->bucket_start_time[bucket] == 0)
+			continue;
+
+		if (IsBucketValid(bucket, now))
+		{
+			used_buckets = bucket + 1;
+			continue;
+		}
+
+		pgsm_rollup_bucket(pgsm, bucket, 0);
+		hash_entry_dealloc(bucket);
+		pgsm->bucket_start_time[bucket] = 0;
+	}
+
+	pgsm->used_buckets = used_buckets;
 }
 
 static uint64
 get_next_wbucket(pgsmSharedState *pgsm)
 {
 	struct timeval tv;
+	uint64		prev_bucket_start;
+	uint64		prev_bucket_end;
 	uint64		new_bucket_id;
 	time_t		new_bucket_start;
+	Latch	   *archiver_latch;
+	instr_time	start;
+	instr_time	now;
 
 	gettimeofday(&tv, NULL);
 
 	/*
-	 * If current bucket expired we loop attempting to update
-	 * current_bucket_start.
-	 *
-	 * pg_atomic_compare_exchange_u64 may fail in two possible ways: 1.
-	 * Another thread/process updated the variable before us. 2. A spurious
-	 * failure / hardware event.
-	 *
-	 * In both failure cases we read current_bucket_start from memory again,
-	 * if it was a spurious failure then the value of current_bucket_start
-	 * must be the same as before, which will cause the while loop to execute
-	 * again.
+	 * A reloaded shorter bucket time ends the current bucket early, see
+	 * pgsm_switch_settings().
+	 */
+	prev_bucket_start = pg_atomic_read_u64(&pgsm->current_bucket_start);
+	if ((uint64) tv.tv_sec < prev_bucket_start +
+		(uint64) Min(pgsm->settings.bucket_time, pgsm_bucket_time))
+		return pg_atomic_read_u64(&pgsm->current_bucket_id);
+
+	/* Rotations are rare and stall every backend, so always time them */
+	INSTR_TIME_SET_CURRENT(start);
+
+	/*
+	 * The current bucket has expired.  Decide whether to rotate, and rotate,
+	 * all under the exclusive lock: a backend which read the expired start
+	 * time may get the lock only after another one rotated, even to a later
+	 * bucket, and must then not rotate again, which would drop the entries
+	 * stored into the new bucket in the meantime.
 	 *
-	 * If another thread updated current_bucket_start, then its current value
-	 * will definitely make the while condition to fail, we can stop the loop
-	 * as another thread has already updated current_bucket_start.
+	 * Every backend past the boundary gets here at about the same time.
+	 * Rather than queueing up for the exclusive lock one after the other,
+	 * they wait for it to be released and look again, so that only one of
+	 * them takes it to rotate.
 	 */
-	for (;;)
+	while (!pgsm_lock_aquire_or_wait(pgsm))
 	{
-		uint64		current_bucket_start = pg_atomic_read_u64(&pgsm->current_bucket_start);
-
-		if ((uint64) tv.tv_sec < current_bucket_start + (uint64) pgsm_bucket_time)
+		prev_bucket_start = pg_atomic_read_u64(&pgsm->current_bucket_start);
+		if ((uint64) tv.tv_sec < prev_bucket_start +
+			(uint64) Min(pgsm->settings.bucket_time, pgsm_bucket_time))
 			return pg_atomic_read_u64(&pgsm->current_bucket_id);
-
-		if (pg_atomic_compare_exchange_u64(&pgsm->current_bucket_start, &current_bucket_start, (uint64) tv.tv_sec))
-			break;
 	}
 
-	new_bucket_id = (tv.tv_sec / pgsm_bucket_time) % pgsm_max_buckets;
-
-	pg_atomic_write_u64(&pgsm->current_bucket_id, new_bucket_id);
+	prev_bucket_start = pg_atomic_read_u64(&pgsm->current_bucket_start);
+	prev_bucket_end = Min(prev_bucket_start + pgsm->settings.bucket_time,
+						  (uint64) tv.tv_sec);
+	pgsm_switch_settings(pgsm, pg_atomic_read_u64(&pgsm->current_bucket_id), tv.tv_sec);
 
 	/*
-	 * There is a race condition here where entries might get lost if the
-	 * bucket update/insert lock in pgsm_store() is taken before we grab this
-	 * lock by another backend which also attempts to insert into the new
-	 * bucket.
+	 * Another backend rotated first, or one which has not reloaded yet wanted
+	 * to end the bucket early for settings it cannot switch to.
 	 */
-	pgsm_lock_aquire(pgsm, LW_EXCLUSIVE);
+	if ((uint64) tv.tv_sec < prev_bucket_start + (uint64) pgsm->settings.bucket_time)
+	{
+		pgsm_lock_release(pgsm);
+		return pg_atomic_read_u64(&pgsm->current_bucket_id);
+	}
+
+	new_bucket_id = (tv.tv_sec / pgsm->settings.bucket_time + pgsm->settings.bucket_offset) %
+		pgsm->settings.max_buckets;
+	new_bucket_start = tv.tv_sec - tv.tv_sec % pgsm->settings.bucket_time;
+
+	pgsm_rollup_bucket(pgsm, new_bucket_id, 0);
 	hash_entry_dealloc(new_bucket_id);
-	pgsm_lock_release(pgsm);
+	pgsm_drop_stale_buckets(pgsm, time_t_to_timestamptz(tv.tv_sec));
 
-	new_bucket_start = tv.tv_sec - tv.tv_sec % pgsm_bucket_time;
+	/*
+	 * After a switch of the bucket time the new bucket may start before the
+	 * previous one ended, so start it at the end of the previous one.
+	 */
+	pgsm->bucket_start_time[new_bucket_id] =
+		time_t_to_timestamptz(Max(new_bucket_start, (time_t) prev_bucket_end));
+	pgsm_start_bucket_geometry(pgsm, new_bucket_id, NULL);
 
+	/*
+	 * Publish the new bucket only once it is empty and has its start time.
+	 * Backends which read the new start time but still the old bucket id
+	 * store into the old bucket, which is only closed, not dropped.
+	 */
 	pg_atomic_write_u64(&pgsm->current_bucket_start, (uint64) new_bucket_start);
+	pg_write_barrier();
+	pg_atomic_write_u64(&pgsm->current_bucket_id, new_bucket_id);
+
+	pgsm_lock_release(pgsm);
+
+	/* Let the archiver pick up the bucket which was just closed */
+	archiver_latch = pgsm->archiver_latch;
+	if (archiver_latch != NULL)
+		SetLatch(archiver_latch);
 
-	pgsm->bucket_start_time[new_bucket_id] = (TimestampTz) (new_bucket_start -
-															(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY) * USECS_PER_SEC;
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(hook_time[PGSM_HS_BUCKET_ROTATION], now, start);
+	hook_calls[PGSM_HS_BUCKET_ROTATION]++;
 
 	return new_bucket_id;
 }
@@ -3079,9 +7882,136 @@ intarray_get_datum(const int32 *arr, int len)
 	return datum;
 }
 
+/* Names of the pgsmHookStat counters, in the same order */
+static const char *const pgsm_hook_stat_names[PGSM_HS_NUM] =
+{
+	"post_parse_analyze",
+	"executor_start",
+	"executor_run",
+	"executor_finish",
+	"executor_end",
+	"executor_check_perms",
+	"planner",
+	"process_utility",
+	"emit_log",
+	"store",
+	"normalize",
+	"explain",
+	"lock_wait",
+	"bucket_rotation",
+	"dsa_alloc",
+	"dsa_alloc_failure",
+	"oom_drop",
+	"eviction",
+};
+
+/*
+ * Start timing some of pg_stat_monitor's own work, if
+ * pg_stat_monitor.pgsm_track_overhead is on.
+ */
+static inline void
+pgsm_hook_stat_start(instr_time *start)
+{
+	if (pgsm_track_overhead)
+		INSTR_TIME_SET_CURRENT(*start);
+	else
+		INSTR_TIME_SET_ZERO(*start);
+}
+
+/* Add the time since pgsm_hook_stat_start() to the given counter */
+static inline void
+pgsm_hook_stat_stop(pgsmHookStat stat, instr_time *start)
+{
+	instr_time	now;
+
+	if (INSTR_TIME_IS_ZERO(*start))
+		return;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(hook_time[stat], now, *start);
+}
+
+static void
+pgsm_hook_stats_exit(int code, Datum arg)
+{
+	pgsm_flush_hook_stats(true);
+}
+
+/*
+ * Add the counters of this backend to the shared ones.  To keep the atomic
+ * operations off the hot path this happens at most once a second, unless
+ * forced, and at backend exit.
+ */
+static void
+pgsm_flush_hook_stats(bool force)
+{
+	pgsmSharedState *pgsm = pgsm_get_ss();
+	TimestampTz now = GetCurrentStatementStartTimestamp();
+
+	if (pgsm == NULL)
+		return;
+
+	if (!hook_stats_exit_registered)
+	{
+		before_shmem_exit(pgsm_hook_stats_exit, (Datum) 0);
+		hook_stats_exit_registered = true;
+	}
+
+	if (!force && now < hook_stats_flushed + USECS_PER_SEC)
+		return;
+	hook_stats_flushed = now;
+
+	for (int i = 0; i < PGSM_HS_NUM; i++)
+	{
+		uint64		usecs = INSTR_TIME_GET_MICROSEC(hook_time[i]);
+
+		if (hook_calls[i] != 0)
+			pg_atomic_fetch_add_u64(&pgsm->hook_calls[i], hook_calls[i]);
+		if (usecs != 0)
+			pg_atomic_fetch_add_u64(&pgsm->hook_time[i], usecs);
+		hook_calls[i] = 0;
+		INSTR_TIME_SET_ZERO(hook_time[i]);
+	}
+}
+
+/*
+ * Report pg_stat_monitor's own cost summed over all backends: the calls and
+ * time of each hook, with the time spent in the functions the hook calls
+ * left out, and of the costliest steps, which the hook times include.  Times
+ * are only collected while pg_stat_monitor.pgsm_track_overhead is on.
+ */
 Datum
 pg_stat_monitor_hook_stats(PG_FUNCTION_ARGS)
 {
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pgsmSharedState *pgsm;
+
+	/* Safety check... */
+	if (!IsSystemInitialized())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_hook_stats: Must be loaded via shared_preload_libraries."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_hook_stats", &tupstore);
+
+	pgsm = pgsm_get_ss();
+	pgsm_flush_hook_stats(true);
+
+	for (int i = 0; i < PGSM_HS_NUM; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3] = {0};
+
+		values[0] = CStringGetTextDatum(pgsm_hook_stat_names[i]);
+		values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&pgsm->hook_calls[i]));
+		if (i < PGSM_HS_DSA_ALLOC)
+			values[2] = Float8GetDatum(pg_atomic_read_u64(&pgsm->hook_time[i]) / 1000.0);
+		else
+			nulls[2] = true;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
 	return (Datum) 0;
 }
 
@@ -3098,8 +8028,16 @@ pgsm_emit_log_hook(ErrorData *edata)
 	if (MyProc == NULL)
 		goto exit;
 
+	hook_calls[PGSM_HS_EMIT_LOG]++;
+
 	if (edata->elevel >= WARNING && debug_query_string && !disable_error_capture && !IsSystemOOM())
+	{
+		instr_time	start;
+
+		pgsm_hook_stat_start(&start);
 		pgsm_store_error(debug_query_string, edata);
+		pgsm_hook_stat_stop(PGSM_HS_EMIT_LOG, &start);
+	}
 
 	/* We need to make sure we re-enable error capture if query was aborted */
 	if (edata->elevel >= ERROR)
@@ -3126,21 +8064,23 @@ time_diff(struct timeval end, struct timeval start)
 
 /* Validate histogram values and find the max number of histogram buckets that can be created */
 static void
-set_histogram_bucket_timings(void)
+pgsm_histogram_init(pgsmHistogram *hist, double min, double max, int buckets, int elevel)
 {
-	hist_bucket_min = pgsm_histogram_min;
-	hist_bucket_max = pgsm_histogram_max;
-	hist_bucket_count_user = pgsm_histogram_buckets;
+	hist->min = min;
+	hist->max = max;
+	hist->buckets = buckets;
+	hist->count_user = buckets;
+	hist->count_total = 0;
 
-	if (hist_bucket_count_user >= 2)
+	if (hist->count_user >= 2)
 	{
-		int			b_count = hist_bucket_count_user;
+		int			b_count = hist->count_user;
 
-		for (; hist_bucket_count_user > 0; hist_bucket_count_user--)
+		for (; hist->count_user > 0; hist->count_user--)
 		{
 			/* TODO: This is likely broken as it ignores pgsm_histogram_min */
-			double		b2_start = histogram_bucket_boundary(1);
-			double		b2_end = histogram_bucket_boundary(2);
+			double		b2_start = histogram_bucket_boundary(hist, 1);
+			double		b2_end = histogram_bucket_boundary(hist, 2);
 
 			/*
 			 * The first bucket size will always be one or greater as we're
@@ -3156,11 +8096,11 @@ set_histogram_bucket_timings(void)
 			}
 		}
 
-		if (b_count != hist_bucket_count_user)
-			ereport(WARNING,
+		if (b_count != hist->count_user)
+			ereport(elevel,
 					errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 					errmsg("pg_stat_monitor: Histogram buckets are overlapping."),
-					errdetail("Histogram bucket size is set to %d [not including outlier buckets].", hist_bucket_count_user));
+					errdetail("Histogram bucket size is set to %d [not including outlier buckets].", hist->count_user));
 	}
 
 	/*
@@ -3168,22 +8108,22 @@ set_histogram_bucket_timings(void)
 	 * must add 1 for max outlier queries. However, for min, bucket should
 	 * only be added if the minimum value provided by user is greater than 0
 	 */
-	hist_bucket_count_total = hist_bucket_count_user + (int) (hist_bucket_max < HISTOGRAM_MAX_TIME) + (int) (hist_bucket_min > 0);
+	hist->count_total = hist->count_user + (int) (hist->max < HISTOGRAM_MAX_TIME) + (int) (hist->min > 0);
 
-	for (int index = 0; index < hist_bucket_count_total; index++)
-		hist_bucket_timings[index] = histogram_bucket_boundary(index);
+	for (int index = 0; index < hist->count_total; index++)
+		hist->timings[index] = histogram_bucket_boundary(hist, index);
 }
 
 /*
  * Given an index, return the upper histogram bucket boundary
  */
 static double
-histogram_bucket_boundary(int index)
+histogram_bucket_boundary(const pgsmHistogram *hist, int index)
 {
-	double		q_min = hist_bucket_min;
-	double		q_max = hist_bucket_max;
-	int			b_count = hist_bucket_count_total;
-	int			b_count_user = hist_bucket_count_user;
+	double		q_min = hist->min;
+	double		q_max = hist->max;
+	int			b_count = hist->count_total;
+	int			b_count_user = hist->count_user;
 	double		bucket_size;
 
 	if (index == b_count - 1)
@@ -3210,15 +8150,76 @@ histogram_bucket_boundary(int index)
  * Get the histogram bucket index for a given query time.
  */
 static int
-get_histogram_bucket(double q_time)
+get_histogram_bucket(const pgsmHistogram *hist, double q_time)
 {
-	for (int index = 0; index < hist_bucket_count_total - 1; index++)
+	for (int index = 0; index < hist->count_total - 1; index++)
 	{
-		if (q_time <= hist_bucket_timings[index])
+		if (q_time <= hist->timings[index])
 			return index;
 	}
 
-	return hist_bucket_count_total - 1;
+	return hist->count_total - 1;
+}
+
+/*
+ * The histogram of a bucket, from the histogram settings of its geometry.
+ * That of the settings in use is kept in the shared state, others are
+ * computed into *cache, unless it holds them already.
+ *
+ * Caller must hold pgsm->lock.
+ */
+static const pgsmHistogram *
+pgsm_bucket_histogram(pgsmSharedState *pgsm, uint64 bucket_id, pgsmHistogram *cache)
+{
+	const pgsmBucketGeometry *geometry = &pgsm->bucket_geometry[bucket_id];
+
+	if (pgsm->histogram.min == geometry->histogram_min &&
+		pgsm->histogram.max == geometry->histogram_max &&
+		pgsm->histogram.buckets == geometry->histogram_buckets)
+		return &pgsm->histogram;
+
+	if (cache->min != geometry->histogram_min ||
+		cache->max != geometry->histogram_max ||
+		cache->buckets != geometry->histogram_buckets ||
+		cache->count_total == 0)
+		pgsm_histogram_init(cache, geometry->histogram_min, geometry->histogram_max,
+							geometry->histogram_buckets, DEBUG1);
+	return cache;
+}
+
+/*
+ * Move the counts of an execution time histogram with the bounds of from to
+ * the buckets of to, each into the one holding its upper bound, so that
+ * buckets with different settings can be added up.
+ */
+static void
+pgsm_histogram_convert(int *resp_calls, const pgsmHistogram *from,
+					   const pgsmHistogram *to)
+{
+	int			converted[MAX_RESPONSE_BUCKET + 2] = {0};
+
+	if (from == to ||
+		(from->min == to->min && from->max == to->max && from->buckets == to->buckets))
+		return;
+
+	for (int b = 0; b < from->count_total; b++)
+		converted[get_histogram_bucket(to, from->timings[b])] += resp_calls[b];
+	memcpy(resp_calls, converted, sizeof(converted));
+}
+
+/*
+ * Get the executor memory histogram bucket index for a number of bytes.
+ */
+static int
+get_mem_histogram_bucket(int64 bytes)
+{
+	int			index;
+
+	if (bytes < PGSM_MEM_HIST_MIN)
+		return 0;
+
+	index = pg_leftmost_one_pos64((uint64) (bytes / PGSM_MEM_HIST_MIN)) + 1;
+	return Min(index, PGSM_MEM_HIST_BUCKETS - 1);
 }
 
 /*
@@ -3228,16 +8229,26 @@ get_histogram_bucket(double q_time)
 Datum
 get_histogram_timings(PG_FUNCTION_ARGS)
 {
+	pgsmSharedState *pgsm = pgsm_get_ss();
+	pgsmHistogram hist = {0};
 	StringInfoData buf;
 
+	/* The histogram of the settings in use */
+	if (pgsm != NULL)
+	{
+		pgsm_lock_aquire(pgsm, LW_SHARED);
+		hist = pgsm->histogram;
+		pgsm_lock_release(pgsm);
+	}
+
 	initStringInfo(&buf);
 
 	appendStringInfoChar(&buf, '{');
 
-	for (int index = 0; index < hist_bucket_count_total; index++)
+	for (int index = 0; index < hist.count_total; index++)
 	{
-		double		b_start = index > 0 ? hist_bucket_timings[index - 1] : 0;
-		double		b_end = hist_bucket_timings[index];
+		double		b_start = index > 0 ? hist.timings[index - 1] : 0;
+		double		b_end = hist.timings[index];
 
 		if (index == 0)
 			appendStringInfoChar(&buf, '{');
@@ -3320,12 +8331,297 @@ terminate:
 	comments[curr_len] = '\0';
 }
 
+#ifdef PGSM_BENCHMARK
+
+/* Kernels pg_stat_monitor_bench_kernel() can run */
+typedef enum pgsmBenchKernel
+{
+	PGSM_BENCH_NORMALIZE,
+	PGSM_BENCH_QUERY_ID_HASH,
+	PGSM_BENCH_COMMENTS,
+	PGSM_BENCH_HISTOGRAM,
+	PGSM_BENCH_NUM
+} pgsmBenchKernel;
+
+static const char *const pgsm_bench_kernel_names[PGSM_BENCH_NUM] =
+{
+	"normalize",
+	"query_id_hash",
+	"comments",
+	"histogram",
+};
+
+/* Query times run through get_histogram_bucket(), per query of the corpus */
+#define PGSM_BENCH_HISTOGRAM_TIMES 16
+
+/* A statement of the corpus with what the kernels need */
+typedef struct pgsmBenchQuery
+{
+	char	   *text;
+	int			location;
+	int			len;
+	JumbleState *jstate;
+	char	   *norm_text;
+	int			norm_len;
+} pgsmBenchQuery;
+
+/*
+ * Parse, analyze and jumble a statement the way the backend does before our
+ * post_parse_analyze hook runs.
+ */
+static void
+pgsm_bench_prepare(pgsmBenchQuery *q, const char *text)
+{
+	List	   *raw;
+	ParseState *pstate;
+	Query	   *query;
+	const char *clean;
+
+	raw = raw_parser(text, RAW_PARSE_DEFAULT);
+	if (list_length(raw) != 1)
+		ereport(ERROR,
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_bench_kernel: Each query must hold exactly one statement."));
+
+	pstate = make_parsestate(NULL);
+	pstate->p_sourcetext = text;
+	query = transformTopLevelStmt(pstate, linitial_node(RawStmt, raw));
+	free_parsestate(pstate);
+
+#if PG_VERSION_NUM >= 160000
+	q->jstate = JumbleQuery(query);
+#else
+	q->jstate = JumbleQuery(query, text);
+#endif
+
+	q->location = query->stmt_location;
+	q->len = query->stmt_len;
+	clean = CleanQuerytext(text, &q->location, &q->len);
+	q->text = pnstrdup(clean, q->len);
+
+	q->norm_len = q->len;
+	if (q->jstate && q->jstate->clocations_count > 0)
+		q->norm_text = generate_normalized_query(q->jstate, q->text, q->location, &q->norm_len);
+	else
+		q->norm_text = pstrdup(q->text);
+}
+
+/*
+ * Run one of the per statement text kernels over a corpus of statements, for
+ * measuring them apart from the rest of the hooks.  Not part of the
+ * extension's SQL API, and only built with PGSM_BENCHMARK defined; the
+ * benchmarks in t/ declare it themselves, see t/045_bench_kernels.pl.
+ *
+ * Returns the calls made, the bytes of query text they went over, the time
+ * per call and per byte, and the bytes of memory the results of a call take.
+ * Memory is measured at the block level of a context of its own and leaves
+ * out what the kernel frees itself.
+ */
+Datum
+pg_stat_monitor_bench_kernel(PG_FUNCTION_ARGS)
+{
+	char	   *kernel_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	ArrayType  *queries = PG_GETARG_ARRAYTYPE_P(1);
+	int32		iterations = PG_GETARG_INT32(2);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	Datum	   *elems;
+	bool	   *elem_nulls;
+	int			nqueries;
+	pgsmBenchQuery *corpus;
+	pgsmBenchKernel kernel = PGSM_BENCH_NUM;
+	double		times[PGSM_BENCH_HISTOGRAM_TIMES];
+	pgsmHistogram hist;
+	MemoryContext bench_cxt;
+	MemoryContext oldcxt;
+	Size		empty_size;
+	Size		alloc_size = 0;
+	instr_time	start;
+	instr_time	duration;
+	int64		calls = 0;
+	int64		bytes = 0;
+	volatile int64 sink = 0;
+	char		comments[COMMENTS_LEN];
+	Datum		values[5];
+	bool		nulls[5] = {0};
+
+	for (int i = 0; i < PGSM_BENCH_NUM; i++)
+	{
+		if (strcmp(kernel_name, pgsm_bench_kernel_names[i]) == 0)
+			kernel = i;
+	}
+	if (kernel == PGSM_BENCH_NUM)
+		ereport(ERROR,
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_bench_kernel: Unknown kernel \"%s\".", kernel_name),
+				errhint("Valid kernels are normalize, query_id_hash, comments and histogram."));
+	if (iterations < 1)
+		ereport(ERROR,
+				errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_bench_kernel: The number of iterations must be positive."));
+	if (!IsQueryIdEnabled())
+		ereport(ERROR,
+				errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("[pg_stat_monitor] pg_stat_monitor_bench_kernel: Query identifier calculation must be enabled."));
+
+	tupdesc = pgsm_init_srf(fcinfo, "pg_stat_monitor_bench_kernel", &tupstore);
+
+	deconstruct_array(queries, TEXTOID, -1, false, TYPALIGN_INT,
+					  &elems, &elem_nulls, &nqueries);
+
+	corpus = palloc0(sizeof(pgsmBenchQuery) * nqueries);
+	for (int i = 0; i < nqueries; i++)
+	{
+		if (elem_nulls[i])
+			ereport(ERROR,
+					errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					errmsg("[pg_stat_monitor] pg_stat_monitor_bench_kernel: Queries must not be NULL."));
+		pgsm_bench_prepare(&corpus[i], TextDatumGetCString(elems[i]));
+	}
+
+	/* Spread the query times over the histogram, and beyond on both sides */
+	pgsm_histogram_init(&hist, pgsm_histogram_min, pgsm_histogram_max,
+						pgsm_histogram_buckets, DEBUG1);
+	for (int i = 0; i < PGSM_BENCH_HISTOGRAM_TIMES; i++)
+		times[i] = (hist.min + 0.01) *
+			pow((hist.max * 2) / (hist.min + 0.01),
+				(double) i / (PGSM_BENCH_HISTOGRAM_TIMES - 1));
+
+	bench_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									  "pg_stat_monitor bench",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldcxt = MemoryContextSwitchTo(bench_cxt);
+	empty_size = MemoryContextMemAllocated(bench_cxt, false);
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	for (int iter = 0; iter < iterations; iter++)
+	{
+		for (int i = 0; i < nqueries; i++)
+		{
+			pgsmBenchQuery *q = &corpus[i];
+			int			len;
+
+			switch (kernel)
+			{
+				case PGSM_BENCH_NORMALIZE:
+					if (q->jstate == NULL || q->jstate->clocations_count == 0)
+						break;
+					len = q->len;
+					sink += (int64) generate_normalized_query(q->jstate, q->text,
+															  q->location, &len)[0];
+					bytes += q->len;
+					calls++;
+					break;
+				case PGSM_BENCH_QUERY_ID_HASH:
+					sink += get_pgsm_query_id_hash(q->norm_text, q->norm_len);
+					bytes += q->norm_len;
+					calls++;
+					break;
+				case PGSM_BENCH_COMMENTS:
+					extract_query_comments(q->text, comments, sizeof(comments));
+					sink += comments[0];
+					bytes += q->len;
+					calls++;
+					break;
+				case PGSM_BENCH_HISTOGRAM:
+					for (int t = 0; t < PGSM_BENCH_HISTOGRAM_TIMES; t++)
+						sink += get_histogram_bucket(&hist, times[t]);
+					calls += PGSM_BENCH_HISTOGRAM_TIMES;
+					break;
+				case PGSM_BENCH_NUM:
+					Assert(false);
+					break;
+			}
+		}
+
+		/* Only measure what the first pass over the corpus allocates */
+		if (iter == 0)
+			alloc_size = MemoryContextMemAllocated(bench_cxt, false) - empty_size;
+		MemoryContextReset(bench_cxt);
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextDelete(bench_cxt);
+
+	(void) sink;
+
+	values[0] = Int64GetDatum(calls);
+	values[1] = Int64GetDatum(bytes);
+	if (calls == 0)
+	{
+		nulls[2] = true;
+		nulls[4] = true;
+	}
+	else
+	{
+		values[2] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(duration) * 1e9 / calls);
+		values[4] = Float8GetDatum((double) alloc_size * iterations / calls);
+	}
+	if (bytes == 0)
+		nulls[3] = true;
+	else
+		values[3] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(duration) * 1e9 / bytes);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+#endif							/* PGSM_BENCHMARK */
+
 static void
 pgsm_lock_aquire(pgsmSharedState *pgsm, LWLockMode mode)
 {
+	/*
+	 * Only time the lock when we have to wait for it, the uncontended case is
+	 * too cheap to be worth two clock reads.
+	 */
+	if (!LWLockConditionalAcquire(pgsm->lock, mode))
+	{
+		instr_time	start;
+		instr_time	now;
+
+		INSTR_TIME_SET_CURRENT(start);
+		LWLockAcquire(pgsm->lock, mode);
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_ACCUM_DIFF(hook_time[PGSM_HS_LOCK_WAIT], now, start);
+		hook_calls[PGSM_HS_LOCK_WAIT]++;
+	}
+
+	/* Disable error capturing while holding the lock to avoid deadlocks */
+	disable_error_capture = true;
+}
+
+/*
+ * Take pgsm->lock in exclusive mode if it is free.  Otherwise wait until it
+ * is released and return false without taking it, so that the caller can
+ * first check whether the backend which held it did the work already.
+ */
+static bool
+pgsm_lock_aquire_or_wait(pgsmSharedState *pgsm)
+{
+	if (!LWLockConditionalAcquire(pgsm->lock, LW_EXCLUSIVE))
+	{
+		instr_time	start;
+		instr_time	now;
+		bool		acquired;
+
+		INSTR_TIME_SET_CURRENT(start);
+		acquired = LWLockAcquireOrWait(pgsm->lock, LW_EXCLUSIVE);
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_ACCUM_DIFF(hook_time[PGSM_HS_LOCK_WAIT], now, start);
+		hook_calls[PGSM_HS_LOCK_WAIT]++;
+
+		if (!acquired)
+			return false;
+	}
+
 	/* Disable error capturing while holding the lock to avoid deadlocks */
-	LWLockAcquire(pgsm->lock, mode);
 	disable_error_capture = true;
+	return true;
 }
 
 static void
@@ -21,13 +21,14 @@ my %pg_versions_pgsm_columns = (
 	19 => "application_name,"
 	  . "bucket,bucket_done,bucket_start_time,calls,"
 	  . "client_ip,cmd_type,cmd_type_text,comments,cpu_sys_time,cpu_user_time,"
-	  . "custom_plan_calls,datname,dbid,elevel,generic_plan_calls,"
+	  . "custom_plan_calls,datname,dbid,elevel,exec_mem_calls,generic_plan_calls,"
 	  . "jit_deform_count,jit_deform_time,"
 	  . "jit_emission_count,jit_emission_time,jit_functions,jit_generation_time,"
 	  . "jit_inlining_count,jit_inlining_time,jit_optimization_count,jit_optimization_time,"
 	  . "local_blk_read_time,local_blk_write_time,local_blks_dirtied,local_blks_hit,"
-	  . "local_blks_read,local_blks_written,max_exec_time,max_plan_time,mean_exec_time,"
-	  . "mean_plan_time,message,min_exec_time,min_plan_time,minmax_stats_since,"
+	  . "local_blks_read,local_blks_written,max_exec_mem,max_exec_time,max_plan_time,"
+	  . "mean_exec_mem,mean_exec_time,"
+	  . "mean_plan_time,message,min_exec_mem,min_exec_time,min_plan_time,minmax_stats_since,"
 	  . "parallel_workers_launched,parallel_workers_to_launch,"
 	  . "pgsm_query_id,planid,plans,query,query_plan,queryid,relations,resp_calls,rows,"
 	  . "shared_blk_read_time,shared_blk_write_time,shared_blks_dirtied,"
@@ -39,12 +40,13 @@ my %pg_versions_pgsm_columns = (
 	18 => "application_name,"
 	  . "bucket,bucket_done,bucket_start_time,calls,"
 	  . "client_ip,cmd_type,cmd_type_text,comments,cpu_sys_time,cpu_user_time,"
-	  . "datname,dbid,elevel,jit_deform_count,jit_deform_time,"
+	  . "datname,dbid,elevel,exec_mem_calls,jit_deform_count,jit_deform_time,"
 	  . "jit_emission_count,jit_emission_time,jit_functions,jit_generation_time,"
 	  . "jit_inlining_count,jit_inlining_time,jit_optimization_count,jit_optimization_time,"
 	  . "local_blk_read_time,local_blk_write_time,local_blks_dirtied,local_blks_hit,"
-	  . "local_blks_read,local_blks_written,max_exec_time,max_plan_time,mean_exec_time,"
-	  . "mean_plan_time,message,min_exec_time,min_plan_time,minmax_stats_since,"
+	  . "local_blks_read,local_blks_written,max_exec_mem,max_exec_time,max_plan_time,"
+	  . "mean_exec_mem,mean_exec_time,"
+	  . "mean_plan_time,message,min_exec_mem,min_exec_time,min_plan_time,minmax_stats_since,"
 	  . "parallel_workers_launched,parallel_workers_to_launch,"
 	  . "pgsm_query_id,planid,plans,query,query_plan,queryid,relations,resp_calls,rows,"
 	  . "shared_blk_read_time,shared_blk_write_time,shared_blks_dirtied,"
@@ -56,12 +58,13 @@ my %pg_versions_pgsm_columns = (
 	17 => "application_name,"
 	  . "bucket,bucket_done,bucket_start_time,calls,"
 	  . "client_ip,cmd_type,cmd_type_text,comments,cpu_sys_time,cpu_user_time,"
-	  . "datname,dbid,elevel,jit_deform_count,jit_deform_time,"
+	  . "datname,dbid,elevel,exec_mem_calls,jit_deform_count,jit_deform_time,"
 	  . "jit_emission_count,jit_emission_time,jit_functions,jit_generation_time,"
 	  . "jit_inlining_count,jit_inlining_time,jit_optimization_count,jit_optimization_time,"
 	  . "local_blk_read_time,local_blk_write_time,local_blks_dirtied,local_blks_hit,"
-	  . "local_blks_read,local_blks_written,max_exec_time,max_plan_time,mean_exec_time,"
-	  . "mean_plan_time,message,min_exec_time,min_plan_time,minmax_stats_since,"
+	  . "local_blks_read,local_blks_written,max_exec_mem,max_exec_time,max_plan_time,"
+	  . "mean_exec_mem,mean_exec_time,"
+	  . "mean_plan_time,message,min_exec_mem,min_exec_time,min_plan_time,minmax_stats_since,"
 	  . "pgsm_query_id,planid,plans,query,query_plan,queryid,relations,resp_calls,rows,"
 	  . "shared_blk_read_time,shared_blk_write_time,shared_blks_dirtied,"
 	  . "shared_blks_hit,shared_blks_read,shared_blks_written,sqlcode,stats_since,"
@@ -71,12 +74,13 @@ my %pg_versions_pgsm_columns = (
 	16 => "application_name,blk_read_time,"
 	  . "blk_write_time,bucket,bucket_done,bucket_start_time,calls,"
 	  . "client_ip,cmd_type,cmd_type_text,comments,cpu_sys_time,cpu_user_time,"
-	  . "datname,dbid,elevel,jit_emission_count,jit_emission_time,jit_functions,"
+	  . "datname,dbid,elevel,exec_mem_calls,jit_emission_count,jit_emission_time,jit_functions,"
 	  . "jit_generation_time,jit_inlining_count,jit_inlining_time,"
 	  . "jit_optimization_count,jit_optimization_time,"
 	  . "local_blks_dirtied,local_blks_hit,local_blks_read,"
-	  . "local_blks_written,max_exec_time,max_plan_time,mean_exec_time,"
-	  . "mean_plan_time,message,min_exec_time,min_plan_time,pgsm_query_id,planid,"
+	  . "local_blks_written,max_exec_mem,max_exec_time,max_plan_time,"
+	  . "mean_exec_mem,mean_exec_time,"
+	  . "mean_plan_time,message,min_exec_mem,min_exec_time,min_plan_time,pgsm_query_id,planid,"
 	  . "plans,query,query_plan,queryid,relations,resp_calls,"
 	  . "rows,shared_blks_dirtied,shared_blks_hit,shared_blks_read,"
 	  . "shared_blks_written,sqlcode,stddev_exec_time,stddev_plan_time,"
@@ -86,12 +90,13 @@ my %pg_versions_pgsm_columns = (
 	15 => "application_name,blk_read_time,"
 	  . "blk_write_time,bucket,bucket_done,bucket_start_time,calls,"
 	  . "client_ip,cmd_type,cmd_type_text,comments,cpu_sys_time,cpu_user_time,"
-	  . "datname,dbid,elevel,jit_emission_count,jit_emission_time,jit_functions,"
+	  . "datname,dbid,elevel,exec_mem_calls,jit_emission_count,jit_emission_time,jit_functions,"
 	  . "jit_generation_time,jit_inlining_count,jit_inlining_time,"
 	  . "jit_optimization_count,jit_optimization_time,"
 	  . "local_blks_dirtied,local_blks_hit,local_blks_read,"
-	  . "local_blks_written,max_exec_time,max_plan_time,mean_exec_time,"
-	  . "mean_plan_time,message,min_exec_time,min_plan_time,pgsm_query_id,planid,"
+	  . "local_blks_written,max_exec_mem,max_exec_time,max_plan_time,"
+	  . "mean_exec_mem,mean_exec_time,"
+	  . "mean_plan_time,message,min_exec_mem,min_exec_time,min_plan_time,pgsm_query_id,planid,"
 	  . "plans,query,query_plan,queryid,relations,resp_calls,"
 	  . "rows,shared_blks_dirtied,shared_blks_hit,shared_blks_read,"
 	  . "shared_blks_written,sqlcode,stddev_exec_time,stddev_plan_time,"
@@ -101,9 +106,10 @@ my %pg_versions_pgsm_columns = (
 	14 => "application_name,blk_read_time,"
 	  . "blk_write_time,bucket,bucket_done,bucket_start_time,calls,"
 	  . "client_ip,cmd_type,cmd_type_text,comments,cpu_sys_time,cpu_user_time,"
-	  . "datname,dbid,elevel,local_blks_dirtied,local_blks_hit,local_blks_read,"
-	  . "local_blks_written,max_exec_time,max_plan_time,mean_exec_time,"
-	  . "mean_plan_time,message,min_exec_time,min_plan_time,pgsm_query_id,planid,"
+	  . "datname,dbid,elevel,exec_mem_calls,local_blks_dirtied,local_blks_hit,local_blks_read,"
+	  . "local_blks_written,max_exec_mem,max_exec_time,max_plan_time,"
+	  . "mean_exec_mem,mean_exec_time,"
+	  . "mean_plan_time,message,min_exec_mem,min_exec_time,min_plan_time,pgsm_query_id,planid,"
 	  . "plans,query,query_plan,queryid,relations,resp_calls,"
 	  . "rows,shared_blks_dirtied,shared_blks_hit,shared_blks_read,"
 	  . "shared_blks_written,sqlcode,stddev_exec_time,stddev_plan_time,"
@@ -0,0 +1,84 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_save = on
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+for my $i (1 .. 5)
+{
+	$node->safe_psql('postgres', 'SELECT 1 AS saved_num;');
+}
+
+my $before = trim($node->safe_psql('postgres',
+	"SELECT calls || ' ' || query FROM pg_stat_monitor WHERE query = 'SELECT 1 AS saved_num';"));
+is($before, '5 SELECT 1 AS saved_num', "Check: statement is tracked");
+
+# A clean shutdown saves the statistics and the next start loads them
+$node->stop('fast');
+ok(-f $node->data_dir . '/pg_stat/pg_stat_monitor.stat', "Check: statistics file written");
+$node->start;
+
+$node->poll_query_until('postgres',
+	"SELECT count(*) > 0 FROM pg_stat_monitor WHERE query = 'SELECT 1 AS saved_num';");
+my $after = trim($node->safe_psql('postgres',
+	"SELECT calls || ' ' || query FROM pg_stat_monitor WHERE query = 'SELECT 1 AS saved_num';"));
+is($after, $before, "Check: statistics survive a restart");
+ok(!-f $node->data_dir . '/pg_stat/pg_stat_monitor.stat', "Check: statistics file removed after loading");
+
+# A corrupted file is ignored as a whole
+$node->stop('fast');
+my $stat_file = $node->data_dir . '/pg_stat/pg_stat_monitor.stat';
+open(my $fh, '+<', $stat_file) or die "could not open $stat_file: $!";
+binmode($fh);
+seek($fh, -1, 2);
+read($fh, my $last, 1);
+seek($fh, -1, 2);
+print $fh chr(ord($last) ^ 0xff);
+close($fh);
+$node->start;
+
+$node->poll_query_until('postgres',
+	"SELECT count(*) = 0 FROM pg_ls_dir('pg_stat') AS f WHERE f = 'pg_stat_monitor.stat';");
+$after = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_monitor WHERE query = 'SELECT 1 AS saved_num';"));
+is($after, '0', "Check: corrupted statistics file is not loaded");
+
+# Nothing is saved on an immediate shutdown
+$node->stop('immediate');
+ok(!-f $node->data_dir . '/pg_stat/pg_stat_monitor.stat', "Check: no statistics file after immediate shutdown");
+$node->start;
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
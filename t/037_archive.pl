@@ -0,0 +1,76 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_bucket_time = 1
+pg_stat_monitor.pgsm_max_buckets = 10
+pg_stat_monitor.pgsm_save = on
+pg_stat_monitor.pgsm_archive_directory = 'pgsm_archive'
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+for my $i (1 .. 3)
+{
+	$node->safe_psql('postgres', 'SELECT 1 AS archived_num;');
+}
+
+# The bucket is archived once a later statement closes it
+$node->poll_query_until('postgres',
+	"SELECT pg_sleep(0.5), count(*) > 0 FROM pg_stat_monitor_archive() WHERE query = 'SELECT 1 AS archived_num';",
+	"|t");
+
+my $archived = trim($node->safe_psql('postgres',
+	"SELECT sum(calls) FROM pg_stat_monitor_archive() WHERE query = 'SELECT 1 AS archived_num';"));
+is($archived, '3', "Check: closed bucket is archived");
+
+my @files = glob($node->data_dir . '/pgsm_archive/pgsm-*.archive');
+ok(scalar(@files) > 0, "Check: archive file written");
+
+my $filtered = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_monitor_archive(now() + interval '1 hour');"));
+is($filtered, '0', "Check: archive is filtered by bucket start time");
+
+# Buckets archived before a restart are not archived again after it
+$node->restart;
+
+$node->safe_psql('postgres', 'SELECT 2 AS archived_num;');
+$node->poll_query_until('postgres',
+	"SELECT pg_sleep(0.5), count(*) > 0 FROM pg_stat_monitor_archive() WHERE query = 'SELECT 2 AS archived_num';",
+	"|t");
+
+$archived = trim($node->safe_psql('postgres',
+	"SELECT sum(calls) FROM pg_stat_monitor_archive() WHERE query = 'SELECT 1 AS archived_num';"));
+is($archived, '3', "Check: no bucket archived twice across a restart");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	"SET ROLE pg_read_all_stats; SELECT count(*) FROM pg_stat_monitor_archive();");
+like($stderr, qr/permission denied/, "Check: archive is not readable by default");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
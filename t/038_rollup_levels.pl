@@ -0,0 +1,67 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+# Two 1s buckets, then five 2s buckets, then five 10s buckets
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_bucket_time = 1
+pg_stat_monitor.pgsm_max_buckets = 2
+pg_stat_monitor.pgsm_rollup_levels = '5x2,5x10'
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+for my $i (1 .. 3)
+{
+	$node->safe_psql('postgres', 'SELECT 1 AS rolled_num;');
+}
+
+# Expired buckets are merged into the first rollup level ...
+ok($node->poll_query_until('postgres',
+	"SELECT pg_sleep(0.2), coalesce(sum(calls), 0) = 3 FROM pg_stat_monitor m JOIN pg_stat_monitor_buckets() b USING (bucket) WHERE query = 'SELECT 1 AS rolled_num' AND b.level = 1;",
+	"|t"), "Check: statement is merged into the first rollup level");
+
+# ... and later into the second one, keeping all calls on the way
+ok($node->poll_query_until('postgres',
+	"SELECT pg_sleep(0.5), coalesce(sum(calls), 0) = 3 FROM pg_stat_monitor m JOIN pg_stat_monitor_buckets() b USING (bucket) WHERE query = 'SELECT 1 AS rolled_num' AND b.level = 2;",
+	"|t"), "Check: statement is merged into the second rollup level");
+
+my $total = trim($node->safe_psql('postgres',
+	"SELECT sum(calls) FROM pg_stat_monitor WHERE query = 'SELECT 1 AS rolled_num';"));
+is($total, '3', "Check: calls are not counted twice");
+
+my $levels = trim($node->safe_psql('postgres',
+	"SELECT string_agg(DISTINCT level || ':' || bucket_time, ',') FROM pg_stat_monitor_buckets();"));
+is($levels, '0:1,1:2,2:10', "Check: buckets of every level are listed");
+
+$node->stop;
+
+# Invalid levels prevent the server from starting
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_rollup_levels = '5x3,5x10'\n");
+my $ret = $node->start(fail_ok => 1);
+is($ret, 0, "Check: level times must be multiples of the previous level");
+
+# Done testing for this testcase file.
+done_testing();
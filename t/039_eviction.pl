@@ -0,0 +1,76 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_max = 10
+pg_stat_monitor.pgsm_bucket_time = 3600
+pg_stat_monitor.pgsm_eviction = least_calls
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+$node->safe_psql('postgres',
+	join("\n", map { "SELECT 1 AS hot_query;" } 1 .. 50));
+
+# Far more distinct statements than the hash table holds
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	join("\n", map { "SELECT $_ AS evicted_$_;" } 1 .. 10000));
+is($cmdret, 0, "Run many distinct statements");
+unlike($stderr, qr/out of memory/, "Check: no statement dropped");
+
+my $hot = trim($node->safe_psql('postgres',
+	"SELECT calls FROM pg_stat_monitor WHERE query = 'SELECT 1 AS hot_query';"));
+is($hot, '50', "Check: frequent statement is kept");
+
+my $other = trim($node->safe_psql('postgres',
+	"SELECT count(*) = 1 AND sum(calls) > 0 FROM pg_stat_monitor WHERE query = '<other>';"));
+is($other, 't', "Check: evicted statements are merged into one other row");
+
+my $total = trim($node->safe_psql('postgres',
+	"SELECT sum(calls) >= 10000 FROM pg_stat_monitor WHERE query LIKE 'SELECT % AS evicted_%' OR query = '<other>';"));
+is($total, 't', "Check: no calls are lost");
+
+# The clock policy takes its victims from the batch picked by the last scan
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_eviction = clock\n");
+$node->restart;
+
+$node->safe_psql('postgres', 'SELECT pg_stat_monitor_reset();');
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	join("\n", map { "SELECT $_ AS clock_$_;" } 1 .. 10000));
+is($cmdret, 0, "Run many distinct statements with the clock policy");
+
+$total = trim($node->safe_psql('postgres',
+	"SELECT sum(calls) >= 10000 FROM pg_stat_monitor WHERE query LIKE 'SELECT % AS clock_%' OR query = '<other>';"));
+is($total, 't', "Check: no calls are lost with the clock policy");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
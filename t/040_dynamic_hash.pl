@@ -0,0 +1,90 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+if ($PGSM::PG_MAJOR_VERSION <= 14)
+{
+	plan skip_all => "pg_stat_monitor test cases for versions 14 and below.";
+}
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_dynamic_hash = on
+pg_stat_monitor.pgsm_dynamic_hash_max = 10
+pg_stat_monitor.pgsm_bucket_time = 3600
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+$node->safe_psql('postgres',
+	join("\n", map { "SELECT $_ AS dynamic_$_;" } 1 .. 100));
+
+my $count = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_monitor WHERE query LIKE 'SELECT % AS dynamic_%';"));
+is($count, '100', "Check: statements are tracked in the dynamic hash table");
+
+# Fill the table up to its limit
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	join("\n", map { "SELECT $_ AS filler_$_;" } 1 .. 20000));
+is($cmdret, 0, "Run more distinct statements than the limit allows");
+
+my $full = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_monitor;"));
+ok($full > 100 && $full < 20100, "Check: the table stops growing at its limit");
+
+# A full table drops new statements instead of failing them
+$node->safe_psql('postgres',
+	join("\n", map { "SELECT $_ AS full_$_, repeat('x', $_) AS padding;" } 1 .. 5000));
+
+my $dropped = trim($node->safe_psql('postgres',
+	"SELECT calls > 0 FROM pg_stat_monitor_hook_stats() WHERE name = 'oom_drop';"));
+is($dropped, 't', "Check: statements past the limit are counted as dropped");
+
+# Raising the limit takes effect on reload
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_dynamic_hash_max = 1024\n");
+$node->reload;
+
+$node->safe_psql('postgres',
+	join("\n", map { "SELECT $_ AS grown_$_;" } 1 .. 100));
+
+$count = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_monitor WHERE query LIKE 'SELECT % AS grown_%';"));
+is($count, '100', "Check: the table grows after raising the limit");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+$count = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_monitor WHERE query LIKE 'SELECT % AS grown_%';"));
+is($count, '0', "Check: reset empties the dynamic hash table");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
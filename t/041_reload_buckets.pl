@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_bucket_time = 3600
+pg_stat_monitor.pgsm_max_buckets = 10
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+my $hist = trim($node->safe_psql('postgres',
+	"SELECT 1 AS before_reload; SELECT array_length(resp_calls, 1) FROM pg_stat_monitor WHERE query = 'SELECT 1 AS before_reload';"));
+is($hist, "1\n22", "Check: histogram with the initial settings");
+
+# Shorter and fewer buckets, and a smaller histogram, without a restart
+$node->append_conf(
+	'postgresql.conf', qq(
+pg_stat_monitor.pgsm_bucket_time = 1
+pg_stat_monitor.pgsm_max_buckets = 3
+pg_stat_monitor.pgsm_histogram_buckets = 5
+));
+$node->reload;
+
+ok($node->poll_query_until('postgres',
+	"SELECT bucket_time = 1 FROM pg_stat_monitor_buckets() WHERE current;"),
+	"Check: the current bucket has the new bucket time");
+
+$hist = trim($node->safe_psql('postgres',
+	"SELECT b.bucket_time, array_length(s.resp_calls, 1) FROM pg_stat_monitor s JOIN pg_stat_monitor_buckets() b USING (bucket) WHERE s.query = 'SELECT 1 AS before_reload';"));
+is($hist, "3600|22", "Check: the bucket before the reload keeps its bucket time and histogram");
+
+ok($node->poll_query_until('postgres',
+	"SELECT pg_sleep(1), max(bucket) < 3 FROM pg_stat_monitor_buckets();",
+	"|t"),
+	"Check: the ring has the new number of buckets");
+
+$hist = trim($node->safe_psql('postgres',
+	"SELECT 1 AS after_reload; SELECT array_length(resp_calls, 1) FROM pg_stat_monitor WHERE query = 'SELECT 1 AS after_reload';"));
+is($hist, "1\n7", "Check: histogram with the new settings");
+
+my $settings = trim($node->safe_psql('postgres',
+	"SELECT string_agg(context, ',' ORDER BY name) FROM pg_settings WHERE name IN ('pg_stat_monitor.pgsm_bucket_time', 'pg_stat_monitor.pgsm_max_buckets', 'pg_stat_monitor.pgsm_histogram_buckets');"));
+is($settings, 'sighup,sighup,sighup', "Check: settings are reloadable");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_track_overhead = on
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+$node->safe_psql('postgres',
+	join("\n", "CREATE TABLE t1 (a int);",
+		map { "INSERT INTO t1 VALUES ($_); SELECT * FROM t1 WHERE a = $_;" } 1 .. 100));
+
+my $rows = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_monitor_hook_stats();"));
+is($rows, '18', "Check: every hook and step has a row");
+
+my $calls = trim($node->safe_psql('postgres',
+	"SELECT calls FROM pg_stat_monitor_hook_stats() WHERE name = 'executor_end';"));
+ok($calls >= 200, "Check: executor_end calls are counted");
+
+my $store = trim($node->safe_psql('postgres',
+	"SELECT calls > 0 AND total_time > 0 FROM pg_stat_monitor_hook_stats() WHERE name = 'store';"));
+is($store, 't', "Check: pgsm_store calls and time are collected");
+
+my $null_time = trim($node->safe_psql('postgres',
+	"SELECT total_time IS NULL FROM pg_stat_monitor_hook_stats() WHERE name = 'dsa_alloc';"));
+is($null_time, 't', "Check: counted only steps have no time");
+
+# Without pgsm_track_overhead only the calls keep going up
+$node->append_conf('postgresql.conf', "pg_stat_monitor.pgsm_track_overhead = off\n");
+$node->reload;
+
+my $before = trim($node->safe_psql('postgres',
+	"SELECT total_time FROM pg_stat_monitor_hook_stats() WHERE name = 'executor_end';"));
+$node->safe_psql('postgres',
+	join("\n", map { "SELECT * FROM t1 WHERE a = $_;" } 1 .. 100));
+my $after = trim($node->safe_psql('postgres',
+	"SELECT total_time FROM pg_stat_monitor_hook_stats() WHERE name = 'executor_end';"));
+is($after, $before, "Check: no time is collected with pgsm_track_overhead off");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
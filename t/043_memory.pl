@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_bucket_time = 3600
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+$node->safe_psql('postgres',
+	join("\n", map { "SELECT $_ AS memory_$_;" } 1 .. 100));
+
+my $entries = trim($node->safe_psql('postgres',
+	"SELECT entries >= 100 AND entries <= max_entries FROM pg_stat_monitor_memory() WHERE bucket IS NULL;"));
+is($entries, 't', "Check: the total row counts the entries");
+
+my $sums = trim($node->safe_psql('postgres',
+	"SELECT sum(entries) FILTER (WHERE bucket IS NOT NULL) = sum(entries) FILTER (WHERE bucket IS NULL) AND " .
+	"sum(text_bytes) FILTER (WHERE bucket IS NOT NULL) = sum(text_bytes) FILTER (WHERE bucket IS NULL) " .
+	"FROM pg_stat_monitor_memory();"));
+is($sums, 't', "Check: the bucket rows add up to the total row");
+
+my $texts = trim($node->safe_psql('postgres',
+	"SELECT texts >= 100 AND avg_text_len > 0 AND entry_bytes > 0 FROM pg_stat_monitor_memory() WHERE bucket IS NULL;"));
+is($texts, 't', "Check: query texts are counted");
+
+my $dsa = trim($node->safe_psql('postgres',
+	"SELECT dsa_bytes > 0 AND dsa_free_bytes < dsa_bytes AND dsa_overflow_bytes = 0 FROM pg_stat_monitor_memory() WHERE bucket IS NULL;"));
+if ($PGSM::PG_MAJOR_VERSION >= 17)
+{
+	is($dsa, 't', "Check: dsa area usage is reported");
+}
+else
+{
+	is($dsa, '', "Check: dsa area usage is unknown before PostgreSQL 17");
+}
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,197 @@
+#!/usr/bin/perl
+
+# Overhead benchmark.  Runs fixed pgbench workloads without pg_stat_monitor,
+# with it at its defaults and with each of its costlier features enabled, and
+# writes TPS, latency percentiles and the change against the run without
+# pg_stat_monitor to t/results/044_benchmark.json.
+#
+# Skipped unless PGSM_BENCHMARK is set.  PGSM_BENCHMARK_DURATION (seconds per
+# run, default 10), PGSM_BENCHMARK_CLIENTS (default 4) and
+# PGSM_BENCHMARK_SCALE (default 10) size the runs.
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Temp qw(tempdir);
+use JSON::PP;
+use Test::More;
+use lib 't';
+use pgsm;
+
+if (!$ENV{PGSM_BENCHMARK})
+{
+	plan skip_all => "benchmarks only run with PGSM_BENCHMARK set.";
+}
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+my $duration = $ENV{PGSM_BENCHMARK_DURATION} // 10;
+my $clients = $ENV{PGSM_BENCHMARK_CLIENTS} // 4;
+my $scale = $ENV{PGSM_BENCHMARK_SCALE} // 10;
+my $bench_dir = 't/bench';
+my $result_file = 't/results/044_benchmark.json';
+
+# name => [ script, pgbench protocol ]
+my @workloads = (
+	[ 'point_select', 'point_select.sql', 'simple' ],
+	[ 'prepared_select', 'point_select.sql', 'prepared' ],
+	[ 'nested_plpgsql', 'nested_plpgsql.sql', 'simple' ],
+	[ 'utility', 'utility.sql', 'simple' ],
+	[ 'error', 'error.sql', 'simple' ],
+);
+
+# name => settings; "off" does not load pg_stat_monitor at all
+my @configs = (
+	[ 'off', undef ],
+	[ 'defaults', {} ],
+	[ 'query_plan', { 'pg_stat_monitor.pgsm_enable_query_plan' => 'on' } ],
+	[ 'comments', { 'pg_stat_monitor.pgsm_extract_comments' => 'on' } ],
+	[ 'track_all', { 'pg_stat_monitor.pgsm_track' => 'all' } ],
+	[ 'normalized', { 'pg_stat_monitor.pgsm_normalized_query' => 'on' } ],
+);
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+max_connections = 100
+shared_buffers = 256MB
+));
+
+# Start server
+$node->start;
+
+my $port = $node->port;
+
+my $cmdret = system("pgbench -i -q -s $scale -p $port postgres");
+is($cmdret, 0, "Perform pgbench init");
+
+open(my $setup_fh, '<', "$bench_dir/setup.sql")
+  or die "could not open $bench_dir/setup.sql: $!";
+my $setup_sql = do { local $/; <$setup_fh> };
+close($setup_fh);
+
+($cmdret, my $stdout, my $stderr) = $node->psql('postgres', $setup_sql);
+is($cmdret, 0, "Create benchmark objects");
+
+# Return the given percentile of a sorted list
+sub percentile
+{
+	my ($sorted, $p) = @_;
+
+	return undef if !@$sorted;
+	return $sorted->[ int($p / 100 * $#$sorted + 0.5) ];
+}
+
+# Run one workload, returning its TPS and latency percentiles in ms, read from
+# the per-transaction logs of pgbench.
+sub run_workload
+{
+	my ($script, $protocol) = @_;
+	my $log_dir = tempdir(CLEANUP => 1);
+	my @latencies;
+	my $out;
+
+	$out = `pgbench -n -c $clients -j $clients -T $duration -M $protocol -f $bench_dir/$script -l --log-prefix=$log_dir/bench -p $port postgres 2>&1`;
+	return undef if $? != 0;
+
+	my ($tps) = $out =~ /tps = ([0-9.]+)/;
+
+	foreach my $log (glob("$log_dir/bench*"))
+	{
+		open(my $fh, '<', $log) or die "could not open $log: $!";
+		while (my $line = <$fh>)
+		{
+			# client_id transaction_no time script_no time_epoch time_us
+			my @fields = split(/\s+/, $line);
+			push @latencies, $fields[2] / 1000.0;
+		}
+		close($fh);
+	}
+
+	@latencies = sort { $a <=> $b } @latencies;
+
+	return {
+		tps => $tps + 0,
+		transactions => scalar(@latencies),
+		latency_p50_ms => percentile(\@latencies, 50),
+		latency_p95_ms => percentile(\@latencies, 95),
+		latency_p99_ms => percentile(\@latencies, 99),
+	};
+}
+
+my %results;
+
+foreach my $config (@configs)
+{
+	my ($config_name, $settings) = @$config;
+
+	$node->safe_psql('postgres', 'ALTER SYSTEM RESET ALL;');
+	if (defined $settings)
+	{
+		$node->safe_psql('postgres',
+			"ALTER SYSTEM SET shared_preload_libraries = 'pg_stat_monitor';");
+		foreach my $name (sort keys %$settings)
+		{
+			$node->safe_psql('postgres',
+				"ALTER SYSTEM SET $name = '$settings->{$name}';");
+		}
+	}
+	$node->restart;
+
+	if (defined $settings)
+	{
+		$node->safe_psql('postgres',
+			'CREATE EXTENSION IF NOT EXISTS pg_stat_monitor;');
+		$node->safe_psql('postgres', 'SELECT pg_stat_monitor_reset();');
+	}
+
+	foreach my $workload (@workloads)
+	{
+		my ($workload_name, $script, $protocol) = @$workload;
+		my $result = run_workload($script, $protocol);
+
+		ok(defined $result, "Run $workload_name with $config_name");
+		$results{$workload_name}{$config_name} = $result if defined $result;
+	}
+}
+
+# Compare every run to the one without pg_stat_monitor
+foreach my $workload_name (keys %results)
+{
+	my $baseline = $results{$workload_name}{off};
+
+	next if !defined $baseline || !$baseline->{tps};
+
+	foreach my $config_name (keys %{ $results{$workload_name} })
+	{
+		my $result = $results{$workload_name}{$config_name};
+
+		$result->{tps_delta_pct} =
+		  ($result->{tps} - $baseline->{tps}) / $baseline->{tps} * 100;
+		$result->{latency_p99_delta_pct} =
+		  ($result->{latency_p99_ms} - $baseline->{latency_p99_ms}) /
+		  $baseline->{latency_p99_ms} * 100
+		  if $baseline->{latency_p99_ms};
+	}
+}
+
+open(my $fh, '>', $result_file) or die "could not open $result_file: $!";
+print $fh JSON::PP->new->canonical->pretty->encode(
+	{
+		pg_major_version => $PGSM::PG_MAJOR_VERSION,
+		duration => $duration,
+		clients => $clients,
+		scale => $scale,
+		results => \%results,
+	});
+close($fh);
+
+diag("benchmark results written to $result_file");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,122 @@
+#!/usr/bin/perl
+
+# Microbenchmarks of the text kernels run for every statement: query
+# normalization, the pgsm_query_id hash, comment extraction and the histogram
+# bucket lookup.  Each kernel runs over the statement corpora in t/bench, and
+# the time per call and per byte and the memory per call go to
+# t/results/045_bench_kernels.json.
+#
+# Skipped unless PGSM_BENCHMARK is set, and unless pg_stat_monitor was built
+# with it set, see CONTRIBUTING.md.  PGSM_BENCHMARK_ITERATIONS (passes over
+# each corpus, default 10000) sizes the runs.
+
+use strict;
+use warnings;
+use File::Basename;
+use JSON::PP;
+use Test::More;
+use lib 't';
+use pgsm;
+
+if (!$ENV{PGSM_BENCHMARK})
+{
+	plan skip_all => "benchmarks only run with PGSM_BENCHMARK set.";
+}
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+my $iterations = $ENV{PGSM_BENCHMARK_ITERATIONS} // 10000;
+my $bench_dir = 't/bench';
+my $result_file = 't/results/045_bench_kernels.json';
+my @corpora = ('oltp', 'orm', 'comments');
+my @kernels = ('normalize', 'query_id_hash', 'comments', 'histogram');
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+));
+
+# Start server
+$node->start;
+
+my $port = $node->port;
+
+# The kernel benchmark is not part of the extension's SQL API, nor of builds
+# without PGSM_BENCHMARK
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres', q{
+CREATE FUNCTION pg_stat_monitor_bench_kernel(
+    IN kernel                text,
+    IN queries               text[],
+    IN iterations            int,
+    OUT calls                int8,
+    OUT bytes                int8,
+    OUT ns_per_call          float8,
+    OUT ns_per_byte          float8,
+    OUT alloc_bytes_per_call float8
+)
+RETURNS SETOF record
+LANGUAGE c
+AS '$libdir/pg_stat_monitor', 'pg_stat_monitor_bench_kernel';
+});
+if ($cmdret != 0)
+{
+	$node->stop;
+	plan skip_all => "pg_stat_monitor was built without PGSM_BENCHMARK.";
+}
+
+# The corpora run against the pgbench tables
+$cmdret = system("pgbench -i -q -s 1 -p $port postgres");
+is($cmdret, 0, "Perform pgbench init");
+
+my %results;
+
+foreach my $corpus (@corpora)
+{
+	my $file = "$bench_dir/corpus_$corpus.sql";
+
+	open(my $fh, '<', $file) or die "could not open $file: $!";
+	my @queries = grep { /\S/ } map { chomp; $_ } <$fh>;
+	close($fh);
+
+	# Quote the statements as an array literal
+	my $array = 'ARRAY[' . join(', ', map { my $q = $_; $q =~ s/'/''/g; "'$q'" } @queries) . ']';
+
+	foreach my $kernel (@kernels)
+	{
+		my $out = $node->safe_psql('postgres',
+			"SELECT calls, bytes, ns_per_call, ns_per_byte, alloc_bytes_per_call " .
+			"FROM pg_stat_monitor_bench_kernel('$kernel', $array, $iterations);");
+		my ($calls, $bytes, $ns_per_call, $ns_per_byte, $alloc) = split(/\|/, $out);
+
+		ok($calls > 0, "Run $kernel over the $corpus corpus");
+
+		$results{$corpus}{$kernel} = {
+			calls => $calls + 0,
+			bytes => $bytes + 0,
+			ns_per_call => $ns_per_call eq '' ? undef : $ns_per_call + 0,
+			ns_per_byte => $ns_per_byte eq '' ? undef : $ns_per_byte + 0,
+			alloc_bytes_per_call => $alloc eq '' ? undef : $alloc + 0,
+		};
+	}
+}
+
+open(my $fh, '>', $result_file) or die "could not open $result_file: $!";
+print $fh JSON::PP->new->canonical->pretty->encode(
+	{
+		pg_major_version => $PGSM::PG_MAJOR_VERSION,
+		iterations => $iterations,
+		results => \%results,
+	});
+close($fh);
+
+diag("benchmark results written to $result_file");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
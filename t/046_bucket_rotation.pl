@@ -0,0 +1,80 @@
+#!/usr/bin/perl
+
+# Drive many clients across rapid bucket boundaries and check that no calls
+# are lost around bucket rotation.  PGSM_STRESS_CLIENTS (default 8) and
+# PGSM_STRESS_DURATION (seconds, default 3) size the run, which crosses a
+# boundary every second.
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+my $clients = $ENV{PGSM_STRESS_CLIENTS} // 8;
+my $duration = $ENV{PGSM_STRESS_DURATION} // 3;
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+# Enough buckets for none to be recycled during the run
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+max_connections = 100
+pg_stat_monitor.pgsm_bucket_time = 1
+pg_stat_monitor.pgsm_max_buckets = 3600
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+my $port = $node->port;
+my $out = `pgbench -n -c $clients -j 4 -T $duration -f t/bench/rotation_stress.sql -p $port postgres 2>&1`;
+is($?, 0, "Run concurrent clients across bucket boundaries");
+PGSM::append_to_debug_file($out);
+
+my ($issued) = $out =~ /number of transactions actually processed: (\d+)/;
+ok(defined $issued && $issued > 0, "Check: pgbench ran transactions");
+$issued //= 0;
+
+my $seen = trim($node->safe_psql('postgres',
+	"SELECT coalesce(sum(calls), 0) FROM pg_stat_monitor WHERE query LIKE 'SELECT 1 AS rotation%';"));
+my $buckets = trim($node->safe_psql('postgres',
+	"SELECT count(DISTINCT bucket) FROM pg_stat_monitor WHERE query LIKE 'SELECT 1 AS rotation%';"));
+my ($lock_waits, $lock_wait_time) = split(/\|/, trim($node->safe_psql('postgres',
+	"SELECT calls, round(total_time::numeric, 3) FROM pg_stat_monitor_hook_stats() WHERE name = 'lock_wait';")));
+my ($rotations, $rotation_time) = split(/\|/, trim($node->safe_psql('postgres',
+	"SELECT calls, round(total_time::numeric, 3) FROM pg_stat_monitor_hook_stats() WHERE name = 'bucket_rotation';")));
+
+my $report = sprintf(
+	"executions issued: %d, calls seen: %d over %d buckets, lost-update rate: %.6f\n" .
+	"lock waits: %d taking %s ms, bucket rotations: %d taking %s ms",
+	$issued, $seen, $buckets, $issued ? ($issued - $seen) / $issued : 0,
+	$lock_waits, $lock_wait_time, $rotations, $rotation_time);
+diag($report);
+PGSM::append_to_debug_file($report);
+
+ok($buckets > 1, "Check: the run spans several buckets");
+is($seen, $issued, "Check: no calls are lost around bucket rotation");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
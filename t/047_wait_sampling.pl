@@ -0,0 +1,70 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_bucket_time = 3600
+pg_stat_monitor.pgsm_wait_sampling = on
+pg_stat_monitor.pgsm_wait_sampling_frequency = 100
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+my $workers = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_activity WHERE backend_type = 'pg_stat_monitor sampler';"));
+is($workers, '1', "Check: the sampler is running");
+
+$node->safe_psql('postgres', 'SELECT pg_sleep(2) AS wait_sampling;');
+
+my $queryid = trim($node->safe_psql('postgres',
+	"SELECT queryid FROM pg_stat_monitor WHERE query LIKE '%AS wait_sampling%';"));
+isnt($queryid, '', "Check: the sleeping statement is tracked");
+
+my $samples = trim($node->safe_psql('postgres',
+	"SELECT sum(samples) FROM pg_stat_monitor_wait_events() " .
+	"WHERE queryid = $queryid AND wait_event_type = 'Timeout' AND wait_event = 'PgSleep';"));
+ok($samples >= 50, "Check: the sleep is sampled ($samples samples)");
+
+my $other = trim($node->safe_psql('postgres',
+	"SELECT count(*) FROM pg_stat_monitor_wait_events() w " .
+	"LEFT JOIN pg_stat_monitor_buckets() b USING (bucket) WHERE b.bucket IS NULL;"));
+is($other, '0', "Check: samples are in known buckets");
+
+# Samples stop with the statement
+my $before = trim($node->safe_psql('postgres',
+	"SELECT coalesce(sum(samples), 0) FROM pg_stat_monitor_wait_events() WHERE queryid = $queryid;"));
+sleep(1);
+my $after = trim($node->safe_psql('postgres',
+	"SELECT coalesce(sum(samples), 0) FROM pg_stat_monitor_wait_events() WHERE queryid = $queryid;"));
+is($after, $before, "Check: finished statements are no longer sampled");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
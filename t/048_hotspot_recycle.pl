@@ -0,0 +1,74 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use Text::Trim qw(trim);
+use Test::More;
+use lib 't';
+use pgsm;
+
+# Get filename and create out file name and dirs where requried
+PGSM::setup_files_dir(basename($0));
+
+if ($PGSM::PG_MAJOR_VERSION >= 19)
+{
+	plan skip_all => "pg_stat_monitor hotspots are not captured on versions 19 and above.";
+}
+
+# Create new PostgreSQL node and do initdb
+my $node = PGSM->pgsm_init_pg();
+
+$node->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_stat_monitor'
+pg_stat_monitor.pgsm_bucket_time = 1
+pg_stat_monitor.pgsm_max_buckets = 2
+pg_stat_monitor.pgsm_hotspot_threshold = 0
+max_parallel_workers_per_gather = 0
+));
+
+# Start server
+$node->start;
+
+my ($cmdret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	'CREATE EXTENSION pg_stat_monitor;',
+	extra_params => ['-a']);
+is($cmdret, 0, "Create PGSM EXTENSION");
+PGSM::append_to_debug_file($stdout);
+
+$node->safe_psql('postgres',
+	"CREATE TABLE hotspot_t (a int); INSERT INTO hotspot_t SELECT generate_series(1, 1000); ANALYZE hotspot_t;");
+
+($cmdret, $stdout, $stderr) = $node->psql('postgres',
+	'SELECT pg_stat_monitor_reset();');
+is($cmdret, 0, "Reset PGSM EXTENSION");
+
+my $slow = "SELECT count(*) FROM hotspot_t WHERE a <= 100";
+my $hotspots = "SELECT count(*) > 0 FROM pg_stat_monitor_hotspots() AS h JOIN pg_stat_monitor AS s USING (bucket, queryid, planid, userid, dbid, toplevel) WHERE s.query = '$slow';";
+
+# The first call marks the statement as slow, the second one is instrumented
+$node->safe_psql('postgres', "$slow; $slow;");
+
+my $result = trim($node->safe_psql('postgres', $hotspots));
+is($result, 't', "Check: the slow statement has hotspots");
+
+# Wait until every bucket with the statement has been recycled
+ok($node->poll_query_until('postgres',
+	"SELECT pg_sleep(1), count(*) = 0 FROM pg_stat_monitor WHERE query = '$slow';",
+	"|t"),
+	"Check: the buckets of the slow statement are recycled");
+
+# Still known as slow, so its first call after the recycle is instrumented
+$node->safe_psql('postgres', "$slow;");
+
+$result = trim($node->safe_psql('postgres', $hotspots));
+is($result, 't', "Check: the slow statement keeps its hotspots after the recycle");
+
+$node->safe_psql('postgres', "DROP TABLE hotspot_t;");
+
+$node->stop;
+
+# Done testing for this testcase file.
+done_testing();
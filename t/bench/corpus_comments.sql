@@ -0,0 +1,6 @@
+/* app=checkout, controller=cart, action=show, request_id=8f14e45fceea167a5a36dedd4bea2543 */ SELECT abalance FROM pgbench_accounts WHERE aid = 17;
+/* app=checkout, controller=cart, action=update */ UPDATE pgbench_accounts /* route=/cart/update */ SET abalance = abalance + 5 WHERE aid = 17 /* shard=3 */;
+SELECT /* hint: use the primary key */ bid, bbalance FROM pgbench_branches /* traceparent=00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01 */ WHERE bid = 1;
+/* sqlcommenter: db_driver='psycopg2', framework='django', route='/accounts/<int:pk>/' */ SELECT aid, abalance FROM pgbench_accounts WHERE bid = 1 AND abalance > 100 LIMIT 20;
+/* a */ /* b */ /* c */ /* d */ /* e */ /* f */ /* g */ /* h */ SELECT 1 FROM pgbench_tellers WHERE tid = 2;
+SELECT tid FROM pgbench_tellers WHERE bid = 1;
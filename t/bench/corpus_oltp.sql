@@ -0,0 +1,10 @@
+SELECT abalance FROM pgbench_accounts WHERE aid = 48213;
+UPDATE pgbench_accounts SET abalance = abalance + -2373 WHERE aid = 48213;
+UPDATE pgbench_tellers SET tbalance = tbalance + -2373 WHERE tid = 7;
+UPDATE pgbench_branches SET bbalance = bbalance + -2373 WHERE bid = 1;
+INSERT INTO pgbench_history (tid, bid, aid, delta, mtime) VALUES (7, 1, 48213, -2373, CURRENT_TIMESTAMP);
+SELECT aid, bid, abalance FROM pgbench_accounts WHERE aid BETWEEN 1000 AND 1010;
+SELECT count(*) FROM pgbench_tellers WHERE bid = 1 AND tbalance > 0;
+DELETE FROM pgbench_history WHERE tid = 3 AND delta < 0;
+SELECT bbalance FROM pgbench_branches WHERE bid = 1 FOR UPDATE;
+SELECT a.aid, a.abalance FROM pgbench_accounts a WHERE a.bid = 1 ORDER BY a.abalance DESC LIMIT 10;
@@ -0,0 +1,5 @@
+SELECT "pgbench_accounts"."aid" AS "pgbench_accounts_aid", "pgbench_accounts"."bid" AS "pgbench_accounts_bid", "pgbench_accounts"."abalance" AS "pgbench_accounts_abalance", "pgbench_accounts"."filler" AS "pgbench_accounts_filler", "pgbench_branches"."bid" AS "pgbench_branches_bid", "pgbench_branches"."bbalance" AS "pgbench_branches_bbalance", "pgbench_branches"."filler" AS "pgbench_branches_filler" FROM "pgbench_accounts" INNER JOIN "pgbench_branches" ON "pgbench_branches"."bid" = "pgbench_accounts"."bid" WHERE "pgbench_accounts"."aid" IN (1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32) AND "pgbench_accounts"."abalance" >= 0 ORDER BY "pgbench_accounts"."aid" ASC LIMIT 50 OFFSET 0;
+SELECT "t0"."tid", "t0"."bid", "t0"."tbalance", "t0"."filler", (SELECT COUNT(*) FROM "pgbench_history" AS "t1" WHERE "t1"."tid" = "t0"."tid" AND "t1"."mtime" > '2024-01-01 00:00:00'::timestamp AND "t1"."delta" BETWEEN -5000 AND 5000) AS "history_count", (SELECT COALESCE(SUM("t2"."delta"), 0) FROM "pgbench_history" AS "t2" WHERE "t2"."tid" = "t0"."tid" AND "t2"."bid" = "t0"."bid") AS "history_sum" FROM "pgbench_tellers" AS "t0" WHERE "t0"."bid" = 1 AND "t0"."tid" NOT IN (100, 101, 102, 103) ORDER BY "t0"."tbalance" DESC, "t0"."tid" ASC LIMIT 25;
+UPDATE "pgbench_accounts" SET "abalance" = "pgbench_accounts"."abalance" + 125, "filler" = 'updated by the orm layer for account reconciliation batch 2024-07' WHERE "pgbench_accounts"."aid" = 99231 AND "pgbench_accounts"."bid" = 1 AND "pgbench_accounts"."abalance" < 1000000 RETURNING "pgbench_accounts"."aid", "pgbench_accounts"."bid", "pgbench_accounts"."abalance", "pgbench_accounts"."filler";
+INSERT INTO "pgbench_history" ("tid", "bid", "aid", "delta", "mtime", "filler") VALUES (1, 1, 1, 10, '2024-07-01 12:00:00', 'a'), (2, 1, 2, 20, '2024-07-01 12:00:01', 'b'), (3, 1, 3, 30, '2024-07-01 12:00:02', 'c'), (4, 1, 4, 40, '2024-07-01 12:00:03', 'd'), (5, 1, 5, 50, '2024-07-01 12:00:04', 'e'), (6, 1, 6, 60, '2024-07-01 12:00:05', 'f'), (7, 1, 7, 70, '2024-07-01 12:00:06', 'g'), (8, 1, 8, 80, '2024-07-01 12:00:07', 'h') RETURNING "pgbench_history"."tid";
+SELECT COUNT(*) AS "__count" FROM "pgbench_accounts" LEFT OUTER JOIN "pgbench_tellers" ON ("pgbench_accounts"."bid" = "pgbench_tellers"."bid") LEFT OUTER JOIN "pgbench_branches" ON ("pgbench_tellers"."bid" = "pgbench_branches"."bid") WHERE ("pgbench_accounts"."abalance" > 100 AND "pgbench_branches"."bbalance" < 50000 AND NOT ("pgbench_tellers"."tid" IN (SELECT U0."tid" FROM "pgbench_history" U0 WHERE (U0."delta" < -1000 AND U0."mtime" >= '2024-01-01T00:00:00'::timestamp))) AND "pgbench_accounts"."filler" LIKE '%reconciliation%');
@@ -0,0 +1,2 @@
+\set aid random(1, 100000 * :scale)
+SELECT bench_nested(:aid);
@@ -0,0 +1 @@
+SELECT 1 AS rotation_stress;
@@ -0,0 +1,29 @@
+-- Objects used by the benchmark scripts, created after pgbench -i.
+
+-- Runs a few statements of its own, which are nested statements for
+-- pg_stat_monitor.pgsm_track = all.
+CREATE FUNCTION bench_nested(p_aid int) RETURNS int
+LANGUAGE plpgsql AS $$
+DECLARE
+    v_bid int;
+    v_balance int;
+BEGIN
+    SELECT bid INTO v_bid FROM pgbench_accounts WHERE aid = p_aid;
+    SELECT bbalance INTO v_balance FROM pgbench_branches WHERE bid = v_bid;
+    SELECT count(*) INTO v_balance FROM pgbench_tellers WHERE bid = v_bid;
+    RETURN v_balance;
+END;
+$$;
+
+-- pgbench aborts a client on its first error, so the error workload raises
+-- warnings, which pg_stat_monitor captures the same way.
+CREATE FUNCTION bench_warning(p_aid int) RETURNS void
+LANGUAGE plpgsql AS $$
+BEGIN
+    RAISE WARNING 'bench warning for aid %', p_aid;
+END;
+$$;
+
+-- Keep the warnings out of the pgbench output; the server log still gets
+-- them, and with it pg_stat_monitor.
+ALTER DATABASE postgres SET client_min_messages = error;
@@ -0,0 +1,6 @@
+BEGIN;
+SET LOCAL work_mem = '8MB';
+SHOW work_mem;
+SAVEPOINT bench;
+RELEASE SAVEPOINT bench;
+COMMIT;